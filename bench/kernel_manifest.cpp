@@ -0,0 +1,100 @@
+#include "kernel_manifest.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+std::string trim(const std::string& s)
+{
+    size_t begin = s.find_first_not_of(" \t\r");
+    if (begin == std::string::npos) {
+        return "";
+    }
+    size_t end = s.find_last_not_of(" \t\r");
+    return s.substr(begin, end - begin + 1);
+}
+
+} // namespace
+
+double KernelManifest::active_invocations(unsigned int res, uint64_t elements) const
+{
+    double n = res;
+    double count = 0;
+    if (invocations == "cells") {
+        count = n * n * n;
+    } else if (invocations == "faces") {
+        count = (n + 1) * n * n;
+    } else {
+        count = double(elements);
+    }
+    return count * active;
+}
+
+double KernelManifest::requested_bytes(double fieldBytes) const
+{
+    return (bytesRead + bytesWritten - fixedBytes) * fieldBytes / 4 + fixedBytes;
+}
+
+KernelManifest load_kernel_manifest(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file) {
+        throw std::runtime_error("Failed to open kernel manifest: " + path);
+    }
+
+    KernelManifest manifest;
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(file, line)) {
+        lineNumber++;
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty()) {
+            continue;
+        }
+
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) {
+            throw std::runtime_error(path + ":" + std::to_string(lineNumber) + ": expected key = value");
+        }
+        std::string key = trim(line.substr(0, eq));
+        std::string value = trim(line.substr(eq + 1));
+
+        try {
+            if (key == "shader") {
+                manifest.shader = value;
+            } else if (key == "passes") {
+                std::stringstream ss(value);
+                std::string pass;
+                while (std::getline(ss, pass, ',')) {
+                    manifest.passes.push_back(trim(pass));
+                }
+            } else if (key == "invocations") {
+                if (value != "cells" && value != "faces" && value != "elements") {
+                    throw std::invalid_argument(value);
+                }
+                manifest.invocations = value;
+            } else if (key == "active") {
+                manifest.active = std::stod(value);
+            } else if (key == "bytes_read") {
+                manifest.bytesRead = std::stod(value);
+            } else if (key == "bytes_written") {
+                manifest.bytesWritten = std::stod(value);
+            } else if (key == "fixed_bytes") {
+                manifest.fixedBytes = std::stod(value);
+            } else if (key == "flops") {
+                manifest.flops = std::stod(value);
+            } else {
+                throw std::runtime_error(path + ":" + std::to_string(lineNumber) + ": unknown key " + key);
+            }
+        } catch (const std::invalid_argument&) {
+            throw std::runtime_error(path + ":" + std::to_string(lineNumber) + ": bad value for " + key);
+        }
+    }
+
+    if (manifest.shader.empty() || manifest.invocations.empty()) {
+        throw std::runtime_error(path + ": shader and invocations are required");
+    }
+    return manifest;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Static cost of one compute shader, read from the <shader>.manifest file next to it.
+// Counts are per invocation; the dispatch size follows from the grid resolution.
+struct KernelManifest {
+    std::string shader;
+    std::vector<std::string> passes; // frame graph passes that dispatch this shader
+    std::string invocations;         // "cells" (res^3), "faces" ((res+1)*res^2) or "elements"
+    double active = 1.0;             // fraction of invocations doing the counted work
+    double bytesRead = 0;
+    double bytesWritten = 0;
+    double fixedBytes = 0;           // part of the bytes outside the solver fields, fp32 in every storage mode
+    double flops = 0;
+
+    // Invocations doing work in one dispatch, elements is only meaningful for the stream kernel
+    double active_invocations(unsigned int res, uint64_t elements = 0) const;
+    // Bytes one invocation requests when the fields take fieldBytes each instead of 4
+    double requested_bytes(double fieldBytes = 4) const;
+};
+
+// Parses "key = value" lines, # starts a comment. Throws std::runtime_error on missing or malformed files.
+KernelManifest load_kernel_manifest(const std::string& path);
@@ -0,0 +1,976 @@
+// Headless solver benchmark.
+// Runs every combination of resolution, projection sweep count and solver variant for a fixed number of
+// warm-up and timed steps and writes the results as JSON: wall time per step, steps/s, GPU time per
+// kernel from timestamp queries, achieved bandwidth and peak device memory.
+//
+// Each kernel also gets a roofline entry: the per-invocation bytes and flops from the <shader>.manifest
+// next to its shader, turned into GB/s, GFLOP/s and arithmetic intensity with the measured times and
+// compared against the bandwidth of the STREAM style copy kernel (streamCopy.comp). Vulkan runs also
+// report the solver diagnostics of their last step, e.g. to see what a sweep count leaves in divergence.
+//
+//   rotor_cfd_bench [--res 65,129,257] [--sweeps 50] [--variants graph,ordered,cpu]
+//                   [--warmup 3] [--reps 10] [--threads 0] [--stream-mb 256] [--storage f32]
+//                   [--volume rg16f] [--check-boundaries 1] [--check-cpu 4] [--out rotor_cfd_bench.json]
+//
+// Variants: "graph" is the Vulkan solver with frame graph reordering, "ordered" keeps the declared pass
+// order, "cpu" is the CPU reference backend. Shaders are loaded from build/shaders like the viewer,
+// so run it from the repository root. Works on software implementations such as lavapipe.
+// A resolution of 0 lets the Vulkan solver pick the largest grid its memory plan fits in the device budget.
+// --storage picks the element type of the Vulkan solver fields: f32, f16 (needs 16-bit storage buffers)
+// or f16packed; the manifest byte counts are scaled to it. --volume picks the format of the visualisation
+// volume writeTexture fills: rg32f, rg16f or rg8.
+// Unless --check-boundaries is 0, Vulkan runs are preceded by a check of the device boundary mask: a
+// synthetic terrain is voxelised, re-voxelised with another height scale and filter, and obstacles are
+// stamped and removed; after every change the mask is read back and compared with the host reference
+// (stamp_terrain_boundaries and stamp_boundary_primitive). A mismatch fails the run.
+// --check-cpu N then steps the Vulkan solver and the CPU backend N times (0 skips it) from the default
+// state over a synthetic terrain and compares the velocity and density fields, a value differs when
+// it is off by more than both the absolute and the ULP tolerance. Half storage gets looser tolerances.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "VkBootstrap.h"
+
+#include "cfd.h"
+#include "cpu_cfd.h"
+#include "vk_upload.h"
+#include "kernel_manifest.h"
+
+namespace {
+
+struct BenchOptions {
+    std::vector<unsigned int> resolutions = {65, 129, 257};
+    std::vector<int> sweeps = {CFD_PROJECTION_SWEEPS};
+    std::vector<std::string> variants = {"graph", "ordered"};
+    int warmup = 3;
+    int repetitions = 10;
+    unsigned int threads = 0;
+    unsigned int streamMB = 256; // 0 skips the bandwidth probe
+    FieldStorage storage = FieldStorage::Float32;
+    VolumeFormat volume = VolumeFormat::Float16;
+    bool checkBoundaries = true;
+    int checkCpuSteps = 4; // 0 skips the comparison with the CPU backend
+    std::string output = "rotor_cfd_bench.json";
+};
+
+struct BenchDevice {
+    vkb::Instance instance;
+    vkb::Device device;
+    VkQueue queue = VK_NULL_HANDLE;
+    uint32_t queueFamily = 0;
+    VmaAllocator allocator = VK_NULL_HANDLE;
+
+    std::string name;
+    float timestampPeriod = 0;    // ns per tick
+    uint32_t timestampBits = 0;   // 0 when the queue cannot write timestamps
+    bool storage16Bit = false;    // storageBuffer16BitAccess enabled
+};
+
+struct KernelResult {
+    std::string name;
+    uint32_t dispatches = 0;
+    double gpuMs = 0;       // per step, all dispatches of the kernel
+    VkDeviceSize bytes = 0; // per step, whole resources as declared to the frame graph
+
+    // Per step from the shader manifest, 0 when the pass has none
+    double requestedBytes = 0;
+    double flops = 0;
+};
+
+struct RunResult {
+    std::string backend;
+    std::string variant;
+    unsigned int res = 0;
+    int sweeps = 0;
+    uint32_t threads = 0;
+    uint32_t levels = 0;
+
+    std::vector<double> stepMs;
+    double gpuStepMs = -1; // < 0 when not measured
+    VkDeviceSize bytesPerStep = 0;
+    VkDeviceSize peakMemory = 0;
+    std::vector<KernelResult> kernels;
+
+    bool hasDiagnostics = false;
+    DiagnosticsRecord diagnostics{};
+};
+
+std::vector<std::string> split(const std::string& list)
+{
+    std::vector<std::string> items;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+BenchOptions parse_options(int argc, char* argv[])
+{
+    BenchOptions options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            printf("usage: rotor_cfd_bench [--res 65,129,257] [--sweeps 50] [--variants graph,ordered,cpu]\n"
+                   "                       [--warmup 3] [--reps 10] [--threads 0] [--stream-mb 256]\n"
+                   "                       [--storage f32|f16|f16packed] [--volume rg32f|rg16f|rg8]\n"
+                   "                       [--check-boundaries 0|1] [--check-cpu 4] [--out rotor_cfd_bench.json]\n");
+            exit(0);
+        }
+        if (i + 1 >= argc) {
+            throw std::runtime_error("Missing value for " + arg);
+        }
+        std::string value = argv[++i];
+
+        if (arg == "--res") {
+            options.resolutions.clear();
+            for (auto& item : split(value)) options.resolutions.push_back(std::stoul(item));
+        } else if (arg == "--sweeps") {
+            options.sweeps.clear();
+            for (auto& item : split(value)) options.sweeps.push_back(std::stoi(item));
+        } else if (arg == "--variants") {
+            options.variants = split(value);
+            for (auto& variant : options.variants) {
+                if (variant != "graph" && variant != "ordered" && variant != "cpu") {
+                    throw std::runtime_error("Unknown variant: " + variant);
+                }
+            }
+        } else if (arg == "--warmup") {
+            options.warmup = std::stoi(value);
+        } else if (arg == "--reps") {
+            options.repetitions = std::stoi(value);
+        } else if (arg == "--threads") {
+            options.threads = std::stoul(value);
+        } else if (arg == "--stream-mb") {
+            options.streamMB = std::stoul(value);
+        } else if (arg == "--storage") {
+            if (value == "f32") {
+                options.storage = FieldStorage::Float32;
+            } else if (value == "f16") {
+                options.storage = FieldStorage::Float16;
+            } else if (value == "f16packed") {
+                options.storage = FieldStorage::Float16Packed;
+            } else {
+                throw std::runtime_error("Unknown storage: " + value);
+            }
+        } else if (arg == "--volume") {
+            if (value == "rg32f") {
+                options.volume = VolumeFormat::Float32;
+            } else if (value == "rg16f") {
+                options.volume = VolumeFormat::Float16;
+            } else if (value == "rg8") {
+                options.volume = VolumeFormat::Unorm8;
+            } else {
+                throw std::runtime_error("Unknown volume format: " + value);
+            }
+        } else if (arg == "--check-boundaries") {
+            options.checkBoundaries = std::stoi(value) != 0;
+        } else if (arg == "--check-cpu") {
+            options.checkCpuSteps = std::stoi(value);
+        } else if (arg == "--out") {
+            options.output = value;
+        } else {
+            throw std::runtime_error("Unknown option: " + arg);
+        }
+    }
+    if (options.repetitions < 1) {
+        throw std::runtime_error("--reps must be at least 1");
+    }
+    if (options.checkCpuSteps < 0) {
+        throw std::runtime_error("--check-cpu must not be negative");
+    }
+    return options;
+}
+
+void init_device(BenchDevice& bench)
+{
+    auto inst_ret = vkb::InstanceBuilder()
+        .set_app_name("rotor_cfd_bench")
+        .set_headless(true)
+        .require_api_version(1, 2, 0)
+        .build();
+    if (!inst_ret) {
+        throw std::runtime_error("Failed to create Vulkan instance: " + inst_ret.error().message());
+    }
+    bench.instance = inst_ret.value();
+
+    // Queries are reset from the host between steps so the solver's command buffer stays untouched
+    VkPhysicalDeviceVulkan12Features features12{};
+    features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    features12.hostQueryReset = VK_TRUE;
+
+    // Same as the viewer, the solver writes its visualisation volume without a declared format
+    VkPhysicalDeviceFeatures features{};
+    features.shaderStorageImageWriteWithoutFormat = VK_TRUE;
+    features.shaderStorageImageExtendedFormats = VK_TRUE;
+
+    auto phys_ret = vkb::PhysicalDeviceSelector{ bench.instance }
+        .set_minimum_version(1, 2)
+        .set_required_features(features)
+        .set_required_features_12(features12)
+        .select();
+    if (!phys_ret) {
+        throw std::runtime_error("No suitable Vulkan device: " + phys_ret.error().message());
+    }
+    vkb::PhysicalDevice physicalDevice = phys_ret.value();
+
+    // Enabled whenever present, only the f16 storage needs it
+    VkPhysicalDeviceVulkan11Features features11{};
+    features11.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES;
+    VkPhysicalDeviceFeatures2 supported{};
+    supported.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    supported.pNext = &features11;
+    vkGetPhysicalDeviceFeatures2(physicalDevice.physical_device, &supported);
+    bench.storage16Bit = features11.storageBuffer16BitAccess == VK_TRUE;
+
+    vkb::DeviceBuilder deviceBuilder{ physicalDevice };
+    features11 = {};
+    features11.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES;
+    features11.storageBuffer16BitAccess = VK_TRUE;
+    if (bench.storage16Bit) {
+        deviceBuilder.add_pNext(&features11);
+    }
+    bench.device = deviceBuilder.build().value();
+    bench.queue = bench.device.get_queue(vkb::QueueType::graphics).value();
+    bench.queueFamily = bench.device.get_queue_index(vkb::QueueType::graphics).value();
+
+    bench.name = physicalDevice.properties.deviceName;
+    bench.timestampPeriod = physicalDevice.properties.limits.timestampPeriod;
+    bench.timestampBits = physicalDevice.get_queue_families()[bench.queueFamily].timestampValidBits;
+
+    VmaAllocatorCreateInfo allocatorInfo{};
+    allocatorInfo.physicalDevice = physicalDevice.physical_device;
+    allocatorInfo.device = bench.device.device;
+    allocatorInfo.instance = bench.instance.instance;
+    allocatorInfo.vulkanApiVersion = VK_API_VERSION_1_2;
+    if (vmaCreateAllocator(&allocatorInfo, &bench.allocator) != VK_SUCCESS) {
+        throw std::runtime_error("Failed to create VMA allocator!");
+    }
+
+    printf("Benchmarking on %s\n", bench.name.c_str());
+}
+
+void cleanup_device(BenchDevice& bench)
+{
+    vmaDestroyAllocator(bench.allocator);
+    vkb::destroy_device(bench.device);
+    vkb::destroy_instance(bench.instance);
+}
+
+// Device memory in use across all heaps, as the driver reports it when VK_EXT_memory_budget is available
+VkDeviceSize device_memory_usage(VmaAllocator allocator)
+{
+    const VkPhysicalDeviceMemoryProperties* memProps = nullptr;
+    vmaGetMemoryProperties(allocator, &memProps);
+
+    VmaBudget budgets[VK_MAX_MEMORY_HEAPS];
+    vmaGetHeapBudgets(allocator, budgets);
+
+    VkDeviceSize usage = 0;
+    for (uint32_t i = 0; i < memProps->memoryHeapCount; i++) {
+        usage += budgets[i].usage;
+    }
+    return usage;
+}
+
+// Cost manifests of the solver kernels, copied next to the SPIR-V by the build
+std::vector<KernelManifest> load_solver_manifests()
+{
+    std::vector<KernelManifest> manifests;
+    for (const char* shader : {"gaussSiedel", "advect", "writeTexture", "diagnosticsReduce", "buildOccupancy"}) {
+        manifests.push_back(load_kernel_manifest(std::string("build/shaders/") + shader + ".comp.manifest"));
+    }
+    return manifests;
+}
+
+// Attainable bandwidth in GB/s from the STREAM style copy, < 0 when it cannot be timed
+double measure_stream_copy(BenchDevice& bench, const BenchOptions& options)
+{
+    if (bench.timestampBits == 0 || options.streamMB == 0) {
+        return -1;
+    }
+
+    VkDevice device = bench.device.device;
+    KernelManifest manifest = load_kernel_manifest("build/shaders/streamCopy.comp.manifest");
+
+    const VkDeviceSize size = VkDeviceSize(options.streamMB) << 20;
+    const uint32_t count = uint32_t(size / 16);
+    const uint32_t groups = std::min<uint32_t>((count + 255) / 256, 65535);
+    const uint32_t repetitions = 10;
+
+    ResourceBinding src = {0, size, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, BUFFER};
+    ResourceBinding dst = {1, size, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, BUFFER};
+    vkinit::createResource(device, bench.allocator, src);
+    vkinit::createResource(device, bench.allocator, dst);
+    std::vector<ResourceBinding> bindings = {src, dst};
+
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(uint32_t);
+    std::vector<VkPushConstantRange> pushConstants = { pushConstantRange };
+
+    Kernel kernel = vkinit::initKernel(device, KernelType::Compute, { "build/shaders/streamCopy.comp.spv" }, bindings, pushConstants);
+    vkinit::updateKernelDescriptors(device, kernel, bindings);
+
+    VkQueryPoolCreateInfo queryInfo{};
+    queryInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryInfo.queryCount = repetitions * 2;
+    VkQueryPool queryPool;
+    VK_CHECK(vkCreateQueryPool(device, &queryInfo, nullptr, &queryPool));
+    vkResetQueryPool(device, queryPool, 0, repetitions * 2);
+
+    VkCommandPoolCreateInfo poolInfo = vkinit::command_pool_create_info(bench.queueFamily);
+    VkCommandPool commandPool;
+    VK_CHECK(vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool));
+
+    VkCommandBuffer cmd = vkinit::beginSingleTimeCommands(device, commandPool);
+    vkCmdFillBuffer(cmd, src.buffer, 0, VK_WHOLE_SIZE, 0);
+
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, kernel.pipeline);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, kernel.pipelineLayout, 0, 1, &kernel.descriptorSet, 0, nullptr);
+    vkCmdPushConstants(cmd, kernel.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(uint32_t), &count);
+
+    // One untimed copy first, then every repetition ordered after the previous one's writes
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdDispatch(cmd, groups, 1, 1);
+    for (uint32_t i = 0; i < repetitions; i++) {
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             0, 1, &barrier, 0, nullptr, 0, nullptr);
+        vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, i * 2);
+        vkCmdDispatch(cmd, groups, 1, 1);
+        vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, i * 2 + 1);
+    }
+    vkinit::endSingleTimeCommands(device, commandPool, bench.queue, cmd);
+
+    std::vector<uint64_t> timestamps(repetitions * 2);
+    VK_CHECK(vkGetQueryPoolResults(device, queryPool, 0, repetitions * 2,
+                                   timestamps.size() * sizeof(uint64_t), timestamps.data(), sizeof(uint64_t),
+                                   VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+
+    // Best repetition, the probe is there to find the ceiling
+    const uint64_t mask = bench.timestampBits >= 64 ? ~0ull : ((1ull << bench.timestampBits) - 1);
+    double bestNs = 0;
+    for (uint32_t i = 0; i < repetitions; i++) {
+        double ns = double((timestamps[i * 2 + 1] - timestamps[i * 2]) & mask) * bench.timestampPeriod;
+        if (ns > 0 && (bestNs == 0 || ns < bestNs)) {
+            bestNs = ns;
+        }
+    }
+
+    vkDestroyCommandPool(device, commandPool, nullptr);
+    vkDestroyQueryPool(device, queryPool, nullptr);
+    vkhelp::destroy_kernel(device, kernel);
+    vkhelp::destroy_resource(device, bench.allocator, src);
+    vkhelp::destroy_resource(device, bench.allocator, dst);
+
+    if (bestNs == 0) {
+        return -1;
+    }
+    double bytes = manifest.active_invocations(0, count) * (manifest.bytesRead + manifest.bytesWritten);
+    double gbs = bytes / bestNs;
+    printf("STREAM copy: %.1f GB/s over %u MB\n", gbs, options.streamMB);
+    return gbs;
+}
+
+template <typename StepFn>
+void time_steps(const BenchOptions& options, RunResult& result, StepFn step)
+{
+    for (int i = 0; i < options.warmup; i++) {
+        step(-1);
+    }
+    for (int i = 0; i < options.repetitions; i++) {
+        auto start = std::chrono::steady_clock::now();
+        step(i);
+        auto end = std::chrono::steady_clock::now();
+        result.stepMs.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+    }
+}
+
+RunResult run_vulkan(BenchDevice& bench, const BenchOptions& options, const std::vector<KernelManifest>& manifests,
+                     unsigned int res, int sweeps, bool reorder)
+{
+    VkDevice device = bench.device.device;
+
+    RunResult result;
+    result.backend = "vulkan";
+    result.variant = reorder ? "graph" : "ordered";
+    result.res = res;
+    result.sweeps = sweeps;
+
+    UploadManager uploader;
+    uploader.init(device, bench.allocator, bench.queueFamily, bench.queue);
+
+    if (options.storage == FieldStorage::Float16 && !bench.storage16Bit) {
+        throw std::runtime_error("f16 storage needs storageBuffer16BitAccess, try --storage f16packed");
+    }
+
+    Cfd cfd;
+    cfd.set_field_storage(options.storage);
+    cfd.set_volume_format(options.volume);
+    cfd.init_cfd(device, bench.allocator, res);
+    res = cfd.get_resolution();
+    result.res = res;
+    cfd.set_projection_sweeps(sweeps);
+    cfd.get_graph().set_reorder(reorder);
+    cfd.get_graph().compile();
+    cfd.init_solver(bench.queueFamily, bench.queue, uploader);
+    cfd.upload_state(make_default_state(res));
+    uploader.wait_idle();
+    result.peakMemory = device_memory_usage(bench.allocator);
+
+    FrameGraph& graph = cfd.get_graph();
+    const uint32_t passCount = graph.pass_count();
+    result.levels = graph.level_count();
+
+    // Kernels are reported by pass name, the projection sweeps all share one entry
+    std::map<std::string, size_t> kernelIndex;
+    std::vector<size_t> passKernel(passCount);
+    const double fieldBytes = options.storage == FieldStorage::Float32 ? 4 : 2;
+    for (uint32_t i = 0; i < passCount; i++) {
+        auto it = kernelIndex.find(graph.pass_name(i));
+        if (it == kernelIndex.end()) {
+            it = kernelIndex.emplace(graph.pass_name(i), result.kernels.size()).first;
+            result.kernels.push_back({graph.pass_name(i)});
+        }
+        passKernel[i] = it->second;
+        KernelResult& kernel = result.kernels[it->second];
+        kernel.dispatches++;
+        kernel.bytes += graph.pass_traffic(i);
+        result.bytesPerStep += graph.pass_traffic(i);
+
+        for (auto& manifest : manifests) {
+            if (std::find(manifest.passes.begin(), manifest.passes.end(), graph.pass_name(i)) != manifest.passes.end()) {
+                double invocations = manifest.active_invocations(res);
+                kernel.requestedBytes += invocations * manifest.requested_bytes(fieldBytes);
+                kernel.flops += invocations * manifest.flops;
+            }
+        }
+    }
+
+    VkQueryPool queryPool = VK_NULL_HANDLE;
+    std::vector<uint64_t> timestamps(passCount * 2);
+    std::vector<double> kernelTicks(result.kernels.size(), 0.0);
+    double stepTicks = 0;
+
+    const bool timed = bench.timestampBits > 0;
+    if (timed) {
+        VkQueryPoolCreateInfo queryInfo{};
+        queryInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        queryInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        queryInfo.queryCount = passCount * 2;
+        VK_CHECK(vkCreateQueryPool(device, &queryInfo, nullptr, &queryPool));
+
+        // Bottom of pipe on both sides: the start waits for the previous pass, the end for this one
+        graph.set_pass_hooks(
+            [queryPool](VkCommandBuffer cmd, uint32_t passIndex, const std::string&) {
+                vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, passIndex * 2);
+            },
+            [queryPool](VkCommandBuffer cmd, uint32_t passIndex, const std::string&) {
+                vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, passIndex * 2 + 1);
+            });
+    }
+
+    time_steps(options, result, [&](int repetition) {
+        if (timed) {
+            vkResetQueryPool(device, queryPool, 0, passCount * 2);
+        }
+
+        cfd.step();
+
+        if (!timed || repetition < 0) {
+            return;
+        }
+        VK_CHECK(vkGetQueryPoolResults(device, queryPool, 0, passCount * 2,
+                                       timestamps.size() * sizeof(uint64_t), timestamps.data(), sizeof(uint64_t),
+                                       VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+
+        const uint64_t mask = bench.timestampBits >= 64 ? ~0ull : ((1ull << bench.timestampBits) - 1);
+        uint64_t first = ~0ull;
+        uint64_t last = 0;
+        for (uint32_t i = 0; i < passCount; i++) {
+            uint64_t begin = timestamps[i * 2] & mask;
+            uint64_t end = timestamps[i * 2 + 1] & mask;
+            kernelTicks[passKernel[i]] += double((end - begin) & mask);
+            first = std::min(first, begin);
+            last = std::max(last, end);
+        }
+        stepTicks += double(last - first);
+    });
+
+    if (timed) {
+        const double ticksToMs = bench.timestampPeriod * 1e-6 / options.repetitions;
+        for (size_t k = 0; k < result.kernels.size(); k++) {
+            result.kernels[k].gpuMs = kernelTicks[k] * ticksToMs;
+        }
+        result.gpuStepMs = stepTicks * ticksToMs;
+        vkDestroyQueryPool(device, queryPool, nullptr);
+    }
+
+    result.peakMemory = std::max(result.peakMemory, device_memory_usage(bench.allocator));
+
+    std::vector<DiagnosticsRecord> records = cfd.download_diagnostics();
+    if (!records.empty()) {
+        result.hasDiagnostics = true;
+        result.diagnostics = records.back();
+    }
+
+    vkDeviceWaitIdle(device);
+    cfd.cleanup();
+    uploader.cleanup();
+    return result;
+}
+
+RunResult run_cpu(const BenchOptions& options, unsigned int res, int sweeps)
+{
+    RunResult result;
+    result.backend = "cpu";
+    result.variant = "cpu";
+    result.res = res;
+    result.sweeps = sweeps;
+
+    if (res == 0) {
+        throw std::runtime_error("The cpu variant needs an explicit resolution");
+    }
+
+    CpuCfd cpu(options.threads);
+    cpu.set_projection_sweeps(sweeps);
+    result.threads = cpu.thread_count();
+
+    CfdState state = make_default_state(res);
+    cpu.upload_state(state);
+
+    // The working set is the state plus the advection scratch arrays
+    const VkDeviceSize faces = VkDeviceSize(res + 1) * res * res;
+    const VkDeviceSize cells = VkDeviceSize(res) * res * res;
+    result.peakMemory = (state.vx.size() + state.vy.size() + state.vz.size() + state.density.size() +
+                         state.pressure.size() + state.boundaries.size() + faces * 3 + cells) * sizeof(float) +
+                        state.velocitySources.size() * sizeof(VelocitySource) +
+                        state.densitySources.size() * sizeof(DensitySource);
+
+    time_steps(options, result, [&](int) { cpu.step(); });
+    return result;
+}
+
+double median(std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    size_t mid = values.size() / 2;
+    return values.size() % 2 ? values[mid] : 0.5 * (values[mid - 1] + values[mid]);
+}
+
+// Per kernel achieved rates from the manifest counts, against the copy bandwidth when it was measured
+void print_roofline(const RunResult& run, double streamGbs)
+{
+    if (run.gpuStepMs < 0) {
+        return;
+    }
+    printf("Roofline, %s at res %u:\n", run.variant.c_str(), run.res);
+    printf("  %-22s %10s %10s %10s %10s\n", "kernel", "GB/s", "GFLOP/s", "flop/byte", "of peak");
+    for (auto& kernel : run.kernels) {
+        if (kernel.requestedBytes == 0 || kernel.gpuMs <= 0) {
+            continue;
+        }
+        double gbs = kernel.requestedBytes / (kernel.gpuMs * 1e6);
+        double gflops = kernel.flops / (kernel.gpuMs * 1e6);
+        printf("  %-22s %10.1f %10.1f %10.3f", kernel.name.c_str(), gbs, gflops, kernel.flops / kernel.requestedBytes);
+        if (streamGbs > 0) {
+            printf(" %9.0f%%", 100.0 * gbs / streamGbs);
+        }
+        printf("\n");
+    }
+}
+
+void write_json(std::ostream& out, const BenchDevice* bench, const BenchOptions& options, double streamGbs,
+                const std::vector<RunResult>& runs)
+{
+    out << "{\n";
+    out << "  \"device\": \"" << (bench ? bench->name : std::string("none")) << "\",\n";
+    out << "  \"timestamp_period_ns\": " << (bench ? bench->timestampPeriod : 0.0f) << ",\n";
+    out << "  \"warmup\": " << options.warmup << ",\n";
+    out << "  \"repetitions\": " << options.repetitions << ",\n";
+    out << "  \"field_storage\": \"" << field_storage_name(options.storage) << "\",\n";
+    out << "  \"volume_format\": \"" << volume_format_name(options.volume) << "\",\n";
+    if (streamGbs > 0) {
+        out << "  \"stream_copy_gbs\": " << streamGbs << ",\n";
+    } else {
+        out << "  \"stream_copy_gbs\": null,\n";
+    }
+    out << "  \"runs\": [";
+
+    for (size_t r = 0; r < runs.size(); r++) {
+        const RunResult& run = runs[r];
+        const double mean = std::accumulate(run.stepMs.begin(), run.stepMs.end(), 0.0) / run.stepMs.size();
+        const double best = *std::min_element(run.stepMs.begin(), run.stepMs.end());
+
+        out << (r ? ",\n" : "\n") << "    {\n";
+        out << "      \"backend\": \"" << run.backend << "\",\n";
+        out << "      \"variant\": \"" << run.variant << "\",\n";
+        out << "      \"res\": " << run.res << ",\n";
+        out << "      \"sweeps\": " << run.sweeps << ",\n";
+        if (run.backend == "cpu") {
+            out << "      \"threads\": " << run.threads << ",\n";
+        } else {
+            out << "      \"levels\": " << run.levels << ",\n";
+        }
+        out << "      \"step_ms\": {\"mean\": " << mean << ", \"median\": " << median(run.stepMs)
+            << ", \"min\": " << best << "},\n";
+        out << "      \"steps_per_second\": " << 1000.0 / mean << ",\n";
+        out << "      \"peak_memory_bytes\": " << run.peakMemory << ",\n";
+
+        if (run.gpuStepMs < 0) {
+            out << "      \"gpu_step_ms\": null,\n";
+            out << "      \"bytes_per_step\": " << (run.bytesPerStep ? std::to_string(run.bytesPerStep) : "null") << ",\n";
+            out << "      \"bandwidth_gbs\": null,\n";
+        } else {
+            out << "      \"gpu_step_ms\": " << run.gpuStepMs << ",\n";
+            out << "      \"bytes_per_step\": " << run.bytesPerStep << ",\n";
+            out << "      \"bandwidth_gbs\": " << run.bytesPerStep / (run.gpuStepMs * 1e6) << ",\n";
+        }
+
+        if (run.hasDiagnostics) {
+            const DiagnosticsRecord& d = run.diagnostics;
+            out << "      \"diagnostics\": {\"step\": " << d.step
+                << ", \"max_divergence\": " << d.maxDivergence << ", \"rms_divergence\": " << d.rmsDivergence
+                << ", \"kinetic_energy\": " << d.kineticEnergy << ", \"mass\": " << d.mass
+                << ", \"max_velocity\": " << d.maxVelocity << ", \"cfl\": " << d.cfl << "},\n";
+        }
+
+        out << "      \"kernels\": [";
+        for (size_t k = 0; k < run.kernels.size(); k++) {
+            const KernelResult& kernel = run.kernels[k];
+            out << (k ? ",\n" : "\n") << "        {\"name\": \"" << kernel.name << "\", \"dispatches\": " << kernel.dispatches;
+            if (run.gpuStepMs < 0) {
+                out << ", \"gpu_ms\": null, \"bytes\": " << kernel.bytes << ", \"bandwidth_gbs\": null}";
+            } else {
+                out << ", \"gpu_ms\": " << kernel.gpuMs << ", \"bytes\": " << kernel.bytes
+                    << ", \"bandwidth_gbs\": " << (kernel.gpuMs > 0 ? kernel.bytes / (kernel.gpuMs * 1e6) : 0.0);
+                if (kernel.requestedBytes > 0 && kernel.gpuMs > 0) {
+                    double gbs = kernel.requestedBytes / (kernel.gpuMs * 1e6);
+                    out << ",\n         \"roofline\": {\"requested_bytes\": " << kernel.requestedBytes
+                        << ", \"flops\": " << kernel.flops
+                        << ", \"intensity\": " << kernel.flops / kernel.requestedBytes
+                        << ", \"gbs\": " << gbs
+                        << ", \"gflops\": " << kernel.flops / (kernel.gpuMs * 1e6);
+                    if (streamGbs > 0) {
+                        out << ", \"peak_fraction\": " << gbs / streamGbs;
+                    }
+                    out << "}";
+                }
+                out << "}";
+            }
+        }
+        out << (run.kernels.empty() ? "]\n" : "\n      ]\n");
+        out << "    }";
+    }
+    out << "\n  ]\n}\n";
+}
+
+// Heights in [0, 1] with slopes in every direction, so nearest and bilinear sampling differ
+TerrainMap make_check_terrain(uint32_t cols, uint32_t rows)
+{
+    TerrainHeader header{};
+    std::memcpy(header.magic, TERRAIN_FILE_MAGIC, sizeof(header.magic));
+    header.version = TERRAIN_FILE_VERSION;
+    header.cols = cols;
+    header.rows = rows;
+    header.spacingX = header.spacingY = 1.0;
+    header.heightScale = 1.0f;
+
+    std::vector<float> samples(size_t(cols) * rows);
+    for (uint32_t r = 0; r < rows; r++) {
+        for (uint32_t c = 0; c < cols; c++) {
+            samples[size_t(r) * cols + c] = 0.45f + 0.25f * std::sin(c * 0.21f) * std::cos(r * 0.13f) + 0.1f * r / rows;
+        }
+    }
+    return TerrainMap::from_samples(header, std::move(samples));
+}
+
+// Returns false when the device mask differs from the host reference after any of the changes
+bool check_boundaries(BenchDevice& bench, const BenchOptions& options)
+{
+    const unsigned int res = CFD_MIN_RESOLUTION;
+    VkDevice device = bench.device.device;
+
+    if (options.storage == FieldStorage::Float16 && !bench.storage16Bit) {
+        throw std::runtime_error("f16 storage needs storageBuffer16BitAccess, try --storage f16packed");
+    }
+
+    UploadManager uploader;
+    uploader.init(device, bench.allocator, bench.queueFamily, bench.queue);
+
+    Cfd cfd;
+    cfd.set_field_storage(options.storage);
+    cfd.set_volume_format(options.volume);
+    cfd.init_cfd(device, bench.allocator, res);
+    cfd.get_graph().compile();
+    cfd.init_solver(bench.queueFamily, bench.queue, uploader);
+    cfd.upload_state(make_default_state(res));
+
+    const TerrainMap terrain = make_check_terrain(2 * res + 7, res + 12);
+    float heightScale = 0.6f;
+    cfd.load_terrain(uploader, terrain, heightScale);
+
+    // An opening carved under the terrain, a vertical mast and a raised patch, all within the interior
+    BoundaryPrimitive cave = boundary_box(4, 20, 4, 12, int(res) + 2, 10);
+    cave.value = 1.0f;
+    const BoundaryPrimitive mast = boundary_cylinder(1, 21.5f, 20.0f, 2.5f, 1, int(res) - 2);
+    std::vector<float> patchHeights(8 * 6);
+    for (size_t i = 0; i < patchHeights.size(); i++) {
+        patchHeights[i] = 0.5f + 0.02f * float(i % 8) + 0.03f * float(i / 8);
+    }
+    const BoundaryPrimitive patch = boundary_heightfield(22, 5, 8, 6, patchHeights, heightScale);
+    // A second heightfield, whose heights move down when the patch ahead of it is removed
+    std::vector<float> ridgeHeights(10 * 4);
+    for (size_t i = 0; i < ridgeHeights.size(); i++) {
+        ridgeHeights[i] = 0.7f - 0.04f * float(i % 10);
+    }
+    const BoundaryPrimitive ridge = boundary_heightfield(3, 24, 10, 4, ridgeHeights, heightScale);
+
+    bool passed = true;
+    // The mask the next step reads against the host's, voxelised with nearest sampling and stamped in order
+    auto compare = [&](const char* stage, const std::vector<const BoundaryPrimitive*>& stamps) {
+        uploader.flush();
+        cfd.step();
+        CfdState state;
+        cfd.download_state(state);
+
+        std::vector<float> expected = init_boundaries(res + 2);
+        stamp_terrain_boundaries(expected, res, terrain, heightScale);
+        for (const BoundaryPrimitive* stamp : stamps) {
+            stamp_boundary_primitive(expected, res, *stamp);
+        }
+
+        size_t mismatches = 0;
+        for (size_t i = 0; i < expected.size(); i++) {
+            mismatches += state.boundaries[i] != expected[i] ? 1 : 0;
+        }
+        printf("Boundary check, %s: %zu of %zu cells differ\n", stage, mismatches, expected.size());
+        passed = passed && mismatches == 0;
+    };
+
+    compare("terrain", {});
+
+    // No host reference for the filtered heights, switching back has to restore the nearest mask
+    cfd.set_terrain_bilinear(true);
+    uploader.flush();
+    cfd.step();
+    cfd.set_terrain_bilinear(false);
+    compare("terrain after bilinear", {});
+
+    const uint32_t caveId = cfd.stamp_boundary(uploader, cave);
+    const uint32_t mastId = cfd.stamp_boundary(uploader, mast);
+    uint32_t patchId = cfd.stamp_boundary(uploader, patch);
+    const uint32_t ridgeId = cfd.stamp_boundary(uploader, ridge);
+    compare("cave, mast, patch and ridge stamped", {&cave, &mast, &patch, &ridge});
+
+    cfd.remove_boundary_stamp(uploader, mastId);
+    cfd.remove_boundary_stamp(uploader, patchId);
+    compare("mast and patch removed", {&cave, &ridge});
+
+    // Stamped again into the room the first patch left
+    patchId = cfd.stamp_boundary(uploader, patch);
+    compare("patch stamped again", {&cave, &ridge, &patch});
+
+    // Voxelised again over the whole grid, the remaining stamps replayed on top
+    heightScale = 0.4f;
+    cfd.set_terrain_height_scale(heightScale);
+    compare("height scale changed", {&cave, &ridge, &patch});
+
+    cfd.remove_boundary_stamp(uploader, caveId);
+    cfd.remove_boundary_stamp(uploader, ridgeId);
+    cfd.remove_boundary_stamp(uploader, patchId);
+    compare("every stamp removed", {});
+
+    vkDeviceWaitIdle(device);
+    cfd.cleanup();
+    uploader.cleanup();
+    return passed;
+}
+
+// Distance in representable floats, 0 for equal values including +0 and -0
+int64_t ulp_distance(float a, float b)
+{
+    auto ordered = [](float v) {
+        int32_t bits;
+        std::memcpy(&bits, &v, sizeof(bits));
+        return bits < 0 ? int64_t(INT32_MIN) - bits : int64_t(bits);
+    };
+    return std::llabs(ordered(a) - ordered(b));
+}
+
+// Returns false when a field of the Vulkan solver differs from the CPU backend's after the same steps
+bool check_cpu(BenchDevice& bench, const BenchOptions& options)
+{
+    const unsigned int res = CFD_MIN_RESOLUTION;
+    const int sweeps = options.sweeps.empty() ? CFD_PROJECTION_SWEEPS : options.sweeps.front();
+    VkDevice device = bench.device.device;
+
+    if (options.storage == FieldStorage::Float16 && !bench.storage16Bit) {
+        throw std::runtime_error("f16 storage needs storageBuffer16BitAccess, try --storage f16packed");
+    }
+
+    // Neither backend voxelises here, both get the terrain already in the mask
+    CfdState state = make_default_state(res);
+    stamp_terrain_boundaries(state.boundaries, res, make_check_terrain(2 * res + 7, res + 12), 0.6f);
+
+    UploadManager uploader;
+    uploader.init(device, bench.allocator, bench.queueFamily, bench.queue);
+
+    Cfd cfd;
+    cfd.set_field_storage(options.storage);
+    cfd.set_volume_format(options.volume);
+    cfd.init_cfd(device, bench.allocator, res);
+    cfd.set_projection_sweeps(sweeps);
+    cfd.get_graph().compile();
+    cfd.init_solver(bench.queueFamily, bench.queue, uploader);
+    cfd.upload_state(state);
+
+    CpuCfd cpu(options.threads);
+    cpu.set_projection_sweeps(sweeps);
+    cpu.upload_state(state);
+
+    for (int i = 0; i < options.checkCpuSteps; i++) {
+        cfd.step();
+        cpu.step();
+    }
+
+    CfdState gpuState;
+    CfdState cpuState;
+    cfd.download_state(gpuState);
+    cpu.download_state(cpuState);
+
+    // The kernels match operation for operation, f32 only differs by contraction and division rounding
+    // on the device; half storage rounds every stored value to 11 bits, once per sweep
+    const bool half = options.storage != FieldStorage::Float32;
+    const float relativeTolerance = half ? 2e-2f : 1e-4f;
+    const int64_t ulpTolerance = half ? 1 << 17 : 256;
+
+    struct Field {
+        const char* name;
+        const std::vector<float>& gpu;
+        const std::vector<float>& cpu;
+    };
+    const Field fields[] = {
+        {"vx", gpuState.vx, cpuState.vx},
+        {"vy", gpuState.vy, cpuState.vy},
+        {"vz", gpuState.vz, cpuState.vz},
+        {"density", gpuState.density, cpuState.density},
+    };
+
+    bool passed = true;
+    for (const Field& field : fields) {
+        // Absolute tolerance relative to the field's largest value, at least 1
+        float scale = 1.0f;
+        for (float v : field.cpu) {
+            scale = std::max(scale, std::fabs(v));
+        }
+        const float absTolerance = relativeTolerance * scale;
+
+        float maxAbs = 0.0f;
+        int64_t maxUlps = 0;
+        size_t mismatches = 0;
+        for (size_t i = 0; i < field.cpu.size(); i++) {
+            const float diff = std::fabs(field.gpu[i] - field.cpu[i]);
+            const int64_t ulps = ulp_distance(field.gpu[i], field.cpu[i]);
+            // NaN fails the comparison and counts as a mismatch
+            if (!(diff <= absTolerance) && ulps > ulpTolerance) {
+                mismatches++;
+            }
+            maxAbs = std::isnan(diff) ? diff : std::max(maxAbs, diff);
+            maxUlps = std::max(maxUlps, ulps);
+        }
+        printf("CPU check, %s after %d steps: max abs %g (tolerance %g), max %lld ulps (tolerance %lld), "
+               "%zu of %zu values differ\n", field.name, options.checkCpuSteps, maxAbs, absTolerance,
+               (long long)maxUlps, (long long)ulpTolerance, mismatches, field.cpu.size());
+        passed = passed && mismatches == 0;
+    }
+
+    vkDeviceWaitIdle(device);
+    cfd.cleanup();
+    uploader.cleanup();
+    return passed;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    try {
+        BenchOptions options = parse_options(argc, argv);
+
+        bool needsDevice = std::any_of(options.variants.begin(), options.variants.end(),
+                                       [](const std::string& v) { return v != "cpu"; });
+
+        BenchDevice bench;
+        std::vector<KernelManifest> manifests;
+        double streamGbs = -1;
+        if (needsDevice) {
+            init_device(bench);
+            manifests = load_solver_manifests();
+            streamGbs = measure_stream_copy(bench, options);
+            if (options.checkBoundaries && !check_boundaries(bench, options)) {
+                throw std::runtime_error("the device boundary mask differs from the host reference");
+            }
+            if (options.checkCpuSteps > 0 && !check_cpu(bench, options)) {
+                throw std::runtime_error("the Vulkan solver differs from the CPU backend");
+            }
+        }
+
+        std::vector<RunResult> runs;
+        for (unsigned int res : options.resolutions) {
+            for (int sweeps : options.sweeps) {
+                for (auto& variant : options.variants) {
+                    printf("Running %s at res %u with %d sweeps\n", variant.c_str(), res, sweeps);
+                    if (variant == "cpu") {
+                        runs.push_back(run_cpu(options, res, sweeps));
+                    } else {
+                        runs.push_back(run_vulkan(bench, options, manifests, res, sweeps, variant == "graph"));
+                        print_roofline(runs.back(), streamGbs);
+                    }
+                }
+            }
+        }
+
+        // Progress goes to stdout with the solver's own logging, so the results always go to a file
+        std::ofstream file(options.output);
+        if (!file) {
+            throw std::runtime_error("Failed to open " + options.output);
+        }
+        write_json(file, needsDevice ? &bench : nullptr, options, streamGbs, runs);
+        printf("Results written to %s\n", options.output.c_str());
+
+        if (needsDevice) {
+            cleanup_device(bench);
+        }
+    } catch (const std::exception& e) {
+        fprintf(stderr, "rotor_cfd_bench: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
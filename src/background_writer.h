@@ -0,0 +1,120 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+// Runs jobs one at a time, in submission order, on a thread of its own, for writers the solver hands data
+// to without waiting. At most maxJobs are in flight, counting the one running; submit drops further ones
+// rather than block. The thread starts with the first job, so a writer that never gets one never pays for it.
+template <typename Job>
+class BackgroundWriter {
+public:
+    // Runs on the worker thread, returns whether the job was written
+    using Run = std::function<bool(Job&)>;
+
+    BackgroundWriter(size_t maxJobs, Run run) : _maxJobs(maxJobs), _run(std::move(run)) {}
+    // Runs what is still queued
+    ~BackgroundWriter() { stop(); }
+    BackgroundWriter(const BackgroundWriter&) = delete;
+    BackgroundWriter& operator=(const BackgroundWriter&) = delete;
+
+    // Whether submit would drop a job now, lets callers skip building one
+    bool full() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _stop || _queue.size() + (_running ? 1 : 0) >= _maxJobs;
+    }
+
+    // Returns false and drops the job when maxJobs are in flight or the writer is stopped
+    bool submit(Job job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_stop || _queue.size() + (_running ? 1 : 0) >= _maxJobs) {
+                _dropped++;
+                return false;
+            }
+            _queue.push_back(std::move(job));
+            if (!_worker.joinable()) {
+                _worker = std::thread(&BackgroundWriter::worker_loop, this);
+            }
+        }
+        _cv.notify_all();
+        return true;
+    }
+
+    // Blocks until nothing is in flight
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [&] { return _queue.empty() && !_running; });
+    }
+
+    // Runs what is queued and joins the thread, for owners whose state the jobs use to call before tearing
+    // it down. Later submits are dropped.
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _cv.notify_all();
+        if (_worker.joinable()) {
+            _worker.join();
+        }
+    }
+
+    uint64_t written() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _written;
+    }
+
+    uint64_t dropped() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _dropped;
+    }
+
+private:
+    size_t _maxJobs;
+    Run _run;
+
+    std::thread _worker;
+    mutable std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<Job> _queue;
+    bool _running = false;
+    bool _stop = false;
+    uint64_t _written = 0;
+    uint64_t _dropped = 0;
+
+    void worker_loop()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true) {
+            // Queued jobs still run when stopping, the last one of a run is usually the one wanted
+            _cv.wait(lock, [&] { return !_queue.empty() || _stop; });
+            if (_queue.empty()) {
+                return;
+            }
+
+            Job job = std::move(_queue.front());
+            _queue.pop_front();
+            _running = true;
+            lock.unlock();
+
+            const bool ok = _run(job);
+
+            lock.lock();
+            _running = false;
+            _written += ok;
+            _cv.notify_all();
+        }
+    }
+};
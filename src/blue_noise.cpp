@@ -0,0 +1,125 @@
+#include "blue_noise.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <stdexcept>
+
+namespace {
+
+// Gaussian filtered density of the set pixels of a toroidal binary pattern, kept up to date per change
+class EnergyField {
+public:
+    explicit EnergyField(unsigned int size) : _size(size), _kernel(size_t(size) * size), _energy(size_t(size) * size, 0.0f)
+    {
+        const float sigma = 1.5f;
+        for (unsigned int y = 0; y < size; y++) {
+            for (unsigned int x = 0; x < size; x++) {
+                // Toroidal distance, so the tile repeats without seams
+                float dx = float(std::min(x, size - x));
+                float dy = float(std::min(y, size - y));
+                _kernel[size_t(y) * size + x] = std::exp(-(dx * dx + dy * dy) / (2.0f * sigma * sigma));
+            }
+        }
+    }
+
+    void toggle(size_t index, bool set)
+    {
+        const float sign = set ? 1.0f : -1.0f;
+        const unsigned int px = unsigned(index % _size);
+        const unsigned int py = unsigned(index / _size);
+        for (unsigned int y = 0; y < _size; y++) {
+            const unsigned int ky = (y + _size - py) % _size;
+            for (unsigned int x = 0; x < _size; x++) {
+                const unsigned int kx = (x + _size - px) % _size;
+                _energy[size_t(y) * _size + x] += sign * _kernel[size_t(ky) * _size + kx];
+            }
+        }
+    }
+
+    // Highest energy set pixel, or lowest energy clear pixel when tightest is false
+    size_t find(const std::vector<uint8_t>& pattern, bool tightest) const
+    {
+        size_t best = pattern.size();
+        for (size_t i = 0; i < pattern.size(); i++) {
+            if (bool(pattern[i]) != tightest) {
+                continue;
+            }
+            if (best == pattern.size() || (tightest ? _energy[i] > _energy[best] : _energy[i] < _energy[best])) {
+                best = i;
+            }
+        }
+        return best;
+    }
+
+private:
+    unsigned int _size;
+    std::vector<float> _kernel;
+    std::vector<float> _energy;
+};
+
+}
+
+std::vector<float> blue_noise_tile(unsigned int size, uint32_t seed)
+{
+    if (size == 0) {
+        throw std::runtime_error("blue_noise_tile: size must be positive");
+    }
+    const size_t count = size_t(size) * size;
+
+    // Initial pattern: a tenth of the pixels at random, relaxed until the tightest cluster is the largest void
+    std::vector<uint8_t> pattern(count, 0);
+    EnergyField energy(size);
+    std::mt19937 rng(seed);
+    const size_t initialOnes = std::max<size_t>(1, count / 10);
+    for (size_t placed = 0; placed < initialOnes;) {
+        size_t index = rng() % count;
+        if (!pattern[index]) {
+            pattern[index] = 1;
+            energy.toggle(index, true);
+            placed++;
+        }
+    }
+
+    for (size_t iteration = 0; iteration < count; iteration++) {
+        size_t cluster = energy.find(pattern, true);
+        pattern[cluster] = 0;
+        energy.toggle(cluster, false);
+
+        size_t hole = energy.find(pattern, false);
+        pattern[hole] = 1;
+        energy.toggle(hole, true);
+        if (hole == cluster) {
+            break;
+        }
+    }
+
+    std::vector<size_t> rank(count, 0);
+
+    // Phase 1: ranks below the initial pattern by removing its tightest clusters one at a time
+    {
+        std::vector<uint8_t> remaining = pattern;
+        EnergyField remainingEnergy = energy;
+        for (size_t r = initialOnes; r-- > 0;) {
+            size_t cluster = remainingEnergy.find(remaining, true);
+            remaining[cluster] = 0;
+            remainingEnergy.toggle(cluster, false);
+            rank[cluster] = r;
+        }
+    }
+
+    // Phases 2 and 3: the rest by filling the largest void, which is also the tightest cluster of the
+    // inverted pattern once more than half is set
+    for (size_t r = initialOnes; r < count; r++) {
+        size_t hole = energy.find(pattern, false);
+        pattern[hole] = 1;
+        energy.toggle(hole, true);
+        rank[hole] = r;
+    }
+
+    std::vector<float> tile(count);
+    for (size_t i = 0; i < count; i++) {
+        tile[i] = (float(rank[i]) + 0.5f) / float(count);
+    }
+    return tile;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Edge of the tile the ray marcher jitters its samples with, matches raymarch.glsl
+const unsigned int BLUE_NOISE_TILE_SIZE = 64;
+
+// Tileable blue noise threshold map by void-and-cluster (Ulichney 1993): size * size values, row major,
+// each rank r stored as (r + 0.5) / (size * size) so they are uniform over [0, 1). Deterministic for a seed.
+std::vector<float> blue_noise_tile(unsigned int size, uint32_t seed = 1);
@@ -1,5 +1,10 @@
 #include "cfd.h"
 
+#include <algorithm>
+#include <cstring>
+
+#include "half_float.h"
+
 std::vector<float> init_velocities(size_t gridsize, float vx, float vy, float vz) {
     std::vector<float> velocities(gridsize * gridsize * gridsize * 3);
     for (size_t i = 0; i < velocities.size(); i += 3) {
@@ -10,14 +15,6 @@ std::vector<float> init_velocities(size_t gridsize, float vx, float vy, float vz
     return velocities;
 }
 
-std::vector<float> init_scalars(size_t gridsize, float base_val) {
-    std::vector<float> scalars(gridsize * gridsize * gridsize);
-    for (size_t i = 0; i < scalars.size(); i += 1) {
-        scalars[i] = base_val;
-    }
-    return scalars;
-}
-
 std::vector<glm::vec4> init_vec4(size_t gridsize, float base_val) {
     std::vector<glm::vec4> vectors(gridsize * gridsize * gridsize);
     for (size_t i = 0; i < vectors.size(); i += 1) {
@@ -26,20 +23,6 @@ std::vector<glm::vec4> init_vec4(size_t gridsize, float base_val) {
     return vectors;
 }
 
-std::vector<float> init_vels(size_t gridsize, float base_val) {
-    std::vector<float> scalars((gridsize+1) * gridsize * gridsize);
-    for (size_t i = 0; i < scalars.size(); i += 1) {
-        uint x = i % gridsize;
-        uint y = (i / gridsize) % gridsize;
-        uint z = i / (gridsize * gridsize);
-        scalars[i] = base_val;
-        // if (sqrt(pow(x - (gridsize-1)/2, 2) + pow(y - (gridsize-1)/2, 2)) < 10) {
-        //     scalars[i] = 0.0;
-        // }
-    }
-    return scalars;
-}
-
 std::vector<float> init_cylinder(float base_val, int sizeX, int sizeY, int sizeZ, int radius) {
     std::vector<float> scalars(sizeX * sizeY * sizeZ);
     for (int i = 0; i < scalars.size(); i += 1) {
@@ -70,21 +53,6 @@ std::vector<float> init_wall(float base_val, int sizeX, int sizeY, int sizeZ) {
     return scalars;
 }
 
-std::vector<float> init_boundaries(int gridSize) {
-    std::vector<float> scalars(gridSize * gridSize * gridSize);
-    for (int i = 0; i < scalars.size(); i += 1) {
-        int x = i % gridSize;
-        int y = (i / gridSize) % gridSize;
-        int z = i / (gridSize * gridSize);
-        if (x % (gridSize) == 0 || y % (gridSize) == 0 || z % (gridSize) == 0) {
-            scalars[i] = 0.0;
-        } else {
-            scalars[i] = 1.0;
-        }
-    }
-    return scalars;
-}
-
 void add_boundary_cylinder(std::vector<float>& boundaries, int rad, int posX, int posY, int gridsize) {
     for (int i = 0; i < boundaries.size(); i += 1) {
         int x = i % gridsize;
@@ -185,71 +153,252 @@ void add_boundary_cylinder(std::vector<float>& boundaries, int rad, int posX, in
 //     init.disp.destroyShaderModule(shaderModuleWrtieTex, nullptr);
 // }
 
-void loadTerrain(const std::string& filename, std::vector<float>& terrain, int& sizeX, int& sizeY) {
-    std::ifstream file(filename);
-    if (!file.is_open()) {
-        std::cerr << "Error opening file: " << filename << std::endl;
-        return;
+void Cfd::load_terrain(UploadManager& uploader, const TerrainMap& terrain, float heightScale) {
+    std::cout << "Terrain size: " << terrain.rows() << " x " << terrain.cols() << std::endl;
+
+    if (_terrainHeights.image != VK_NULL_HANDLE) {
+        vkhelp::destroy_resource(_device, _allocator, _terrainHeights);
     }
 
-    sizeX = 0;
-    terrain.clear();
+    // Full precision heights, voxelise.comp reads them with texelFetch so the mask matches the CPU stamp
+    std::vector<float> heights = terrain.to_floats();
+    _terrainHeights = {1, heights.size() * sizeof(float), VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, COLOR_IMAGE};
+    vkinit::createResource(_device, _allocator, _terrainHeights, {terrain.cols(), terrain.rows(), 1}, VK_FORMAT_R32_SFLOAT,
+                           VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, 2);
+    uploader.upload_image(_terrainHeights, heights.data(), {terrain.cols(), terrain.rows()}, sizeof(float));
+    vkinit::updateKernelDescriptors(_device, _voxelise, {_boundaries, _terrainHeights});
 
-    std::string line;
-    while (std::getline(file, line)) {
-        std::istringstream iss(line);
-        float value;
-        sizeY = 0;
+    _terrainHeightScale = heightScale;
+    _voxelisePending = true;
+}
 
-        while (iss >> value) {
-            terrain.push_back(value);
-            sizeY += 1;
-        }
-        sizeX += 1;
+void Cfd::load_terrain(UploadManager& uploader, const TerrainMap& terrain, float heightScale,
+                       const void* boundaries, size_t boundaryBytes)
+{
+    const size_t cells = size_t(_res + 2) * (_res + 2) * (_res + 2);
+    const size_t expected = cells * (_fieldStorage == FieldStorage::Float32 ? sizeof(float) : sizeof(uint16_t));
+    if (boundaryBytes != expected) {
+        throw std::runtime_error("load_terrain: boundary mask of " + std::to_string(boundaryBytes) +
+                                 " bytes, expected " + std::to_string(expected));
     }
-    file.close();
+
+    load_terrain(uploader, terrain, heightScale);
+    uploader.upload(_boundaries, boundaries, boundaryBytes);
+    // With stamps on the mask the voxeliser still runs, it replays them
+    _voxelisePending = !_stamps.empty();
+}
+
+std::vector<uint8_t> Cfd::stamp_boundaries(const TerrainMap& terrain, float heightScale) const
+{
+    std::vector<float> mask = init_boundaries(_res + 2);
+    stamp_terrain_boundaries(mask, _res, terrain, heightScale);
+
+    std::vector<uint8_t> bytes;
+    if (_fieldStorage == FieldStorage::Float32) {
+        bytes.resize(mask.size() * sizeof(float));
+        std::memcpy(bytes.data(), mask.data(), bytes.size());
+    } else {
+        std::vector<uint16_t> halves = to_half_buffer(mask);
+        bytes.resize(halves.size() * sizeof(uint16_t));
+        std::memcpy(bytes.data(), halves.data(), bytes.size());
+    }
+    return bytes;
+}
+
+void Cfd::set_terrain_height_scale(float heightScale)
+{
+    _terrainHeightScale = heightScale;
+    _voxelisePending = _terrainHeights.image != VK_NULL_HANDLE;
 }
 
-void Cfd::load_terrain(VkCommandPool& commandPool, VkQueue& queue, const std::string& filename, float heightScale) {
-    int terrainSizeX, terrainSizeY;
-    std::vector<float> terrain;
-    loadTerrain(filename, terrain, terrainSizeX, terrainSizeY);
+void Cfd::set_terrain_bilinear(bool bilinear)
+{
+    _terrainBilinear = bilinear;
+    _voxelisePending = _terrainHeights.image != VK_NULL_HANDLE;
+}
 
-    std::cout << "Terrain size: " << terrainSizeX << " x " << terrainSizeY << std::endl;
+uint32_t Cfd::stamp_boundary(UploadManager& uploader, const BoundaryPrimitive& primitive)
+{
+    BoundaryStampPushConstants stamp{};
+    stamp.gridSize = _res;
+    stamp.shape = int(primitive.shape);
+    stamp.axis = primitive.axis;
+    stamp.value = primitive.value;
+    stamp.centre[0] = primitive.centre[0];
+    stamp.centre[1] = primitive.centre[1];
+    stamp.radius = primitive.radius;
+    stamp.heightScale = primitive.heightScale;
+
+    if (primitive.shape == BoundaryShape::Heightfield) {
+        const int32_t cols = primitive.hi[0] - primitive.lo[0];
+        const size_t count = primitive.heights.size();
+        if (cols <= 0 || count != size_t(cols) * (primitive.hi[2] - primitive.lo[2])) {
+            throw std::runtime_error("stamp_boundary: heightfield size does not match its box");
+        }
+        if (_stampHeightsUsed + count > cfd_stamp_height_capacity(_res)) {
+            throw std::runtime_error("stamp_boundary: heightfield stamps hold more than " +
+                                     std::to_string(cfd_stamp_height_capacity(_res)) + " heights, remove some first");
+        }
+        uploader.upload(_stampHeights, primitive.heights.data(), count * sizeof(float), _stampHeightsUsed * sizeof(float));
+        stamp.columns[0] = primitive.lo[0];
+        stamp.columns[1] = primitive.lo[2];
+        stamp.columns[2] = cols;
+        stamp.columns[3] = int32_t(_stampHeightsUsed);
+        _stampHeightsUsed += count;
+    }
 
-    int boundarySize = _res + 2;
-    std::vector<float> boundariesVec = init_boundaries(boundarySize);
-    
-    float terrainStepX = terrainSizeX / float(_res);
-    float terrainStepY = terrainSizeY / float(_res);
+    // Outside the interior a stamp is kept but never dispatched
+    int32_t lo[3], hi[3];
+    if (!boundary_primitive_bounds(primitive, _res, lo, hi)) {
+        std::fill(hi, hi + 3, 0);
+        std::fill(lo, lo + 3, 0);
+    }
+    for (int a = 0; a < 3; a++) {
+        stamp.lo[a] = lo[a];
+        stamp.extent[a] = hi[a] - lo[a];
+    }
 
-    std::cout << "Terrain step: " << terrainStepX << " x " << terrainStepY << std::endl;
+    const uint32_t id = _nextStampId++;
+    _stamps.push_back({id, stamp, primitive.shape == BoundaryShape::Heightfield ? primitive.heights : std::vector<float>()});
+    _boundaryUpdates.push_back({false, stamp, id});
+    return id;
+}
 
-    for (int i = 0; i < boundariesVec.size(); i += 1) {
-        int x = i % boundarySize;
-        int y = (i / boundarySize) % boundarySize;
-        int z = i / (boundarySize * boundarySize);
+void Cfd::remove_boundary_stamp(UploadManager& uploader, uint32_t id)
+{
+    auto stamp = std::find_if(_stamps.begin(), _stamps.end(), [&](const BoundaryStamp& s) { return s.id == id; });
+    if (stamp == _stamps.end()) {
+        throw std::runtime_error("remove_boundary_stamp: no stamp " + std::to_string(id));
+    }
+    if (_terrainHeights.image == VK_NULL_HANDLE) {
+        throw std::runtime_error("remove_boundary_stamp: needs a terrain to restore the cells from");
+    }
 
-        if (x > 0 && x < _res+1 && z > 0 && z < _res+1) {
-            int terrainX = (x-1) * terrainStepX;
-            int terrainZ = (z-1) * terrainStepY;
-    
-            float terrainHeight = terrain[terrainX + terrainZ*terrainSizeX]*heightScale;
+    _boundaryUpdates.push_back({true, stamp->constants, 0});
+    const bool heightfield = !stamp->heights.empty();
+    _stamps.erase(stamp);
+    if (!heightfield) {
+        return;
+    }
 
-            if (boundarySize - y >= terrainHeight*boundarySize) {
-                boundariesVec[i] = 1.0;
-            } else {
-                boundariesVec[i] = 0.0;
+    // Later heights move down over the removed ones, pending stamps of them are dispatched with the new
+    // offsets as the upload lands ahead of the next step
+    size_t used = 0;
+    for (BoundaryStamp& s : _stamps) {
+        if (s.heights.empty()) {
+            continue;
+        }
+        if (s.constants.columns[3] != int32_t(used)) {
+            uploader.upload(_stampHeights, s.heights.data(), s.heights.size() * sizeof(float), used * sizeof(float));
+            s.constants.columns[3] = int32_t(used);
+            for (BoundaryUpdate& update : _boundaryUpdates) {
+                if (update.id == s.id) {
+                    update.stamp.columns[3] = int32_t(used);
+                }
             }
         }
+        used += s.heights.size();
     }
+    _stampHeightsUsed = used;
+}
 
-    for (int i=0; i<_res+2; i++)
-    {
-        boundariesVec[(_res+2)*(_res+2)*(_res/2+1) + (_res+2)*(i) + (0+1)] = 0.0f;
+namespace {
+
+// Orders the mask writes of one dispatch against the reads and writes around it
+void boundary_barrier(VkCommandBuffer cmd)
+{
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+uint32_t box_groups(int32_t extent) { return uint32_t(extent + 3) / 4; }
+
+} // namespace
+
+void Cfd::dispatch_voxelise(VkCommandBuffer cmd, const int32_t lo[3], const int32_t hi[3])
+{
+    VoxelisePushConstants pushData{};
+    pushData.gridSize = _res;
+    pushData.heightScale = _terrainHeightScale;
+    pushData.bilinear = _terrainBilinear ? 1 : 0;
+    for (int a = 0; a < 3; a++) {
+        pushData.lo[a] = lo[a];
+        pushData.extent[a] = hi[a] - lo[a];
     }
 
-    vkhelp::copy_to_buffer(_device, _allocator, commandPool, queue, _boundaries, boundariesVec.data(), boundariesVec.size() * sizeof(float));
+    boundary_barrier(cmd);
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _voxelise.pipeline);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _voxelise.pipelineLayout, 0, 1, &_voxelise.descriptorSet, 0, nullptr);
+    vkCmdPushConstants(cmd, _voxelise.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(VoxelisePushConstants), &pushData);
+    vkCmdDispatch(cmd, box_groups(pushData.extent[0]), box_groups(pushData.extent[1]), box_groups(pushData.extent[2]));
+}
+
+void Cfd::dispatch_stamp(VkCommandBuffer cmd, const BoundaryStampPushConstants& stamp, const int32_t lo[3], const int32_t hi[3])
+{
+    // Only the part of the stamp inside the box
+    BoundaryStampPushConstants pushData = stamp;
+    for (int a = 0; a < 3; a++) {
+        int32_t first = std::max(stamp.lo[a], lo[a]);
+        int32_t last = std::min(stamp.lo[a] + stamp.extent[a], hi[a]);
+        if (first >= last) {
+            return;
+        }
+        pushData.lo[a] = first;
+        pushData.extent[a] = last - first;
+    }
+
+    boundary_barrier(cmd);
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _stampBoundary.pipeline);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _stampBoundary.pipelineLayout, 0, 1, &_stampBoundary.descriptorSet, 0, nullptr);
+    vkCmdPushConstants(cmd, _stampBoundary.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(BoundaryStampPushConstants), &pushData);
+    vkCmdDispatch(cmd, box_groups(pushData.extent[0]), box_groups(pushData.extent[1]), box_groups(pushData.extent[2]));
+}
+
+void Cfd::record_boundary_updates(VkCommandBuffer cmd)
+{
+    if (!_voxelisePending && _boundaryUpdates.empty()) {
+        return;
+    }
+
+    if (_voxelisePending) {
+        // The whole mask again, every stamp goes back on top and the queued updates are covered by it
+        const int32_t lo[3] = {0, 0, 0};
+        const int32_t hi[3] = {int32_t(_res + 2), int32_t(_res + 2), int32_t(_res + 2)};
+        dispatch_voxelise(cmd, lo, hi);
+        for (const BoundaryStamp& stamp : _stamps) {
+            dispatch_stamp(cmd, stamp.constants, lo, hi);
+        }
+    } else {
+        for (const BoundaryUpdate& update : _boundaryUpdates) {
+            int32_t lo[3], hi[3];
+            for (int a = 0; a < 3; a++) {
+                lo[a] = update.stamp.lo[a];
+                hi[a] = update.stamp.lo[a] + update.stamp.extent[a];
+            }
+            if (!update.revoxelise) {
+                dispatch_stamp(cmd, update.stamp, lo, hi);
+                continue;
+            }
+            if (lo[0] >= hi[0] || lo[1] >= hi[1] || lo[2] >= hi[2]) {
+                continue;
+            }
+            // Stamps still listed that overlap the box, in order. One stamped after this update was queued
+            // is replayed here as well as by its own update, which writes the same values again.
+            dispatch_voxelise(cmd, lo, hi);
+            for (const BoundaryStamp& stamp : _stamps) {
+                dispatch_stamp(cmd, stamp.constants, lo, hi);
+            }
+        }
+    }
+
+    // The step's passes read the new mask
+    boundary_barrier(cmd);
+    _voxelisePending = false;
+    _boundaryUpdates.clear();
 }
 
 // void load_terrain(Init& init, Cfd& cfd, const std::string& filename) {
@@ -321,16 +470,114 @@ void Cfd::load_terrain(VkCommandPool& commandPool, VkQueue& queue, const std::st
 //     cleanup(init, cfd.densityTex);   
 // }
 
-void Cfd::init_cfd(VkDevice &device, VmaAllocator &allocator, int res)
+const char* field_storage_name(FieldStorage storage)
 {
-    _device = device;
-    _allocator = allocator;
-    _res = res;
+    switch (storage) {
+    case FieldStorage::Float16: return "f16";
+    case FieldStorage::Float16Packed: return "f16packed";
+    default: return "f32";
+    }
+}
+
+const char* volume_format_name(VolumeFormat format)
+{
+    switch (format) {
+    case VolumeFormat::Float32: return "rg32f";
+    case VolumeFormat::Unorm8: return "rg8";
+    default: return "rg16f";
+    }
+}
 
-    const VkDeviceSize bufferSize = _res * _res * _res * sizeof(float);
-    const VkDeviceSize bufferSizeSource2 = _res * _res * _res * sizeof(glm::vec4);
-    const VkDeviceSize velBufferSize = (_res+1) * _res * _res * sizeof(float);
-    const VkDeviceSize boarderBufferSize = (_res+2) * (_res+2) * (_res+2) * sizeof(float);
+VkFormat volume_vk_format(VolumeFormat format)
+{
+    switch (format) {
+    case VolumeFormat::Float32: return VK_FORMAT_R32G32_SFLOAT;
+    case VolumeFormat::Unorm8: return VK_FORMAT_R8G8_UNORM;
+    default: return VK_FORMAT_R16G16_SFLOAT;
+    }
+}
+
+VkDeviceSize volume_texel_bytes(VolumeFormat format)
+{
+    switch (format) {
+    case VolumeFormat::Float32: return 8;
+    case VolumeFormat::Unorm8: return 2;
+    default: return 4;
+    }
+}
+
+void Cfd::set_volume_format(VolumeFormat format)
+{
+    if (_device != VK_NULL_HANDLE) {
+        throw std::runtime_error("Cfd: volume format must be set before init_cfd");
+    }
+    _volumeFormat = format;
+}
+
+void Cfd::check_volume_format()
+{
+    VmaAllocatorInfo allocatorInfo{};
+    vmaGetAllocatorInfo(_allocator, &allocatorInfo);
+
+    // Written by the kernels and sampled with linear filtering by the renderer
+    const VkFormatFeatureFlags required = VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+    auto supported = [&](VolumeFormat format) {
+        VkFormatProperties properties{};
+        vkGetPhysicalDeviceFormatProperties(allocatorInfo.physicalDevice, volume_vk_format(format), &properties);
+        return (properties.optimalTilingFeatures & required) == required;
+    };
+
+    if (supported(_volumeFormat)) {
+        return;
+    }
+    if (_volumeFormat == VolumeFormat::Float16 || !supported(VolumeFormat::Float16)) {
+        throw std::runtime_error(std::string("Cfd: no usable volume format, ") + volume_format_name(_volumeFormat) + " is not supported");
+    }
+    printf("Volume format %s is not supported, using rg16f\n", volume_format_name(_volumeFormat));
+    _volumeFormat = VolumeFormat::Float16;
+}
+
+void Cfd::set_field_storage(FieldStorage storage)
+{
+    if (_device != VK_NULL_HANDLE) {
+        throw std::runtime_error("Cfd: field storage must be set before init_cfd");
+    }
+    _fieldStorage = storage;
+}
+
+VkDeviceSize Cfd::field_bytes(size_t count) const
+{
+    if (_fieldStorage == FieldStorage::Float32) {
+        return VkDeviceSize(count) * sizeof(float);
+    }
+    // Whole 32-bit words, the packed kernels address two halves per uint
+    return VkDeviceSize((count + 1) / 2) * sizeof(uint32_t);
+}
+
+std::string Cfd::field_kernel(const std::string& shader) const
+{
+    if (_fieldStorage == FieldStorage::Float32) {
+        return "build/shaders/" + shader + ".comp.spv";
+    }
+    return "build/shaders/" + shader + "." + field_storage_name(_fieldStorage) + ".comp.spv";
+}
+
+void Cfd::upload_field(UploadManager& uploader, ResourceBinding& field, const std::vector<float>& values)
+{
+    if (_fieldStorage == FieldStorage::Float32) {
+        uploader.upload(field, values.data(), values.size() * sizeof(float));
+        return;
+    }
+    // Converted on the host, the staging copy is taken before this returns
+    std::vector<uint16_t> halves = to_half_buffer(values);
+    uploader.upload(field, halves.data(), halves.size() * sizeof(uint16_t));
+}
+
+void Cfd::create_buffers()
+{
+    const VkDeviceSize bufferSize = field_bytes(size_t(_res) * _res * _res);
+    const VkDeviceSize velBufferSize = field_bytes(size_t(_res+1) * _res * _res);
+    const VkDeviceSize boarderBufferSize = field_bytes(size_t(_res+2) * (_res+2) * (_res+2));
 
     _vx = {0, velBufferSize, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, BUFFER};
     _vy = {1, velBufferSize, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, BUFFER};
@@ -338,7 +585,7 @@ void Cfd::init_cfd(VkDevice &device, VmaAllocator &allocator, int res)
 
     _density = {3, bufferSize, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, BUFFER};
     _pressure = {4, bufferSize, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, BUFFER};
-    _source = {5, bufferSize, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, BUFFER};
+    _densitySources = {5, cfd_source_capacity(_res) * sizeof(DensitySource), VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, BUFFER};
 
     _vx2 = {6, velBufferSize, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, BUFFER};
     _vy2 = {7, velBufferSize, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, BUFFER};
@@ -347,35 +594,124 @@ void Cfd::init_cfd(VkDevice &device, VmaAllocator &allocator, int res)
     _density2 = {9, bufferSize, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, BUFFER};
     _pressure2 = {10, bufferSize, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, BUFFER};
 
-    _source2 = {11, bufferSizeSource2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, BUFFER};
+    _velocitySources = {11, cfd_source_capacity(_res) * sizeof(VelocitySource), VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, BUFFER};
 
     _boundaries = {12, boarderBufferSize, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, BUFFER};
+    _stampHeights = {17, cfd_stamp_height_capacity(_res) * sizeof(float), VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, BUFFER};
+
+    // Only bound by the diagnostics kernels, so their indices here are informational
+    _diagnosticPartials = {14, DIAGNOSTICS_PARTIALS * 6 * sizeof(float), VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, BUFFER};
+    _diagnostics = {15, DIAGNOSTICS_RING_SIZE * sizeof(DiagnosticsRecord), VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, BUFFER};
+
+    // The state, what is uploaded or read back and anything that has to survive from one step to the next
+    _memory.add_buffer("vx", _vx, false);
+    _memory.add_buffer("vy", _vy, false);
+    _memory.add_buffer("vz", _vz, false);
+    _memory.add_buffer("density", _density, false);
+    _memory.add_buffer("pressure", _pressure, false);
+    _memory.add_buffer("densitySources", _densitySources, false);
+    _memory.add_buffer("velocitySources", _velocitySources, false);
+    _memory.add_buffer("boundaries", _boundaries, false);
+    _memory.add_buffer("stampHeights", _stampHeights, false);
+    _memory.add_buffer("diagnostics", _diagnostics, false);
+
+    // Scratch fully rewritten within a step before it is read: advect writes every face of the
+    // second velocities, writeTexture every cell of density2 and diagnosticsReduce every partial.
+    // pressure2 is only bound for the shared layout.
+    _memory.add_buffer("vx2", _vx2, true);
+    _memory.add_buffer("vy2", _vy2, true);
+    _memory.add_buffer("vz2", _vz2, true);
+    _memory.add_buffer("density2", _density2, true);
+    _memory.add_buffer("pressure2", _pressure2, true);
+    _memory.add_buffer("diagnosticPartials", _diagnosticPartials, true);
+
+    // The density texture is sampled by the renderer between steps, so it keeps its own image
+    const VkDeviceSize bricks = volume_brick_count(_res);
+    _memory.add_external(VkDeviceSize(_res) * _res * _res * volume_texel_bytes(_volumeFormat) + bricks * bricks * bricks * 2);
+}
 
-    _densityTex = {13, bufferSize, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, COLOR_IMAGE};
+unsigned int Cfd::choose_resolution()
+{
+    // What is left of the largest device local heap's budget
+    VmaBudget budgets[VK_MAX_MEMORY_HEAPS];
+    vmaGetHeapBudgets(_allocator, budgets);
+    const VkPhysicalDeviceMemoryProperties* memoryProperties = nullptr;
+    vmaGetMemoryProperties(_allocator, &memoryProperties);
+
+    VkDeviceSize available = 0;
+    for (uint32_t i = 0; i < memoryProperties->memoryHeapCount; i++) {
+        if ((memoryProperties->memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) && budgets[i].budget > budgets[i].usage) {
+            available = std::max(available, budgets[i].budget - budgets[i].usage);
+        }
+    }
+    const VkDeviceSize budget = VkDeviceSize(available * CFD_MEMORY_BUDGET_FRACTION);
+
+    // The boundary mask is the largest buffer and must fit one storage descriptor, the texture one image
+    const VkPhysicalDeviceProperties* properties = nullptr;
+    vmaGetPhysicalDeviceProperties(_allocator, &properties);
+    unsigned int maxRes = std::min<unsigned int>(CFD_MAX_RESOLUTION, properties->limits.maxImageDimension3D);
+    while (maxRes > CFD_MIN_RESOLUTION &&
+           field_bytes(size_t(maxRes + 2) * (maxRes + 2) * (maxRes + 2)) > properties->limits.maxStorageBufferRange) {
+        maxRes--;
+    }
 
-    vkinit::createResource(_device, _allocator, _vx);
-    vkinit::createResource(_device, _allocator, _vy);
-    vkinit::createResource(_device, _allocator, _vz);
-    vkinit::createResource(_device, _allocator, _density);
-    vkinit::createResource(_device, _allocator, _pressure);
-    vkinit::createResource(_device, _allocator, _source);
+    // Planned on buffers without memory, nothing is allocated while searching
+    auto footprint = [this](unsigned int res) {
+        _res = res;
+        create_buffers();
+        build_graph();
+        VkDeviceSize bytes = _memory.plan(_graph);
+        _graph.clear();
+        _memory.destroy();
+        return bytes;
+    };
 
-    vkinit::createResource(_device, _allocator, _vx2);
-    vkinit::createResource(_device, _allocator, _vy2);
-    vkinit::createResource(_device, _allocator, _vz2);
-    vkinit::createResource(_device, _allocator, _density2);
-    vkinit::createResource(_device, _allocator, _pressure2);
-    vkinit::createResource(_device, _allocator, _source2);
+    if (footprint(CFD_MIN_RESOLUTION) > budget) {
+        throw std::runtime_error("Cfd: device memory budget is too small for any grid");
+    }
+
+    // The footprint grows with the resolution, search the odd ones (2k+1) for the largest that fits
+    unsigned int lo = CFD_MIN_RESOLUTION / 2;
+    unsigned int hi = (maxRes - 1) / 2;
+    while (lo < hi) {
+        unsigned int mid = (lo + hi + 1) / 2;
+        if (footprint(2 * mid + 1) <= budget) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    unsigned int res = 2 * lo + 1;
+    printf("Picked res %u for a budget of %.1f MB\n", res, budget / (1024.0 * 1024.0));
+    return res;
+}
 
-    vkinit::createResource(_device, _allocator, _boundaries);
+void Cfd::init_cfd(VkDevice &device, VmaAllocator &allocator, int res)
+{
+    _device = device;
+    _allocator = allocator;
+    _memory.init(_device, _allocator);
+    check_volume_format();
+    _res = res > 0 ? res : choose_resolution();
 
+    // Buffers get their memory once the graph has given the planner their lifetimes
+    create_buffers();
+
+    _densityTex = {13, VkDeviceSize(_res) * _res * _res * volume_texel_bytes(_volumeFormat), VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, COLOR_IMAGE};
     _densityTex.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-    vkinit::createResource(_device, _allocator, _densityTex, {_res, _res, _res}, VK_FORMAT_R32G32B32A32_SFLOAT, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT);
+    vkinit::createResource(_device, _allocator, _densityTex, {_res, _res, _res}, volume_vk_format(_volumeFormat), VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT);
 	_densityTex.type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE; // revert back for compute shader
 
+    // Read with texelFetch, the sampler is only there for the combined descriptor
+    const unsigned int bricks = volume_brick_count(_res);
+    _occupancy = {16, VkDeviceSize(bricks) * bricks * bricks * 2, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, COLOR_IMAGE};
+    vkinit::createResource(_device, _allocator, _occupancy, {bricks, bricks, bricks}, VK_FORMAT_R16_SFLOAT, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT);
+    _occupancy.type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+
     std::vector<ResourceBinding> resourceBindings = {
-        _vx, _vy, _vz, _density, _pressure, _source,
-        _vx2, _vy2, _vz2, _density2, _pressure2, _source2,
+        _vx, _vy, _vz, _density, _pressure, _densitySources,
+        _vx2, _vy2, _vz2, _density2, _pressure2, _velocitySources,
         _boundaries, _densityTex
     };
 
@@ -394,166 +730,436 @@ void Cfd::init_cfd(VkDevice &device, VmaAllocator &allocator, int res)
 	std::swap(swappedBindings[4], swappedBindings[10]);
     // std::swap(swappedBindings[5], swappedBindings[11]);
 
-    printf("Creating CFD Kernels...\n");
+    printf("Creating CFD Kernels (%s fields, %s volume)...\n", field_storage_name(_fieldStorage), volume_format_name(_volumeFormat));
+
+	_gaussSidel = vkinit::initKernel(_device, KernelType::Compute, { field_kernel("gaussSiedel") }, resourceBindings, pushConstants);
 
-	_gaussSidel = vkinit::initKernel(_device, KernelType::Compute, { "build/shaders/gaussSiedel.comp.spv" }, resourceBindings, pushConstants);
-	vkinit::updateKernelDescriptors(_device, _gaussSidel, resourceBindings);
+    _advect = vkinit::initKernel(_device, KernelType::Compute, { field_kernel("advect") }, resourceBindings, pushConstants);
 
-    _advect = vkinit::initKernel(_device, KernelType::Compute, { "build/shaders/advect.comp.spv" }, resourceBindings, pushConstants);
-	vkinit::updateKernelDescriptors(_device, _advect, resourceBindings);
+	_advectSwapped = vkinit::initKernel(_device, KernelType::Compute, { field_kernel("advect") }, swappedBindings, pushConstants);
 
-	_advectSwapped = vkinit::initKernel(_device, KernelType::Compute, { "build/shaders/advect.comp.spv" }, swappedBindings, pushConstants);
-	vkinit::updateKernelDescriptors(_device, _advectSwapped, swappedBindings);
+	_writeTexture = vkinit::initKernel(_device, KernelType::Compute, { field_kernel("writeTexture") }, resourceBindings, pushConstants);
 
-	_writeTexture = vkinit::initKernel(_device, KernelType::Compute, { "build/shaders/writeTexture.comp.spv" }, resourceBindings, pushConstants);
-	vkinit::updateKernelDescriptors(_device, _writeTexture, resourceBindings);
+	_writeTextureSwapped = vkinit::initKernel(_device, KernelType::Compute, { field_kernel("writeTexture") }, swappedBindings, pushConstants);
 
-	_writeTextureSwapped = vkinit::initKernel(_device, KernelType::Compute, { "build/shaders/writeTexture.comp.spv" }, swappedBindings, pushConstants);
-	vkinit::updateKernelDescriptors(_device, _writeTextureSwapped, swappedBindings);
+    VkPushConstantRange sourceRange{};
+    sourceRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    sourceRange.offset = 0;
+    sourceRange.size = sizeof(SourcePushConstants);
+    std::vector<VkPushConstantRange> sourcePushConstants = { sourceRange };
+
+    _applyVelocitySources = vkinit::initKernel(_device, KernelType::Compute, { field_kernel("applyVelocitySources") }, resourceBindings, sourcePushConstants);
+
+    _applyDensitySources = vkinit::initKernel(_device, KernelType::Compute, { field_kernel("applyDensitySources") }, resourceBindings, sourcePushConstants);
+
+    _applyDensitySourcesSwapped = vkinit::initKernel(_device, KernelType::Compute, { field_kernel("applyDensitySources") }, swappedBindings, sourcePushConstants);
+
+    VkPushConstantRange diagnosticsRange{};
+    diagnosticsRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    diagnosticsRange.offset = 0;
+    diagnosticsRange.size = sizeof(DiagnosticsPushConstants);
+    std::vector<VkPushConstantRange> diagnosticsPushConstants = { diagnosticsRange };
+
+    std::vector<ResourceBinding> reduceBindings = {_vx, _vy, _vz, _density, _boundaries, _diagnosticPartials};
+    _diagnosticsReduce = vkinit::initKernel(_device, KernelType::Compute, { field_kernel("diagnosticsReduce") }, reduceBindings, diagnosticsPushConstants);
+
+    std::vector<ResourceBinding> finalBindings = {_diagnosticPartials, _diagnostics};
+    _diagnosticsFinal = vkinit::initKernel(_device, KernelType::Compute, { "build/shaders/diagnosticsFinal.comp.spv" }, finalBindings, diagnosticsPushConstants);
+
+    std::vector<ResourceBinding> occupancyBindings = {_density, _occupancy};
+    _buildOccupancy = vkinit::initKernel(_device, KernelType::Compute, { field_kernel("buildOccupancy") }, occupancyBindings, pushConstants);
+
+    // Descriptors are written once load_terrain has created the heightmap
+    VkPushConstantRange voxeliseRange{};
+    voxeliseRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    voxeliseRange.offset = 0;
+    voxeliseRange.size = sizeof(VoxelisePushConstants);
+    _terrainHeights = {1, 0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, COLOR_IMAGE};
+    _voxelise = vkinit::initKernel(_device, KernelType::Compute, { field_kernel("voxelise") }, {_boundaries, _terrainHeights}, { voxeliseRange });
+
+    VkPushConstantRange stampRange{};
+    stampRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    stampRange.offset = 0;
+    stampRange.size = sizeof(BoundaryStampPushConstants);
+    _stampBoundary = vkinit::initKernel(_device, KernelType::Compute, { field_kernel("stampBoundary") }, {_boundaries, _stampHeights}, { stampRange });
+
+    build_graph();
+    _memory.plan(_graph);
+    _memory.allocate();
+    if (_verbose) {
+        _memory.report();
+    }
+
+    // Again with the aliases registered, so passes on shared memory stay ordered
+    build_graph();
+
+    vkinit::updateKernelDescriptors(_device, _gaussSidel, resourceBindings);
+    vkinit::updateKernelDescriptors(_device, _advect, resourceBindings);
+    vkinit::updateKernelDescriptors(_device, _advectSwapped, swappedBindings);
+    vkinit::updateKernelDescriptors(_device, _writeTexture, resourceBindings);
+    vkinit::updateKernelDescriptors(_device, _writeTextureSwapped, swappedBindings);
+    vkinit::updateKernelDescriptors(_device, _applyVelocitySources, resourceBindings);
+    vkinit::updateKernelDescriptors(_device, _applyDensitySources, resourceBindings);
+    vkinit::updateKernelDescriptors(_device, _applyDensitySourcesSwapped, swappedBindings);
+    vkinit::updateKernelDescriptors(_device, _diagnosticsReduce, reduceBindings);
+    vkinit::updateKernelDescriptors(_device, _diagnosticsFinal, finalBindings);
+    vkinit::updateKernelDescriptors(_device, _buildOccupancy, occupancyBindings);
+    vkinit::updateKernelDescriptors(_device, _stampBoundary, {_boundaries, _stampHeights});
 
     printf("Initialized CFD with res %d\n", _res);
 }
 
-void Cfd::evolve_cfd_cmd(VkCommandBuffer& commandBuffer)
+void Cfd::build_graph()
 {
     const uint local_work_size = 32;
 
-    const VkDeviceSize nThreads = (_res * _res * _res + local_work_size - 1) / local_work_size;
-    const VkDeviceSize nThreadsVel = ((_res+1) * _res * _res + local_work_size - 1) / local_work_size;
+    const uint32_t nThreads = (_res * _res * _res + local_work_size - 1) / local_work_size;
+    const uint32_t nThreadsVel = ((_res+1) * _res * _res + local_work_size - 1) / local_work_size;
+
+    auto dispatch = [this](Kernel& kernel, uint32_t groups, int shouldRed) {
+        return [this, &kernel, groups, shouldRed](VkCommandBuffer cmd) {
+            CFDPushConstants pushData;
+            pushData.gridSize = _res;
+            pushData.shouldRed = shouldRed;
+            vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, kernel.pipeline);
+            vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, kernel.pipelineLayout, 0, 1, &kernel.descriptorSet, 0, nullptr);
+            vkCmdPushConstants(cmd, kernel.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CFDPushConstants), &pushData);
+            vkCmdDispatch(cmd, groups, 1, 1);
+        };
+    };
+
+    // Sized from the source count at record time, a new state may change it without a rebuild
+    auto dispatchSources = [this](Kernel& kernel, const uint32_t& count) {
+        return [this, &kernel, &count](VkCommandBuffer cmd) {
+            SourcePushConstants pushData;
+            pushData.gridSize = _res;
+            pushData.count = count;
+            vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, kernel.pipeline);
+            vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, kernel.pipelineLayout, 0, 1, &kernel.descriptorSet, 0, nullptr);
+            vkCmdPushConstants(cmd, kernel.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(SourcePushConstants), &pushData);
+            vkCmdDispatch(cmd, (count + local_work_size - 1) / local_work_size, 1, 1);
+        };
+    };
 
-    for (int i=0; i<50; i++)
+    _graph.clear();
+
+    // Red and black sweeps share face velocities, so every sweep depends on the one before.
+    // Sources are re-imposed after each sweep, the next one reads them as fixed faces.
+    for (int i=0; i<_projectionSweeps; i++)
     {
+        _graph.add_pass("gaussSiedel",
+            {_vx, _vy, _vz, _boundaries},
+            {_vx, _vy, _vz},
+            dispatch(_gaussSidel, nThreads, i % 2));
+        _graph.add_pass("applyVelocitySources",
+            {_velocitySources},
+            {_vx, _vy, _vz},
+            dispatchSources(_applyVelocitySources, _velocitySourceCount));
+    }
+
+    _graph.add_pass("advect", {_vx, _vy, _vz}, {_vx2, _vy2, _vz2}, dispatch(_advect, nThreadsVel, 0));
+    _graph.add_pass("advectSwapped", {_vx2, _vy2, _vz2}, {_vx, _vy, _vz}, dispatch(_advectSwapped, nThreadsVel, 0));
+
+    // The swapped texture pass reads the velocities through the swapped bindings
+    _graph.add_pass("writeTexture",
+        {_vx, _vy, _vz, _density, _boundaries},
+        {_density2, _densityTex},
+        dispatch(_writeTexture, nThreads, 0));
+    _graph.add_pass("applyDensitySources",
+        {_densitySources, _vy},
+        {_density2, _densityTex},
+        dispatchSources(_applyDensitySources, _densitySourceCount));
+    _graph.add_pass("writeTextureSwapped",
+        {_vx2, _vy2, _vz2, _density2, _boundaries},
+        {_density, _densityTex},
+        dispatch(_writeTextureSwapped, nThreads, 0));
+    _graph.add_pass("applyDensitySourcesSwapped",
+        {_densitySources, _vy2},
+        {_density, _densityTex},
+        dispatchSources(_applyDensitySourcesSwapped, _densitySourceCount));
+
+    // Occupancy of the final density for the ray marcher, one work group per brick
+    const uint32_t bricks = volume_brick_count(_res);
+    _graph.add_pass("buildOccupancy", {_density}, {_occupancy}, [this, bricks](VkCommandBuffer cmd) {
         CFDPushConstants pushData;
         pushData.gridSize = _res;
-        pushData.shouldRed = i % 2;
-        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, _gaussSidel.pipeline);
-        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, _gaussSidel.pipelineLayout, 0, 1, &_gaussSidel.descriptorSet, 0, nullptr);
-        vkCmdPushConstants(commandBuffer, _gaussSidel.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CFDPushConstants), &pushData);
+        pushData.shouldRed = 0;
+        vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _buildOccupancy.pipeline);
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _buildOccupancy.pipelineLayout, 0, 1, &_buildOccupancy.descriptorSet, 0, nullptr);
+        vkCmdPushConstants(cmd, _buildOccupancy.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CFDPushConstants), &pushData);
+        vkCmdDispatch(cmd, bricks, bricks, bricks);
+    });
+
+    // Diagnostics of the state the step ends on, reduced in two stages into this step's ring slot
+    auto dispatchDiagnostics = [this](Kernel& kernel, uint32_t groups) {
+        return [this, &kernel, groups](VkCommandBuffer cmd) {
+            DiagnosticsPushConstants pushData;
+            pushData.gridSize = _res;
+            pushData.partialCount = DIAGNOSTICS_PARTIALS;
+            pushData.slot = static_cast<uint32_t>(_stepCount % DIAGNOSTICS_RING_SIZE);
+            pushData.step = static_cast<uint32_t>(_stepCount + 1);
+            vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, kernel.pipeline);
+            vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, kernel.pipelineLayout, 0, 1, &kernel.descriptorSet, 0, nullptr);
+            vkCmdPushConstants(cmd, kernel.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(DiagnosticsPushConstants), &pushData);
+            vkCmdDispatch(cmd, groups, 1, 1);
+        };
+    };
+
+    _graph.add_pass("diagnosticsReduce",
+        {_vx, _vy, _vz, _density, _boundaries},
+        {_diagnosticPartials},
+        dispatchDiagnostics(_diagnosticsReduce, DIAGNOSTICS_PARTIALS));
+    _graph.add_pass("diagnosticsFinal", {_diagnosticPartials}, {_diagnostics}, dispatchDiagnostics(_diagnosticsFinal, 1));
+
+    _memory.register_aliases(_graph);
+    _graph.compile();
+}
 
-        vkCmdDispatch(commandBuffer, nThreads, 1, 1);
+void Cfd::evolve_cfd_cmd(VkCommandBuffer& commandBuffer, vkhelp::ImageStateTracker& images)
+{
+    record_boundary_updates(commandBuffer);
+    _graph.execute(commandBuffer, images);
+    _stepCount++;
+}
+
+void Cfd::stage_state(UploadManager& uploader, const CfdState& state, bool includeBoundaries)
+{
+    if (state.res != _res) {
+        throw std::runtime_error("Cfd: state resolution does not match the solver");
+    }
+    if (state.velocitySources.size() > cfd_source_capacity(_res) || state.densitySources.size() > cfd_source_capacity(_res)) {
+        throw std::runtime_error("Cfd: more sources than the source buffers hold");
+    }
+    // The source kernels index the fields with these directly
+    const size_t cells = size_t(_res) * _res * _res;
+    for (const VelocitySource& source : state.velocitySources) {
+        if (source.cell >= cells) throw std::runtime_error("Cfd: velocity source outside the grid");
+    }
+    for (const DensitySource& source : state.densitySources) {
+        if (source.cell >= cells) throw std::runtime_error("Cfd: density source outside the grid");
     }
 
-    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, _advect.pipeline);
-    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, _advect.pipelineLayout, 0, 1, &_advect.descriptorSet, 0, nullptr);
-    vkCmdDispatch(commandBuffer, nThreadsVel, 1, 1);
+    // Staged into the upload ring, all copies go out in a single submission on the next flush
+    upload_field(uploader, _vx, state.vx);
+    upload_field(uploader, _vy, state.vy);
+    upload_field(uploader, _vz, state.vz);
+    upload_field(uploader, _density, state.density);
+    upload_field(uploader, _pressure, state.pressure);
+    uploader.upload(_densitySources, state.densitySources.data(), state.densitySources.size() * sizeof(DensitySource));
+    uploader.upload(_velocitySources, state.velocitySources.data(), state.velocitySources.size() * sizeof(VelocitySource));
+    _densitySourceCount = static_cast<uint32_t>(state.densitySources.size());
+    _velocitySourceCount = static_cast<uint32_t>(state.velocitySources.size());
+    if (includeBoundaries) {
+        upload_field(uploader, _boundaries, state.boundaries);
+        // The state's mask replaces the terrain and every stamp
+        _voxelisePending = false;
+        _boundaryUpdates.clear();
+        _stamps.clear();
+        _stampHeightsUsed = 0;
+    }
 
-    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, _advectSwapped.pipeline);
-    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, _advectSwapped.pipelineLayout, 0, 1, &_advectSwapped.descriptorSet, 0, nullptr);
-    vkCmdDispatch(commandBuffer, nThreadsVel, 1, 1);
+    // A new state restarts the step count, clear the ring so no slot is mistaken for a current step
+    std::vector<DiagnosticsRecord> emptyRing(DIAGNOSTICS_RING_SIZE, DiagnosticsRecord{});
+    uploader.upload(_diagnostics, emptyRing.data(), emptyRing.size() * sizeof(DiagnosticsRecord));
+    _stepCount = 0;
+}
 
-    CFDPushConstants pushData;
-    pushData.gridSize = _res;
+void Cfd::load_default_state(UploadManager& uploader)
+{
+    // The boundary mask is left to load_terrain
+    stage_state(uploader, make_default_state(_res), false);
+}
+
+void Cfd::restore_state(UploadManager& uploader, const CfdState& state, uint64_t step)
+{
+    stage_state(uploader, state, true);
+    _stepCount = step;
+}
 
-    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, _writeTexture.pipeline);
-    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, _writeTexture.pipelineLayout, 0, 1, &_writeTexture.descriptorSet, 0, nullptr);
-    vkCmdPushConstants(commandBuffer, _writeTexture.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CFDPushConstants), &pushData);
-    vkCmdDispatch(commandBuffer, nThreads, 1, 1);
-
-    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, _writeTextureSwapped.pipeline);
-    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, _writeTextureSwapped.pipelineLayout, 0, 1, &_writeTextureSwapped.descriptorSet, 0, nullptr);
-    vkCmdPushConstants(commandBuffer, _writeTextureSwapped.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CFDPushConstants), &pushData);
-    vkCmdDispatch(commandBuffer, nThreads, 1, 1);
-
-}
-
-void Cfd::load_default_state(VkCommandPool& commandPool, VkQueue& queue)
-{
-    // std::vector<float> vxs = init_wall(20.0f, _res+1, _res, _res);
-    std::vector<float> vxs = init_vels(_res, 0.0f);
-    std::vector<float> vys = init_vels(_res, 0.0f);
-    std::vector<float> vzs = init_vels(_res, 0.0f);
-    std::vector<float> densities = init_scalars(_res, 0.0f);
-    std::vector<float> pressures = init_scalars(_res, 0.0f);
-    std::vector<float> source = init_scalars(_res, 0.0f);
-    std::vector<glm::vec4> source2 = init_vec4(_res, 0.0f);
-    std::vector<float> boundariesVec = init_boundaries(_res+2);
-
-    // // set velocity x to 1 in the first quarter
-    // int boarder = 20;
-    // for (int z=0; z<_res-2*boarder; z++) {
-    //     for (int y=0; y<_res-2*boarder; y++) {
-    //         for (int x=0; x<_res/4; x++) {
-    //             vxs[(_res+1)*_res*(z+boarder) + (_res+1)*(y+boarder) + x] = 10.0f;
-    //         }
-    //     }
-    // }
-
-    int boarder = 1;
-    for (int z=0; z<_res-2*boarder; z++) {
-        for (int y=0; y<_res-2*boarder; y++) {
-            source2[(_res)*_res*(z+boarder) + (_res)*(y+boarder)] = glm::vec4(10, 0, 0, 1);
+void Cfd::init_solver(uint32_t queueFamily, VkQueue queue, UploadManager& uploader)
+{
+    _queue = queue;
+    _uploader = &uploader;
+
+    VkCommandPoolCreateInfo poolInfo = vkinit::command_pool_create_info(queueFamily, VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
+    VK_CHECK(vkCreateCommandPool(_device, &poolInfo, nullptr, &_commandPool));
+
+    VkCommandBufferAllocateInfo cmdAllocInfo = vkinit::command_buffer_allocate_info(_commandPool, 1);
+    VK_CHECK(vkAllocateCommandBuffers(_device, &cmdAllocInfo, &_stepCommandBuffer));
+
+    VkFenceCreateInfo fenceInfo = vkinit::fence_create_info();
+    VK_CHECK(vkCreateFence(_device, &fenceInfo, nullptr, &_stepFence));
+}
+
+void Cfd::upload_state(const CfdState& state)
+{
+    stage_state(*_uploader, state, true);
+    _uploader->flush();
+}
+
+void Cfd::step()
+{
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    VK_CHECK(vkBeginCommandBuffer(_stepCommandBuffer, &beginInfo));
+
+    evolve_cfd_cmd(_stepCommandBuffer, _images);
+
+    VK_CHECK(vkEndCommandBuffer(_stepCommandBuffer));
+
+    VkSubmitInfo submit{};
+    submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit.commandBufferCount = 1;
+    submit.pCommandBuffers = &_stepCommandBuffer;
+    VK_CHECK(vkQueueSubmit(_queue, 1, &submit, _stepFence));
+
+    VK_CHECK(vkWaitForFences(_device, 1, &_stepFence, VK_TRUE, UINT64_MAX));
+    VK_CHECK(vkResetFences(_device, 1, &_stepFence));
+}
+
+void Cfd::download_state(CfdState& state)
+{
+    _uploader->wait_idle();
+
+    auto download = [&](ResourceBinding& buf, std::vector<float>& dst, size_t count) {
+        dst.resize(count);
+        if (_fieldStorage == FieldStorage::Float32) {
+            vkhelp::copy_from_buffer(_device, _allocator, _commandPool, _queue, buf, dst.data(), count * sizeof(float));
+            return;
         }
+        std::vector<uint16_t> halves(count);
+        vkhelp::copy_from_buffer(_device, _allocator, _commandPool, _queue, buf, halves.data(), count * sizeof(uint16_t));
+        halves_to_floats(halves.data(), dst.data(), count);
+    };
+
+    const size_t cells = size_t(_res) * _res * _res;
+    const size_t faces = size_t(_res + 1) * _res * _res;
+    const size_t ghostCells = size_t(_res + 2) * (_res + 2) * (_res + 2);
+
+    state.res = _res;
+    download(_vx, state.vx, faces);
+    download(_vy, state.vy, faces);
+    download(_vz, state.vz, faces);
+    download(_density, state.density, cells);
+    download(_pressure, state.pressure, cells);
+    download(_boundaries, state.boundaries, ghostCells);
+
+    // The lists never change on the device, only their staged length is needed
+    state.densitySources.resize(_densitySourceCount);
+    state.velocitySources.resize(_velocitySourceCount);
+    if (_densitySourceCount > 0) {
+        vkhelp::copy_from_buffer(_device, _allocator, _commandPool, _queue, _densitySources, state.densitySources.data(),
+                                 _densitySourceCount * sizeof(DensitySource));
+    }
+    if (_velocitySourceCount > 0) {
+        vkhelp::copy_from_buffer(_device, _allocator, _commandPool, _queue, _velocitySources, state.velocitySources.data(),
+                                 _velocitySourceCount * sizeof(VelocitySource));
     }
+}
 
-    // Create a source wall of vx=1
-    // int boarder = 10;
-    // for (int z=0; z<_res-2*boarder; z++) {
-    //     for (int y=0; y<_res-2*boarder; y++) {
-    //         vxs[(_res+1)*_res*(z+boarder) + (_res+1)*(y+boarder) + 0] = 5.0f;
-    //         source2[(_res)*_res*(z+boarder) + (_res)*(y+boarder) + 0] = 1.0f;
-
-    //         vxs[(_res+1)*_res*(z+boarder) + (_res+1)*(y+boarder) + _res] = 5.0f;
-    //         source2[(_res)*_res*(z+boarder) + (_res)*(y+boarder) + _res] = 1.0f;
-    //     }
-    // }
-
-    // vxs[(_res+1)*_res*(_res/2) + (_res+1)*(_res/2) + _res/2] = 100.0f;
-    // source2[(_res)*_res*(_res/2) + (_res)*(_res/2) + _res/2] = 1.0f;
-
-    // Arbitrary Geometry
-    // add_boundary_cylinder(boundariesVec, 10, 0, 0, _res+2);
-    // add_boundary_cylinder(boundariesVec, 10, -20, -20, _res+2);
-
-    // int nStreams = 5;
-    // int streamSize = _res / nStreams;
-    // for (int i=1; i<nStreams-1; i++) {
-    //     densities[_res*_res*(_res/2) + _res*i*streamSize + 10] = 10.0f;
-    //     source[_res*_res*(_res/2) + _res*i*streamSize + 10] = 1.0f;
-
-    //     densities[_res*_res*(_res/2) + _res*i*streamSize + 80] = 10.0f;
-    //     source[_res*_res*(_res/2) + _res*i*streamSize + 80] = 1.0f;
-    // }
-
-    // profuce 3d grid of 20x20x20 streams
-    int nStreams3D = 6;
-    int streamSize3D = _res / nStreams3D;
-    for (int i=3; i<nStreams3D; i++) {
-        for (int j=1; j<nStreams3D; j++) {
-            for (int k=1; k<nStreams3D; k++) {
-                densities[_res*_res*(k*streamSize3D) + _res*i*streamSize3D + j*streamSize3D] = 10.0f;
-                source[_res*_res*(k*streamSize3D) + _res*i*streamSize3D + j*streamSize3D] = 1.0f;
-            }
-        }
+void Cfd::set_projection_sweeps(int sweeps)
+{
+    _projectionSweeps = sweeps;
+    if (_device != VK_NULL_HANDLE) {
+        build_graph();
     }
+}
 
-    // densities[_res*_res*_res + _res*_res + _res-1] = 10.0f; // last cell is 0 density
-    // source[_res*_res*_res + _res*_res + _res-1] = 10.0f; // last cell is 0 density
-    // for (int i=0; i<_res+2; i++)
-    // {
-    //     boundariesVec[(_res+2)*(_res+2)*(_res/2+1) + (_res+2)*(i) + (0+1)] = 0.0f;
-    // }
+void Cfd::cleanup_solver()
+{
+    vkDestroyFence(_device, _stepFence, nullptr);
+    vkDestroyCommandPool(_device, _commandPool, nullptr);
+    _stepFence = VK_NULL_HANDLE;
+    _commandPool = VK_NULL_HANDLE;
+}
 
-    vkhelp::copy_to_buffer(_device, _allocator, commandPool, queue, _vx, vxs.data(), vxs.size() * sizeof(float));
-    vkhelp::copy_to_buffer(_device, _allocator, commandPool, queue, _vy, vys.data(), vys.size() * sizeof(float));
-    vkhelp::copy_to_buffer(_device, _allocator, commandPool, queue, _vz, vzs.data(), vzs.size() * sizeof(float));
-    vkhelp::copy_to_buffer(_device, _allocator, commandPool, queue, _density, densities.data(), densities.size() * sizeof(float));
-    vkhelp::copy_to_buffer(_device, _allocator, commandPool, queue, _pressure, pressures.data(), pressures.size() * sizeof(float));
-    vkhelp::copy_to_buffer(_device, _allocator, commandPool, queue, _source, source.data(), source.size() * sizeof(float));
-    vkhelp::copy_to_buffer(_device, _allocator, commandPool, queue, _source2, source2.data(), source2.size() * sizeof(glm::vec4));
-    // vkhelp::copy_to_buffer(_device, _allocator, commandPool, queue, _boundaries, boundariesVec.data(), boundariesVec.size() * sizeof(float));
+void Cfd::cleanup()
+{
+    if (_commandPool != VK_NULL_HANDLE) {
+        cleanup_solver();
+    }
 
-    // Test read back
-    // std::vector<float> testDensity(densities.size());
-    // vkhelp::copy_from_buffer(_device, _allocator, commandPool, queue, _density, testDensity.data(), testDensity.size() * sizeof(float));
-    // for (int i=0; i<10; i++) {
-    //     printf("Density[%d] = %f\n", i, testDensity[i]);
-    // }    
+    _graph.clear();
+
+    vkhelp::destroy_kernel(_device, _gaussSidel);
+    vkhelp::destroy_kernel(_device, _advect);
+    vkhelp::destroy_kernel(_device, _advectSwapped);
+    vkhelp::destroy_kernel(_device, _writeTexture);
+    vkhelp::destroy_kernel(_device, _writeTextureSwapped);
+    vkhelp::destroy_kernel(_device, _applyVelocitySources);
+    vkhelp::destroy_kernel(_device, _applyDensitySources);
+    vkhelp::destroy_kernel(_device, _applyDensitySourcesSwapped);
+    vkhelp::destroy_kernel(_device, _diagnosticsReduce);
+    vkhelp::destroy_kernel(_device, _diagnosticsFinal);
+    vkhelp::destroy_kernel(_device, _buildOccupancy);
+    vkhelp::destroy_kernel(_device, _voxelise);
+    vkhelp::destroy_kernel(_device, _stampBoundary);
+
+    _memory.destroy();
+    vkhelp::destroy_resource(_device, _allocator, _densityTex);
+    vkhelp::destroy_resource(_device, _allocator, _occupancy);
+    if (_terrainHeights.image != VK_NULL_HANDLE) {
+        vkhelp::destroy_resource(_device, _allocator, _terrainHeights);
+    }
 }
 
 std::vector<ResourceBinding> Cfd::get_texture_bindings()
 {
     // std::vector<uint32_t> activeBindings = {11};
 	// auto subsetResources = vkinit::subsetVector(_resourceBindings, activeBindings);
-    std::vector<ResourceBinding> subsetResources = {_densityTex};
+    std::vector<ResourceBinding> subsetResources = {_densityTex, _occupancy};
     return subsetResources;
 }
+
+std::vector<FieldBinding> Cfd::get_field_bindings()
+{
+    // evolve_cfd_cmd finishes on the swapped kernels, so the result is always in the primary buffers
+    const bool half = _fieldStorage != FieldStorage::Float32;
+    const size_t cells = size_t(_res) * _res * _res;
+    const size_t faces = size_t(_res + 1) * _res * _res;
+    return {
+        {"vx", _vx, half, faces},
+        {"vy", _vy, half, faces},
+        {"vz", _vz, half, faces},
+        {"density", _density, half, cells},
+        {"pressure", _pressure, half, cells}
+    };
+}
+
+std::vector<FieldBinding> Cfd::get_checkpoint_bindings()
+{
+    std::vector<FieldBinding> bindings = get_field_bindings();
+    bindings.push_back({"boundaries", _boundaries, _fieldStorage != FieldStorage::Float32,
+                        size_t(_res + 2) * (_res + 2) * (_res + 2)});
+    bindings.push_back({"velocitySources", _velocitySources});
+    bindings.push_back({"densitySources", _densitySources});
+    return bindings;
+}
+
+FieldBinding Cfd::get_diagnostics_binding()
+{
+    return {"diagnostics", _diagnostics};
+}
+
+FieldBinding Cfd::get_boundaries_binding()
+{
+    return {"boundaries", _boundaries};
+}
+
+std::vector<DiagnosticsRecord> Cfd::download_diagnostics()
+{
+    std::vector<DiagnosticsRecord> ring(DIAGNOSTICS_RING_SIZE);
+    vkhelp::copy_from_buffer(_device, _allocator, _commandPool, _queue, _diagnostics, ring.data(),
+                             ring.size() * sizeof(DiagnosticsRecord));
+
+    std::vector<DiagnosticsRecord> records;
+    for (auto& record : ring) {
+        if (record.step != 0) {
+            records.push_back(record);
+        }
+    }
+    std::sort(records.begin(), records.end(),
+              [](const DiagnosticsRecord& a, const DiagnosticsRecord& b) { return a.step < b.step; });
+    return records;
+}
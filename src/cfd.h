@@ -7,13 +7,73 @@
 #include "vk_types.h"
 #include "vk_helper.h"
 #include "vk_initializers.h"
+#include "vk_upload.h"
+#include "vk_frame_graph.h"
+#include "vk_memory_planner.h"
+#include "solver.h"
+#include "cfd_diagnostics.h"
 
-class Cfd {
+// Element type of the solver field buffers. Arithmetic is fp32 in every mode, halves only change what
+// is stored, halving the traffic of the bandwidth bound kernels. Float16Packed is for devices without
+// storageBuffer16BitAccess. Sources and diagnostics stay fp32.
+enum class FieldStorage {
+    Float32,
+    Float16,
+    Float16Packed
+};
+
+const char* field_storage_name(FieldStorage storage);
+
+// Format of the visualisation volume the solver writes for the renderer, two channels (density and
+// vertical speed) encoded as in volume.glsl. Unorm8 is the smallest, at 8-bit precision over the ranges there.
+enum class VolumeFormat {
+    Float32,
+    Float16,
+    Unorm8
+};
+
+const char* volume_format_name(VolumeFormat format);
+VkFormat volume_vk_format(VolumeFormat format);
+VkDeviceSize volume_texel_bytes(VolumeFormat format);
+
+// Cells per edge of an occupancy brick, matches volume.glsl
+const unsigned int VOLUME_BRICK_SIZE = 8;
+inline unsigned int volume_brick_count(unsigned int res) { return (res + VOLUME_BRICK_SIZE - 1) / VOLUME_BRICK_SIZE; }
+
+// Heights the heightfield stamps may hold at once
+inline size_t cfd_stamp_height_capacity(unsigned int res) { return size_t(4) * res * res; }
+
+// Both dispatched over a box of the boundary mask, lo is its first cell
+struct VoxelisePushConstants {
+    int gridSize;
+    float heightScale;
+    int bilinear;
+    int pad;
+    int32_t lo[4];
+    int32_t extent[4];
+};
+
+struct BoundaryStampPushConstants {
+    int gridSize;
+    int shape;          // BoundaryShape
+    int axis;
+    float value;
+    int32_t lo[4];      // the primitive's cells, clipped to the interior
+    int32_t extent[4];
+    int32_t columns[4]; // heightfield: first x and z, columns per row, first height in the heights buffer
+    float centre[2];
+    float radius;
+    float heightScale;
+};
+
+class Cfd : public CfdSolver {
 private:
     unsigned int _res = 129;
+    FieldStorage _fieldStorage = FieldStorage::Float32;
+    VolumeFormat _volumeFormat = VolumeFormat::Float16;
 
-    VkDevice _device;
-    VmaAllocator _allocator;
+    VkDevice _device = VK_NULL_HANDLE;
+    VmaAllocator _allocator = VK_NULL_HANDLE;
 
     ResourceBinding _vx;
     ResourceBinding _vy;
@@ -21,7 +81,7 @@ private:
 
     ResourceBinding _density;
     ResourceBinding _pressure;
-    ResourceBinding _source;
+    ResourceBinding _densitySources;
 
     ResourceBinding _vx2;
     ResourceBinding _vy2;
@@ -29,11 +89,20 @@ private:
 
     ResourceBinding _density2; 
     ResourceBinding _pressure2;
-    ResourceBinding _source2;
+    ResourceBinding _velocitySources;
+    uint32_t _velocitySourceCount = 0;
+    uint32_t _densitySourceCount = 0;
 
     ResourceBinding _boundaries;
 
     ResourceBinding _densityTex;
+    // Max density per brick of the volume, lets the ray marcher skip empty space
+    ResourceBinding _occupancy;
+
+    // Per step diagnostics: partial records of the first reduction stage and the ring of final records
+    ResourceBinding _diagnosticPartials;
+    ResourceBinding _diagnostics;
+    uint64_t _stepCount = 0; // steps completed, from 0 at a state upload or a restored checkpoint's step
 
     Kernel _gaussSidel{};
     Kernel _advect{};
@@ -41,13 +110,137 @@ private:
 	Kernel _writeTexture{};
 	Kernel _writeTextureSwapped{};
 	Kernel _rp{};
+    Kernel _applyVelocitySources{};
+    Kernel _applyDensitySources{};
+    Kernel _applyDensitySourcesSwapped{};
+    Kernel _diagnosticsReduce{};
+    Kernel _diagnosticsFinal{};
+    Kernel _buildOccupancy{};
+    Kernel _voxelise{};
+    Kernel _stampBoundary{};
+
+    // Heightmap voxelise.comp stamps into _boundaries, kept so the mask can be rebuilt without the map
+    ResourceBinding _terrainHeights;
+    float _terrainHeightScale = 1.0f;
+    bool _terrainBilinear = false;
+    bool _voxelisePending = false; // recorded ahead of the next step
+
+    // Obstacles layered over the terrain in the order they were stamped, replayed over every cell the
+    // voxeliser rewrites
+    struct BoundaryStamp {
+        uint32_t id;
+        BoundaryStampPushConstants constants;
+        std::vector<float> heights; // heightfield stamps, to move them when an earlier one is removed
+    };
+    std::vector<BoundaryStamp> _stamps;
+    uint32_t _nextStampId = 1;
+    // Heights of heightfield stamps in stamp order, packed again whenever one is removed
+    ResourceBinding _stampHeights;
+    size_t _stampHeightsUsed = 0;
+    // Mask changes since the last step, a stamp or the terrain voxelised again under a removed one
+    struct BoundaryUpdate {
+        bool revoxelise;
+        BoundaryStampPushConstants stamp; // revoxelise only uses its box
+        uint32_t id;                      // of the stamp, 0 for revoxelise
+    };
+    std::vector<BoundaryUpdate> _boundaryUpdates;
+
+    FrameGraph _graph;
+    MemoryPlanner _memory;
+    bool _verbose = false;
+
+    // Only used when stepping standalone through the CfdSolver interface
+    VkQueue _queue = VK_NULL_HANDLE;
+    VkCommandPool _commandPool = VK_NULL_HANDLE;
+    VkCommandBuffer _stepCommandBuffer = VK_NULL_HANDLE;
+    VkFence _stepFence = VK_NULL_HANDLE;
+    UploadManager* _uploader = nullptr;
+    vkhelp::ImageStateTracker _images;
+
+    // Describes every buffer for _res and hands it to the planner without memory
+    void create_buffers();
+    // Falls back to Float16 when the device cannot store to and filter the requested format
+    void check_volume_format();
+    // Device bytes of a field of count values in the current storage
+    VkDeviceSize field_bytes(size_t count) const;
+    // SPIR-V of a field kernel built for the current storage
+    std::string field_kernel(const std::string& shader) const;
+    void upload_field(UploadManager& uploader, ResourceBinding& field, const std::vector<float>& values);
+    // Largest odd resolution whose planned footprint fits the device budget
+    unsigned int choose_resolution();
+    void build_graph();
+    void stage_state(UploadManager& uploader, const CfdState& state, bool includeBoundaries);
+    // Everything the mask has pending ahead of the step that reads it
+    void record_boundary_updates(VkCommandBuffer cmd);
+    // The terrain or a stamp over the cells of a box, lo inclusive and hi exclusive
+    void dispatch_voxelise(VkCommandBuffer cmd, const int32_t lo[3], const int32_t hi[3]);
+    void dispatch_stamp(VkCommandBuffer cmd, const BoundaryStampPushConstants& stamp, const int32_t lo[3], const int32_t hi[3]);
 
 public:
-    void load_terrain(VkCommandPool& commandPool, VkQueue& queue, const std::string &filename, float heightScale=1);
+    // Uploads the heightmap, the boundary mask is voxelised from it on the device at the start of the next
+    // step. Heights are scaled into domain units by heightScale. Replacing a loaded terrain needs the device idle.
+    void load_terrain(UploadManager& uploader, const TerrainMap& terrain, float heightScale=1);
+    // Same, with the mask already voxelised, e.g. mapped from the terrain cache or by stamp_boundaries
+    void load_terrain(UploadManager& uploader, const TerrainMap& terrain, float heightScale,
+                      const void* boundaries, size_t boundaryBytes);
+    // The mask voxelise.comp writes with nearest sampling, as uploaded in the current field storage
+    std::vector<uint8_t> stamp_boundaries(const TerrainMap& terrain, float heightScale) const;
+    // Both voxelise the loaded terrain again before the next step, nothing is uploaded
+    void set_terrain_height_scale(float heightScale);
+    // Filter heights between samples instead of taking the nearest one like stamp_terrain_boundaries
+    void set_terrain_bilinear(bool bilinear);
+    bool get_terrain_bilinear() const { return _terrainBilinear; }
+    // Stamps an obstacle into the boundary mask ahead of the next step, dispatched over its cells only.
+    // Heightfield heights are staged on uploader. Returns the id remove_boundary_stamp takes.
+    uint32_t stamp_boundary(UploadManager& uploader, const BoundaryPrimitive& primitive);
+    // Voxelises the terrain again under the stamp and replays the other stamps there, so only its box is
+    // rewritten. Needs a terrain from load_terrain, a state's mask has nothing to fall back to. The heights
+    // of later heightfield stamps are staged on uploader again, moved down over the removed stamp's.
+    void remove_boundary_stamp(UploadManager& uploader, uint32_t id);
+    size_t boundary_stamp_count() const { return _stamps.size(); }
+    // res 0 picks the largest grid the device memory budget allows
     void init_cfd(VkDevice &device, VmaAllocator &allocator, int res);
-    void evolve_cfd_cmd(VkCommandBuffer& commandBuffer);
-    void load_default_state(VkCommandPool& commandPool, VkQueue& queue);
+    // Call before init_cfd, the half modes need the matching device feature (see FieldStorage)
+    void set_field_storage(FieldStorage storage);
+    FieldStorage get_field_storage() const { return _fieldStorage; }
+    // Call before init_cfd, the kernels write it without a format so it needs shaderStorageImageWriteWithoutFormat
+    void set_volume_format(VolumeFormat format);
+    // Call before init_cfd, logs the memory plan and every frame graph compile
+    void set_verbose(bool verbose) { _verbose = verbose; _graph.set_verbose(verbose); }
+    VolumeFormat get_volume_format() const { return _volumeFormat; }
+    unsigned int get_resolution() const { return _res; }
+    void evolve_cfd_cmd(VkCommandBuffer& commandBuffer, vkhelp::ImageStateTracker& images);
+    FrameGraph& get_graph() { return _graph; }
+    void load_default_state(UploadManager& uploader);
+    // Stages a state read from a checkpoint, mask included, in place of the terrain's mask and every stamp.
+    // step is the checkpoint's steps completed, diagnostics records carry on counting from it.
+    void restore_state(UploadManager& uploader, const CfdState& state, uint64_t step = 0);
+    uint32_t velocity_source_count() const { return _velocitySourceCount; }
+    uint32_t density_source_count() const { return _densitySourceCount; }
+
+    // CfdSolver, each call submits and waits on its own, the viewer records evolve_cfd_cmd into its frame instead
+    void init_solver(uint32_t queueFamily, VkQueue queue, UploadManager& uploader);
+    void upload_state(const CfdState& state) override;
+    void step() override;
+    void download_state(CfdState& state) override;
+    const char* name() const override { return "vulkan"; }
+    void set_projection_sweeps(int sweeps) override;
+    void cleanup_solver();
+    // Destroys every buffer, image and kernel, the device must be idle
+    void cleanup();
+    // The visualisation volume and its occupancy grid
     std::vector<ResourceBinding> get_texture_bindings();
+    // Fields holding the solver state at the end of a step
+    std::vector<FieldBinding> get_field_bindings();
+    // Everything a CfdState holds: the fields, the boundary mask and the whole source buffers, of which
+    // only the first velocity_source_count and density_source_count entries are in use
+    std::vector<FieldBinding> get_checkpoint_bindings();
+    // Device ring of DiagnosticsRecord, slot step % DIAGNOSTICS_RING_SIZE, for asynchronous readback
+    FieldBinding get_diagnostics_binding();
+    // The boundary mask as the device stores it, halves are handed over raw and padded to whole words
+    FieldBinding get_boundaries_binding();
+    // Blocking copy of the ring through the standalone solver objects, sorted by step, unwritten slots dropped
+    std::vector<DiagnosticsRecord> download_diagnostics();
 };
 
 struct CFDPushConstants {
@@ -55,6 +248,27 @@ struct CFDPushConstants {
     int shouldRed;
 };
 
+// Share of the free device local memory an automatically sized grid may plan for, the rest is left
+// to rendering and the readback rings
+const float CFD_MEMORY_BUDGET_FRACTION = 0.8f;
+const unsigned int CFD_MIN_RESOLUTION = 33;
+const unsigned int CFD_MAX_RESOLUTION = 1023;
+
+struct SourcePushConstants {
+    int gridSize;
+    uint32_t count;
+};
+
+// Entries the source list buffers hold, enough to cover every wall of the domain
+inline size_t cfd_source_capacity(unsigned int res) { return size_t(6) * res * res; }
+
+struct DiagnosticsPushConstants {
+    int gridSize;
+    uint32_t partialCount;
+    uint32_t slot;
+    uint32_t step;
+};
+
 // int create_command_buffers(Init& init, RenderData& data, std::vector<texture>& textures);
 
 // void init_cfd(Init& init, ComputeHandler& computeHandler, Cfd& cfd, int gridSize);
@@ -0,0 +1,67 @@
+#include "cfd_diagnostics.h"
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+size_t DiagnosticsSeries::append_ring(const DiagnosticsRecord* ring, size_t count)
+{
+    std::vector<DiagnosticsRecord> fresh;
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    for (size_t i = 0; i < count; i++) {
+        if (ring[i].step > _lastStep) {
+            fresh.push_back(ring[i]);
+        }
+    }
+    std::sort(fresh.begin(), fresh.end(),
+              [](const DiagnosticsRecord& a, const DiagnosticsRecord& b) { return a.step < b.step; });
+
+    for (auto& record : fresh) {
+        _records.push_back(record);
+        if (_records.size() > _capacity) {
+            _records.pop_front();
+        }
+    }
+    if (!fresh.empty()) {
+        _lastStep = fresh.back().step;
+    }
+    return fresh.size();
+}
+
+std::vector<DiagnosticsRecord> DiagnosticsSeries::snapshot() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return std::vector<DiagnosticsRecord>(_records.begin(), _records.end());
+}
+
+bool DiagnosticsSeries::latest(DiagnosticsRecord& record) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_records.empty()) {
+        return false;
+    }
+    record = _records.back();
+    return true;
+}
+
+void DiagnosticsSeries::clear()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _records.clear();
+    _lastStep = 0;
+}
+
+void DiagnosticsSeries::write_csv(const std::string& path) const
+{
+    std::ofstream file(path);
+    if (!file) {
+        throw std::runtime_error("Failed to open " + path);
+    }
+
+    file << "step,max_divergence,rms_divergence,kinetic_energy,mass,max_velocity,cfl,fluid_cells\n";
+    for (auto& r : snapshot()) {
+        file << r.step << ',' << r.maxDivergence << ',' << r.rmsDivergence << ',' << r.kineticEnergy << ','
+             << r.mass << ',' << r.maxVelocity << ',' << r.cfl << ',' << r.fluidCells << '\n';
+    }
+}
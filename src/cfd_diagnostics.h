@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// One step's physical diagnostics, layout shared with diagnosticsFinal.comp (std430, 32 bytes)
+struct DiagnosticsRecord {
+    float maxDivergence;
+    float rmsDivergence;  // over fluid cells
+    float kineticEnergy;  // 0.5 |u|^2 summed over fluid cells, cell centred velocity
+    float mass;           // tracer density summed over every cell
+    float maxVelocity;
+    float cfl;            // maxVelocity * dt / dx
+    float fluidCells;
+    uint32_t step;        // steps completed when the record was written, 0 marks a slot never written
+};
+
+// Records kept on the device, one slot per step. Must cover the steps between two host copies of the ring.
+const uint32_t DIAGNOSTICS_RING_SIZE = 64;
+// Work groups of the first reduction stage, each leaves one partial record
+const uint32_t DIAGNOSTICS_PARTIALS = 1024;
+
+// Host side time series of the diagnostics, filled from copies of the device ring.
+// Safe to append from the readback worker while other threads read it.
+class DiagnosticsSeries {
+private:
+    mutable std::mutex _mutex;
+    std::deque<DiagnosticsRecord> _records;
+    size_t _capacity;
+    uint32_t _lastStep = 0;
+
+public:
+    explicit DiagnosticsSeries(size_t capacity = 4096) : _capacity(capacity) {}
+
+    // Adds the records of a ring copy newer than anything already held, in step order; returns how many
+    size_t append_ring(const DiagnosticsRecord* ring, size_t count);
+
+    std::vector<DiagnosticsRecord> snapshot() const;
+    bool latest(DiagnosticsRecord& record) const;
+    // Forget everything, e.g. after a new state restarted the step count
+    void clear();
+
+    void write_csv(const std::string& path) const;
+};
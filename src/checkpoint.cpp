@@ -0,0 +1,359 @@
+#include "checkpoint.h"
+#include "lz_codec.h"
+#include "terrain_file.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+#include <unistd.h>
+
+namespace {
+
+// A field's bytes as they are written, or where they are read into
+struct FieldBytes {
+    const char* name;
+    uint32_t elementSize;
+    uint8_t* data;
+    size_t bytes;
+};
+
+template <typename T>
+FieldBytes field_bytes(const char* name, const std::vector<T>& values)
+{
+    return {name, uint32_t(sizeof(T)), reinterpret_cast<uint8_t*>(const_cast<T*>(values.data())), values.size() * sizeof(T)};
+}
+
+std::vector<FieldBytes> state_fields(const CfdState& state)
+{
+    return {
+        field_bytes("vx", state.vx),
+        field_bytes("vy", state.vy),
+        field_bytes("vz", state.vz),
+        field_bytes("density", state.density),
+        field_bytes("pressure", state.pressure),
+        field_bytes("boundaries", state.boundaries),
+        field_bytes("velocitySources", state.velocitySources),
+        field_bytes("densitySources", state.densitySources),
+    };
+}
+
+// In the order write_checkpoint stores them, the six dense fields first
+const char* const CHECKPOINT_FIELDS[] = {
+    "vx", "vy", "vz", "density", "pressure", "boundaries", "velocitySources", "densitySources"
+};
+const size_t CHECKPOINT_FIELD_COUNT = sizeof(CHECKPOINT_FIELDS) / sizeof(CHECKPOINT_FIELDS[0]);
+const size_t CHECKPOINT_DENSE_FIELDS = 6;
+// Sanity bounds a reader applies before trusting the header, far above anything the writer produces
+const uint32_t CHECKPOINT_MAX_RESOLUTION = 4096;
+const size_t CHECKPOINT_MAX_CHUNK_BYTES = size_t(1) << 30;
+// An LZ sequence of a few bytes can stand for at most about 255 times as many, anything claiming more is corrupt
+const size_t LZ_MAX_RATIO = 255;
+
+// Element size a field must have and, for the dense fields, its element count on a res grid
+void field_layout(size_t index, size_t res, uint32_t& elementSize, size_t& count)
+{
+    elementSize = sizeof(float);
+    count = 0;
+    switch (index) {
+    case 0: case 1: case 2: count = (res + 1) * res * res; break;
+    case 3: case 4: count = res * res * res; break;
+    case 5: count = (res + 2) * (res + 2) * (res + 2); break;
+    case 6: elementSize = sizeof(VelocitySource); break;
+    case 7: elementSize = sizeof(DensitySource); break;
+    }
+}
+
+template <typename T>
+uint8_t* resize_field(std::vector<T>& values, size_t bytes)
+{
+    values.resize(bytes / sizeof(T));
+    return reinterpret_cast<uint8_t*>(values.data());
+}
+
+// Only called once every field was validated, so each vector is sized exactly once
+uint8_t* field_destination(CfdState& state, size_t index, size_t bytes)
+{
+    switch (index) {
+    case 0: return resize_field(state.vx, bytes);
+    case 1: return resize_field(state.vy, bytes);
+    case 2: return resize_field(state.vz, bytes);
+    case 3: return resize_field(state.density, bytes);
+    case 4: return resize_field(state.pressure, bytes);
+    case 5: return resize_field(state.boundaries, bytes);
+    case 6: return resize_field(state.velocitySources, bytes);
+    default: return resize_field(state.densitySources, bytes);
+    }
+}
+
+unsigned int pool_threads(unsigned int threads, size_t tasks)
+{
+    const size_t wanted = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+    return static_cast<unsigned int>(std::max<size_t>(1, std::min(wanted, tasks)));
+}
+
+} // namespace
+
+void write_checkpoint(const std::string& filename, const CfdState& state, uint64_t step, const CheckpointOptions& options)
+{
+    const std::vector<FieldBytes> fields = state_fields(state);
+    const size_t chunkBytes = std::max<size_t>(options.chunkBytes, 1024);
+
+    // One task per chunk of every field, each compressed into its own buffer
+    struct Chunk {
+        size_t field;
+        size_t offset;
+        size_t rawBytes;
+        std::vector<uint8_t> stored; // empty when the chunk is kept raw
+    };
+    std::vector<Chunk> chunks;
+    std::vector<size_t> firstChunk(fields.size() + 1);
+    for (size_t f = 0; f < fields.size(); f++) {
+        firstChunk[f] = chunks.size();
+        for (size_t offset = 0; offset < fields[f].bytes; offset += chunkBytes) {
+            chunks.push_back({f, offset, std::min(chunkBytes, fields[f].bytes - offset), {}});
+        }
+    }
+    firstChunk[fields.size()] = chunks.size();
+
+    if (options.compress && !chunks.empty()) {
+        ThreadPool pool(pool_threads(options.threads, chunks.size()));
+        pool.parallel_for(0, chunks.size(), 1, [&](size_t begin, size_t end) {
+            std::vector<uint8_t> shuffled;
+            for (size_t c = begin; c < end; c++) {
+                Chunk& chunk = chunks[c];
+                const FieldBytes& field = fields[chunk.field];
+                shuffled.resize(chunk.rawBytes);
+                shuffle_bytes(field.data + chunk.offset, shuffled.data(), chunk.rawBytes, field.elementSize);
+
+                // Only worth keeping when it saves something, capacity one byte short of raw rejects the rest
+                chunk.stored.resize(chunk.rawBytes - 1);
+                const size_t size = lz_compress(shuffled.data(), chunk.rawBytes, chunk.stored.data(), chunk.stored.size());
+                chunk.stored.resize(size);
+                chunk.stored.shrink_to_fit();
+            }
+        });
+    }
+
+    CheckpointHeader header{};
+    std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.res = state.res;
+    header.step = step;
+    header.fieldCount = uint32_t(fields.size());
+    header.chunkBytes = uint32_t(chunkBytes);
+
+    // Every field's chunk table and then its chunks, in field order
+    std::vector<CheckpointField> table(fields.size());
+    std::vector<CheckpointChunk> chunkTable(chunks.size());
+    uint64_t offset = sizeof(CheckpointHeader) + fields.size() * sizeof(CheckpointField);
+    for (size_t f = 0; f < fields.size(); f++) {
+        CheckpointField& entry = table[f];
+        std::strncpy(entry.name, fields[f].name, sizeof(entry.name) - 1);
+        entry.elementSize = fields[f].elementSize;
+        entry.codec = uint32_t(options.compress ? CheckpointCodec::ShuffleLz : CheckpointCodec::Raw);
+        entry.rawBytes = fields[f].bytes;
+        entry.chunkTable = offset;
+        entry.chunkCount = uint32_t(firstChunk[f + 1] - firstChunk[f]);
+        offset += entry.chunkCount * sizeof(CheckpointChunk);
+        for (size_t c = firstChunk[f]; c < firstChunk[f + 1]; c++) {
+            chunkTable[c].offset = offset;
+            chunkTable[c].storedBytes = uint32_t(chunks[c].stored.empty() ? chunks[c].rawBytes : chunks[c].stored.size());
+            offset += chunkTable[c].storedBytes;
+        }
+    }
+
+    // Unique per process like the terrain cache, the rename replaces the previous file whole
+    const std::string temporary = filename + "." + std::to_string(getpid()) + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary);
+        if (!file.is_open()) {
+            throw std::runtime_error("Failed to open file for writing: " + temporary);
+        }
+
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(table.data()), std::streamsize(table.size() * sizeof(CheckpointField)));
+        for (size_t f = 0; f < fields.size(); f++) {
+            file.write(reinterpret_cast<const char*>(chunkTable.data() + firstChunk[f]),
+                       std::streamsize(table[f].chunkCount * sizeof(CheckpointChunk)));
+            for (size_t c = firstChunk[f]; c < firstChunk[f + 1]; c++) {
+                const Chunk& chunk = chunks[c];
+                if (chunk.stored.empty()) {
+                    file.write(reinterpret_cast<const char*>(fields[f].data + chunk.offset), std::streamsize(chunk.rawBytes));
+                } else {
+                    file.write(reinterpret_cast<const char*>(chunk.stored.data()), std::streamsize(chunk.stored.size()));
+                }
+            }
+        }
+
+        if (!file) {
+            file.close();
+            std::remove(temporary.c_str());
+            throw std::runtime_error("Failed to write file: " + temporary);
+        }
+    }
+
+    std::filesystem::rename(temporary, filename);
+}
+
+CfdState read_checkpoint(const std::string& filename, uint64_t* step, unsigned int threads)
+{
+    MappedFile file(filename);
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(file.data());
+
+    if (file.size() < sizeof(CheckpointHeader)) {
+        throw std::runtime_error("Checkpoint is truncated: " + filename);
+    }
+    CheckpointHeader header;
+    std::memcpy(&header, bytes, sizeof(header));
+    if (std::memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0) {
+        throw std::runtime_error("Not a checkpoint: " + filename);
+    }
+    if (header.version != CHECKPOINT_VERSION) {
+        throw std::runtime_error("Checkpoint " + filename + " is version " + std::to_string(header.version) +
+                                 ", expected " + std::to_string(CHECKPOINT_VERSION));
+    }
+    if (header.res == 0 || header.res > CHECKPOINT_MAX_RESOLUTION || header.chunkBytes == 0 || header.chunkBytes > CHECKPOINT_MAX_CHUNK_BYTES ||
+        (file.size() - sizeof(CheckpointHeader)) / sizeof(CheckpointField) < header.fieldCount) {
+        throw std::runtime_error("Checkpoint header is corrupt: " + filename);
+    }
+
+    // Everything is validated against the file before any field is sized, so a corrupt table can
+    // neither ask for absurd allocations nor resize a field whose chunks were already pointed into it
+    struct Chunk {
+        CheckpointChunk stored;
+        CheckpointCodec codec;
+        uint32_t elementSize;
+        uint8_t* destination;
+        size_t rawBytes;
+        size_t field;       // CHECKPOINT_FIELDS index
+        size_t offset;      // in the field
+    };
+    std::vector<Chunk> chunks;
+    uint64_t fieldBytes[CHECKPOINT_FIELD_COUNT] = {};
+    bool seen[CHECKPOINT_FIELD_COUNT] = {};
+    uint64_t storedEnd = 0;
+    for (uint32_t f = 0; f < header.fieldCount; f++) {
+        CheckpointField field;
+        std::memcpy(&field, bytes + sizeof(CheckpointHeader) + f * sizeof(CheckpointField), sizeof(field));
+        const std::string name(field.name, strnlen(field.name, sizeof(field.name)));
+
+        size_t index = 0;
+        while (index < CHECKPOINT_FIELD_COUNT && name != CHECKPOINT_FIELDS[index]) {
+            index++;
+        }
+        if (index == CHECKPOINT_FIELD_COUNT) {
+            throw std::runtime_error("Checkpoint holds an unknown field " + name);
+        }
+        if (seen[index]) {
+            throw std::runtime_error("Checkpoint holds field " + name + " twice");
+        }
+        seen[index] = true;
+
+        uint32_t elementSize;
+        size_t count;
+        field_layout(index, header.res, elementSize, count);
+        if (field.elementSize != elementSize || field.rawBytes % elementSize != 0 ||
+            (index < CHECKPOINT_DENSE_FIELDS && field.rawBytes != count * elementSize)) {
+            throw std::runtime_error("Checkpoint field " + name + " does not match the solver's layout");
+        }
+        if (field.chunkCount != (field.rawBytes + header.chunkBytes - 1) / header.chunkBytes ||
+            field.chunkTable > file.size() || (file.size() - field.chunkTable) / sizeof(CheckpointChunk) < field.chunkCount) {
+            throw std::runtime_error("Checkpoint chunk table of " + name + " is corrupt: " + filename);
+        }
+
+        for (uint32_t c = 0; c < field.chunkCount; c++) {
+            Chunk chunk;
+            std::memcpy(&chunk.stored, bytes + field.chunkTable + c * sizeof(CheckpointChunk), sizeof(CheckpointChunk));
+            chunk.codec = CheckpointCodec(field.codec);
+            chunk.elementSize = field.elementSize;
+            chunk.field = index;
+            chunk.offset = size_t(c) * header.chunkBytes;
+            chunk.rawBytes = std::min<size_t>(header.chunkBytes, field.rawBytes - chunk.offset);
+            // Chunks follow each other through the file in table order, so their raw sizes are bounded by it
+            if (chunk.stored.offset < storedEnd || chunk.stored.offset > file.size() ||
+                chunk.stored.storedBytes > file.size() - chunk.stored.offset ||
+                chunk.rawBytes / LZ_MAX_RATIO > chunk.stored.storedBytes) {
+                throw std::runtime_error("Checkpoint chunk is out of range: " + filename);
+            }
+            storedEnd = chunk.stored.offset + chunk.stored.storedBytes;
+            chunks.push_back(chunk);
+        }
+        fieldBytes[index] = field.rawBytes;
+    }
+    for (size_t index = 0; index < CHECKPOINT_DENSE_FIELDS; index++) {
+        if (!seen[index]) {
+            throw std::runtime_error("Checkpoint is missing field " + std::string(CHECKPOINT_FIELDS[index]) + ": " + filename);
+        }
+    }
+
+    CfdState state;
+    state.res = header.res;
+    uint8_t* destinations[CHECKPOINT_FIELD_COUNT];
+    for (size_t index = 0; index < CHECKPOINT_FIELD_COUNT; index++) {
+        destinations[index] = field_destination(state, index, fieldBytes[index]);
+    }
+    for (Chunk& chunk : chunks) {
+        chunk.destination = destinations[chunk.field] + chunk.offset;
+    }
+
+    std::atomic<bool> corrupt{false};
+    ThreadPool pool(pool_threads(threads, chunks.size()));
+    pool.parallel_for(0, chunks.size(), 1, [&](size_t begin, size_t end) {
+        std::vector<uint8_t> shuffled;
+        for (size_t c = begin; c < end; c++) {
+            const Chunk& chunk = chunks[c];
+            const uint8_t* stored = bytes + chunk.stored.offset;
+            // A chunk stored at its raw size was kept raw whatever the field's codec
+            if (chunk.codec == CheckpointCodec::Raw || chunk.stored.storedBytes == chunk.rawBytes) {
+                if (chunk.stored.storedBytes != chunk.rawBytes) {
+                    corrupt = true;
+                    continue;
+                }
+                std::memcpy(chunk.destination, stored, chunk.rawBytes);
+                continue;
+            }
+            shuffled.resize(chunk.rawBytes);
+            if (chunk.codec != CheckpointCodec::ShuffleLz ||
+                !lz_decompress(stored, chunk.stored.storedBytes, shuffled.data(), chunk.rawBytes)) {
+                corrupt = true;
+                continue;
+            }
+            unshuffle_bytes(shuffled.data(), chunk.destination, chunk.rawBytes, chunk.elementSize);
+        }
+    });
+    if (corrupt) {
+        throw std::runtime_error("Checkpoint has a corrupt chunk: " + filename);
+    }
+
+    if (step) {
+        *step = header.step;
+    }
+    return state;
+}
+
+bool CheckpointWriter::write(Job& job) const
+{
+    const auto start = std::chrono::steady_clock::now();
+    try {
+        std::filesystem::path directory = std::filesystem::path(job.filename).parent_path();
+        if (!directory.empty()) {
+            std::filesystem::create_directories(directory);
+        }
+        write_checkpoint(job.filename, job.state, job.step, _options);
+    } catch (const std::exception& e) {
+        printf("Checkpoint at step %llu failed: %s\n", static_cast<unsigned long long>(job.step), e.what());
+        return false;
+    }
+
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    printf("Checkpoint at step %llu written to %s in %.0f ms\n", static_cast<unsigned long long>(job.step),
+           job.filename.c_str(), ms);
+    return true;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "background_writer.h"
+#include "solver.h"
+
+// Solver state on disk, to restart a developed flow: a CheckpointHeader, a CheckpointField per field, then
+// every field's chunk table and chunks. Fields are fp32 in CfdState's layout whatever the device stores, so
+// a checkpoint restores into any backend and field storage at the same resolution. Chunks are compressed
+// independently (byte shuffle and LZ, lz_codec.h), written and read in parallel, and kept raw when
+// compressing does not make them smaller.
+const char CHECKPOINT_MAGIC[8] = {'R', 'C', 'H', 'E', 'C', 'K', 'P', 'T'};
+const uint32_t CHECKPOINT_VERSION = 1;
+
+enum class CheckpointCodec : uint32_t {
+    Raw = 0,
+    ShuffleLz = 1
+};
+
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t res;
+    uint64_t step;          // steps completed when the state was captured, the next step to run
+    uint32_t fieldCount;
+    uint32_t chunkBytes;    // uncompressed bytes per chunk, the last one of a field may be shorter
+    uint32_t reserved[8];
+};
+static_assert(sizeof(CheckpointHeader) == 64, "CheckpointHeader is part of the file format");
+
+struct CheckpointField {
+    char name[24];          // as the CfdState member, zero padded
+    uint32_t elementSize;   // bytes per element, the stride of the byte shuffle
+    uint32_t codec;         // CheckpointCodec of the chunks that did compress
+    uint64_t rawBytes;
+    uint64_t chunkTable;    // offset of chunkCount CheckpointChunks
+    uint32_t chunkCount;
+    uint32_t reserved[3];
+};
+static_assert(sizeof(CheckpointField) == 64, "CheckpointField is part of the file format");
+
+struct CheckpointChunk {
+    uint64_t offset;
+    uint32_t storedBytes;   // the raw size for a chunk kept raw
+    uint32_t reserved;
+};
+
+struct CheckpointOptions {
+    bool compress = true;
+    size_t chunkBytes = 1 << 20;
+    unsigned int threads = 0;   // 0 uses every hardware thread
+};
+
+// Written next to filename and renamed over it, so an interrupted write leaves the previous checkpoint
+void write_checkpoint(const std::string& filename, const CfdState& state, uint64_t step,
+                      const CheckpointOptions& options = {});
+// Throws for another version, a corrupt table or fields that do not match the resolution, step receives
+// the header's steps completed
+CfdState read_checkpoint(const std::string& filename, uint64_t* step = nullptr, unsigned int threads = 0);
+
+// Writes checkpoints on a thread of its own, the caller only pays for handing the state over. One checkpoint
+// is in flight at a time, a state submitted meanwhile is dropped rather than queued.
+class CheckpointWriter {
+private:
+    struct Job {
+        std::string filename;
+        CfdState state;
+        uint64_t step;
+    };
+
+    CheckpointOptions _options;
+    // Last, so it finishes the checkpoint in flight before the options go
+    BackgroundWriter<Job> _worker;
+
+    bool write(Job& job) const;
+
+public:
+    explicit CheckpointWriter(const CheckpointOptions& options = {})
+        : _options(options), _worker(1, [this](Job& job) { return write(job); }) {}
+
+    // Whether submit would drop a state now, lets callers skip building one
+    bool busy() const { return _worker.full(); }
+    // Returns false and drops the state when a checkpoint is still in flight
+    bool submit(std::string filename, CfdState state, uint64_t step)
+    {
+        return _worker.submit({std::move(filename), std::move(state), step});
+    }
+    // Blocks until nothing is in flight
+    void wait() { _worker.wait(); }
+
+    uint64_t written() const { return _worker.written(); }
+    uint64_t skipped() const { return _worker.dropped(); }
+};
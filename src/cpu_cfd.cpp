@@ -0,0 +1,334 @@
+#include "cpu_cfd.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace {
+
+// Same constants as the shaders
+const float dt = 0.1f;
+const float overRelaxation = 1.9f;
+
+inline int clampi(int v, int lo, int hi) { return std::min(std::max(v, lo), hi); }
+inline float mixf(float a, float b, float t) { return a * (1.0f - t) + b * t; }
+inline float fractf(float v) { return v - std::floor(v); }
+
+// Layout of the three staggered velocity arrays, get_x_vel_index / get_y_vel_index / get_z_vel_index
+struct VelocityGrid {
+    int n;
+
+    template <int C>
+    long index(int x, int y, int z) const {
+        if (C == 0) return x + long(y) * (n+1) + long(z) * (n+1) * n;
+        if (C == 1) return x + long(y) * n + long(z) * (n+1) * n;
+        return x + long(y) * n + long(z) * n * n;
+    }
+
+    // Largest valid coordinate on each axis of component C's grid, reads are clamped to it like the shader
+    template <int C>
+    int extent(int axis) const { return C == axis ? n : n - 1; }
+};
+
+// Average of the 8 values of component C around the corner pair a / b, same summation order as the shader
+template <int C>
+float average8(const VelocityGrid& g, const float* v, const int a[3], const int b[3])
+{
+    float sum = v[g.index<C>(a[0], a[1], a[2])];
+    sum += v[g.index<C>(b[0], a[1], a[2])];
+    sum += v[g.index<C>(a[0], b[1], a[2])];
+    sum += v[g.index<C>(b[0], b[1], a[2])];
+    sum += v[g.index<C>(a[0], a[1], b[2])];
+    sum += v[g.index<C>(b[0], a[1], b[2])];
+    sum += v[g.index<C>(a[0], b[1], b[2])];
+    sum += v[g.index<C>(b[0], b[1], b[2])];
+    return sum / 8.0f;
+}
+
+// Corners of component O's grid around the face of component C at pos
+template <int C, int O>
+float face_average(const VelocityGrid& g, const float* v, const int pos[3])
+{
+    int a[3], b[3];
+    for (int axis = 0; axis < 3; axis++) {
+        int pn = pos[axis] - (axis == C ? 1 : 0);
+        a[axis] = clampi(pn, 0, g.extent<O>(axis));
+        b[axis] = clampi(pn + 1, 0, g.extent<O>(axis));
+    }
+    return average8<O>(g, v, a, b);
+}
+
+// get_full_vel_x / _y / _z: the own component at pos, the other two averaged around the face
+template <int C>
+void full_velocity(const VelocityGrid& g, const float* const vel[3], const int pos[3], float out[3])
+{
+    out[C] = vel[C][g.index<C>(clampi(pos[0], 0, g.extent<C>(0)),
+                               clampi(pos[1], 0, g.extent<C>(1)),
+                               clampi(pos[2], 0, g.extent<C>(2)))];
+    if (C != 0) out[0] = face_average<C, 0>(g, vel[0], pos);
+    if (C != 1) out[1] = face_average<C, 1>(g, vel[1], pos);
+    if (C != 2) out[2] = face_average<C, 2>(g, vel[2], pos);
+}
+
+// interpolate_velX / _Y / _Z
+template <int C>
+float interpolate_velocity(const VelocityGrid& g, const float* v, const float pos[3])
+{
+    int p0[3], p1[3];
+    float f[3];
+    for (int axis = 0; axis < 3; axis++) {
+        int base = int(std::floor(pos[axis]));
+        p0[axis] = clampi(base, 0, g.extent<C>(axis));
+        p1[axis] = clampi(base + 1, 0, g.extent<C>(axis));
+        f[axis] = fractf(pos[axis]);
+    }
+
+    auto at = [&](int x, int y, int z) { return v[g.index<C>(x, y, z)]; };
+
+    float v00 = mixf(at(p0[0], p0[1], p0[2]), at(p1[0], p0[1], p0[2]), f[0]);
+    float v10 = mixf(at(p0[0], p1[1], p0[2]), at(p1[0], p1[1], p0[2]), f[0]);
+    float v01 = mixf(at(p0[0], p0[1], p1[2]), at(p1[0], p0[1], p1[2]), f[0]);
+    float v11 = mixf(at(p0[0], p1[1], p1[2]), at(p1[0], p1[1], p1[2]), f[0]);
+    float v0 = mixf(v00, v10, f[1]);
+    float v1 = mixf(v01, v11, f[1]);
+    return mixf(v0, v1, f[2]);
+}
+
+// One output component of advect.comp for the invocation at x-face position pos and trace origin origin
+template <int C>
+float advect_component(const VelocityGrid& g, const float* const vel[3], const int pos[3], const int origin[3])
+{
+    float v[3];
+    full_velocity<C>(g, vel, pos, v);
+
+    float newPos[3];
+    for (int axis = 0; axis < 3; axis++) {
+        newPos[axis] = float(origin[axis]) - v[axis] * dt;
+    }
+    return interpolate_velocity<C>(g, vel[C], newPos);
+}
+
+// trilinearInterpolation_density
+float interpolate_cell(const float* v, int n, const float pos[3])
+{
+    int p0[3], p1[3];
+    float f[3];
+    for (int axis = 0; axis < 3; axis++) {
+        int base = int(std::floor(pos[axis]));
+        p0[axis] = clampi(base, 0, n - 1);
+        p1[axis] = clampi(base + 1, 0, n - 1);
+        f[axis] = fractf(pos[axis]);
+    }
+
+    auto at = [&](int x, int y, int z) { return v[x + long(y) * n + long(z) * n * n]; };
+
+    float v00 = mixf(at(p0[0], p0[1], p0[2]), at(p1[0], p0[1], p0[2]), f[0]);
+    float v10 = mixf(at(p0[0], p1[1], p0[2]), at(p1[0], p1[1], p0[2]), f[0]);
+    float v01 = mixf(at(p0[0], p0[1], p1[2]), at(p1[0], p0[1], p1[2]), f[0]);
+    float v11 = mixf(at(p0[0], p1[1], p1[2]), at(p1[0], p1[1], p1[2]), f[0]);
+    float v0 = mixf(v00, v10, f[1]);
+    float v1 = mixf(v01, v11, f[1]);
+    return mixf(v0, v1, f[2]);
+}
+
+} // namespace
+
+CpuCfd::CpuCfd(unsigned int threadCount)
+    : _pool(threadCount)
+{
+}
+
+void CpuCfd::upload_state(const CfdState& state)
+{
+    const size_t n = state.res;
+    const size_t cells = n * n * n;
+    const size_t faces = (n + 1) * n * n;
+    if (state.vx.size() != faces || state.vy.size() != faces || state.vz.size() != faces ||
+        state.density.size() != cells || state.boundaries.size() != (n + 2) * (n + 2) * (n + 2)) {
+        throw std::runtime_error("CpuCfd: state arrays do not match the resolution");
+    }
+    for (const VelocitySource& source : state.velocitySources) {
+        if (source.cell >= cells) throw std::runtime_error("CpuCfd: velocity source outside the grid");
+    }
+    for (const DensitySource& source : state.densitySources) {
+        if (source.cell >= cells) throw std::runtime_error("CpuCfd: density source outside the grid");
+    }
+
+    _state = state;
+    _vx2.assign(faces, 0.0f);
+    _vy2.assign(faces, 0.0f);
+    _vz2.assign(faces, 0.0f);
+    _density2.assign(cells, 0.0f);
+}
+
+void CpuCfd::download_state(CfdState& state)
+{
+    state = _state;
+}
+
+void CpuCfd::step()
+{
+    for (int i = 0; i < _projectionSweeps; i++) {
+        gauss_seidel(i % 2);
+        apply_velocity_sources();
+    }
+
+    // advect then advectSwapped, writeTexture then writeTextureSwapped, as recorded by Cfd::build_graph
+    advect(_state.vx.data(), _state.vy.data(), _state.vz.data(), _vx2.data(), _vy2.data(), _vz2.data());
+    advect(_vx2.data(), _vy2.data(), _vz2.data(), _state.vx.data(), _state.vy.data(), _state.vz.data());
+
+    advect_density(_state.vx.data(), _state.vy.data(), _state.vz.data(), _state.density.data(), _density2.data());
+    apply_density_sources(_density2.data());
+    advect_density(_vx2.data(), _vy2.data(), _vz2.data(), _density2.data(), _state.density.data());
+    apply_density_sources(_state.density.data());
+}
+
+// gaussSiedel.comp. Colours follow the linear index parity like the shader, which only separates
+// neighbouring cells for odd resolutions; the default 129 is race free on both backends.
+void CpuCfd::gauss_seidel(int shouldRed)
+{
+    const int n = _state.res;
+    const long m = n + 2;
+    float* vx = _state.vx.data();
+    float* vy = _state.vy.data();
+    float* vz = _state.vz.data();
+    const float* b = _state.boundaries.data();
+
+    // Offsets to the far face of a cell in each staggered array
+    const long dx = 1;
+    const long dy = n;
+    const long dz = long(n) * n;
+
+    _pool.parallel_for(0, n, 1, [&](size_t zBegin, size_t zEnd) {
+        for (int z = int(zBegin); z < int(zEnd); z++) {
+            for (int y = 0; y < n; y++) {
+                const long rowIndex = long(y) * n + long(z) * n * n;
+                const long rowX = long(y) * (n+1) + long(z) * (n+1) * n;
+                const long rowY = long(y) * n + long(z) * (n+1) * n;
+                const long rowB = 1 + long(y+1) * m + long(z+1) * m * m;
+
+                for (int x = int((rowIndex + shouldRed + 1) % 2); x < n; x += 2) {
+                    const long ix = rowX + x;
+                    const long iy = rowY + x;
+                    const long iz = rowIndex + x;
+
+                    float vx0 = vx[ix], vx1 = vx[ix + dx];
+                    float vy0 = vy[iy], vy1 = vy[iy + dy];
+                    float vz0 = vz[iz], vz1 = vz[iz + dz];
+
+                    float div = overRelaxation*((vx1 - vx0) + (vy1 - vy0) + (vz1 - vz0));
+
+                    // Neighbouring boundary cells, the mask has a one cell ghost layer
+                    const long bc = rowB + x;
+                    float b100 = b[bc + 1], bm100 = b[bc - 1];
+                    float b010 = b[bc + m], bm010 = b[bc - m];
+                    float b001 = b[bc + m*m], bm001 = b[bc - m*m];
+
+                    float boundCoeff = b100 + bm100 + b010 + bm010 + b001 + bm001;
+
+                    if (boundCoeff == 0.0f) {
+                        vx[ix] = 0; vx[ix + dx] = 0;
+                        vy[iy] = 0; vy[iy + dy] = 0;
+                        vz[iz] = 0; vz[iz + dz] = 0;
+                    } else {
+                        vx[ix] = vx0 + bm100*div/boundCoeff;
+                        vx[ix + dx] = vx1 - b100*div/boundCoeff;
+                        vy[iy] = vy0 + bm010*div/boundCoeff;
+                        vy[iy + dy] = vy1 - b010*div/boundCoeff;
+                        vz[iz] = vz0 + bm001*div/boundCoeff;
+                        vz[iz + dz] = vz1 - b001*div/boundCoeff;
+                    }
+                }
+            }
+        }
+    });
+}
+
+// advect.comp. Like the shader, all three components are traced from the x-face position of the
+// invocation index and written to the same index of each output array.
+void CpuCfd::advect(const float* vx, const float* vy, const float* vz, float* outX, float* outY, float* outZ)
+{
+    const int n = _state.res;
+    const float* const vel[3] = {vx, vy, vz};
+    VelocityGrid g{n};
+
+    _pool.parallel_for(0, n, 1, [&](size_t zBegin, size_t zEnd) {
+        for (int z = int(zBegin); z < int(zEnd); z++) {
+            for (int y = 0; y < n; y++) {
+                for (int x = 0; x <= n; x++) {
+                    const long idx = x + long(y) * (n+1) + long(z) * (n+1) * n;
+
+                    // get_grid_position_x / _y / _z of the same index
+                    const int pos[3][3] = {
+                        {x, y, z},
+                        {int(idx % n), int((idx / n) % (n+1)), int(idx / (long(n) * (n+1)))},
+                        {int(idx % n), int((idx / n) % n), int(idx / (long(n) * n))}
+                    };
+
+                    outX[idx] = advect_component<0>(g, vel, pos[0], pos[0]);
+                    outY[idx] = advect_component<1>(g, vel, pos[0], pos[1]);
+                    outZ[idx] = advect_component<2>(g, vel, pos[0], pos[2]);
+                }
+            }
+        }
+    });
+}
+
+// writeTexture.comp without the image store
+void CpuCfd::advect_density(const float* vx, const float* vy, const float* vz, const float* density, float* out)
+{
+    const int n = _state.res;
+
+    _pool.parallel_for(0, n, 1, [&](size_t zBegin, size_t zEnd) {
+        for (int z = int(zBegin); z < int(zEnd); z++) {
+            for (int y = 0; y < n; y++) {
+                for (int x = 0; x < n; x++) {
+                    const long idx = x + long(y) * n + long(z) * n * n;
+
+                    const long ix = x + long(y) * (n+1) + long(z) * (n+1) * n;
+                    const long iy = x + long(y) * n + long(z) * n * (n+1);
+                    const long iz = idx;
+                    float velocity[3] = {
+                        (vx[ix] + vx[ix + 1]) * 0.5f,
+                        (vy[iy] + vy[iy + n]) * 0.5f,
+                        (vz[iz] + vz[iz + long(n) * n]) * 0.5f
+                    };
+
+                    float newPos[3] = {x - velocity[0] * dt, y - velocity[1] * dt, z - velocity[2] * dt};
+                    out[idx] = interpolate_cell(density, n, newPos);
+                }
+            }
+        }
+    });
+}
+
+// applyVelocitySources.comp, in list order so shared faces of neighbouring sources take the later value
+void CpuCfd::apply_velocity_sources()
+{
+    const long n = _state.res;
+    float* vx = _state.vx.data();
+    float* vy = _state.vy.data();
+    float* vz = _state.vz.data();
+
+    for (const VelocitySource& s : _state.velocitySources) {
+        const long x = s.cell % n;
+        const long y = (s.cell / n) % n;
+        const long z = s.cell / (n * n);
+
+        const long ix = x + y * (n+1) + z * (n+1) * n;
+        const long iy = x + y * n + z * (n+1) * n;
+        const long iz = s.cell;
+
+        vx[ix] = s.vx/2.0f; vx[ix + 1] = s.vx/2.0f;
+        vy[iy] = s.vy/2.0f; vy[iy + n] = s.vy/2.0f;
+        vz[iz] = s.vz/2.0f; vz[iz + n * n] = s.vz/2.0f;
+    }
+}
+
+// applyDensitySources.comp without the image store
+void CpuCfd::apply_density_sources(float* density)
+{
+    for (const DensitySource& s : _state.densitySources) {
+        density[s.cell] = s.value;
+    }
+}
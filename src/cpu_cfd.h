@@ -0,0 +1,39 @@
+#pragma once
+
+#include "solver.h"
+#include "thread_pool.h"
+
+// Native reference implementation of the compute shaders in src/shaders.
+// Every kernel is a line for line port of its GLSL counterpart (same index maths, clamping and
+// operation order) so fields match the GPU within float rounding. Both sides clamp reads to the edge
+// of their array and never rely on robust buffer access. Loops run over z-slabs on a work-stealing
+// pool with x innermost on the separate (SoA) field arrays. The density texture is visualisation
+// only and is not produced.
+class CpuCfd : public CfdSolver {
+private:
+    CfdState _state;
+
+    std::vector<float> _vx2;
+    std::vector<float> _vy2;
+    std::vector<float> _vz2;
+    std::vector<float> _density2;
+
+    ThreadPool _pool;
+
+    void gauss_seidel(int shouldRed);
+    void advect(const float* vx, const float* vy, const float* vz, float* outX, float* outY, float* outZ);
+    void advect_density(const float* vx, const float* vy, const float* vz, const float* density, float* out);
+    void apply_velocity_sources();
+    void apply_density_sources(float* density);
+
+public:
+    // 0 uses every hardware thread
+    explicit CpuCfd(unsigned int threadCount = 0);
+
+    void upload_state(const CfdState& state) override;
+    void step() override;
+    void download_state(CfdState& state) override;
+    const char* name() const override { return "cpu"; }
+
+    unsigned int thread_count() const { return _pool.thread_count(); }
+};
@@ -0,0 +1,418 @@
+#include "field_output.h"
+#include "half_float.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdarg>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+namespace {
+
+const char* const OUTPUT_FIELD_NAMES[] = {"velocityMagnitude", "verticalVelocity", "density", "vorticity"};
+static_assert(sizeof(OUTPUT_FIELD_NAMES) / sizeof(OUTPUT_FIELD_NAMES[0]) == size_t(OutputField::Count),
+              "a name for every OutputField");
+
+// Derivative along one axis of a halo box field at local coordinate c, central where both neighbours exist
+inline float derivative(const float* f, uint32_t c, uint32_t extent, size_t stride)
+{
+    if (extent < 2) {
+        return 0.0f;
+    }
+    if (c == 0) {
+        return f[stride] - f[0];
+    }
+    if (c + 1 == extent) {
+        return f[0] - f[-long(stride)];
+    }
+    return 0.5f * (f[stride] - f[-long(stride)]);
+}
+
+void append_format(std::string& out, const char* format, ...)
+{
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    const int length = std::vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length > 0) {
+        out.append(line, std::min(size_t(length), sizeof(line) - 1));
+    }
+}
+
+std::string data_path(const std::string& path) { return path + ".rfo"; }
+std::string index_path(const std::string& path) { return path + ".rfoi"; }
+
+} // namespace
+
+const char* output_field_name(OutputField field)
+{
+    return OUTPUT_FIELD_NAMES[uint32_t(field)];
+}
+
+FieldOutputFrame make_output_frame(uint64_t step, unsigned int res, const uint32_t lo[3], const uint32_t size[3],
+                                   const float* vx, const float* vy, const float* vz, const float* density)
+{
+    const size_t n = res;
+    FieldOutputFrame frame;
+    frame.step = step;
+    for (int a = 0; a < 3; a++) {
+        frame.haloLo[a] = lo[a] > 0 ? lo[a] - 1 : 0;
+        frame.haloSize[a] = std::min(lo[a] + size[a] + 1, res) - frame.haloLo[a];
+    }
+
+    // Same layouts as get_x_vel_index / get_y_vel_index / get_z_vel_index, each component averaged over
+    // the two faces of the cell normal to it
+    const size_t haloCells = size_t(frame.haloSize[0]) * frame.haloSize[1] * frame.haloSize[2];
+    frame.u.resize(haloCells);
+    frame.v.resize(haloCells);
+    frame.w.resize(haloCells);
+    size_t i = 0;
+    for (uint32_t z = frame.haloLo[2]; z < frame.haloLo[2] + frame.haloSize[2]; z++) {
+        for (uint32_t y = frame.haloLo[1]; y < frame.haloLo[1] + frame.haloSize[1]; y++) {
+            const size_t xRow = size_t(y) * (n + 1) + size_t(z) * (n + 1) * n;
+            const size_t yRow = size_t(y) * n + size_t(z) * (n + 1) * n;
+            const size_t zRow = size_t(y) * n + size_t(z) * n * n;
+            for (uint32_t x = frame.haloLo[0]; x < frame.haloLo[0] + frame.haloSize[0]; x++, i++) {
+                frame.u[i] = 0.5f * (vx[xRow + x] + vx[xRow + x + 1]);
+                frame.v[i] = 0.5f * (vy[yRow + x] + vy[yRow + n + x]);
+                frame.w[i] = 0.5f * (vz[zRow + x] + vz[zRow + n * n + x]);
+            }
+        }
+    }
+
+    frame.density.resize(size_t(size[0]) * size[1] * size[2]);
+    i = 0;
+    for (uint32_t z = lo[2]; z < lo[2] + size[2]; z++) {
+        for (uint32_t y = lo[1]; y < lo[1] + size[1]; y++) {
+            const float* row = density + size_t(y) * n + size_t(z) * n * n + lo[0];
+            std::copy(row, row + size[0], frame.density.begin() + i);
+            i += size[0];
+        }
+    }
+    return frame;
+}
+
+FieldOutputWriter::FieldOutputWriter(const FieldOutputOptions& options, unsigned int res)
+    : _options(options), _worker(options.queueDepth + 1, [this](FieldOutputFrame& frame) { return write(frame); })
+{
+    std::memcpy(_header.magic, FIELD_OUTPUT_MAGIC, sizeof(_header.magic));
+    _header.version = FIELD_OUTPUT_VERSION;
+    _header.res = res;
+    for (int a = 0; a < 3; a++) {
+        const uint32_t hi = std::min(options.hi[a] ? options.hi[a] : res, res);
+        if (options.lo[a] >= hi) {
+            throw std::runtime_error("Field output region is empty along axis " + std::to_string(a));
+        }
+        _header.lo[a] = options.lo[a];
+        _header.size[a] = hi - options.lo[a];
+    }
+
+    open_container();
+}
+
+FieldOutputWriter::~FieldOutputWriter()
+{
+    // Queued frames are still written, they are the end of the series
+    _worker.stop();
+    if (_xdmfPending > 0) {
+        try {
+            write_xdmf();
+        } catch (const std::exception& e) {
+            printf("Field output %s.xmf not updated: %s\n", _options.path.c_str(), e.what());
+        }
+    }
+    if (_data) {
+        std::fclose(_data);
+    }
+    if (_index) {
+        std::fclose(_index);
+    }
+}
+
+void FieldOutputWriter::open_container()
+{
+    const std::filesystem::path directory = std::filesystem::path(_options.path).parent_path();
+    if (!directory.empty()) {
+        std::filesystem::create_directories(directory);
+    }
+    const std::string dataFile = data_path(_options.path);
+    const std::string indexFile = index_path(_options.path);
+
+    uint64_t dataEnd = sizeof(FieldOutputHeader);
+    if (std::filesystem::exists(indexFile) && std::filesystem::exists(dataFile)) {
+        std::ifstream index(indexFile, std::ios::binary);
+        FieldOutputHeader existing{};
+        index.read(reinterpret_cast<char*>(&existing), sizeof(existing));
+        if (!index || std::memcmp(existing.magic, FIELD_OUTPUT_MAGIC, sizeof(existing.magic)) != 0 ||
+            existing.version != FIELD_OUTPUT_VERSION) {
+            throw std::runtime_error("Not a field output index of this version: " + indexFile);
+        }
+        if (existing.res != _header.res || std::memcmp(existing.lo, _header.lo, sizeof(_header.lo)) != 0 ||
+            std::memcmp(existing.size, _header.size, sizeof(_header.size)) != 0) {
+            throw std::runtime_error("Field output " + _options.path + " holds another grid or region, "
+                                     "choose a different path to start a new series");
+        }
+
+        // A torn last record or an unindexed block after it are what an interrupted run leaves behind
+        FieldOutputRecord record;
+        while (index.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+            _records.push_back(record);
+            dataEnd = std::max(dataEnd, record.offset + record.bytes);
+        }
+        index.close();
+        if (std::filesystem::file_size(dataFile) < dataEnd) {
+            throw std::runtime_error("Field output data is shorter than its index: " + dataFile);
+        }
+        std::filesystem::resize_file(indexFile, sizeof(FieldOutputHeader) + _records.size() * sizeof(FieldOutputRecord));
+        std::filesystem::resize_file(dataFile, dataEnd);
+
+        _data = std::fopen(dataFile.c_str(), "r+b");
+        _index = std::fopen(indexFile.c_str(), "r+b");
+        if (_data) {
+            std::fseek(_data, 0, SEEK_END);
+        }
+        if (_index) {
+            std::fseek(_index, 0, SEEK_END);
+        }
+        if (!_records.empty()) {
+            _nextStep = _records.back().step + 1;
+        }
+        for (size_t r = 0, end = 0; r < _records.size(); r = end) {
+            while (end < _records.size() && _records[end].step == _records[r].step) {
+                end++;
+            }
+            append_xdmf_grid(&_records[r], end - r);
+        }
+        printf("Appending to field output %s after %zu blocks, frames before step %llu are dropped\n",
+               _options.path.c_str(), _records.size(), static_cast<unsigned long long>(_nextStep));
+    } else {
+        _data = std::fopen(dataFile.c_str(), "w+b");
+        _index = std::fopen(indexFile.c_str(), "w+b");
+        if (_data && _index) {
+            std::fwrite(&_header, sizeof(_header), 1, _data);
+            std::fwrite(&_header, sizeof(_header), 1, _index);
+            std::fflush(_data);
+            std::fflush(_index);
+        }
+    }
+
+    if (!_data || !_index) {
+        if (_data) {
+            std::fclose(_data);
+        }
+        if (_index) {
+            std::fclose(_index);
+        }
+        throw std::runtime_error("Failed to open field output for writing: " + _options.path);
+    }
+}
+
+bool FieldOutputWriter::submit(FieldOutputFrame frame)
+{
+    std::lock_guard<std::mutex> lock(_submitMutex);
+    // Time values have to increase, a repeated step would show up twice in the collection
+    if (frame.step < _nextStep) {
+        _stale++;
+        return false;
+    }
+    const uint64_t step = frame.step;
+    if (!_worker.submit(std::move(frame))) {
+        return false;
+    }
+    _nextStep = step + 1;
+    return true;
+}
+
+uint64_t FieldOutputWriter::dropped() const
+{
+    std::lock_guard<std::mutex> lock(_submitMutex);
+    return _worker.dropped() + _stale;
+}
+
+bool FieldOutputWriter::write(FieldOutputFrame& frame)
+{
+    try {
+        write_frame(frame);
+    } catch (const std::exception& e) {
+        printf("Field output of step %llu failed: %s\n", static_cast<unsigned long long>(frame.step), e.what());
+        return false;
+    }
+    return true;
+}
+
+void FieldOutputWriter::write_frame(const FieldOutputFrame& frame)
+{
+    const uint32_t* size = _header.size;
+    const size_t cells = size_t(size[0]) * size[1] * size[2];
+    const size_t hx = frame.haloSize[0];
+    const size_t hxy = hx * frame.haloSize[1];
+    uint32_t offset[3];
+    for (int a = 0; a < 3; a++) {
+        offset[a] = _header.lo[a] - frame.haloLo[a];
+    }
+
+    std::vector<float> values(cells);
+    std::vector<uint16_t> halves;
+    std::vector<FieldOutputRecord> records;
+    for (uint32_t f = 0; f < uint32_t(OutputField::Count); f++) {
+        const OutputField field = OutputField(f);
+        if (!(_options.fields & output_field_bit(field))) {
+            continue;
+        }
+
+        if (field == OutputField::Density) {
+            values = frame.density;
+        } else {
+            size_t i = 0;
+            for (uint32_t z = 0; z < size[2]; z++) {
+                for (uint32_t y = 0; y < size[1]; y++) {
+                    for (uint32_t x = 0; x < size[0]; x++, i++) {
+                        const uint32_t h[3] = {x + offset[0], y + offset[1], z + offset[2]};
+                        const size_t c = h[0] + h[1] * hx + h[2] * hxy;
+                        if (field == OutputField::VelocityMagnitude) {
+                            values[i] = std::sqrt(frame.u[c] * frame.u[c] + frame.v[c] * frame.v[c] + frame.w[c] * frame.w[c]);
+                        } else if (field == OutputField::VerticalVelocity) {
+                            values[i] = -frame.v[c];
+                        } else {
+                            const float dwdy = derivative(&frame.w[c], h[1], frame.haloSize[1], hx);
+                            const float dvdz = derivative(&frame.v[c], h[2], frame.haloSize[2], hxy);
+                            const float dudz = derivative(&frame.u[c], h[2], frame.haloSize[2], hxy);
+                            const float dwdx = derivative(&frame.w[c], h[0], frame.haloSize[0], 1);
+                            const float dvdx = derivative(&frame.v[c], h[0], frame.haloSize[0], 1);
+                            const float dudy = derivative(&frame.u[c], h[1], frame.haloSize[1], hx);
+                            const float cx = dwdy - dvdz;
+                            const float cy = dudz - dwdx;
+                            const float cz = dvdx - dudy;
+                            values[i] = std::sqrt(cx * cx + cy * cy + cz * cz);
+                        }
+                    }
+                }
+            }
+        }
+
+        FieldOutputRecord record{};
+        record.step = frame.step;
+        record.field = f;
+        record.encoding = uint32_t(_options.encoding);
+        record.scale = 1.0f;
+        record.bias = 0.0f;
+        const auto range = std::minmax_element(values.begin(), values.end());
+        record.min = *range.first;
+        record.max = *range.second;
+
+        const void* block = values.data();
+        record.bytes = cells * sizeof(float);
+        if (_options.encoding != OutputEncoding::Float32) {
+            halves.resize(cells);
+            if (_options.encoding == OutputEncoding::Float16) {
+                floats_to_halves(values.data(), halves.data(), cells);
+            } else {
+                record.bias = record.min;
+                record.scale = record.max > record.min ? (record.max - record.min) / 65535.0f : 1.0f;
+                const float inverse = 1.0f / record.scale;
+                for (size_t i = 0; i < cells; i++) {
+                    const float q = std::round((values[i] - record.bias) * inverse);
+                    halves[i] = uint16_t(std::min(std::max(q, 0.0f), 65535.0f));
+                }
+            }
+            block = halves.data();
+            record.bytes = cells * sizeof(uint16_t);
+        }
+
+        record.offset = uint64_t(std::ftell(_data));
+        if (std::fwrite(block, 1, record.bytes, _data) != record.bytes) {
+            throw std::runtime_error("Failed to write " + data_path(_options.path));
+        }
+        records.push_back(record);
+    }
+
+    // The data reaches the file before the index names it
+    if (std::fflush(_data) != 0 ||
+        std::fwrite(records.data(), sizeof(FieldOutputRecord), records.size(), _index) != records.size() ||
+        std::fflush(_index) != 0) {
+        throw std::runtime_error("Failed to write " + index_path(_options.path));
+    }
+    _records.insert(_records.end(), records.begin(), records.end());
+    append_xdmf_grid(records.data(), records.size());
+    if (++_xdmfPending >= std::max(_options.xdmfInterval, 1u)) {
+        write_xdmf();
+    }
+}
+
+void FieldOutputWriter::append_xdmf_grid(const FieldOutputRecord* records, size_t count)
+{
+    const std::string dataName = std::filesystem::path(data_path(_options.path)).filename().string();
+    const uint32_t* size = _header.size;
+    const uint32_t* lo = _header.lo;
+    const uint64_t step = records[0].step;
+
+    // XDMF lists dimensions slowest first, z y x for our x fastest blocks
+    std::string& out = _xdmfGrids;
+    append_format(out, "   <Grid Name=\"step_%" PRIu64 "\" GridType=\"Uniform\">\n", step);
+    append_format(out, "    <Time Value=\"%" PRIu64 "\"/>\n", step);
+    append_format(out, "    <Topology TopologyType=\"3DCoRectMesh\" Dimensions=\"%u %u %u\"/>\n",
+                  size[2] + 1, size[1] + 1, size[0] + 1);
+    append_format(out, "    <Geometry GeometryType=\"ORIGIN_DXDYDZ\">\n");
+    append_format(out, "     <DataItem Dimensions=\"3\" NumberType=\"Float\" Precision=\"4\" Format=\"XML\">%u %u %u</DataItem>\n",
+                  lo[2], lo[1], lo[0]);
+    append_format(out, "     <DataItem Dimensions=\"3\" NumberType=\"Float\" Precision=\"4\" Format=\"XML\">1 1 1</DataItem>\n");
+    append_format(out, "    </Geometry>\n");
+
+    for (size_t r = 0; r < count; r++) {
+        const FieldOutputRecord& record = records[r];
+        const char* name = output_field_name(OutputField(record.field));
+        if (OutputEncoding(record.encoding) == OutputEncoding::Float16) {
+            append_format(out, "    <!-- %s is stored as halves at offset %" PRIu64 ", which XDMF cannot describe -->\n",
+                          name, record.offset);
+            continue;
+        }
+
+        append_format(out, "    <Attribute Name=\"%s\" AttributeType=\"Scalar\" Center=\"Cell\">\n", name);
+        const bool quantised = OutputEncoding(record.encoding) == OutputEncoding::Quantised16;
+        const char* indent = "     ";
+        if (quantised) {
+            append_format(out, "     <DataItem ItemType=\"Function\" Function=\"$0 * %.9g + %.9g\" Dimensions=\"%u %u %u\">\n",
+                          record.scale, record.bias, size[2], size[1], size[0]);
+            indent = "      ";
+        }
+        append_format(out, "%s<DataItem Dimensions=\"%u %u %u\" NumberType=\"%s\" Precision=\"%d\" Format=\"Binary\" "
+                      "Endian=\"Little\" Seek=\"%" PRIu64 "\">%s</DataItem>\n",
+                      indent, size[2], size[1], size[0], quantised ? "UInt" : "Float", quantised ? 2 : 4,
+                      record.offset, dataName.c_str());
+        if (quantised) {
+            append_format(out, "     </DataItem>\n");
+        }
+        append_format(out, "    </Attribute>\n");
+    }
+    append_format(out, "   </Grid>\n");
+}
+
+void FieldOutputWriter::write_xdmf()
+{
+    const std::string xdmfFile = _options.path + ".xmf";
+
+    // Rewritten whole and renamed into place, a viewer reloading mid-write still sees a complete file
+    const std::string temporary = xdmfFile + ".tmp";
+    FILE* file = std::fopen(temporary.c_str(), "w");
+    if (!file) {
+        throw std::runtime_error("Failed to open file for writing: " + temporary);
+    }
+
+    std::fprintf(file, "<?xml version=\"1.0\" ?>\n<!DOCTYPE Xdmf SYSTEM \"Xdmf.dtd\" []>\n<Xdmf Version=\"2.0\">\n <Domain>\n");
+    std::fprintf(file, "  <Grid Name=\"fields\" GridType=\"Collection\" CollectionType=\"Temporal\">\n");
+    std::fwrite(_xdmfGrids.data(), 1, _xdmfGrids.size(), file);
+    std::fprintf(file, "  </Grid>\n </Domain>\n</Xdmf>\n");
+
+    const bool ok = !std::ferror(file);
+    std::fclose(file);
+    if (!ok) {
+        std::remove(temporary.c_str());
+        throw std::runtime_error("Failed to write file: " + temporary);
+    }
+    std::filesystem::rename(temporary, xdmfFile);
+    _xdmfPending = 0;
+}
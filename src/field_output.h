@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "background_writer.h"
+
+// Time series of derived fields for offline post-processing. Every frame appends one block per field to
+// <path>.rfo and then one FieldOutputRecord per block to <path>.rfoi, so the index only ever names blocks
+// that were completely written, and a reopened container drops whatever follows the last indexed block
+// and carries on appending. Steps only ever increase along a series, frames of steps it already holds
+// (e.g. from a run restored from an earlier checkpoint) are dropped. <path>.xmf is an XDMF temporal
+// collection pointing into the data file, which ParaView and VisIt open directly. It is rewritten every
+// xdmfInterval frames and when the writer closes, from grid descriptions kept as each frame is written.
+const char FIELD_OUTPUT_MAGIC[8] = {'R', 'F', 'O', 'U', 'T', 'P', 'U', 'T'};
+const uint32_t FIELD_OUTPUT_VERSION = 1;
+
+// Cell centred, over the output region. The grid's y axis points down (see voxelise.comp), vertical
+// velocity is positive upwards.
+enum class OutputField : uint32_t {
+    VelocityMagnitude,
+    VerticalVelocity,
+    Density,
+    Vorticity,      // |curl u|, central differences in grid units
+    Count
+};
+
+inline uint32_t output_field_bit(OutputField field) { return 1u << uint32_t(field); }
+const uint32_t OUTPUT_ALL_FIELDS = (1u << uint32_t(OutputField::Count)) - 1;
+const char* output_field_name(OutputField field);
+
+enum class OutputEncoding : uint32_t {
+    Float32,
+    Float16,        // IEEE halves, not described in the XDMF sidecar, which has no half type
+    Quantised16     // uint16 spread over the block's range, value = q * scale + bias
+};
+
+// Shared by the data file and the index, both start with it
+struct FieldOutputHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t res;           // solver grid the region was cut from
+    uint32_t lo[3];         // first cell of the region
+    uint32_t size[3];       // cells of the region along x, y and z, x fastest in every block
+    uint32_t reserved[6];
+};
+static_assert(sizeof(FieldOutputHeader) == 64, "FieldOutputHeader is part of the file format");
+
+struct FieldOutputRecord {
+    uint64_t step;          // steps completed when the fields were captured
+    uint32_t field;         // OutputField
+    uint32_t encoding;      // OutputEncoding
+    uint64_t offset;        // of the block in the data file
+    uint64_t bytes;
+    float scale;            // Quantised16 only, 1 and 0 otherwise
+    float bias;
+    float min;              // range of the block before encoding
+    float max;
+};
+static_assert(sizeof(FieldOutputRecord) == 48, "FieldOutputRecord is part of the file format");
+
+struct FieldOutputOptions {
+    std::string path = "Data/output/fields";   // without extension
+    uint32_t fields = OUTPUT_ALL_FIELDS;         // output_field_bit mask
+    // Half the size of Float32 and, unlike Float16, described in the XDMF sidecar so viewers load it
+    OutputEncoding encoding = OutputEncoding::Quantised16;
+    // Region of interest in cells, lo inclusive and hi exclusive, a hi of 0 extends to the grid's end
+    uint32_t lo[3] = {0, 0, 0};
+    uint32_t hi[3] = {0, 0, 0};
+    // Frames waiting for the writer before further ones are dropped
+    size_t queueDepth = 4;
+    // Frames between rewrites of the .xmf, which grows with the series
+    uint32_t xdmfInterval = 8;
+};
+
+// What a frame is derived from: cell centred velocities over the region grown by a cell on every side that
+// the grid allows, so vorticity has neighbours at the region's faces, and the density over the region
+struct FieldOutputFrame {
+    uint64_t step = 0;
+    uint32_t haloLo[3] = {};    // first cell of the velocity box
+    uint32_t haloSize[3] = {};
+    std::vector<float> u, v, w;
+    std::vector<float> density;
+};
+
+// Cuts a frame out of the solver's fields: staggered velocities ((res+1)*res*res each, CfdState layout)
+// averaged to cell centres, density as it is. Cheap enough for the readback worker, everything else
+// happens on the writer thread.
+FieldOutputFrame make_output_frame(uint64_t step, unsigned int res, const uint32_t lo[3], const uint32_t size[3],
+                                   const float* vx, const float* vy, const float* vz, const float* density);
+
+// Derives, encodes and appends frames on a thread of its own. submit never waits: once queueDepth frames
+// are queued further ones are dropped and counted.
+class FieldOutputWriter {
+private:
+    FieldOutputOptions _options;
+    FieldOutputHeader _header{};
+    std::vector<FieldOutputRecord> _records;
+    FILE* _data = nullptr;
+    FILE* _index = nullptr;
+
+    std::string _xdmfGrids;  // one <Grid> per frame in the series, worker only once it runs
+    uint32_t _xdmfPending = 0; // frames not in the .xmf yet
+
+    mutable std::mutex _submitMutex;
+    uint64_t _nextStep = 0;  // first step the series does not hold yet
+    uint64_t _stale = 0;     // frames dropped for their step
+    BackgroundWriter<FieldOutputFrame> _worker;
+
+    void open_container();
+    bool write(FieldOutputFrame& frame);
+    void write_frame(const FieldOutputFrame& frame);
+    // Appends the grid of one frame's records to _xdmfGrids
+    void append_xdmf_grid(const FieldOutputRecord* records, size_t count);
+    void write_xdmf();
+
+public:
+    // Opens or creates the container, throws when an existing one was cut from a different grid or region
+    FieldOutputWriter(const FieldOutputOptions& options, unsigned int res);
+    // Writes every queued frame and then the .xmf first
+    ~FieldOutputWriter();
+    FieldOutputWriter(const FieldOutputWriter&) = delete;
+    FieldOutputWriter& operator=(const FieldOutputWriter&) = delete;
+
+    const uint32_t* region_lo() const { return _header.lo; }
+    const uint32_t* region_size() const { return _header.size; }
+
+    // Whether submit would drop a frame now, lets callers skip building one
+    bool full() const { return _worker.full(); }
+    // Drops the frame when the queue is full or its step is not past the last one in the series
+    bool submit(FieldOutputFrame frame);
+    // Blocks until the queue is empty and the last frame is on disk
+    void wait() { _worker.wait(); }
+
+    uint64_t written() const { return _worker.written(); }
+    uint64_t dropped() const;
+};
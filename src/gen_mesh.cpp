@@ -51,28 +51,18 @@ std::vector<uint32_t> generateGridIndices(uint32_t rows, uint32_t cols) {
     return indices;
 }
 
-std::vector<std::vector<float>> readHeightMap(const std::string& filename) {
-    std::vector<std::vector<float>> heightMap;
-    std::ifstream file(filename);
-
-    if (!file.is_open()) {
-        throw std::runtime_error("Failed to open file: " + filename);
-    }
-
-    std::string line;
-    while (std::getline(file, line)) {
-        std::istringstream lineStream(line);
-        std::vector<float> row;
-        float value;
-
-        while (lineStream >> value) {
-            row.push_back(value);
+std::vector<std::vector<float>> MeshGen::readHeightMap(const std::string& filename) {
+    RasteriseOptions raster;
+    raster.normalise = true;
+    TerrainMap terrain = open_terrain(filename, raster);
+
+    std::vector<std::vector<float>> heightMap(terrain.rows(), std::vector<float>(terrain.cols()));
+    for (uint32_t row = 0; row < terrain.rows(); ++row) {
+        for (uint32_t col = 0; col < terrain.cols(); ++col) {
+            heightMap[row][col] = terrain.height(row, col);
         }
-
-        heightMap.push_back(row);
     }
 
-    file.close();
     return heightMap;
 }
 
@@ -11,7 +11,10 @@
 #include <stdexcept>
 
 #include "vk_types.h"
+#include "terrain_points.h"
 
 namespace MeshGen {
+    // Any heightmap open_terrain reads, point clouds are gridded by their density and normalised
+    std::vector<std::vector<float>> readHeightMap(const std::string& filename);
     void generateMesh(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, const std::string& filename, float gridSize, float maxHeight);
 }
@@ -0,0 +1,96 @@
+#include "half_float.h"
+
+#include <cstring>
+
+uint16_t float_to_half(float value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+
+    const uint32_t sign = (bits >> 16) & 0x8000u;
+    const uint32_t exponent = (bits >> 23) & 0xffu;
+    uint32_t mantissa = bits & 0x7fffffu;
+
+    if (exponent == 0xffu) {
+        // Keep a quiet NaN quiet, a payload that only lives in the low bits would otherwise turn into infinity
+        return static_cast<uint16_t>(sign | 0x7c00u | (mantissa ? 0x200u | (mantissa >> 13) : 0u));
+    }
+
+    const int halfExponent = int(exponent) - 127 + 15;
+    if (halfExponent >= 31) {
+        return static_cast<uint16_t>(sign | 0x7c00u);
+    }
+
+    if (halfExponent <= 0) {
+        // Subnormal or zero, the implicit leading bit shifts into the mantissa
+        if (halfExponent < -10) {
+            return static_cast<uint16_t>(sign);
+        }
+        mantissa |= 0x800000u;
+        const uint32_t shift = uint32_t(14 - halfExponent);
+        uint32_t half = mantissa >> shift;
+        const uint32_t remainder = mantissa & ((1u << shift) - 1u);
+        const uint32_t halfway = 1u << (shift - 1u);
+        if (remainder > halfway || (remainder == halfway && (half & 1u))) {
+            half++;
+        }
+        return static_cast<uint16_t>(sign | half);
+    }
+
+    // Carries out of the mantissa round into the exponent, up to infinity
+    uint32_t half = (uint32_t(halfExponent) << 10) | (mantissa >> 13);
+    const uint32_t remainder = mantissa & 0x1fffu;
+    if (remainder > 0x1000u || (remainder == 0x1000u && (half & 1u))) {
+        half++;
+    }
+    return static_cast<uint16_t>(sign | half);
+}
+
+float half_to_float(uint16_t half)
+{
+    const uint32_t sign = uint32_t(half & 0x8000u) << 16;
+    uint32_t exponent = (half >> 10) & 0x1fu;
+    uint32_t mantissa = half & 0x3ffu;
+
+    uint32_t bits;
+    if (exponent == 0x1fu) {
+        bits = sign | 0x7f800000u | (mantissa << 13);
+    } else if (exponent != 0) {
+        bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    } else if (mantissa == 0) {
+        bits = sign;
+    } else {
+        // Subnormal half, normalise into the float exponent range
+        exponent = 127 - 15 + 1;
+        while ((mantissa & 0x400u) == 0) {
+            mantissa <<= 1;
+            exponent--;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3ffu) << 13);
+    }
+
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+void floats_to_halves(const float* src, uint16_t* dst, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        dst[i] = float_to_half(src[i]);
+    }
+}
+
+void halves_to_floats(const uint16_t* src, float* dst, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        dst[i] = half_to_float(src[i]);
+    }
+}
+
+std::vector<uint16_t> to_half_buffer(const std::vector<float>& values)
+{
+    std::vector<uint16_t> halves((values.size() + 1) & ~size_t(1), 0);
+    floats_to_halves(values.data(), halves.data(), values.size());
+    return halves;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// IEEE 754 binary16 conversion for the half precision field buffers, matching what the shaders read
+// (float16_t or unpackHalf2x16). Rounds to nearest even, overflow goes to infinity, NaN stays NaN.
+uint16_t float_to_half(float value);
+float half_to_float(uint16_t half);
+
+// count values, dst holds count halves. Sized for the device layout, two halves per 32-bit word,
+// so an odd count leaves the last high half zero.
+void floats_to_halves(const float* src, uint16_t* dst, size_t count);
+void halves_to_floats(const uint16_t* src, float* dst, size_t count);
+
+// Halves of count floats padded to whole 32-bit words, ready to upload
+std::vector<uint16_t> to_half_buffer(const std::vector<float>& values);
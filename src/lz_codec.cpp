@@ -0,0 +1,225 @@
+#include "lz_codec.h"
+
+#include <cstring>
+#include <vector>
+
+namespace {
+
+const int LZ_HASH_BITS = 14;
+const size_t LZ_MIN_MATCH = 4;
+const size_t LZ_MAX_OFFSET = 65535;
+// The last bytes of a block are always literals, and a match never starts this close to the end, so the
+// decoder can finish on a literal run
+const size_t LZ_LAST_LITERALS = 5;
+const size_t LZ_MATCH_START_LIMIT = 12;
+
+inline uint32_t read32(const uint8_t* p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t hash4(uint32_t sequence) { return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS); }
+
+// Lengths past the token's 15 continue in bytes of 255 and a final remainder
+inline bool write_length(uint8_t*& out, const uint8_t* end, size_t length)
+{
+    for (; length >= 255; length -= 255) {
+        if (out >= end) {
+            return false;
+        }
+        *out++ = 255;
+    }
+    if (out >= end) {
+        return false;
+    }
+    *out++ = uint8_t(length);
+    return true;
+}
+
+inline bool read_length(const uint8_t*& in, const uint8_t* end, size_t& length)
+{
+    uint8_t byte;
+    do {
+        if (in >= end) {
+            return false;
+        }
+        byte = *in++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+bool write_sequence(uint8_t*& out, const uint8_t* end, const uint8_t* literals, size_t literalCount,
+                    size_t offset, size_t matchLength)
+{
+    if (out >= end) {
+        return false;
+    }
+    const size_t matchCode = matchLength ? matchLength - LZ_MIN_MATCH : 0;
+    uint8_t* token = out++;
+    *token = uint8_t((literalCount < 15 ? literalCount : 15) << 4);
+    if (literalCount >= 15 && !write_length(out, end, literalCount - 15)) {
+        return false;
+    }
+    if (size_t(end - out) < literalCount) {
+        return false;
+    }
+    // memcpy wants valid pointers even for no bytes, and an empty input has none
+    if (literalCount > 0) {
+        std::memcpy(out, literals, literalCount);
+    }
+    out += literalCount;
+
+    // The last sequence of a block has no match
+    if (matchLength == 0) {
+        return true;
+    }
+    *token |= uint8_t(matchCode < 15 ? matchCode : 15);
+    if (end - out < 2) {
+        return false;
+    }
+    *out++ = uint8_t(offset);
+    *out++ = uint8_t(offset >> 8);
+    return matchCode < 15 || write_length(out, end, matchCode - 15);
+}
+
+} // namespace
+
+void shuffle_bytes(const uint8_t* src, uint8_t* dst, size_t byteCount, size_t elementSize)
+{
+    const size_t count = elementSize ? byteCount / elementSize : 0;
+    for (size_t b = 0; b < elementSize && count; b++) {
+        uint8_t* lane = dst + b * count;
+        for (size_t e = 0; e < count; e++) {
+            lane[e] = src[e * elementSize + b];
+        }
+    }
+    const size_t whole = count * elementSize;
+    if (byteCount > whole) {
+        std::memcpy(dst + whole, src + whole, byteCount - whole);
+    }
+}
+
+void unshuffle_bytes(const uint8_t* src, uint8_t* dst, size_t byteCount, size_t elementSize)
+{
+    const size_t count = elementSize ? byteCount / elementSize : 0;
+    for (size_t b = 0; b < elementSize && count; b++) {
+        const uint8_t* lane = src + b * count;
+        for (size_t e = 0; e < count; e++) {
+            dst[e * elementSize + b] = lane[e];
+        }
+    }
+    const size_t whole = count * elementSize;
+    if (byteCount > whole) {
+        std::memcpy(dst + whole, src + whole, byteCount - whole);
+    }
+}
+
+size_t lz_compress(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity)
+{
+    uint8_t* out = dst;
+    const uint8_t* end = dst + capacity;
+    size_t anchor = 0;
+
+    if (size > LZ_MATCH_START_LIMIT) {
+        // Last position seen for each hash of four bytes, 0 doubles as empty as the scan starts at 1
+        std::vector<uint32_t> table(size_t(1) << LZ_HASH_BITS, 0);
+        const size_t matchStartLimit = size - LZ_MATCH_START_LIMIT;
+        const size_t matchEndLimit = size - LZ_LAST_LITERALS;
+
+        size_t i = 1;
+        size_t misses = 0;
+        while (i < matchStartLimit) {
+            const uint32_t sequence = read32(src + i);
+            const uint32_t h = hash4(sequence);
+            size_t candidate = table[h];
+            table[h] = uint32_t(i);
+
+            if (candidate == 0 || i - candidate > LZ_MAX_OFFSET || read32(src + candidate) != sequence) {
+                // Step faster through data that keeps missing, incompressible stretches cost little
+                i += 1 + (misses++ >> 6);
+                continue;
+            }
+
+            size_t matchEnd = i + LZ_MIN_MATCH;
+            size_t from = candidate + LZ_MIN_MATCH;
+            while (matchEnd < matchEndLimit && src[matchEnd] == src[from]) {
+                matchEnd++;
+                from++;
+            }
+            while (i > anchor && candidate > 0 && src[i - 1] == src[candidate - 1]) {
+                i--;
+                candidate--;
+            }
+
+            if (!write_sequence(out, end, src + anchor, i - anchor, i - candidate, matchEnd - i)) {
+                return 0;
+            }
+            i = matchEnd;
+            anchor = matchEnd;
+            misses = 0;
+        }
+    }
+
+    if (!write_sequence(out, end, src + anchor, size - anchor, 0, 0)) {
+        return 0;
+    }
+    return size_t(out - dst);
+}
+
+bool lz_decompress(const uint8_t* src, size_t size, uint8_t* dst, size_t rawSize)
+{
+    const uint8_t* in = src;
+    const uint8_t* inEnd = src + size;
+    uint8_t* out = dst;
+    uint8_t* outEnd = dst + rawSize;
+
+    while (in < inEnd) {
+        const uint8_t token = *in++;
+
+        size_t literalCount = token >> 4;
+        if (literalCount == 15 && !read_length(in, inEnd, literalCount)) {
+            return false;
+        }
+        if (size_t(inEnd - in) < literalCount || size_t(outEnd - out) < literalCount) {
+            return false;
+        }
+        if (literalCount > 0) {
+            std::memcpy(out, in, literalCount);
+        }
+        in += literalCount;
+        out += literalCount;
+
+        if (in == inEnd) {
+            break;
+        }
+
+        if (inEnd - in < 2) {
+            return false;
+        }
+        const size_t offset = size_t(in[0]) | (size_t(in[1]) << 8);
+        in += 2;
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && !read_length(in, inEnd, matchLength)) {
+            return false;
+        }
+        matchLength += LZ_MIN_MATCH;
+        if (offset == 0 || offset > size_t(out - dst) || size_t(outEnd - out) < matchLength) {
+            return false;
+        }
+
+        // An offset shorter than the match repeats the bytes it is writing, byte by byte
+        const uint8_t* from = out - offset;
+        if (offset >= matchLength) {
+            std::memcpy(out, from, matchLength);
+        } else {
+            for (size_t k = 0; k < matchLength; k++) {
+                out[k] = from[k];
+            }
+        }
+        out += matchLength;
+    }
+    return out == outEnd;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Lossless codec for blocks of solver data. The byte shuffle groups byte k of every element together, so
+// the sign and exponent bytes of neighbouring floats, which rarely differ, form long runs that a plain LZ77
+// pass then removes. Sequences follow LZ4's block layout: a token with the literal and match lengths, the
+// literals, a 16-bit offset, 255-continued lengths; a block ends with literals only.
+
+// Element stride of byteCount bytes, trailing bytes that do not make a whole element are copied as they are
+void shuffle_bytes(const uint8_t* src, uint8_t* dst, size_t byteCount, size_t elementSize);
+void unshuffle_bytes(const uint8_t* src, uint8_t* dst, size_t byteCount, size_t elementSize);
+
+// Largest output lz_compress can produce for size bytes
+inline size_t lz_compress_bound(size_t size) { return size + size / 255 + 16; }
+// Returns the compressed size, 0 when it would not fit in capacity
+size_t lz_compress(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity);
+// Returns false for a corrupt block or one that does not decode to exactly rawSize bytes
+bool lz_decompress(const uint8_t* src, size_t size, uint8_t* dst, size_t rawSize);
@@ -0,0 +1,55 @@
+#version 450
+
+// Depth-aware upsampling of the reduced resolution volume from rayMarch.comp over the terrain. Each of
+// the four nearest low resolution samples is weighted bilinearly and by how close the depth its ray
+// stopped at is to this pixel's, so volume behind a terrain edge does not bleed across it.
+
+layout(location = 0) in vec2 inUV;
+layout(set = 0, binding = 0) uniform sampler2D volumeColour;
+layout(set = 0, binding = 1) uniform sampler2D volumeDepth;
+layout(set = 0, binding = 2) uniform sampler2D depthBuffer;
+layout(set = 0, binding = 3) uniform sampler2D colourBuffer;
+
+layout(location = 0) out vec4 outFragColor;
+
+// Must match raymarch.glsl
+const float nearPlane = 0.1;
+const float farPlane = 1000;
+
+// Relative depth difference at which a sample's weight halves
+const float DEPTH_TOLERANCE = 0.01;
+
+float linearizeDepth(float depth, float near, float far) {
+    float z_ndc = depth * 2.0 - 1.0;
+    return (2.0 * near * far) /
+           (far + near - z_ndc * (far - near));
+}
+
+void main() {
+    float linearDepth = linearizeDepth(texture(depthBuffer, inUV).r, nearPlane, farPlane);
+
+    ivec2 size = textureSize(volumeColour, 0);
+    vec2 pos = inUV * vec2(size) - 0.5;
+    ivec2 base = ivec2(floor(pos));
+    vec2 f = pos - vec2(base);
+
+    vec4 sum = vec4(0.0);
+    float weightSum = 0.0;
+    for (int j = 0; j < 2; j++) {
+        for (int i = 0; i < 2; i++) {
+            ivec2 texel = clamp(base + ivec2(i, j), ivec2(0), size - 1);
+            float bilinear = (i == 0 ? 1.0 - f.x : f.x) * (j == 0 ? 1.0 - f.y : f.y);
+            float sampleDepth = texelFetch(volumeDepth, texel, 0).r;
+            float relative = abs(sampleDepth - linearDepth) / max(linearDepth, nearPlane);
+            float weight = bilinear / (1.0 + relative / DEPTH_TOLERANCE);
+
+            sum += weight * texelFetch(volumeColour, texel, 0);
+            weightSum += weight;
+        }
+    }
+    vec4 volume = sum / max(weightSum, 1e-6);
+
+    vec4 sceneColor = texture(colourBuffer, inUV);
+    outFragColor.rgb = sceneColor.rgb * (1.0 - volume.a) + volume.rgb;
+    outFragColor.a = 1.0;
+}
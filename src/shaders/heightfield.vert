@@ -0,0 +1,52 @@
+#version 450
+
+// Terrain chunk placed from the heightmap texture, no vertex buffer. Vertex indices follow
+// TerrainLod::build_indices: the (CHUNK_CELLS + 1)^2 grid row by row, then the skirts along the top,
+// bottom, left and right edges.
+
+layout(set = 0, binding = 0) uniform sampler2D heightMap; // (height - heightMin) / heightRange
+
+// TerrainChunkConstants
+layout(push_constant) uniform PushConstants {
+    mat4 transform;
+    ivec2 origin;      // first sample of the chunk, column and row
+    int stride;
+    float skirtDepth;
+    ivec2 size;        // samples in the heightmap, columns and rows
+    float heightScale;
+    float heightMin;
+    float heightRange;
+} push;
+
+// Outputs to fragment shader
+layout(location = 1) out vec2 fragTexCoord;
+
+const int CHUNK_CELLS = 64; // TERRAIN_CHUNK_CELLS
+
+void main() {
+    const int edgeVertices = CHUNK_CELLS + 1;
+    int index = gl_VertexIndex;
+
+    ivec2 cell; // column and row within the chunk
+    float skirt = 0.0;
+    if (index < edgeVertices * edgeVertices) {
+        cell = ivec2(index % edgeVertices, index / edgeVertices);
+    } else {
+        int edge = (index - edgeVertices * edgeVertices) / edgeVertices;
+        int k = (index - edgeVertices * edgeVertices) % edgeVertices;
+        int row = edge == 0 ? 0 : edge == 1 ? CHUNK_CELLS : k;
+        int col = edge == 2 ? 0 : edge == 3 ? CHUNK_CELLS : k;
+        cell = ivec2(col, row);
+        skirt = push.skirtDepth;
+    }
+
+    // Clamped like TerrainLod::position, chunks overhanging the map collapse onto its edges
+    ivec2 texel = min(push.origin + cell * push.stride, push.size - 1);
+    float height = push.heightMin + texelFetch(heightMap, texel, 0).r * push.heightRange;
+    vec3 position = vec3(float(texel.x) / float(push.size.x),
+                         1.0 - height * push.heightScale + skirt,
+                         float(texel.y) / float(push.size.x));
+
+    fragTexCoord = vec2(position.y, 0.0);
+    gl_Position = push.transform * vec4(position, 1.0);
+}
@@ -0,0 +1,181 @@
+// Ray marcher shared by rayTrace.frag (every pixel) and rayMarch.comp (reduced resolution). The including
+// shader declares volumeTex, occupancyTex and the CamData push constants as cam before including it.
+
+// Simple parameters
+vec3 cameraPos = cam.pos;
+vec3 cameraDir = cam.lookAt - cam.pos;
+vec3 cameraUp  = cam.camUp;
+
+float nearPlane = 0.1;
+float farPlane = 1000;
+float fov      = radians(60.0);
+float stepSize = 0.01; // Step size along the ray
+
+float randomStepModifier(vec2 st) {
+    return max(0.5, fract(sin(dot(st, vec2(12.9898, 78.233)) * 43758.5453)))/10.0 + 0.9;
+}
+
+vec3 computeRayDir(vec3 cameraPos, vec3 cameraDir, vec3 cameraUp, vec2 fragUV, float fov) {
+    // Compute camera basis
+    vec3 forward = normalize(cameraDir);
+    vec3 right = normalize(cross(forward, cameraUp));
+    vec3 up = cross(right, forward);
+
+    // Map UV from [0,1] to [-1,1]
+    vec2 screenPos = fragUV * 2.0 - 1.0;
+
+    // Adjust for aspect ratio if needed (assume square for now)
+    float aspect = 1.0; // set properly if not square
+    screenPos.x *= aspect;
+
+    // Compute ray in camera space using FOV
+    float tanFov = tan(fov * 0.5);
+    vec3 rayDir = normalize(forward + screenPos.x * tanFov * right + screenPos.y * tanFov * up);
+
+    return rayDir;
+}
+
+float computeRayAngle(vec3 cameraDir, vec3 rayDir) {
+    vec3 normCameraDir = normalize(cameraDir);
+    vec3 normRayDir = normalize(rayDir);
+    vec3 crossProduct = cross(normCameraDir, normRayDir);
+    float sinAng = length(crossProduct);
+    return asin(sinAng);
+}
+
+bool intersectBox(vec3 rayOrigin, vec3 rayDir, out float tNear, out float tFar) {
+    vec3 invDir = 1.0 / rayDir;
+    vec3 t0s = (vec3(0.0) - rayOrigin) * invDir;     // min bounds
+    vec3 t1s = (vec3(1.0) - rayOrigin) * invDir;     // max bounds
+
+    vec3 tMin = min(t0s, t1s);
+    vec3 tMax = max(t0s, t1s);
+
+    tNear = max(max(tMin.x, tMin.y), tMin.z);
+    tFar  = min(min(tMax.x, tMax.y), tMax.z);
+
+    // If ray origin is inside, force tNear = 0
+    if (tNear < 0.0) tNear = 0.0;
+
+    return tFar >= tNear;
+}
+
+// depth is the raw value from depth buffer in [0,1]
+// near and far are your camera clip planes
+float linearizeDepth(float depth, float near, float far) {
+    float z_ndc = depth * 2.0 - 1.0;  // Back to Normalized Device Coordinates
+    return (2.0 * near * far) /
+           (far + near - z_ndc * (far - near));
+}
+
+// Front-to-back blends the samples tStart + k * step that fall in [t, tStop), leaves t on the next one.
+// Opacity is corrected for steps longer than stepSize by opacityExponent = step / stepSize, 1 leaves it as is.
+// hit accumulates the contribution weighted ray parameter (x) and the total contribution (y).
+void marchSamples(vec3 rayDir, inout float t, float tStop, float step, float opacityExponent, inout vec4 accumulatedColor, inout vec2 hit) {
+    for (; t < tStop && accumulatedColor.a < 0.95; t += step) {
+        // One fetch per step, both channels come from the same texel
+        vec2 volume = decode_volume(texture(volumeTex, cameraPos + rayDir * t));
+        float density = volume.x;
+        float up = -volume.y;
+        float down = volume.y;
+        vec4 col = density*vec4(down, up, 1.0, 1.0);
+        if (opacityExponent != 1.0) {
+            col.a = 1.0 - pow(1.0 - clamp(col.a, 0.0, 1.0), opacityExponent);
+        }
+
+        // Front-to-back alpha blending
+        float contribution = (1.0 - accumulatedColor.a) * col.a;
+        accumulatedColor.rgb += (1.0 - accumulatedColor.a) * col.rgb * col.a;
+        accumulatedColor.a += contribution;
+        hit += vec2(t * contribution, contribution);
+    }
+}
+
+// Distance along rayDir to the scene at the given linear (view space) depth
+float sceneRayDistance(vec3 rayDir, float linearDepth) {
+    return linearDepth / cos(computeRayAngle(cameraDir, rayDir));
+}
+
+// Marches rayDir from tStart in steps of step up to tEnd, tNear is where it entered the volume. hitT is
+// where the volume's contribution is centred, tEnd when there is none.
+void marchRay(vec3 rayDir, float tNear, float tStart, float tEnd, float step, float opacityExponent, out vec4 accumulatedColor, out float hitT) {
+    float t = tStart;
+    accumulatedColor = vec4(0.0);
+    vec2 hit = vec2(0.0);
+
+    // Empty space skipping: a 3D DDA walks the occupancy bricks along the ray and samples are only taken
+    // in bricks that hold density. Skipped samples stay on the same lattice, so the image does not change.
+    ivec3 brickCount = textureSize(occupancyTex, 0);
+    vec3 bricksPerUnit = vec3(textureSize(volumeTex, 0)) / float(VOLUME_BRICK_SIZE);
+    vec3 gridPos = (cameraPos + rayDir * tNear) * bricksPerUnit;
+    vec3 gridDir = rayDir * bricksPerUnit;
+
+    ivec3 brick = clamp(ivec3(floor(gridPos)), ivec3(0), brickCount - 1);
+    ivec3 brickStep = ivec3(sign(gridDir));
+    vec3 tNext = vec3(1e30); // ray parameter where each axis crosses into its next brick
+    vec3 tDelta = vec3(1e30);
+    for (int axis = 0; axis < 3; axis++) {
+        if (gridDir[axis] != 0.0) {
+            float face = float(brick[axis] + (brickStep[axis] > 0 ? 1 : 0));
+            tNext[axis] = tNear + (face - gridPos[axis]) / gridDir[axis];
+            tDelta[axis] = abs(1.0 / gridDir[axis]);
+        }
+    }
+
+    while (t < tEnd && accumulatedColor.a < 0.95 &&
+           all(greaterThanEqual(brick, ivec3(0))) && all(lessThan(brick, brickCount))) {
+        float tStop = min(min(min(tNext.x, tNext.y), tNext.z), tEnd);
+
+        if (texelFetch(occupancyTex, brick, 0).r > VOLUME_EMPTY_DENSITY) {
+            marchSamples(rayDir, t, tStop, step, opacityExponent, accumulatedColor, hit);
+        } else if (t < tStop) {
+            t += ceil((tStop - t) / step) * step;
+        }
+
+        if (tNext.x <= tNext.y && tNext.x <= tNext.z) {
+            brick.x += brickStep.x;
+            tNext.x += tDelta.x;
+        } else if (tNext.y <= tNext.z) {
+            brick.y += brickStep.y;
+            tNext.y += tDelta.y;
+        } else {
+            brick.z += brickStep.z;
+            tNext.z += tDelta.z;
+        }
+    }
+
+    hitT = hit.y > 0.0 ? hit.x / hit.y : tEnd;
+}
+
+// Front-to-back composited volume colour (premultiplied, alpha in a) along the ray through uv, stopping
+// at the scene's linear depth. Returns false when the ray misses the volume.
+bool march_volume(vec2 uv, float linearDepth, out vec4 accumulatedColor) {
+    accumulatedColor = vec4(0.0);
+    vec3 rayDir = computeRayDir(cameraPos, cameraDir, cameraUp, uv, fov);
+
+    float tNear, tFar;
+    if (!intersectBox(cameraPos, rayDir, tNear, tFar)) {
+        return false;
+    }
+
+    float step = stepSize * randomStepModifier(uv + vec2(tNear, tNear)); // vary step size a bit
+    float tEnd = min(tFar, sceneRayDistance(rayDir, linearDepth)); // the volume's far side or the scene, whichever is closer
+
+    float hitT;
+    marchRay(rayDir, tNear, tNear, tEnd, step, 1.0, accumulatedColor, hitT);
+    return true;
+}
+
+// Inverse of computeRayDir for a camera at pos looking along dir: the uv a world point shows up at and
+// its linear depth. Points behind the camera get a depth <= 0.
+vec2 projectToCamera(vec3 world, vec3 pos, vec3 dir, vec3 up, out float linearDepth) {
+    vec3 forward = normalize(dir);
+    vec3 right = normalize(cross(forward, up));
+    vec3 trueUp = cross(right, forward);
+
+    vec3 v = world - pos;
+    linearDepth = dot(v, forward);
+    float tanFov = tan(fov * 0.5);
+    vec2 screenPos = vec2(dot(v, right), dot(v, trueUp)) / (max(linearDepth, 1e-6) * tanFov);
+    return screenPos * 0.5 + 0.5;
+}
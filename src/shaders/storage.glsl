@@ -0,0 +1,58 @@
+// Element type of the solver field buffers (velocities, density, pressure, boundaries), picked per
+// SPIR-V variant by the build:
+//   default                           float
+//   CFD_FIELD_F16                     float16_t through VK_KHR_16bit_storage
+//   CFD_FIELD_F16 + CFD_FIELD_PACKED  two halves per uint with packHalf2x16, for devices without it
+// Arithmetic stays fp32 everywhere, fields are only touched through FIELD_LOAD and FIELD_STORE.
+
+#if defined(CFD_FIELD_F16) && defined(CFD_FIELD_PACKED)
+
+#define FIELD_T uint
+
+float field_half(uint word, uint i) {
+    vec2 halves = unpackHalf2x16(word);
+    return (i & 1u) == 0u ? halves.x : halves.y;
+}
+
+uint field_set_half(uint word, uint i, float v) {
+    vec2 halves = unpackHalf2x16(word);
+    if ((i & 1u) == 0u) {
+        halves.x = v;
+    } else {
+        halves.y = v;
+    }
+    return packHalf2x16(halves);
+}
+
+// Callers keep indices in range, the word is still clamped to the array since uint(i) of a stray
+// negative index would land ~2^31 words past the buffer, and no robustness feature is enabled
+#define FIELD_LOAD(A, i) field_half(A[min(uint(max(int(i), 0)) >> 1, uint(A.length()) - 1u)], uint(max(int(i), 0)))
+
+// Another invocation may write the other half of the word, so the word is swapped in atomically
+#define FIELD_STORE(A, i, v) do {                                                   \
+    uint fieldIndex = uint(i);                                                      \
+    float fieldValue = float(v);                                                    \
+    uint fieldOld = A[fieldIndex >> 1];                                             \
+    for (;;) {                                                                      \
+        uint fieldNew = field_set_half(fieldOld, fieldIndex, fieldValue);           \
+        uint fieldSeen = atomicCompSwap(A[fieldIndex >> 1], fieldOld, fieldNew);    \
+        if (fieldSeen == fieldOld) break;                                           \
+        fieldOld = fieldSeen;                                                       \
+    }                                                                               \
+} while (false)
+
+#elif defined(CFD_FIELD_F16)
+
+#extension GL_EXT_shader_16bit_storage : require
+
+#define FIELD_T float16_t
+#define FIELD_LOAD(A, i) float(A[i])
+#define FIELD_STORE(A, i, v) A[i] = float16_t(float(v))
+
+#else
+
+#define FIELD_T float
+#define FIELD_LOAD(A, i) A[i]
+#define FIELD_STORE(A, i, v) A[i] = (v)
+
+#endif
@@ -0,0 +1,21 @@
+// Encoding of the visualisation volume, written by writeTexture/applyDensitySources at binding 13 and
+// sampled as volumeTex by rayTrace.frag. Two channels, density and vertical speed, normalised to [0, 1]
+// so every format Cfd can create the volume in (rg32f, rg16f, rg8) stores the same values. The compute
+// kernels declare the image without a format, the store converts to the one it was created with.
+
+const float VOLUME_DENSITY_RANGE = 10.0; // densities above saturate in the 8-bit format
+const float VOLUME_SPEED_RANGE = 10.0;   // |vy| above saturates
+
+vec4 encode_volume(float density, float vy) {
+    return vec4(density / VOLUME_DENSITY_RANGE, vy / (2.0 * VOLUME_SPEED_RANGE) + 0.5, 0.0, 0.0);
+}
+
+// density, vy
+vec2 decode_volume(vec4 texel) {
+    return vec2(texel.r * VOLUME_DENSITY_RANGE, (texel.g - 0.5) * 2.0 * VOLUME_SPEED_RANGE);
+}
+
+// Occupancy grid for empty space skipping: one texel per brick of VOLUME_BRICK_SIZE^3 cells holding the
+// largest |density| the volume can be sampled at inside it (buildOccupancy.comp). Matches VOLUME_BRICK_SIZE in cfd.h.
+const int VOLUME_BRICK_SIZE = 8;
+const float VOLUME_EMPTY_DENSITY = 1e-3; // bricks below contribute nothing visible and are skipped
@@ -0,0 +1,227 @@
+#include "solver.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+std::vector<float> init_scalars(size_t gridsize, float base_val) {
+    std::vector<float> scalars(gridsize * gridsize * gridsize);
+    for (size_t i = 0; i < scalars.size(); i += 1) {
+        scalars[i] = base_val;
+    }
+    return scalars;
+}
+
+std::vector<float> init_vels(size_t gridsize, float base_val) {
+    std::vector<float> scalars((gridsize+1) * gridsize * gridsize);
+    for (size_t i = 0; i < scalars.size(); i += 1) {
+        scalars[i] = base_val;
+    }
+    return scalars;
+}
+
+std::vector<float> init_boundaries(int gridSize) {
+    std::vector<float> scalars(gridSize * gridSize * gridSize);
+    for (int i = 0; i < scalars.size(); i += 1) {
+        int x = i % gridSize;
+        int y = (i / gridSize) % gridSize;
+        int z = i / (gridSize * gridSize);
+        if (x % (gridSize) == 0 || y % (gridSize) == 0 || z % (gridSize) == 0) {
+            scalars[i] = 0.0;
+        } else {
+            scalars[i] = 1.0;
+        }
+    }
+    return scalars;
+}
+
+void stamp_terrain_boundaries(std::vector<float>& boundaries, unsigned int res,
+                              const TerrainMap& terrain, float heightScale)
+{
+    int boundarySize = res + 2;
+
+    // Columns run along x and rows along z
+    float terrainStepX = terrain.cols() / float(res);
+    float terrainStepY = terrain.rows() / float(res);
+
+    for (int i = 0; i < boundaries.size(); i += 1) {
+        int x = i % boundarySize;
+        int y = (i / boundarySize) % boundarySize;
+        int z = i / (boundarySize * boundarySize);
+
+        if (x > 0 && x < res+1 && z > 0 && z < res+1) {
+            int terrainX = (x-1) * terrainStepX;
+            int terrainZ = (z-1) * terrainStepY;
+
+            float terrainHeight = terrain.height(terrainZ, terrainX)*heightScale;
+
+            if (boundarySize - y >= terrainHeight*boundarySize) {
+                boundaries[i] = 1.0;
+            } else {
+                boundaries[i] = 0.0;
+            }
+        }
+    }
+
+    for (int i=0; i<res+2; i++)
+    {
+        boundaries[(res+2)*(res+2)*(res/2+1) + (res+2)*(i) + (0+1)] = 0.0f;
+    }
+}
+
+BoundaryPrimitive boundary_box(int x0, int y0, int z0, int x1, int y1, int z1)
+{
+    BoundaryPrimitive primitive;
+    primitive.shape = BoundaryShape::Box;
+    primitive.lo[0] = x0; primitive.lo[1] = y0; primitive.lo[2] = z0;
+    primitive.hi[0] = x1; primitive.hi[1] = y1; primitive.hi[2] = z1;
+    return primitive;
+}
+
+BoundaryPrimitive boundary_cylinder(int axis, float centreU, float centreV, float radius, int axisLo, int axisHi)
+{
+    if (axis < 0 || axis > 2) {
+        throw std::runtime_error("boundary_cylinder: axis must be 0, 1 or 2");
+    }
+
+    BoundaryPrimitive primitive;
+    primitive.shape = BoundaryShape::Cylinder;
+    primitive.axis = axis;
+    primitive.centre[0] = centreU;
+    primitive.centre[1] = centreV;
+    primitive.radius = radius;
+
+    int other = 0;
+    for (int a = 0; a < 3; a++) {
+        if (a == axis) {
+            primitive.lo[a] = axisLo;
+            primitive.hi[a] = axisHi;
+        } else {
+            const float centre = primitive.centre[other++];
+            primitive.lo[a] = int(std::floor(centre - radius));
+            primitive.hi[a] = int(std::floor(centre + radius)) + 1;
+        }
+    }
+    return primitive;
+}
+
+BoundaryPrimitive boundary_heightfield(int x0, int z0, uint32_t cols, uint32_t rows, std::vector<float> heights,
+                                       float heightScale)
+{
+    if (heights.size() != size_t(cols) * rows) {
+        throw std::runtime_error("boundary_heightfield: expected " + std::to_string(size_t(cols) * rows) +
+                                 " heights, got " + std::to_string(heights.size()));
+    }
+
+    BoundaryPrimitive primitive;
+    primitive.shape = BoundaryShape::Heightfield;
+    primitive.lo[0] = x0; primitive.lo[1] = 0; primitive.lo[2] = z0;
+    primitive.hi[0] = x0 + int(cols); primitive.hi[1] = 0; primitive.hi[2] = z0 + int(rows);
+    primitive.heights = std::move(heights);
+    primitive.heightScale = heightScale;
+    return primitive;
+}
+
+bool boundary_primitive_bounds(const BoundaryPrimitive& primitive, unsigned int res, int32_t lo[3], int32_t hi[3])
+{
+    const int boundarySize = res + 2;
+    for (int a = 0; a < 3; a++) {
+        lo[a] = primitive.lo[a];
+        hi[a] = primitive.hi[a];
+    }
+
+    if (primitive.shape == BoundaryShape::Heightfield) {
+        // Only the cells below the highest column can be covered
+        float top = 0.0f;
+        for (float h : primitive.heights) {
+            top = std::max(top, h * primitive.heightScale);
+        }
+        lo[1] = int(std::floor(boundarySize * (1.0f - top)));
+        hi[1] = boundarySize;
+    }
+
+    bool any = true;
+    for (int a = 0; a < 3; a++) {
+        lo[a] = std::max(lo[a], 1);
+        hi[a] = std::min(hi[a], int32_t(res) + 1);
+        any = any && lo[a] < hi[a];
+    }
+    return any;
+}
+
+void stamp_boundary_primitive(std::vector<float>& boundaries, unsigned int res, const BoundaryPrimitive& primitive)
+{
+    const int boundarySize = res + 2;
+    if (primitive.shape == BoundaryShape::Heightfield &&
+        primitive.heights.size() != size_t(primitive.hi[0] - primitive.lo[0]) * (primitive.hi[2] - primitive.lo[2])) {
+        throw std::runtime_error("stamp_boundary_primitive: heightfield size does not match its box");
+    }
+
+    int32_t lo[3], hi[3];
+    if (!boundary_primitive_bounds(primitive, res, lo, hi)) {
+        return;
+    }
+
+    // The two axes across a cylinder
+    const int u = primitive.axis == 0 ? 1 : 0;
+    const int v = primitive.axis == 2 ? 1 : 2;
+
+    for (int z = lo[2]; z < hi[2]; z++) {
+        for (int y = lo[1]; y < hi[1]; y++) {
+            for (int x = lo[0]; x < hi[0]; x++) {
+                const int p[3] = {x, y, z};
+                bool covered = true;
+                if (primitive.shape == BoundaryShape::Cylinder) {
+                    float du = float(p[u]) - primitive.centre[0];
+                    float dv = float(p[v]) - primitive.centre[1];
+                    covered = du * du + dv * dv < primitive.radius * primitive.radius;
+                } else if (primitive.shape == BoundaryShape::Heightfield) {
+                    size_t column = size_t(z - primitive.lo[2]) * (primitive.hi[0] - primitive.lo[0]) + (x - primitive.lo[0]);
+                    float height = primitive.heights[column] * primitive.heightScale;
+                    // The complement of the fluid test in stamp_terrain_boundaries
+                    covered = float(boundarySize - y) < height * float(boundarySize);
+                }
+                if (covered) {
+                    boundaries[size_t(z) * boundarySize * boundarySize + size_t(y) * boundarySize + x] = primitive.value;
+                }
+            }
+        }
+    }
+}
+
+CfdState make_default_state(unsigned int res)
+{
+    CfdState state;
+    state.res = res;
+
+    state.vx = init_vels(res, 0.0f);
+    state.vy = init_vels(res, 0.0f);
+    state.vz = init_vels(res, 0.0f);
+    state.density = init_scalars(res, 0.0f);
+    state.pressure = init_scalars(res, 0.0f);
+    state.boundaries = init_boundaries(res+2);
+
+    // Inflow wall of vx = 10 on the x = 0 face
+    int boarder = 1;
+    for (int z=0; z<res-2*boarder; z++) {
+        for (int y=0; y<res-2*boarder; y++) {
+            uint32_t cell = res*res*(z+boarder) + res*(y+boarder);
+            state.velocitySources.push_back({cell, 10.0f, 0.0f, 0.0f});
+        }
+    }
+
+    // 3D lattice of smoke sources
+    int nStreams3D = 6;
+    int streamSize3D = res / nStreams3D;
+    for (int i=3; i<nStreams3D; i++) {
+        for (int j=1; j<nStreams3D; j++) {
+            for (int k=1; k<nStreams3D; k++) {
+                uint32_t cell = res*res*(k*streamSize3D) + res*i*streamSize3D + j*streamSize3D;
+                state.density[cell] = 10.0f;
+                state.densitySources.push_back({cell, 10.0f});
+            }
+        }
+    }
+
+    return state;
+}
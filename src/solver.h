@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "terrain_file.h"
+
+// Sparse sources, applied by their own small dispatch instead of being read by every cell.
+// Layouts match the GLSL structs in the source shaders (std430).
+struct VelocitySource {
+    uint32_t cell; // linear cell index, x fastest
+    float vx, vy, vz; // imposed on all six faces of the cell as half of each component
+};
+
+struct DensitySource {
+    uint32_t cell;
+    float value; // density the cell is pinned to after every advection
+};
+
+// Host copy of the complete solver state, shared by every backend.
+// Layouts match the device buffers: velocities are staggered ((res+1)*res*res, x fastest),
+// cell fields are res^3, the boundary mask has a one cell ghost layer ((res+2)^3, 1 = fluid, 0 = solid) and
+// sources are lists of cells.
+struct CfdState {
+    unsigned int res = 0;
+
+    std::vector<float> vx;
+    std::vector<float> vy;
+    std::vector<float> vz;
+
+    std::vector<float> density;
+    std::vector<float> pressure;
+    std::vector<float> boundaries;
+
+    std::vector<VelocitySource> velocitySources;
+    std::vector<DensitySource> densitySources;
+};
+
+// Default red-black Gauss-Seidel sweeps per step, half of them per colour
+const int CFD_PROJECTION_SWEEPS = 50;
+
+// Common interface for the Vulkan solver and the CPU reference backend
+class CfdSolver {
+protected:
+    int _projectionSweeps = CFD_PROJECTION_SWEEPS;
+
+public:
+    virtual ~CfdSolver() = default;
+
+    virtual void set_projection_sweeps(int sweeps) { _projectionSweeps = sweeps; }
+    int projection_sweeps() const { return _projectionSweeps; }
+
+    virtual void upload_state(const CfdState& state) = 0;
+    // One full step: the projection sweeps, velocity advection twice, density advection twice
+    virtual void step() = 0;
+    virtual void download_state(CfdState& state) = 0;
+
+    virtual const char* name() const = 0;
+};
+
+std::vector<float> init_scalars(size_t gridsize, float base_val);
+std::vector<float> init_vels(size_t gridsize, float base_val);
+std::vector<float> init_boundaries(int gridSize);
+
+// Mark every boundary cell below the heightmap as solid
+void stamp_terrain_boundaries(std::vector<float>& boundaries, unsigned int res,
+                              const TerrainMap& terrain, float heightScale);
+
+enum class BoundaryShape : int32_t {
+    Box,
+    Cylinder,
+    Heightfield
+};
+
+// An obstacle stamped into the boundary mask, in cells of the (res+2)^3 mask, so the interior runs from 1 to
+// res. Stamps write value to the cells they cover and are clipped to the interior, the ghost layer stays.
+struct BoundaryPrimitive {
+    BoundaryShape shape = BoundaryShape::Box;
+    float value = 0.0f;         // 0 makes the cells solid, 1 opens them to the flow
+    int32_t lo[3] = {0, 0, 0};  // box of cells (x, y, z) the primitive covers, hi exclusive
+    int32_t hi[3] = {0, 0, 0};
+    // Cylinder: runs along axis (0 = x, 1 = y, 2 = z) over the box, cells closer than radius to
+    // centre (the coordinates on the other two axes, in x, y, z order) are covered
+    int32_t axis = 1;
+    float centre[2] = {0.0f, 0.0f};
+    float radius = 0.0f;
+    // Heightfield: one height per column of the box, row per z, in the units stamp_terrain_boundaries
+    // takes; cells below a column's height are covered, the box's y range is ignored
+    std::vector<float> heights;
+    float heightScale = 1.0f;
+};
+
+// Cells lo <= p < hi
+BoundaryPrimitive boundary_box(int x0, int y0, int z0, int x1, int y1, int z1);
+// A mast along axis from axisLo to axisHi, e.g. axis 1 for a vertical one centred on (x, z)
+BoundaryPrimitive boundary_cylinder(int axis, float centreU, float centreV, float radius, int axisLo, int axisHi);
+// cols x rows heights over the columns from (x0, z0), row major with z
+BoundaryPrimitive boundary_heightfield(int x0, int z0, uint32_t cols, uint32_t rows, std::vector<float> heights,
+                                       float heightScale);
+
+// Cells of the mask the primitive can change, clipped to the interior of a res grid; false when none
+bool boundary_primitive_bounds(const BoundaryPrimitive& primitive, unsigned int res, int32_t lo[3], int32_t hi[3]);
+// Host reference of Cfd::stamp_boundary, touches only the cells inside the bounds
+void stamp_boundary_primitive(std::vector<float>& boundaries, unsigned int res, const BoundaryPrimitive& primitive);
+
+// The scenario the viewer starts with: an inflow wall on x = 0 and a lattice of smoke sources
+CfdState make_default_state(unsigned int res);
@@ -0,0 +1,292 @@
+#include "terrain_cache.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+
+#include <unistd.h>
+
+namespace {
+
+const uint64_t PRIME1 = 0x9E3779B185EBCA87ull;
+const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4Full;
+const uint64_t PRIME3 = 0x165667B19E3779F9ull;
+const uint64_t PRIME4 = 0x85EBCA77C2B2AE63ull;
+const uint64_t PRIME5 = 0x27D4EB2F165667C5ull;
+
+// Bytes of the file hashed per task
+const size_t HASH_CHUNK_BYTES = 16 << 20;
+
+inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+inline uint64_t read64(const unsigned char* p)
+{
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t read32(const unsigned char* p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+inline uint64_t hash_merge(uint64_t acc, uint64_t lane)
+{
+    acc ^= hash_round(0, lane);
+    return acc * PRIME1 + PRIME4;
+}
+
+size_t align_up(size_t offset) { return (offset + TERRAIN_CACHE_ALIGNMENT - 1) / TERRAIN_CACHE_ALIGNMENT * TERRAIN_CACHE_ALIGNMENT; }
+
+} // namespace
+
+uint64_t hash_bytes(const void* data, size_t size, uint64_t seed)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    const unsigned char* end = p + size;
+    uint64_t h;
+
+    if (size >= 32) {
+        // Four independent lanes keep the multipliers busy
+        uint64_t v1 = seed + PRIME1 + PRIME2;
+        uint64_t v2 = seed + PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME1;
+        const unsigned char* limit = end - 32;
+        do {
+            v1 = hash_round(v1, read64(p));
+            v2 = hash_round(v2, read64(p + 8));
+            v3 = hash_round(v3, read64(p + 16));
+            v4 = hash_round(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = hash_merge(h, v1);
+        h = hash_merge(h, v2);
+        h = hash_merge(h, v3);
+        h = hash_merge(h, v4);
+    } else {
+        h = seed + PRIME5;
+    }
+
+    h += uint64_t(size);
+    for (; p + 8 <= end; p += 8) {
+        h ^= hash_round(0, read64(p));
+        h = rotl(h, 27) * PRIME1 + PRIME4;
+    }
+    if (p + 4 <= end) {
+        h ^= uint64_t(read32(p)) * PRIME1;
+        h = rotl(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= uint64_t(*p) * PRIME5;
+        h = rotl(h, 11) * PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t hash_file(const std::string& filename, unsigned int threads)
+{
+    MappedFile file(filename);
+    if (file.empty()) {
+        return hash_bytes(nullptr, 0);
+    }
+
+    // Chunks are hashed independently and the list of their hashes is hashed again, so the result does
+    // not depend on the thread count
+    const size_t chunks = (file.size() + HASH_CHUNK_BYTES - 1) / HASH_CHUNK_BYTES;
+    std::vector<uint64_t> chunkHashes(chunks);
+    ThreadPool pool(std::min<size_t>(threads ? threads : std::thread::hardware_concurrency(), chunks));
+    pool.parallel_for(0, chunks, 1, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; c++) {
+            const size_t offset = c * HASH_CHUNK_BYTES;
+            chunkHashes[c] = hash_bytes(file.data() + offset, std::min(HASH_CHUNK_BYTES, file.size() - offset), c);
+        }
+    });
+    return hash_bytes(chunkHashes.data(), chunkHashes.size() * sizeof(uint64_t), file.size());
+}
+
+uint64_t TerrainCacheKey::digest() const
+{
+    uint32_t heightBits;
+    std::memcpy(&heightBits, &heightScale, sizeof(heightBits));
+    const uint32_t fields[] = {
+        TERRAIN_CACHE_VERSION,
+        uint32_t(source), uint32_t(source >> 32),
+        res, heightBits, fieldStorage, meshStorage, reduction, bilinear
+    };
+    return hash_bytes(fields, sizeof(fields));
+}
+
+void TerrainCacheWriter::add(TerrainCacheSection section, const void* data, size_t size)
+{
+    _data[size_t(section)] = data;
+    _size[size_t(section)] = size;
+}
+
+void TerrainCacheWriter::add_copy(TerrainCacheSection section, const void* data, size_t size)
+{
+    std::vector<char>& copy = _copies[size_t(section)];
+    copy.assign(static_cast<const char*>(data), static_cast<const char*>(data) + size);
+    add(section, copy.data(), copy.size());
+}
+
+void TerrainCacheWriter::add_terrain(const TerrainMap& terrain)
+{
+    TerrainHeader header = terrain.header();
+    header.sampleType = uint32_t(TerrainSampleType::Float32);
+    header.heightOffset = 0.0f;
+    header.heightScale = 1.0f;
+    header.dataOffset = sizeof(TerrainHeader);
+
+    std::vector<float> samples = terrain.to_floats();
+    std::vector<char> bytes(sizeof(TerrainHeader) + samples.size() * sizeof(float));
+    std::memcpy(bytes.data(), &header, sizeof(header));
+    std::memcpy(bytes.data() + sizeof(header), samples.data(), samples.size() * sizeof(float));
+    _copies[size_t(TerrainCacheSection::Heights)] = std::move(bytes);
+    add(TerrainCacheSection::Heights, _copies[size_t(TerrainCacheSection::Heights)].data(),
+        _copies[size_t(TerrainCacheSection::Heights)].size());
+}
+
+const void* TerrainCacheEntry::data(TerrainCacheSection section) const
+{
+    if (empty() || header().sections[size_t(section)].size == 0) {
+        return nullptr;
+    }
+    return _file.data() + header().sections[size_t(section)].offset;
+}
+
+size_t TerrainCacheEntry::size(TerrainCacheSection section) const
+{
+    return empty() ? 0 : size_t(header().sections[size_t(section)].size);
+}
+
+TerrainMap TerrainCacheEntry::terrain() const
+{
+    if (size(TerrainCacheSection::Heights) < sizeof(TerrainHeader)) {
+        throw std::runtime_error("Terrain cache entry holds no heightmap");
+    }
+
+    TerrainHeader header;
+    std::memcpy(&header, data(TerrainCacheSection::Heights), sizeof(header));
+    const size_t count = size_t(header.rows) * header.cols;
+    if (size(TerrainCacheSection::Heights) != sizeof(TerrainHeader) + count * sizeof(float)) {
+        throw std::runtime_error("Terrain cache heightmap does not match its header");
+    }
+
+    std::vector<float> samples(count);
+    std::memcpy(samples.data(), static_cast<const char*>(data(TerrainCacheSection::Heights)) + sizeof(header),
+                count * sizeof(float));
+    return TerrainMap::from_samples(header, std::move(samples));
+}
+
+std::string TerrainCache::path(uint64_t key) const
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016" PRIx64 ".rtcache", key);
+    return (std::filesystem::path(_directory) / name).string();
+}
+
+TerrainCacheEntry TerrainCache::find(uint64_t key) const
+{
+    TerrainCacheEntry entry;
+    const std::string filename = path(key);
+    if (!std::filesystem::exists(filename)) {
+        return entry;
+    }
+
+    MappedFile file(filename);
+    if (file.size() < sizeof(TerrainCacheHeader)) {
+        return entry;
+    }
+    const TerrainCacheHeader& header = *reinterpret_cast<const TerrainCacheHeader*>(file.data());
+    if (std::memcmp(header.magic, TERRAIN_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != TERRAIN_CACHE_VERSION || header.key != key ||
+        header.sectionCount != uint32_t(TerrainCacheSection::Count)) {
+        return entry;
+    }
+    for (const auto& section : header.sections) {
+        if (section.offset > file.size() || section.size > file.size() - section.offset) {
+            return entry;
+        }
+    }
+
+    entry._file = std::move(file);
+    return entry;
+}
+
+TerrainCacheEntry TerrainCache::store(uint64_t key, const TerrainCacheWriter& writer) const
+{
+    std::filesystem::create_directories(_directory);
+
+    TerrainCacheHeader header{};
+    std::memcpy(header.magic, TERRAIN_CACHE_MAGIC, sizeof(header.magic));
+    header.version = TERRAIN_CACHE_VERSION;
+    header.sectionCount = uint32_t(TerrainCacheSection::Count);
+    header.key = key;
+
+    size_t offset = align_up(sizeof(TerrainCacheHeader));
+    for (size_t s = 0; s < size_t(TerrainCacheSection::Count); s++) {
+        const size_t size = writer.size(TerrainCacheSection(s));
+        header.sections[s].offset = size ? offset : 0;
+        header.sections[s].size = size;
+        offset = align_up(offset + size);
+    }
+
+    // Unique per process, two runs filling the same entry each write their own file and the last rename wins
+    const std::string filename = path(key);
+    const std::string temporary = filename + "." + std::to_string(getpid()) + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary);
+        if (!file.is_open()) {
+            throw std::runtime_error("Failed to open file for writing: " + temporary);
+        }
+
+        const char padding[TERRAIN_CACHE_ALIGNMENT] = {};
+        size_t written = sizeof(header);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (size_t s = 0; s < size_t(TerrainCacheSection::Count); s++) {
+            if (header.sections[s].size == 0) {
+                continue;
+            }
+            file.write(padding, std::streamsize(header.sections[s].offset - written));
+            file.write(static_cast<const char*>(writer.data(TerrainCacheSection(s))), std::streamsize(header.sections[s].size));
+            written = header.sections[s].offset + header.sections[s].size;
+        }
+
+        if (!file) {
+            file.close();
+            std::remove(temporary.c_str());
+            throw std::runtime_error("Failed to write file: " + temporary);
+        }
+    }
+
+    try {
+        std::filesystem::rename(temporary, filename);
+    } catch (...) {
+        std::remove(temporary.c_str());
+        throw;
+    }
+    return find(key);
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "terrain_file.h"
+
+// On disk cache of everything load_terrain_model derives from a terrain file: the heightmap as open_terrain
+// read it (point clouds gridded and larger text grids averaged down to the solver resolution, binary maps
+// at their own size), the boundary mask as the device stores it and the terrain mesh buffers. Entries are named by a hash of the
+// terrain file's contents and of every setting the derived data depends on, so a changed file or setting
+// simply misses and stale entries are never read. A hit is mapped rather than parsed, the mask is staged
+// for upload straight from the mapping.
+const char TERRAIN_CACHE_MAGIC[8] = {'R', 'T', 'C', 'A', 'C', 'H', 'E', '\0'};
+// Bump whenever a section's layout or the code producing it changes, old entries then stop matching
+const uint32_t TERRAIN_CACHE_VERSION = 2;
+const char TERRAIN_CACHE_DIR[] = "Data/cache";
+
+enum class TerrainCacheSection : uint32_t {
+    Heights,      // the heightmap open_terrain read, a TerrainHeader followed by Float32 samples
+    Boundaries,   // (res + 2)^3 mask values in the field storage format
+    LodInfo,      // TerrainLod's own header
+    LodNodes,
+    LodVertices,
+    LodTexels,
+    LodIndices,
+    Count
+};
+
+struct TerrainCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t sectionCount;  // TerrainCacheSection::Count when written
+    uint64_t key;
+    struct {
+        uint64_t offset;    // from the start of the file, a multiple of TERRAIN_CACHE_ALIGNMENT
+        uint64_t size;      // 0 for a section the entry does not hold
+    } sections[size_t(TerrainCacheSection::Count)];
+};
+
+const size_t TERRAIN_CACHE_ALIGNMENT = 64;
+
+// 64-bit hash of a byte range (xxHash64)
+uint64_t hash_bytes(const void* data, size_t size, uint64_t seed = 0);
+// Hash of a file's contents, mapped and hashed in chunks on threads (0 uses every hardware thread)
+uint64_t hash_file(const std::string& filename, unsigned int threads = 0);
+
+// Everything a cache entry depends on besides the code, which TERRAIN_CACHE_VERSION stands for
+struct TerrainCacheKey {
+    uint64_t source = 0;        // hash_file of the terrain file
+    uint32_t res = 0;           // solver grid, also the size point clouds and text grids are read at
+    float heightScale = 1.0f;
+    uint32_t fieldStorage = 0;  // FieldStorage of the mask
+    uint32_t meshStorage = 0;   // TerrainLod::Storage
+    uint32_t reduction = 0;     // PointReduction, for point clouds
+    uint32_t bilinear = 0;      // the voxeliser filters heights between samples
+
+    uint64_t digest() const;
+};
+
+// Sections to write. add does not copy, the data has to outlive TerrainCache::store.
+class TerrainCacheWriter {
+public:
+    void add(TerrainCacheSection section, const void* data, size_t size);
+    void add_copy(TerrainCacheSection section, const void* data, size_t size);
+    // Copies the samples as the Heights section
+    void add_terrain(const TerrainMap& terrain);
+
+    const void* data(TerrainCacheSection section) const { return _data[size_t(section)]; }
+    size_t size(TerrainCacheSection section) const { return _size[size_t(section)]; }
+
+private:
+    const void* _data[size_t(TerrainCacheSection::Count)] = {};
+    size_t _size[size_t(TerrainCacheSection::Count)] = {};
+    std::vector<char> _copies[size_t(TerrainCacheSection::Count)];
+};
+
+// A mapped cache file, empty on a miss
+class TerrainCacheEntry {
+public:
+    TerrainCacheEntry() = default;
+
+    bool empty() const { return _file.empty(); }
+    // Bytes of a section, nullptr and 0 when the entry does not hold it
+    const void* data(TerrainCacheSection section) const;
+    size_t size(TerrainCacheSection section) const;
+    // Copy of a section as an array of T, throws when the size is not a whole number of them
+    template <typename T>
+    std::vector<T> array(TerrainCacheSection section) const
+    {
+        if (size(section) % sizeof(T) != 0) {
+            throw std::runtime_error("Terrain cache section " + std::to_string(uint32_t(section)) + " has a partial element");
+        }
+        std::vector<T> values(size(section) / sizeof(T));
+        if (!values.empty()) {
+            std::memcpy(values.data(), data(section), size(section));
+        }
+        return values;
+    }
+    // The Heights section as an in memory map
+    TerrainMap terrain() const;
+
+private:
+    friend class TerrainCache;
+    MappedFile _file;
+
+    const TerrainCacheHeader& header() const { return *reinterpret_cast<const TerrainCacheHeader*>(_file.data()); }
+};
+
+class TerrainCache {
+public:
+    explicit TerrainCache(std::string directory = TERRAIN_CACHE_DIR) : _directory(std::move(directory)) {}
+
+    const std::string& directory() const { return _directory; }
+    std::string path(uint64_t key) const;
+    // Empty when there is no entry, or it is truncated or from another version
+    TerrainCacheEntry find(uint64_t key) const;
+    // Writes the entry next to its final name and renames it into place, so a concurrent or interrupted
+    // run never sees half a file, then maps it
+    TerrainCacheEntry store(uint64_t key, const TerrainCacheWriter& writer) const;
+
+private:
+    std::string _directory;
+};
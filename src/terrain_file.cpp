@@ -0,0 +1,282 @@
+#include "terrain_file.h"
+#include "terrain_ingest.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+size_t sample_bytes(uint32_t sampleType)
+{
+    switch (TerrainSampleType(sampleType)) {
+    case TerrainSampleType::Float32: return sizeof(float);
+    case TerrainSampleType::UInt16: return sizeof(uint16_t);
+    }
+    throw std::runtime_error("Unknown terrain sample type " + std::to_string(sampleType));
+}
+
+} // namespace
+
+bool has_extension(const std::string& filename, const char* extension)
+{
+    size_t dot = filename.find_last_of('.');
+    if (dot == std::string::npos) {
+        return false;
+    }
+    std::string ext = filename.substr(dot + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](char c) { return char(std::tolower(c)); });
+    return ext == extension;
+}
+
+TerrainHeader make_terrain_header(uint32_t rows, uint32_t cols, TerrainSampleType sampleType)
+{
+    TerrainHeader header{};
+    std::memcpy(header.magic, TERRAIN_FILE_MAGIC, sizeof(header.magic));
+    header.version = TERRAIN_FILE_VERSION;
+    header.sampleType = uint32_t(sampleType);
+    header.cols = cols;
+    header.rows = rows;
+    header.spacingX = 1.0;
+    header.spacingY = 1.0;
+    header.heightOffset = 0.0f;
+    header.heightScale = 1.0f;
+    header.dataOffset = sizeof(TerrainHeader);
+    return header;
+}
+
+MappedFile::MappedFile(const std::string& filename)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open file: " + filename);
+    }
+
+    struct stat info{};
+    if (fstat(fd, &info) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Failed to stat file: " + filename);
+    }
+
+    // An empty file stays unmapped, mmap rejects a length of 0
+    if (info.st_size > 0) {
+        void* data = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("Failed to map file: " + filename);
+        }
+        _data = data;
+        _size = size_t(info.st_size);
+    }
+    // The mapping holds its own reference to the file
+    ::close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (_data) {
+        munmap(_data, _size);
+    }
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+    : _data(other._data), _size(other._size)
+{
+    other._data = nullptr;
+    other._size = 0;
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept
+{
+    if (this != &other) {
+        if (_data) {
+            munmap(_data, _size);
+        }
+        _data = other._data;
+        _size = other._size;
+        other._data = nullptr;
+        other._size = 0;
+    }
+    return *this;
+}
+
+TerrainMap::~TerrainMap()
+{
+    release();
+}
+
+TerrainMap::TerrainMap(TerrainMap&& other) noexcept
+{
+    *this = std::move(other);
+}
+
+TerrainMap& TerrainMap::operator=(TerrainMap&& other) noexcept
+{
+    if (this != &other) {
+        release();
+        // Moving the vector keeps its buffer, so _floats stays valid when it points into _owned
+        _header = other._header;
+        _floats = other._floats;
+        _shorts = other._shorts;
+        _owned = std::move(other._owned);
+        _file = std::move(other._file);
+
+        other._header = {};
+        other._floats = nullptr;
+        other._shorts = nullptr;
+    }
+    return *this;
+}
+
+void TerrainMap::release()
+{
+    _file = MappedFile();
+    _owned.clear();
+    _floats = nullptr;
+    _shorts = nullptr;
+}
+
+TerrainMap TerrainMap::from_samples(const TerrainHeader& header, std::vector<float> samples)
+{
+    if (samples.size() != size_t(header.rows) * header.cols) {
+        throw std::runtime_error("TerrainMap: sample count does not match the dimensions");
+    }
+
+    TerrainMap map;
+    map._header = header;
+    map._header.sampleType = uint32_t(TerrainSampleType::Float32);
+    map._owned = std::move(samples);
+    map._floats = map._owned.data();
+    return map;
+}
+
+TerrainMap TerrainMap::open(const std::string& filename, const TerrainIngestOptions& options)
+{
+    MappedFile file(filename);
+    if (file.size() < sizeof(TERRAIN_FILE_MAGIC) ||
+        std::memcmp(file.data(), TERRAIN_FILE_MAGIC, sizeof(TERRAIN_FILE_MAGIC)) != 0) {
+        TerrainMap map = ingest_terrain_text(file.data(), file.size(), filename, options);
+        // Every consumer indexes the samples, an empty grid has none to index
+        if (map.rows() == 0 || map.cols() == 0) {
+            throw std::runtime_error(filename + " holds no samples");
+        }
+        return map;
+    }
+    if (file.size() < sizeof(TerrainHeader)) {
+        throw std::runtime_error(filename + ": truncated terrain header");
+    }
+
+    TerrainMap map;
+    std::memcpy(&map._header, file.data(), sizeof(TerrainHeader));
+
+    const TerrainHeader& header = map._header;
+    if (header.version != TERRAIN_FILE_VERSION) {
+        throw std::runtime_error(filename + ": terrain file version " + std::to_string(header.version) +
+                                 ", expected " + std::to_string(TERRAIN_FILE_VERSION));
+    }
+    if (header.rows == 0 || header.cols == 0) {
+        throw std::runtime_error(filename + " holds no samples");
+    }
+    size_t bytes = sample_bytes(header.sampleType);
+    if (header.dataOffset < sizeof(TerrainHeader) || header.dataOffset % bytes != 0 ||
+        header.dataOffset + size_t(header.rows) * header.cols * bytes > file.size()) {
+        throw std::runtime_error(filename + ": terrain samples do not fit the file");
+    }
+
+    // Samples are read in row order, mostly once, by the voxeliser and mesh builders
+    madvise(const_cast<char*>(file.data()), file.size(), MADV_SEQUENTIAL);
+
+    const char* data = file.data() + header.dataOffset;
+    if (TerrainSampleType(header.sampleType) == TerrainSampleType::Float32) {
+        map._floats = reinterpret_cast<const float*>(data);
+    } else {
+        map._shorts = reinterpret_cast<const uint16_t*>(data);
+    }
+    map._file = std::move(file);
+    return map;
+}
+
+void TerrainMap::height_range(float& min, float& max) const
+{
+    min = INFINITY;
+    max = -INFINITY;
+    size_t count = size_t(rows()) * cols();
+    if (_floats) {
+        for (size_t i = 0; i < count; i++) {
+            min = std::min(min, _floats[i]);
+            max = std::max(max, _floats[i]);
+        }
+    } else if (_shorts && count > 0) {
+        auto [lo, hi] = std::minmax_element(_shorts, _shorts + count);
+        min = _header.heightOffset + _header.heightScale * *lo;
+        max = _header.heightOffset + _header.heightScale * *hi;
+    }
+}
+
+std::vector<float> TerrainMap::to_floats() const
+{
+    size_t count = size_t(rows()) * cols();
+    if (_floats) {
+        return std::vector<float>(_floats, _floats + count);
+    }
+
+    std::vector<float> heights(count);
+    for (size_t i = 0; i < count; i++) {
+        heights[i] = _header.heightOffset + _header.heightScale * _shorts[i];
+    }
+    return heights;
+}
+
+void write_terrain_file(const std::string& filename, const TerrainHeader& header, const std::vector<float>& heights)
+{
+    if (heights.size() != size_t(header.rows) * header.cols) {
+        throw std::runtime_error("write_terrain_file: sample count does not match the header");
+    }
+
+    TerrainHeader out = header;
+    std::memcpy(out.magic, TERRAIN_FILE_MAGIC, sizeof(out.magic));
+    out.version = TERRAIN_FILE_VERSION;
+    out.dataOffset = sizeof(TerrainHeader);
+
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Failed to open file for writing: " + filename);
+    }
+
+    if (TerrainSampleType(out.sampleType) == TerrainSampleType::Float32) {
+        file.write(reinterpret_cast<const char*>(&out), sizeof(out));
+        file.write(reinterpret_cast<const char*>(heights.data()), heights.size() * sizeof(float));
+    } else if (TerrainSampleType(out.sampleType) == TerrainSampleType::UInt16) {
+        float min = INFINITY;
+        float max = -INFINITY;
+        for (float h : heights) {
+            min = std::min(min, h);
+            max = std::max(max, h);
+        }
+        out.heightOffset = heights.empty() ? 0.0f : min;
+        out.heightScale = max > min ? (max - min) / 65535.0f : 1.0f;
+
+        std::vector<uint16_t> samples(heights.size());
+        for (size_t i = 0; i < heights.size(); i++) {
+            float normalized = (heights[i] - out.heightOffset) / out.heightScale;
+            samples[i] = uint16_t(std::lround(std::clamp(normalized, 0.0f, 65535.0f)));
+        }
+        file.write(reinterpret_cast<const char*>(&out), sizeof(out));
+        file.write(reinterpret_cast<const char*>(samples.data()), samples.size() * sizeof(uint16_t));
+    } else {
+        throw std::runtime_error("Unknown terrain sample type " + std::to_string(out.sampleType));
+    }
+
+    if (!file) {
+        throw std::runtime_error("Failed to write file: " + filename);
+    }
+}
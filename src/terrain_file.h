@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Binary heightmap written by rotor_terrain_convert: a TerrainHeader followed by rows * cols samples,
+// row major, little endian. Read through mmap, so opening a large map costs page faults on the
+// samples that are actually touched rather than a parse of the whole file.
+const char TERRAIN_FILE_MAGIC[8] = {'R', 'T', 'E', 'R', 'R', 'A', 'I', 'N'};
+const uint32_t TERRAIN_FILE_VERSION = 1;
+
+enum class TerrainSampleType : uint32_t {
+    Float32 = 0,
+    UInt16 = 1  // height = heightOffset + heightScale * sample
+};
+
+struct TerrainHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t sampleType;   // TerrainSampleType
+    uint32_t cols;
+    uint32_t rows;
+    double spacingX;       // ground distance between columns and between rows, in CRS units
+    double spacingY;
+    double originX;        // georeference of the centre of sample (0, 0), the north west corner;
+    double originY;        // rows step south (-y) by spacingY
+    float heightOffset;    // UInt16 samples only
+    float heightScale;
+    char crs[48];          // e.g. "EPSG:27700", zero padded, empty when unknown
+    uint32_t dataOffset;   // bytes from the start of the file to the first sample
+    uint32_t reserved[3];
+};
+static_assert(sizeof(TerrainHeader) == 128, "TerrainHeader is part of the file format");
+
+// Read only mapping of a whole file
+class MappedFile {
+public:
+    MappedFile() = default;
+    explicit MappedFile(const std::string& filename);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator=(MappedFile&& other) noexcept;
+
+    const char* data() const { return static_cast<const char*>(_data); }
+    size_t size() const { return _size; }
+    bool empty() const { return _data == nullptr; }
+
+private:
+    void* _data = nullptr;
+    size_t _size = 0;
+};
+
+// How text heightmaps are read, see terrain_ingest.h
+struct TerrainIngestOptions {
+    // Size of the produced grid, 0 keeps the source's. Smaller grids average the source samples of each
+    // cell while parsing, the full resolution grid is never held in memory.
+    uint32_t targetCols = 0;
+    uint32_t targetRows = 0;
+    unsigned int threads = 0;          // 0 uses every hardware thread
+    size_t chunkBytes = 8 << 20;       // text parsed per task, rounded to whole lines
+};
+
+// A heightmap, either mapped from a binary terrain file or ingested from one of the text formats of
+// terrain_ingest.h. Shared read only by the voxeliser and the mesh generators, rows run along z and
+// columns along x.
+class TerrainMap {
+public:
+    TerrainMap() = default;
+    ~TerrainMap();
+    TerrainMap(const TerrainMap&) = delete;
+    TerrainMap& operator=(const TerrainMap&) = delete;
+    TerrainMap(TerrainMap&& other) noexcept;
+    TerrainMap& operator=(TerrainMap&& other) noexcept;
+
+    // Maps a binary file, anything without the magic is ingested as text with options
+    static TerrainMap open(const std::string& filename, const TerrainIngestOptions& options = {});
+    // Samples in memory, header gives the dimensions and georeference, its sample type is ignored
+    static TerrainMap from_samples(const TerrainHeader& header, std::vector<float> samples);
+
+    uint32_t rows() const { return _header.rows; }
+    uint32_t cols() const { return _header.cols; }
+    const TerrainHeader& header() const { return _header; }
+    bool mapped() const { return !_file.empty(); }
+
+    float height(uint32_t row, uint32_t col) const
+    {
+        size_t i = size_t(row) * _header.cols + col;
+        return _floats ? _floats[i] : _header.heightOffset + _header.heightScale * _shorts[i];
+    }
+    // Smallest and largest sample
+    void height_range(float& min, float& max) const;
+    // Row major copy of every sample
+    std::vector<float> to_floats() const;
+
+private:
+    TerrainHeader _header{};
+    const float* _floats = nullptr;     // one of the two points into _file or _owned
+    const uint16_t* _shorts = nullptr;
+    std::vector<float> _owned;
+    MappedFile _file;
+
+    void release();
+};
+
+// Writes heights (rows * cols, row major) as a binary terrain file. The sample type, spacing, origin and
+// CRS come from header, UInt16 gets heightOffset and heightScale spanning the range of heights.
+void write_terrain_file(const std::string& filename, const TerrainHeader& header, const std::vector<float>& heights);
+
+// Case insensitive match of the text after the last dot, extension given without the dot
+bool has_extension(const std::string& filename, const char* extension);
+
+// Header with the magic, version and sample offset filled in, spacing 1 and no georeference
+TerrainHeader make_terrain_header(uint32_t rows, uint32_t cols, TerrainSampleType sampleType);
@@ -0,0 +1,587 @@
+#include "terrain_ingest.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include "thread_pool.h"
+
+namespace {
+
+enum class TextFormat {
+    AsciiGrid,
+    PlainGrid,
+    Xyz
+};
+
+const char* text_format_name(TextFormat format)
+{
+    switch (format) {
+    case TextFormat::AsciiGrid: return "ASCII grid";
+    case TextFormat::PlainGrid: return "plain grid";
+    case TextFormat::Xyz: return "XYZ";
+    }
+    return "unknown";
+}
+
+bool is_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+bool is_separator(char c, bool commas) { return is_blank(c) || c == '\n' || (commas && c == ','); }
+bool is_letter(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+
+// Parses the number at p, nullptr when there is none. from_chars takes no leading '+'.
+template <typename T>
+const char* parse_number(const char* p, const char* end, T& value)
+{
+    if (p < end && *p == '+') {
+        p++;
+    }
+    auto [next, ec] = std::from_chars(p, end, value);
+    return ec == std::errc() ? next : nullptr;
+}
+
+// Source samples averaged into each target cell, a box filter of the source grid
+struct Resample {
+    uint32_t srcRows = 0, srcCols = 0;
+    uint32_t dstRows = 0, dstCols = 0;
+    std::vector<uint32_t> colMap; // target column of every source column
+
+    void init(uint32_t sourceRows, uint32_t sourceCols, const TerrainIngestOptions& options)
+    {
+        srcRows = sourceRows;
+        srcCols = sourceCols;
+        dstRows = options.targetRows ? std::min(options.targetRows, srcRows) : srcRows;
+        dstCols = options.targetCols ? std::min(options.targetCols, srcCols) : srcCols;
+        colMap.resize(srcCols);
+        for (uint32_t col = 0; col < srcCols; col++) {
+            colMap[col] = uint32_t(uint64_t(col) * dstCols / srcCols);
+        }
+    }
+    uint32_t row(uint32_t sourceRow) const { return uint32_t(uint64_t(sourceRow) * dstRows / srcRows); }
+};
+
+// A task's share of the text. The first pass sizes the grid, the second accumulates into the target rows
+// the chunk touches, which are contiguous for row major text and usually for XYZ exports too.
+struct Chunk {
+    size_t begin = 0;
+    size_t end = 0;
+
+    size_t values = 0;        // grid values, or XYZ points
+    size_t lines = 0;         // lines holding values
+    size_t minLineValues = std::numeric_limits<size_t>::max();
+    size_t maxLineValues = 0;
+    size_t firstSample = 0;   // row major index of the chunk's first value
+
+    double minX = INFINITY, maxX = -INFINITY;
+    double minY = INFINITY, maxY = -INFINITY;
+    double stepX = INFINITY;  // smallest spacing between consecutive points
+    double stepY = INFINITY;
+
+    uint32_t firstRow = 0;    // target rows held by sum and count
+    uint32_t rowCount = 0;
+    std::vector<float> sum;
+    std::vector<uint32_t> count;
+    size_t noData = 0;
+
+    std::string error;        // set by the task, the pool does not carry exceptions
+
+    void reset_cells(uint32_t first, uint32_t last, uint32_t cols)
+    {
+        firstRow = first;
+        rowCount = last >= first ? last - first + 1 : 0;
+        sum.assign(size_t(rowCount) * cols, 0.0f);
+        count.assign(size_t(rowCount) * cols, 0);
+    }
+};
+
+std::vector<Chunk> split_lines(const char* text, size_t begin, size_t size, size_t chunkBytes)
+{
+    std::vector<Chunk> chunks;
+    chunkBytes = std::max<size_t>(chunkBytes, 1);
+    while (begin < size) {
+        size_t end = std::min(size, begin + chunkBytes);
+        if (end < size) {
+            const void* newline = std::memchr(text + end, '\n', size - end);
+            end = newline ? static_cast<const char*>(newline) - text + 1 : size;
+        }
+        Chunk chunk;
+        chunk.begin = begin;
+        chunk.end = end;
+        chunks.push_back(std::move(chunk));
+        begin = end;
+    }
+    return chunks;
+}
+
+struct AsciiHeader {
+    bool present = false;
+    size_t dataOffset = 0;
+    double ncols = -1, nrows = -1;
+    double xll = 0, yll = 0;
+    bool xCenter = false, yCenter = false;
+    double cellX = 1, cellY = 1;
+    bool hasNoData = false;
+    double noData = 0;
+};
+
+// Keyword lines at the top of the file, stops at the first line starting with a number
+AsciiHeader parse_ascii_header(const char* text, size_t size, const std::string& filename)
+{
+    AsciiHeader header;
+    size_t pos = 0;
+    while (pos < size) {
+        size_t lineEnd = pos;
+        while (lineEnd < size && text[lineEnd] != '\n') {
+            lineEnd++;
+        }
+        const char* p = text + pos;
+        const char* end = text + lineEnd;
+        while (p < end && is_blank(*p)) {
+            p++;
+        }
+        if (p < end && !is_letter(*p)) {
+            break;
+        }
+
+        if (p < end) {
+            const char* keyEnd = p;
+            while (keyEnd < end && !is_blank(*keyEnd)) {
+                keyEnd++;
+            }
+            std::string key(p, keyEnd);
+            std::transform(key.begin(), key.end(), key.begin(), [](char c) { return char(std::tolower(c)); });
+
+            const char* v = keyEnd;
+            while (v < end && is_blank(*v)) {
+                v++;
+            }
+            double value = 0;
+            if (!parse_number(v, end, value)) {
+                throw std::runtime_error(filename + ": no value for header line " + key);
+            }
+
+            header.present = true;
+            if (key == "ncols") {
+                header.ncols = value;
+            } else if (key == "nrows") {
+                header.nrows = value;
+            } else if (key == "xllcorner" || key == "xllcenter") {
+                header.xll = value;
+                header.xCenter = key == "xllcenter";
+            } else if (key == "yllcorner" || key == "yllcenter") {
+                header.yll = value;
+                header.yCenter = key == "yllcenter";
+            } else if (key == "cellsize") {
+                header.cellX = header.cellY = value;
+            } else if (key == "dx") {
+                header.cellX = value;
+            } else if (key == "dy") {
+                header.cellY = value;
+            } else if (key == "nodata_value") {
+                header.hasNoData = true;
+                header.noData = value;
+            } else {
+                printf("%s: ignoring header line %s\n", filename.c_str(), key.c_str());
+            }
+        }
+        pos = lineEnd < size ? lineEnd + 1 : size;
+    }
+    header.dataOffset = pos;
+
+    if (header.present && (header.ncols < 1 || header.nrows < 1)) {
+        throw std::runtime_error(filename + ": ASCII grid header without ncols and nrows");
+    }
+    return header;
+}
+
+// First pass over a grid chunk, counts values without parsing them
+void count_grid_values(const char* text, Chunk& chunk)
+{
+    const char* p = text + chunk.begin;
+    const char* end = text + chunk.end;
+    size_t lineValues = 0;
+    auto end_line = [&]() {
+        if (lineValues > 0) {
+            chunk.lines++;
+            chunk.values += lineValues;
+            chunk.minLineValues = std::min(chunk.minLineValues, lineValues);
+            chunk.maxLineValues = std::max(chunk.maxLineValues, lineValues);
+        }
+        lineValues = 0;
+    };
+
+    while (p < end) {
+        if (*p == '\n') {
+            end_line();
+            p++;
+        } else if (is_blank(*p)) {
+            p++;
+        } else {
+            lineValues++;
+            while (p < end && !is_separator(*p, false)) {
+                p++;
+            }
+        }
+    }
+    end_line();
+}
+
+void accumulate_grid_values(const char* text, const Resample& resample, const AsciiHeader& header, Chunk& chunk)
+{
+    if (chunk.values == 0) {
+        return;
+    }
+    uint32_t row = uint32_t(chunk.firstSample / resample.srcCols);
+    uint32_t col = uint32_t(chunk.firstSample % resample.srcCols);
+    uint32_t lastRow = uint32_t((chunk.firstSample + chunk.values - 1) / resample.srcCols);
+    chunk.reset_cells(resample.row(row), resample.row(lastRow), resample.dstCols);
+
+    size_t rowBase = size_t(resample.row(row) - chunk.firstRow) * resample.dstCols;
+    const float noData = float(header.noData);
+
+    const char* p = text + chunk.begin;
+    const char* end = text + chunk.end;
+    while (p < end) {
+        if (is_separator(*p, false)) {
+            p++;
+            continue;
+        }
+
+        float value;
+        const char* next = parse_number(p, end, value);
+        if (!next || (next < end && !is_separator(*next, false))) {
+            chunk.error = "unreadable value at byte " + std::to_string(p - text);
+            return;
+        }
+        p = next;
+
+        if (header.hasNoData && value == noData) {
+            chunk.noData++;
+        } else {
+            size_t cell = rowBase + resample.colMap[col];
+            chunk.sum[cell] += value;
+            chunk.count[cell]++;
+        }
+
+        if (++col == resample.srcCols) {
+            col = 0;
+            row++;
+            if (row < resample.srcRows) {
+                rowBase = size_t(resample.row(row) - chunk.firstRow) * resample.dstCols;
+            }
+        }
+    }
+}
+
+// Calls point(x, y, z) for every line of an XYZ chunk, false and the chunk's error on a malformed line
+template <typename Fn>
+bool for_each_point(const char* text, Chunk& chunk, Fn point)
+{
+    const char* p = text + chunk.begin;
+    const char* end = text + chunk.end;
+    while (p < end) {
+        const char* lineEnd = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        if (!lineEnd) {
+            lineEnd = end;
+        }
+        while (p < lineEnd && is_separator(*p, true)) {
+            p++;
+        }
+
+        if (p < lineEnd && !is_letter(*p)) {
+            double xyz[3];
+            for (int i = 0; i < 3; i++) {
+                while (p < lineEnd && is_separator(*p, true)) {
+                    p++;
+                }
+                const char* next = parse_number(p, lineEnd, xyz[i]);
+                if (!next) {
+                    chunk.error = "unreadable point at byte " + std::to_string(p - text);
+                    return false;
+                }
+                p = next;
+            }
+            point(xyz[0], xyz[1], float(xyz[2]));
+        }
+        p = lineEnd + 1;
+    }
+    return true;
+}
+
+void bound_xyz_points(const char* text, Chunk& chunk)
+{
+    double lastX = NAN, lastY = NAN;
+    for_each_point(text, chunk, [&](double x, double y, float) {
+        chunk.values++;
+        chunk.minX = std::min(chunk.minX, x);
+        chunk.maxX = std::max(chunk.maxX, x);
+        chunk.minY = std::min(chunk.minY, y);
+        chunk.maxY = std::max(chunk.maxY, y);
+
+        // Exports run along rows or columns, so neighbouring lines differ by one grid step in one axis
+        double dx = std::fabs(x - lastX);
+        double dy = std::fabs(y - lastY);
+        if (dx > 0 && dy == 0) {
+            chunk.stepX = std::min(chunk.stepX, dx);
+        }
+        if (dy > 0 && dx == 0) {
+            chunk.stepY = std::min(chunk.stepY, dy);
+        }
+        lastX = x;
+        lastY = y;
+    });
+}
+
+// Grid of an XYZ file: row 0 at the largest y like an ASCII grid
+struct XyzGrid {
+    double minX = 0, maxY = 0;
+    double stepX = 1, stepY = 1;
+    uint32_t row(double y) const { return uint32_t(std::lround((maxY - y) / stepY)); }
+    uint32_t col(double x) const { return uint32_t(std::lround((x - minX) / stepX)); }
+};
+
+void accumulate_xyz_points(const char* text, const XyzGrid& grid, const Resample& resample, Chunk& chunk)
+{
+    if (chunk.values == 0) {
+        return;
+    }
+    chunk.reset_cells(resample.row(grid.row(chunk.maxY)), resample.row(grid.row(chunk.minY)), resample.dstCols);
+
+    for_each_point(text, chunk, [&](double x, double y, float z) {
+        uint32_t row = resample.row(grid.row(y)) - chunk.firstRow;
+        size_t cell = size_t(row) * resample.dstCols + resample.colMap[grid.col(x)];
+        chunk.sum[cell] += z;
+        chunk.count[cell]++;
+    });
+}
+
+void check_chunk_errors(const std::vector<Chunk>& chunks, const std::string& filename)
+{
+    for (const Chunk& chunk : chunks) {
+        if (!chunk.error.empty()) {
+            throw std::runtime_error(filename + ": " + chunk.error);
+        }
+    }
+}
+
+} // namespace
+
+PointCloud ingest_xyz_points(const char* text, size_t size, const std::string& filename, unsigned int threads)
+{
+    std::vector<Chunk> chunks = split_lines(text, 0, size, TerrainIngestOptions().chunkBytes);
+    PointCloud cloud;
+
+    // The first point is the origin, so the float offsets of the rest stay small
+    for (Chunk& chunk : chunks) {
+        Chunk first = chunk;
+        bool found = false;
+        for_each_point(text, first, [&](double x, double y, float) {
+            if (!found) {
+                cloud.originX = std::floor(x);
+                cloud.originY = std::floor(y);
+                found = true;
+            }
+        });
+        if (found || !first.error.empty()) {
+            break;
+        }
+    }
+
+    std::vector<std::vector<LidarPoint>> points(chunks.size());
+    ThreadPool pool(threads);
+    pool.parallel_for(0, chunks.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; c++) {
+            for_each_point(text, chunks[c], [&](double x, double y, float z) {
+                points[c].push_back({float(x - cloud.originX), float(y - cloud.originY), z});
+            });
+        }
+    });
+    check_chunk_errors(chunks, filename);
+
+    size_t total = 0;
+    for (const auto& chunkPoints : points) {
+        total += chunkPoints.size();
+    }
+    cloud.points.reserve(total);
+    for (auto& chunkPoints : points) {
+        cloud.points.insert(cloud.points.end(), chunkPoints.begin(), chunkPoints.end());
+        chunkPoints = {};
+    }
+    cloud.update_bounds();
+    return cloud;
+}
+
+TerrainMap ingest_terrain_text(const char* text, size_t size, const std::string& filename,
+                               const TerrainIngestOptions& options)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    TextFormat format = has_extension(filename, "xyz") ? TextFormat::Xyz : TextFormat::PlainGrid;
+    AsciiHeader ascii;
+    if (format != TextFormat::Xyz) {
+        ascii = parse_ascii_header(text, size, filename);
+        if (ascii.present) {
+            format = TextFormat::AsciiGrid;
+        }
+    }
+
+    ThreadPool pool(options.threads);
+    std::vector<Chunk> chunks = split_lines(text, ascii.dataOffset, size, options.chunkBytes);
+    auto for_chunks = [&](const std::function<void(Chunk&)>& fn) {
+        pool.parallel_for(0, chunks.size(), 1, [&](size_t begin, size_t end) {
+            for (size_t c = begin; c < end; c++) {
+                fn(chunks[c]);
+            }
+        });
+    };
+
+    TerrainHeader header = make_terrain_header(0, 0, TerrainSampleType::Float32);
+    Resample resample;
+    XyzGrid grid;
+    size_t values = 0;
+    double cellX = 1, cellY = 1; // source spacing
+    double firstX = 0, firstY = 0; // centre of source sample (0, 0)
+
+    if (format == TextFormat::Xyz) {
+        for_chunks([&](Chunk& chunk) { bound_xyz_points(text, chunk); });
+        check_chunk_errors(chunks, filename);
+
+        double minX = INFINITY, maxX = -INFINITY, minY = INFINITY, maxY = -INFINITY;
+        double stepX = INFINITY, stepY = INFINITY;
+        for (const Chunk& chunk : chunks) {
+            values += chunk.values;
+            minX = std::min(minX, chunk.minX);
+            maxX = std::max(maxX, chunk.maxX);
+            minY = std::min(minY, chunk.minY);
+            maxY = std::max(maxY, chunk.maxY);
+            stepX = std::min(stepX, chunk.stepX);
+            stepY = std::min(stepY, chunk.stepY);
+        }
+        if (values == 0) {
+            throw std::runtime_error(filename + " holds no points");
+        }
+        // A single row or column has no step along the other axis, assume square cells
+        if (std::isinf(stepX) && std::isinf(stepY)) {
+            stepX = stepY = 1;
+        }
+        grid.minX = minX;
+        grid.maxY = maxY;
+        grid.stepX = std::isinf(stepX) ? stepY : stepX;
+        grid.stepY = std::isinf(stepY) ? stepX : stepY;
+
+        uint32_t cols = grid.col(maxX) + 1;
+        uint32_t rows = grid.row(minY) + 1;
+        if (double(rows) * cols > 4.0 * values) {
+            throw std::runtime_error(filename + ": the points do not lie on a regular grid, "
+                                     "rasterise them as a point cloud (rotor_terrain_convert --points)");
+        }
+        resample.init(rows, cols, options);
+        cellX = grid.stepX;
+        cellY = grid.stepY;
+        firstX = minX;
+        firstY = maxY;
+
+        for_chunks([&](Chunk& chunk) { accumulate_xyz_points(text, grid, resample, chunk); });
+    } else {
+        for_chunks([&](Chunk& chunk) { count_grid_values(text, chunk); });
+
+        size_t lines = 0, minLineValues = std::numeric_limits<size_t>::max(), maxLineValues = 0;
+        for (Chunk& chunk : chunks) {
+            chunk.firstSample = values;
+            values += chunk.values;
+            lines += chunk.lines;
+            minLineValues = std::min(minLineValues, chunk.minLineValues);
+            maxLineValues = std::max(maxLineValues, chunk.maxLineValues);
+        }
+        if (values == 0) {
+            throw std::runtime_error(filename + " holds no samples");
+        }
+
+        uint32_t rows, cols;
+        if (format == TextFormat::AsciiGrid) {
+            rows = uint32_t(ascii.nrows);
+            cols = uint32_t(ascii.ncols);
+            if (values != size_t(rows) * cols) {
+                throw std::runtime_error(filename + ": " + std::to_string(values) + " samples, the header declares " +
+                                         std::to_string(rows) + " x " + std::to_string(cols));
+            }
+            cellX = ascii.cellX;
+            cellY = ascii.cellY;
+            firstX = ascii.xll + (ascii.xCenter ? 0.0 : 0.5 * cellX);
+            firstY = ascii.yll + (ascii.yCenter ? 0.0 : 0.5 * cellY) + (rows - 1) * cellY;
+        } else {
+            if (minLineValues != maxLineValues) {
+                throw std::runtime_error(filename + ": rows hold between " + std::to_string(minLineValues) + " and " +
+                                         std::to_string(maxLineValues) + " samples");
+            }
+            rows = uint32_t(lines);
+            cols = uint32_t(minLineValues);
+        }
+        resample.init(rows, cols, options);
+
+        for_chunks([&](Chunk& chunk) { accumulate_grid_values(text, resample, ascii, chunk); });
+    }
+    check_chunk_errors(chunks, filename);
+
+    // Chunks overlap only in the target rows at their edges, so merging is one pass over the grid
+    std::vector<float> sum(size_t(resample.dstRows) * resample.dstCols, 0.0f);
+    std::vector<uint32_t> count(sum.size(), 0);
+    size_t noData = 0;
+    for (Chunk& chunk : chunks) {
+        size_t offset = size_t(chunk.firstRow) * resample.dstCols;
+        for (size_t i = 0; i < chunk.sum.size(); i++) {
+            sum[offset + i] += chunk.sum[i];
+            count[offset + i] += chunk.count[i];
+        }
+        noData += chunk.noData;
+        chunk.sum = {};
+        chunk.count = {};
+    }
+
+    std::vector<uint8_t> valid(sum.size(), 0);
+    size_t holes = 0;
+    for (size_t i = 0; i < sum.size(); i++) {
+        if (count[i] > 0) {
+            sum[i] /= count[i];
+            valid[i] = 1;
+        } else {
+            holes++;
+        }
+    }
+    if (holes == sum.size()) {
+        throw std::runtime_error(filename + ": every sample is NODATA");
+    }
+    if (holes > 0) {
+        fill_terrain_holes(sum, valid, resample.dstRows, resample.dstCols);
+    }
+
+    header.rows = resample.dstRows;
+    header.cols = resample.dstCols;
+    header.spacingX = cellX * resample.srcCols / resample.dstCols;
+    header.spacingY = cellY * resample.srcRows / resample.dstRows;
+    header.originX = firstX + 0.5 * (header.spacingX - cellX);
+    header.originY = firstY - 0.5 * (header.spacingY - cellY);
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    printf("Ingested %s (%s, %.1f MB) in %.1f ms on %u threads: %ux%u samples", filename.c_str(),
+           text_format_name(format), size / (1024.0 * 1024.0), ms, pool.thread_count(), resample.srcCols, resample.srcRows);
+    if (resample.dstCols != resample.srcCols || resample.dstRows != resample.srcRows) {
+        printf(" averaged to %ux%u", resample.dstCols, resample.dstRows);
+    }
+    if (noData > 0) {
+        printf(", %zu NODATA samples", noData);
+    }
+    if (holes > 0) {
+        printf(", %zu empty cells filled", holes);
+    }
+    printf("\n");
+
+    return TerrainMap::from_samples(header, std::move(sum));
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "terrain_file.h"
+#include "terrain_points.h"
+
+// Text heightmaps, read from a mapping in line aligned chunks that are parsed concurrently:
+//   ESRI ASCII grid  ncols, nrows, xllcorner/xllcenter, yllcorner/yllcenter, cellsize (or dx and dy) and
+//                    NODATA_value header lines, then nrows * ncols heights from the north edge down,
+//                    line breaks anywhere
+//   plain grid       no header, one row of whitespace separated heights per line
+//   XYZ              "x y z" per line, separated by spaces, tabs or commas, the points of a regular grid
+//                    in any order; picked by a .xyz extension, lines starting with a letter are skipped
+// Samples are averaged straight into a grid of options.targetCols x options.targetRows while parsing.
+// NODATA samples are left out of the averages and cells without any valid sample are filled from their
+// neighbours (fill_terrain_holes).
+TerrainMap ingest_terrain_text(const char* text, size_t size, const std::string& filename,
+                               const TerrainIngestOptions& options = {});
+
+// Every "x y z" line as a point cloud for rasterise_points, for XYZ exports that are not gridded
+PointCloud ingest_xyz_points(const char* text, size_t size, const std::string& filename, unsigned int threads = 0);
@@ -0,0 +1,447 @@
+#include "terrain_lod.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include "vk_helper.h"
+#include "vk_initializers.h"
+
+float TerrainLod::height(uint32_t row, uint32_t col) const
+{
+    return _heights->height(std::min(row, _rows - 1), std::min(col, _cols - 1));
+}
+
+glm::vec3 TerrainLod::position(uint32_t row, uint32_t col) const
+{
+    row = std::min(row, _rows - 1);
+    col = std::min(col, _cols - 1);
+    return {float(col) / _cols, 1.0f - _heights->height(row, col) * _heightScale, float(row) / _cols};
+}
+
+void TerrainLod::build(const TerrainMap& heightMap, float heightScale, Storage storage)
+{
+    if (heightMap.rows() < 2 || heightMap.cols() < 2) {
+        throw std::runtime_error("TerrainLod: heightmap needs at least 2x2 samples");
+    }
+
+    _heights = &heightMap;
+    _storage = storage;
+    _rows = heightMap.rows();
+    _cols = heightMap.cols();
+    _heightScale = heightScale;
+    _nodes.clear();
+
+    // The root is the coarsest level whose single chunk spans the whole map
+    uint32_t levels = 0;
+    while ((TERRAIN_CHUNK_CELLS << levels) < std::max(_rows, _cols) - 1) {
+        levels++;
+    }
+    build_node(levels, 0, 0);
+
+    // A skirt has to reach down to a neighbour one level coarser, so it is as deep as that level's worst error
+    std::vector<float> levelError(levels + 2, 0.0f);
+    for (const Node& node : _nodes) {
+        levelError[node.level] = std::max(levelError[node.level], node.error);
+    }
+    for (Node& node : _nodes) {
+        node.skirtDepth = std::max(levelError[node.level + 1], levelError[node.level]) + 1e-4f;
+        build_bounds(node);
+    }
+
+    if (_storage == Storage::Vertices) {
+        const uint32_t nodeVertices = (TERRAIN_CHUNK_CELLS + 1) * (TERRAIN_CHUNK_CELLS + 5);
+        _vertices.clear();
+        _vertices.reserve(size_t(nodeVertices) * _nodes.size());
+        for (Node& node : _nodes) {
+            build_vertices(node);
+        }
+    } else {
+        build_texels();
+    }
+    build_indices();
+    _heights = nullptr;
+
+    const double deviceBytes = _storage == Storage::Vertices
+        ? double(_vertices.size() * sizeof(Vertex)) : double(_texels.size() * sizeof(uint16_t));
+    printf("Terrain LOD: %ux%u samples, %u levels, %zu chunks, %.2f MB of %s\n", _cols, _rows, levels + 1,
+           _nodes.size(), deviceBytes / (1024.0 * 1024.0), _storage == Storage::Vertices ? "vertices" : "heightfield");
+}
+
+void TerrainLod::save(TerrainCacheWriter& cache) const
+{
+    CacheInfo info{uint32_t(_storage), _rows, _cols, _heightScale, _heightMin, _heightRange};
+    cache.add_copy(TerrainCacheSection::LodInfo, &info, sizeof(info));
+    cache.add_copy(TerrainCacheSection::LodNodes, _nodes.data(), _nodes.size() * sizeof(Node));
+    cache.add_copy(TerrainCacheSection::LodVertices, _vertices.data(), _vertices.size() * sizeof(Vertex));
+    cache.add_copy(TerrainCacheSection::LodTexels, _texels.data(), _texels.size() * sizeof(uint16_t));
+    cache.add_copy(TerrainCacheSection::LodIndices, _indices.data(), _indices.size() * sizeof(uint16_t));
+}
+
+void TerrainLod::load(const TerrainCacheEntry& cache)
+{
+    if (cache.size(TerrainCacheSection::LodInfo) != sizeof(CacheInfo)) {
+        throw std::runtime_error("TerrainLod: cache entry holds no terrain chunks");
+    }
+    CacheInfo info;
+    std::memcpy(&info, cache.data(TerrainCacheSection::LodInfo), sizeof(info));
+
+    _storage = Storage(info.storage);
+    _rows = info.rows;
+    _cols = info.cols;
+    _heightScale = info.heightScale;
+    _heightMin = info.heightMin;
+    _heightRange = info.heightRange;
+    _nodes = cache.array<Node>(TerrainCacheSection::LodNodes);
+    _vertices = cache.array<Vertex>(TerrainCacheSection::LodVertices);
+    _texels = cache.array<uint16_t>(TerrainCacheSection::LodTexels);
+    _indices = cache.array<uint16_t>(TerrainCacheSection::LodIndices);
+    _indexCount = uint32_t(_indices.size());
+
+    // The key covers every setting, so a mismatch here is a damaged entry rather than a stale one
+    const uint32_t nodeVertices = (TERRAIN_CHUNK_CELLS + 1) * (TERRAIN_CHUNK_CELLS + 5);
+    bool valid = info.storage <= uint32_t(Storage::Heightfield) && _rows >= 2 && _cols >= 2 && !_nodes.empty();
+    if (valid && _storage == Storage::Vertices) {
+        valid = _vertices.size() == size_t(nodeVertices) * _nodes.size();
+        for (size_t i = 0; valid && i < _nodes.size(); i++) {
+            valid = _nodes[i].vertexOffset == int32_t(i * nodeVertices);
+        }
+    } else if (valid) {
+        valid = _texels.size() == size_t(_rows) * _cols;
+    }
+    for (size_t i = 0; valid && i < _nodes.size(); i++) {
+        for (uint32_t child : _nodes[i].children) {
+            valid = valid && (child == NO_CHILD || (child > i && child < _nodes.size()));
+        }
+    }
+    for (size_t i = 0; valid && i < _indices.size(); i++) {
+        valid = _indices[i] < nodeVertices;
+    }
+    if (!valid) {
+        _nodes.clear();
+        _vertices.clear();
+        _texels.clear();
+        _indices.clear();
+        _indexCount = 0;
+        throw std::runtime_error("TerrainLod: cache entry does not match its own sizes");
+    }
+
+    printf("Terrain LOD: %ux%u samples, %zu chunks from the cache\n", _cols, _rows, _nodes.size());
+}
+
+void TerrainLod::set_height_scale(float heightScale)
+{
+    if (_storage != Storage::Heightfield) {
+        throw std::runtime_error("TerrainLod: the height scale is built into the vertices, rebuild to change it");
+    }
+    _heightScale = heightScale;
+}
+
+uint32_t TerrainLod::build_node(uint32_t level, uint32_t originRow, uint32_t originCol)
+{
+    const uint32_t index = uint32_t(_nodes.size());
+    _nodes.emplace_back();
+    _nodes[index].level = level;
+    _nodes[index].originRow = originRow;
+    _nodes[index].originCol = originCol;
+
+    float childError = 0.0f;
+    if (level > 0) {
+        const uint32_t half = (TERRAIN_CHUNK_CELLS << level) / 2;
+        for (uint32_t c = 0; c < 4; c++) {
+            uint32_t row = originRow + (c >> 1) * half;
+            uint32_t col = originCol + (c & 1) * half;
+            // Quadrants past the map's far edges hold nothing
+            if (row >= _rows - 1 || col >= _cols - 1) {
+                continue;
+            }
+            uint32_t child = build_node(level - 1, row, col);
+            _nodes[index].children[c] = child;
+            childError = std::max(childError, _nodes[child].error);
+        }
+    }
+
+    // Conservative, the children's own error adds to how far this node strays from them
+    _nodes[index].error = childError + simplification_error(_nodes[index]);
+    return index;
+}
+
+float TerrainLod::simplification_error(const Node& node) const
+{
+    if (node.level == 0) {
+        return 0.0f;
+    }
+
+    const uint32_t stride = 1u << node.level;
+    const uint32_t fine = stride / 2;
+    float error = 0.0f;
+    for (uint32_t i = 0; i <= 2 * TERRAIN_CHUNK_CELLS; i++) {
+        for (uint32_t j = 0; j <= 2 * TERRAIN_CHUNK_CELLS; j++) {
+            if ((i & 1) == 0 && (j & 1) == 0) {
+                continue; // shared with the node's own vertices
+            }
+
+            // The node's cell and where in it the child vertex falls, cells are split TR-BL as in build_indices
+            uint32_t r = std::min(i / 2, TERRAIN_CHUNK_CELLS - 1);
+            uint32_t c = std::min(j / 2, TERRAIN_CHUNK_CELLS - 1);
+            float fz = 0.5f * float(i) - float(r);
+            float fx = 0.5f * float(j) - float(c);
+            uint32_t row = node.originRow + r * stride;
+            uint32_t col = node.originCol + c * stride;
+            float topLeft = height(row, col);
+            float topRight = height(row, col + stride);
+            float bottomLeft = height(row + stride, col);
+            float bottomRight = height(row + stride, col + stride);
+
+            float interpolated = (fx + fz <= 1.0f)
+                ? topLeft + fx * (topRight - topLeft) + fz * (bottomLeft - topLeft)
+                : bottomRight + (1.0f - fx) * (bottomLeft - bottomRight) + (1.0f - fz) * (topRight - bottomRight);
+            float actual = height(node.originRow + i * fine, node.originCol + j * fine);
+            error = std::max(error, std::fabs(actual - interpolated));
+        }
+    }
+    return error;
+}
+
+void TerrainLod::build_bounds(Node& node) const
+{
+    const uint32_t stride = 1u << node.level;
+    const uint32_t lastRow = std::min(node.originRow + TERRAIN_CHUNK_CELLS * stride, _rows - 1);
+    const uint32_t lastCol = std::min(node.originCol + TERRAIN_CHUNK_CELLS * stride, _cols - 1);
+
+    node.boundsMin[0] = float(node.originCol) / _cols;
+    node.boundsMin[1] = float(node.originRow) / _cols;
+    node.boundsMax[0] = float(lastCol) / _cols;
+    node.boundsMax[1] = float(lastRow) / _cols;
+    node.heightMin = INFINITY;
+    node.heightMax = -INFINITY;
+    for (uint32_t i = 0; i <= TERRAIN_CHUNK_CELLS; i++) {
+        for (uint32_t j = 0; j <= TERRAIN_CHUNK_CELLS; j++) {
+            float h = height(node.originRow + i * stride, node.originCol + j * stride);
+            node.heightMin = std::min(node.heightMin, h);
+            node.heightMax = std::max(node.heightMax, h);
+        }
+    }
+}
+
+void TerrainLod::build_vertices(Node& node)
+{
+    const uint32_t stride = 1u << node.level;
+    node.vertexOffset = int32_t(_vertices.size());
+
+    for (uint32_t i = 0; i <= TERRAIN_CHUNK_CELLS; i++) {
+        for (uint32_t j = 0; j <= TERRAIN_CHUNK_CELLS; j++) {
+            _vertices.push_back({position(node.originRow + i * stride, node.originCol + j * stride), {0, 0}});
+        }
+    }
+
+    // Skirts along the top, bottom, left and right edges, y grows downwards
+    for (uint32_t edge = 0; edge < 4; edge++) {
+        for (uint32_t k = 0; k <= TERRAIN_CHUNK_CELLS; k++) {
+            uint32_t i = edge == 0 ? 0 : edge == 1 ? TERRAIN_CHUNK_CELLS : k;
+            uint32_t j = edge == 2 ? 0 : edge == 3 ? TERRAIN_CHUNK_CELLS : k;
+            glm::vec3 pos = _vertices[node.vertexOffset + i * (TERRAIN_CHUNK_CELLS + 1) + j].pos;
+            pos.y += node.skirtDepth * _heightScale;
+            _vertices.push_back({pos, {0, 0}});
+        }
+    }
+}
+
+void TerrainLod::build_texels()
+{
+    float heightMax;
+    _heights->height_range(_heightMin, heightMax);
+    _heightRange = heightMax > _heightMin ? heightMax - _heightMin : 1.0f;
+
+    // 16-bit unorm over the map's own range, a 65536th of it is well below lidar noise
+    _texels.resize(size_t(_rows) * _cols);
+    for (uint32_t row = 0; row < _rows; row++) {
+        for (uint32_t col = 0; col < _cols; col++) {
+            float normalized = (_heights->height(row, col) - _heightMin) / _heightRange;
+            _texels[size_t(row) * _cols + col] = uint16_t(std::lround(std::clamp(normalized, 0.0f, 1.0f) * 65535.0f));
+        }
+    }
+}
+
+void TerrainLod::build_indices()
+{
+    const uint32_t cols = TERRAIN_CHUNK_CELLS + 1;
+    _indices.clear();
+
+    for (uint32_t row = 0; row < TERRAIN_CHUNK_CELLS; ++row) {
+        for (uint32_t col = 0; col < TERRAIN_CHUNK_CELLS; ++col) {
+            uint16_t topLeft = uint16_t(row * cols + col);
+            uint16_t topRight = uint16_t(topLeft + 1);
+            uint16_t bottomLeft = uint16_t((row + 1) * cols + col);
+            uint16_t bottomRight = uint16_t(bottomLeft + 1);
+
+            _indices.insert(_indices.end(), {topLeft, topRight, bottomLeft});
+            _indices.insert(_indices.end(), {topRight, bottomRight, bottomLeft});
+        }
+    }
+
+    const uint32_t skirtStart = cols * cols;
+    for (uint32_t edge = 0; edge < 4; edge++) {
+        for (uint32_t k = 0; k < TERRAIN_CHUNK_CELLS; k++) {
+            auto gridIndex = [&](uint32_t n) {
+                uint32_t i = edge == 0 ? 0 : edge == 1 ? TERRAIN_CHUNK_CELLS : n;
+                uint32_t j = edge == 2 ? 0 : edge == 3 ? TERRAIN_CHUNK_CELLS : n;
+                return uint16_t(i * cols + j);
+            };
+            uint16_t top0 = gridIndex(k);
+            uint16_t top1 = gridIndex(k + 1);
+            uint16_t skirt0 = uint16_t(skirtStart + edge * cols + k);
+            uint16_t skirt1 = uint16_t(skirt0 + 1);
+
+            _indices.insert(_indices.end(), {top0, top1, skirt0});
+            _indices.insert(_indices.end(), {top1, skirt1, skirt0});
+        }
+    }
+    _indexCount = uint32_t(_indices.size());
+}
+
+void TerrainLod::upload(UploadManager& uploader, VkDevice device, VmaAllocator allocator)
+{
+    VmaAllocationCreateInfo vmaAllocInfo{};
+    vmaAllocInfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
+
+    if (_storage == Storage::Vertices) {
+        VkBufferCreateInfo vbInfo{};
+        vbInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        vbInfo.size = sizeof(Vertex) * _vertices.size();
+        vbInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+
+        VK_CHECK(vmaCreateBuffer(allocator, &vbInfo, &vmaAllocInfo, &_vertexBuffer, &_vertexAllocation, nullptr));
+        uploader.upload(_vertexBuffer, _vertices.data(), vbInfo.size);
+    } else {
+        // Read with texelFetch, the sampler is only there for the combined descriptor
+        _heightfield = {0, _texels.size() * sizeof(uint16_t), VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, COLOR_IMAGE};
+        vkinit::createResource(device, allocator, _heightfield, {_cols, _rows, 1}, VK_FORMAT_R16_UNORM,
+                               VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, 2);
+        uploader.upload_image(_heightfield, _texels.data(), {_cols, _rows}, sizeof(uint16_t));
+    }
+
+    VkBufferCreateInfo ibInfo{};
+    ibInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    ibInfo.size = sizeof(uint16_t) * _indices.size();
+    ibInfo.usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+
+    VK_CHECK(vmaCreateBuffer(allocator, &ibInfo, &vmaAllocInfo, &_indexBuffer, &_indexAllocation, nullptr));
+    uploader.upload(_indexBuffer, _indices.data(), ibInfo.size);
+
+    // The staging ring holds its own copy once upload returns
+    std::vector<Vertex>().swap(_vertices);
+    std::vector<uint16_t>().swap(_texels);
+    std::vector<uint16_t>().swap(_indices);
+}
+
+void TerrainLod::cleanup(VkDevice device, VmaAllocator allocator)
+{
+    if (_vertexBuffer != VK_NULL_HANDLE) {
+        vmaDestroyBuffer(allocator, _vertexBuffer, _vertexAllocation);
+        _vertexBuffer = VK_NULL_HANDLE;
+    }
+    if (_indexBuffer != VK_NULL_HANDLE) {
+        vmaDestroyBuffer(allocator, _indexBuffer, _indexAllocation);
+        _indexBuffer = VK_NULL_HANDLE;
+    }
+    if (_heightfield.image != VK_NULL_HANDLE) {
+        vkhelp::destroy_resource(device, allocator, _heightfield);
+    }
+}
+
+void TerrainLod::select(const glm::mat4& viewProj, const glm::vec3& eye, float viewportHeight,
+                        std::vector<uint32_t>& selected, float fovY) const
+{
+    selected.clear();
+    if (_nodes.empty()) {
+        return;
+    }
+
+    // Frustum planes of a zero-to-one depth projection (Gribb and Hartmann), pointing inwards
+    glm::vec4 rows[4];
+    for (int i = 0; i < 4; i++) {
+        rows[i] = glm::vec4(viewProj[0][i], viewProj[1][i], viewProj[2][i], viewProj[3][i]);
+    }
+    const glm::vec4 planes[6] = {
+        rows[3] + rows[0], rows[3] - rows[0],
+        rows[3] + rows[1], rows[3] - rows[1],
+        rows[2], rows[3] - rows[2]
+    };
+
+    // Pixels per world unit of error at unit distance
+    const float pixelScale = viewportHeight / (2.0f * std::tan(0.5f * fovY));
+
+    std::vector<uint32_t> stack = {0};
+    while (!stack.empty()) {
+        const uint32_t index = stack.back();
+        const Node& node = _nodes[index];
+        stack.pop_back();
+
+        // y grows downwards, the skirts hang below the lowest point
+        const glm::vec3 boundsMin(node.boundsMin[0], 1.0f - node.heightMax * _heightScale, node.boundsMin[1]);
+        const glm::vec3 boundsMax(node.boundsMax[0], 1.0f - (node.heightMin - node.skirtDepth) * _heightScale, node.boundsMax[1]);
+
+        bool outside = false;
+        for (const glm::vec4& plane : planes) {
+            // The box corner furthest along the plane normal
+            glm::vec3 corner(plane.x >= 0.0f ? boundsMax.x : boundsMin.x,
+                             plane.y >= 0.0f ? boundsMax.y : boundsMin.y,
+                             plane.z >= 0.0f ? boundsMax.z : boundsMin.z);
+            if (glm::dot(glm::vec3(plane), corner) + plane.w < 0.0f) {
+                outside = true;
+                break;
+            }
+        }
+        if (outside) {
+            continue;
+        }
+
+        float distance = glm::length(eye - glm::clamp(eye, boundsMin, boundsMax));
+        float pixels = node.error * _heightScale * pixelScale / std::max(distance, 1e-3f);
+        if (node.level > 0 && pixels > TERRAIN_PIXEL_ERROR) {
+            for (uint32_t child : node.children) {
+                if (child != NO_CHILD) {
+                    stack.push_back(child);
+                }
+            }
+        } else {
+            selected.push_back(index);
+        }
+    }
+}
+
+void TerrainLod::draw(VkCommandBuffer cmd, VkPipelineLayout layout, const CamMatrices& camera, const CamData& eye, float viewportHeight)
+{
+    select(camera.mvp, glm::vec3(eye.pos[0], eye.pos[1], eye.pos[2]), viewportHeight, _selected);
+
+    vkCmdBindIndexBuffer(cmd, _indexBuffer, 0, VK_INDEX_TYPE_UINT16);
+    if (_storage == Storage::Vertices) {
+        VkDeviceSize offset = 0;
+        vkCmdBindVertexBuffers(cmd, 0, 1, &_vertexBuffer, &offset);
+        for (uint32_t index : _selected) {
+            vkCmdDrawIndexed(cmd, _indexCount, 1, 0, _nodes[index].vertexOffset, 0);
+        }
+        return;
+    }
+
+    // No vertex buffer, heightfield.vert places every vertex from its index and the chunk's constants
+    TerrainChunkConstants constants{};
+    constants.transform = camera.mvp;
+    constants.size[0] = int32_t(_cols);
+    constants.size[1] = int32_t(_rows);
+    constants.heightScale = _heightScale;
+    constants.heightMin = _heightMin;
+    constants.heightRange = _heightRange;
+    for (uint32_t index : _selected) {
+        const Node& node = _nodes[index];
+        constants.origin[0] = int32_t(node.originCol);
+        constants.origin[1] = int32_t(node.originRow);
+        constants.stride = int32_t(1u << node.level);
+        constants.skirtDepth = node.skirtDepth * _heightScale;
+        vkCmdPushConstants(cmd, layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(TerrainChunkConstants), &constants);
+        vkCmdDrawIndexed(cmd, _indexCount, 1, 0, 0, 0);
+    }
+}
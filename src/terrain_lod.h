@@ -0,0 +1,125 @@
+#pragma once
+
+#include <vector>
+
+#include "vk_types.h"
+#include "vk_upload.h"
+#include "terrain_file.h"
+#include "terrain_cache.h"
+
+// Cells per edge of every terrain chunk, at its own level's sample spacing, matches heightfield.vert
+const uint32_t TERRAIN_CHUNK_CELLS = 64;
+// Screen space error in pixels a chunk may show before its children are drawn instead
+const float TERRAIN_PIXEL_ERROR = 2.0f;
+
+// Push constants of heightfield.vert
+struct TerrainChunkConstants {
+    glm::mat4 transform;
+    int32_t origin[2];     // first sample of the chunk, column and row
+    int32_t stride;        // samples between chunk vertices
+    float skirtDepth;
+    int32_t size[2];       // samples in the heightmap, columns and rows
+    float heightScale;
+    float heightMin;       // the texture holds (height - heightMin) / heightRange
+    float heightRange;
+};
+
+// Chunked LOD terrain. A quadtree over the heightmap where every node is a TERRAIN_CHUNK_CELLS grid
+// sampled every 2^level samples, the leaves at full resolution. Skirts hang below each node's edges
+// and hide the cracks between neighbours drawn at different levels. Nodes are picked per frame by
+// screen space error and culled against the view frustum, so the triangles drawn follow the view
+// rather than the size of the heightmap.
+class TerrainLod {
+public:
+    static constexpr uint32_t NO_CHILD = ~0u;
+
+    enum class Storage {
+        Vertices,    // a vertex buffer per node (pos + uv, 20 bytes a vertex), drawn by model.vert
+        Heightfield  // an R16 texture of the heightmap, heightfield.vert builds the grids from the vertex index
+    };
+
+    struct Node {
+        float boundsMin[2] = {0, 0}; // x and z
+        float boundsMax[2] = {0, 0};
+        float heightMin = 0.0f;      // heightmap values, scaled at draw time
+        float heightMax = 0.0f;
+        float error = 0.0f;          // largest height difference to the full resolution surface
+        float skirtDepth = 0.0f;
+        uint32_t level = 0;          // 0 for leaves
+        uint32_t originRow = 0;      // first heightmap sample the node covers
+        uint32_t originCol = 0;
+        int32_t vertexOffset = 0;    // first of the node's vertices, Vertices storage only
+        uint32_t children[4] = {NO_CHILD, NO_CHILD, NO_CHILD, NO_CHILD};
+    };
+
+    // Placed like MeshGen::generateMesh: x = col / cols, z = row / cols, y = 1 - height * heightScale.
+    // The map is only read during the call.
+    void build(const TerrainMap& heightMap, float heightScale, Storage storage);
+    // Adds a copy of the result of build to a terrain cache entry, before upload drops it, so the writer
+    // can be stored after the upload
+    void save(TerrainCacheWriter& cache) const;
+    // In place of build, from an entry save wrote
+    void load(const TerrainCacheEntry& cache);
+    // Node vertices or the heightmap texture and the index grid every node shares, CPU copies are dropped
+    void upload(UploadManager& uploader, VkDevice device, VmaAllocator allocator);
+    void cleanup(VkDevice device, VmaAllocator allocator);
+
+    // Heightfield storage only, the vertex storage has the scale built in
+    void set_height_scale(float heightScale);
+    Storage storage() const { return _storage; }
+    // Heightmap texture for heightfield.vert
+    const ResourceBinding& heightfield() const { return _heightfield; }
+
+    // Nodes to draw for a camera at eye, fovY as in ConvertToMatrices
+    void select(const glm::mat4& viewProj, const glm::vec3& eye, float viewportHeight,
+                std::vector<uint32_t>& selected, float fovY = glm::radians(60.0f)) const;
+    // Selects and draws with the bound pipeline, layout takes the TerrainChunkConstants of heightfield.vert
+    void draw(VkCommandBuffer cmd, VkPipelineLayout layout, const CamMatrices& camera, const CamData& eye, float viewportHeight);
+
+    const std::vector<Node>& nodes() const { return _nodes; }
+    // Nodes drawn by the last draw
+    size_t drawn() const { return _selected.size(); }
+
+private:
+    // The LodInfo section of a cache entry
+    struct CacheInfo {
+        uint32_t storage;
+        uint32_t rows;
+        uint32_t cols;
+        float heightScale;
+        float heightMin;
+        float heightRange;
+    };
+
+    const TerrainMap* _heights = nullptr; // only valid during build
+    Storage _storage = Storage::Vertices;
+    uint32_t _rows = 0;
+    uint32_t _cols = 0;
+    float _heightScale = 1.0f;
+    float _heightMin = 0.0f;
+    float _heightRange = 1.0f;
+
+    std::vector<Node> _nodes; // _nodes[0] is the root
+    std::vector<Vertex> _vertices;
+    std::vector<uint16_t> _texels;
+    std::vector<uint16_t> _indices;
+    std::vector<uint32_t> _selected;
+
+    VkBuffer _vertexBuffer = VK_NULL_HANDLE;
+    VmaAllocation _vertexAllocation = VK_NULL_HANDLE;
+    VkBuffer _indexBuffer = VK_NULL_HANDLE;
+    VmaAllocation _indexAllocation = VK_NULL_HANDLE;
+    uint32_t _indexCount = 0;
+    ResourceBinding _heightfield{};
+
+    // Height at a sample, clamped to the map so nodes overhanging its far edges collapse onto them
+    float height(uint32_t row, uint32_t col) const;
+    glm::vec3 position(uint32_t row, uint32_t col) const;
+    uint32_t build_node(uint32_t level, uint32_t originRow, uint32_t originCol);
+    // Largest height difference between a node's triangles and its children's vertices
+    float simplification_error(const Node& node) const;
+    void build_bounds(Node& node) const;
+    void build_vertices(Node& node);
+    void build_texels();
+    void build_indices();
+};
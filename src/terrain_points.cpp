@@ -0,0 +1,409 @@
+#include "terrain_points.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+
+#include "terrain_ingest.h"
+#include "thread_pool.h"
+
+namespace {
+
+// Cells per edge of the tiles each thread reduces its points into
+const uint32_t RASTER_TILE_SIZE = 64;
+// Density the cell size is picked for when the grid size is left open
+const double RASTER_POINTS_PER_CELL = 4.0;
+const size_t LAS_RECORDS_PER_TASK = 1 << 20;
+const uint8_t LAS_CLASS_GROUND = 2;
+
+template <typename T>
+T read_le(const char* p)
+{
+    T value;
+    std::memcpy(&value, p, sizeof(T));
+    return value;
+}
+
+struct LasHeader {
+    uint32_t pointOffset = 0;
+    uint8_t format = 0;
+    uint16_t recordLength = 0;
+    uint64_t pointCount = 0;
+    double scale[3] = {1, 1, 1};
+    double offset[3] = {0, 0, 0};
+    double minX = 0, minY = 0;
+};
+
+LasHeader parse_las_header(const MappedFile& file, const std::string& filename)
+{
+    const char* data = file.data();
+    if (file.size() < 227 || std::memcmp(data, "LASF", 4) != 0) {
+        throw std::runtime_error(filename + ": not a LAS file");
+    }
+
+    LasHeader header;
+    uint8_t versionMinor = read_le<uint8_t>(data + 25);
+    uint16_t headerSize = read_le<uint16_t>(data + 94);
+    header.pointOffset = read_le<uint32_t>(data + 96);
+    uint8_t format = read_le<uint8_t>(data + 104);
+    header.recordLength = read_le<uint16_t>(data + 105);
+    header.pointCount = read_le<uint32_t>(data + 107);
+    if (versionMinor >= 4 && headerSize >= 375 && file.size() >= 255) {
+        header.pointCount = read_le<uint64_t>(data + 247);
+    }
+    for (int i = 0; i < 3; i++) {
+        header.scale[i] = read_le<double>(data + 131 + 8 * i);
+        header.offset[i] = read_le<double>(data + 155 + 8 * i);
+    }
+    header.minX = read_le<double>(data + 187);
+    header.minY = read_le<double>(data + 203);
+
+    if (format & 0x80) {
+        throw std::runtime_error(filename + ": compressed (LAZ) points are not supported, decompress them first");
+    }
+    header.format = format & 0x3f;
+    if (header.format > 10 || header.recordLength < 20) {
+        throw std::runtime_error(filename + ": unknown point format " + std::to_string(header.format));
+    }
+    // Divided rather than multiplied, a corrupt 64-bit point count would wrap the product
+    if (header.pointOffset > file.size() ||
+        header.pointCount > (file.size() - header.pointOffset) / header.recordLength) {
+        throw std::runtime_error(filename + ": " + std::to_string(header.pointCount) + " points do not fit the file");
+    }
+    return header;
+}
+
+PointCloud read_las(const std::string& filename, const PointCloudOptions& options)
+{
+    MappedFile file(filename);
+    LasHeader header = parse_las_header(file, filename);
+
+    PointCloud cloud;
+    cloud.originX = std::floor(header.minX);
+    cloud.originY = std::floor(header.minY);
+
+    // Formats 6 and up moved the class into its own byte, the older ones share it with flag bits
+    const size_t classOffset = header.format >= 6 ? 16 : 15;
+    const uint8_t classMask = header.format >= 6 ? 0xff : 0x1f;
+
+    size_t tasks = (header.pointCount + LAS_RECORDS_PER_TASK - 1) / LAS_RECORDS_PER_TASK;
+    std::vector<std::vector<LidarPoint>> points(tasks);
+    ThreadPool pool(options.threads);
+    pool.parallel_for(0, tasks, 1, [&](size_t begin, size_t end) {
+        for (size_t t = begin; t < end; t++) {
+            size_t first = t * LAS_RECORDS_PER_TASK;
+            size_t last = std::min<size_t>(header.pointCount, first + LAS_RECORDS_PER_TASK);
+            points[t].reserve(last - first);
+            for (size_t i = first; i < last; i++) {
+                const char* record = file.data() + header.pointOffset + i * header.recordLength;
+                if (options.groundOnly && (read_le<uint8_t>(record + classOffset) & classMask) != LAS_CLASS_GROUND) {
+                    continue;
+                }
+                double x = read_le<int32_t>(record) * header.scale[0] + header.offset[0];
+                double y = read_le<int32_t>(record + 4) * header.scale[1] + header.offset[1];
+                double z = read_le<int32_t>(record + 8) * header.scale[2] + header.offset[2];
+                points[t].push_back({float(x - cloud.originX), float(y - cloud.originY), float(z)});
+            }
+        }
+    });
+
+    size_t total = 0;
+    for (const auto& taskPoints : points) {
+        total += taskPoints.size();
+    }
+    if (total == 0) {
+        throw std::runtime_error(filename + (options.groundOnly ? ": no points are classified as ground" : ": no points"));
+    }
+    cloud.points.reserve(total);
+    for (auto& taskPoints : points) {
+        cloud.points.insert(cloud.points.end(), taskPoints.begin(), taskPoints.end());
+        taskPoints = {};
+    }
+    cloud.update_bounds();
+    return cloud;
+}
+
+struct RasterTile {
+    float min[RASTER_TILE_SIZE * RASTER_TILE_SIZE];
+    float max[RASTER_TILE_SIZE * RASTER_TILE_SIZE];
+    float sum[RASTER_TILE_SIZE * RASTER_TILE_SIZE];
+    uint32_t count[RASTER_TILE_SIZE * RASTER_TILE_SIZE];
+
+    RasterTile()
+    {
+        std::fill(std::begin(min), std::end(min), INFINITY);
+        std::fill(std::begin(max), std::end(max), -INFINITY);
+        std::fill(std::begin(sum), std::end(sum), 0.0f);
+        std::fill(std::begin(count), std::end(count), 0u);
+    }
+};
+
+} // namespace
+
+void PointCloud::update_bounds()
+{
+    minX = minY = INFINITY;
+    maxX = maxY = -INFINITY;
+    for (const LidarPoint& point : points) {
+        minX = std::min(minX, point.x);
+        maxX = std::max(maxX, point.x);
+        minY = std::min(minY, point.y);
+        maxY = std::max(maxY, point.y);
+    }
+}
+
+const char* point_reduction_name(PointReduction reduction)
+{
+    switch (reduction) {
+    case PointReduction::Min: return "min";
+    case PointReduction::Max: return "max";
+    case PointReduction::Mean: return "mean";
+    }
+    return "unknown";
+}
+
+bool is_point_cloud_file(const std::string& filename)
+{
+    return has_extension(filename, "las") || has_extension(filename, "laz");
+}
+
+PointCloud read_point_cloud(const std::string& filename, const PointCloudOptions& options)
+{
+    if (is_point_cloud_file(filename)) {
+        return read_las(filename, options);
+    }
+    MappedFile file(filename);
+    PointCloud cloud = ingest_xyz_points(file.data(), file.size(), filename, options.threads);
+    if (cloud.points.empty()) {
+        throw std::runtime_error(filename + ": no points");
+    }
+    return cloud;
+}
+
+TerrainMap rasterise_points(const PointCloud& cloud, const RasteriseOptions& options)
+{
+    auto start = std::chrono::steady_clock::now();
+    if (cloud.points.empty()) {
+        throw std::runtime_error("rasterise_points: no points");
+    }
+
+    double width = double(cloud.maxX) - cloud.minX;
+    double depth = double(cloud.maxY) - cloud.minY;
+    uint32_t cols = options.cols;
+    uint32_t rows = options.rows;
+    if (cols == 0 && rows == 0) {
+        // A few points per cell, so only real gaps in the coverage are left empty
+        double area = std::max(width, 1e-3) * std::max(depth, 1e-3);
+        double cell = std::sqrt(RASTER_POINTS_PER_CELL * area / cloud.points.size());
+        cols = uint32_t(std::ceil(width / cell));
+        rows = uint32_t(std::ceil(depth / cell));
+    } else if (cols == 0) {
+        cols = uint32_t(std::lround(rows * width / std::max(depth, 1e-6)));
+    } else if (rows == 0) {
+        rows = uint32_t(std::lround(cols * depth / std::max(width, 1e-6)));
+    }
+    cols = std::max(cols, 1u);
+    rows = std::max(rows, 1u);
+    const double cellX = width > 0 ? width / cols : 1.0;
+    const double cellY = depth > 0 ? depth / rows : 1.0;
+
+    const uint32_t tileCols = (cols + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+    const uint32_t tileRows = (rows + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+    const size_t tileCount = size_t(tileCols) * tileRows;
+
+    // One share of the points per thread, each reduced into tiles of its own allocated on first touch.
+    // Lidar is stored in flight lines or tiles, so a share only touches a small part of the grid.
+    ThreadPool pool(options.threads);
+    const size_t shares = pool.thread_count();
+    std::vector<std::vector<std::unique_ptr<RasterTile>>> tiles(shares);
+    pool.parallel_for(0, shares, 1, [&](size_t begin, size_t end) {
+        for (size_t s = begin; s < end; s++) {
+            auto& shareTiles = tiles[s];
+            shareTiles.resize(tileCount);
+            size_t first = s * cloud.points.size() / shares;
+            size_t last = (s + 1) * cloud.points.size() / shares;
+            for (size_t i = first; i < last; i++) {
+                const LidarPoint& point = cloud.points[i];
+                uint32_t col = std::min(cols - 1, uint32_t((point.x - cloud.minX) / cellX));
+                uint32_t row = std::min(rows - 1, uint32_t((cloud.maxY - point.y) / cellY));
+
+                auto& tile = shareTiles[size_t(row / RASTER_TILE_SIZE) * tileCols + col / RASTER_TILE_SIZE];
+                if (!tile) {
+                    tile = std::make_unique<RasterTile>();
+                }
+                size_t cell = (row % RASTER_TILE_SIZE) * RASTER_TILE_SIZE + col % RASTER_TILE_SIZE;
+                tile->min[cell] = std::min(tile->min[cell], point.z);
+                tile->max[cell] = std::max(tile->max[cell], point.z);
+                tile->sum[cell] += point.z;
+                tile->count[cell]++;
+            }
+        }
+    });
+
+    // Tiles cover disjoint cells, so they merge in parallel
+    std::vector<float> heights(size_t(rows) * cols, 0.0f);
+    std::vector<uint8_t> valid(heights.size(), 0);
+    pool.parallel_for(0, tileCount, 1, [&](size_t begin, size_t end) {
+        for (size_t t = begin; t < end; t++) {
+            uint32_t rowBase = uint32_t(t / tileCols) * RASTER_TILE_SIZE;
+            uint32_t colBase = uint32_t(t % tileCols) * RASTER_TILE_SIZE;
+            uint32_t rowEnd = std::min(rows, rowBase + RASTER_TILE_SIZE);
+            uint32_t colEnd = std::min(cols, colBase + RASTER_TILE_SIZE);
+
+            for (uint32_t row = rowBase; row < rowEnd; row++) {
+                for (uint32_t col = colBase; col < colEnd; col++) {
+                    size_t cell = (row - rowBase) * RASTER_TILE_SIZE + (col - colBase);
+                    float min = INFINITY, max = -INFINITY, sum = 0.0f;
+                    uint32_t count = 0;
+                    for (const auto& shareTiles : tiles) {
+                        const RasterTile* tile = shareTiles[t].get();
+                        if (tile && tile->count[cell] > 0) {
+                            min = std::min(min, tile->min[cell]);
+                            max = std::max(max, tile->max[cell]);
+                            sum += tile->sum[cell];
+                            count += tile->count[cell];
+                        }
+                    }
+                    if (count == 0) {
+                        continue;
+                    }
+
+                    size_t i = size_t(row) * cols + col;
+                    valid[i] = 1;
+                    switch (options.reduction) {
+                    case PointReduction::Min: heights[i] = min; break;
+                    case PointReduction::Max: heights[i] = max; break;
+                    case PointReduction::Mean: heights[i] = sum / count; break;
+                    }
+                }
+            }
+        }
+    });
+    tiles.clear();
+
+    size_t holes = std::count(valid.begin(), valid.end(), uint8_t(0));
+    if (holes > 0) {
+        if (options.fillHoles) {
+            fill_terrain_holes(heights, valid, rows, cols);
+        } else {
+            float lowest = INFINITY;
+            for (size_t i = 0; i < heights.size(); i++) {
+                if (valid[i]) {
+                    lowest = std::min(lowest, heights[i]);
+                }
+            }
+            for (size_t i = 0; i < heights.size(); i++) {
+                if (!valid[i]) {
+                    heights[i] = lowest;
+                }
+            }
+        }
+    }
+
+    if (options.normalise) {
+        float lowest = *std::min_element(heights.begin(), heights.end());
+        float scale = float(1.0 / std::max({width, depth, 1e-6}));
+        for (float& h : heights) {
+            h = (h - lowest) * scale;
+        }
+    }
+
+    TerrainHeader header = make_terrain_header(rows, cols, TerrainSampleType::Float32);
+    header.spacingX = cellX;
+    header.spacingY = cellY;
+    header.originX = cloud.originX + cloud.minX + 0.5 * cellX;
+    header.originY = cloud.originY + cloud.maxY - 0.5 * cellY;
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    printf("Rasterised %zu points into %ux%u cells of %.3g x %.3g (%s) in %.1f ms on %zu threads, %zu empty cells %s\n",
+           cloud.points.size(), cols, rows, cellX, cellY, point_reduction_name(options.reduction), ms, shares, holes,
+           options.fillHoles ? "filled" : "set to the lowest height");
+
+    return TerrainMap::from_samples(header, std::move(heights));
+}
+
+TerrainMap open_terrain(const std::string& filename, const RasteriseOptions& options)
+{
+    if (!is_point_cloud_file(filename)) {
+        // Text grids are averaged down while they are parsed, never held at full resolution
+        TerrainIngestOptions ingest;
+        ingest.targetCols = options.cols;
+        ingest.targetRows = options.rows;
+        ingest.threads = options.threads;
+        return TerrainMap::open(filename, ingest);
+    }
+    PointCloudOptions cloudOptions;
+    cloudOptions.threads = options.threads;
+    return rasterise_points(read_point_cloud(filename, cloudOptions), options);
+}
+
+void fill_terrain_holes(std::vector<float>& heights, const std::vector<uint8_t>& valid, uint32_t rows, uint32_t cols)
+{
+    struct Level {
+        uint32_t rows, cols;
+        std::vector<float> heights;
+        std::vector<uint8_t> valid;
+    };
+
+    // Pull: halve the grid until one cell is left, every coarse cell the mean of its valid children
+    std::vector<Level> levels;
+    levels.push_back({rows, cols, heights, valid});
+    while (levels.back().rows > 1 || levels.back().cols > 1) {
+        const Level& fine = levels.back();
+        Level coarse{(fine.rows + 1) / 2, (fine.cols + 1) / 2, {}, {}};
+        coarse.heights.assign(size_t(coarse.rows) * coarse.cols, 0.0f);
+        coarse.valid.assign(coarse.heights.size(), 0);
+
+        for (uint32_t row = 0; row < coarse.rows; row++) {
+            for (uint32_t col = 0; col < coarse.cols; col++) {
+                float sum = 0.0f;
+                uint32_t count = 0;
+                for (uint32_t r = row * 2; r < std::min(fine.rows, row * 2 + 2); r++) {
+                    for (uint32_t c = col * 2; c < std::min(fine.cols, col * 2 + 2); c++) {
+                        size_t i = size_t(r) * fine.cols + c;
+                        if (fine.valid[i]) {
+                            sum += fine.heights[i];
+                            count++;
+                        }
+                    }
+                }
+                if (count > 0) {
+                    size_t i = size_t(row) * coarse.cols + col;
+                    coarse.heights[i] = sum / count;
+                    coarse.valid[i] = 1;
+                }
+            }
+        }
+        levels.push_back(std::move(coarse));
+    }
+    if (!levels.back().valid[0]) {
+        throw std::runtime_error("fill_terrain_holes: no valid cell");
+    }
+
+    // Push: fill the holes of every level bilinearly from the complete level above it
+    for (size_t l = levels.size() - 1; l-- > 0;) {
+        Level& fine = levels[l];
+        const Level& coarse = levels[l + 1];
+        for (uint32_t row = 0; row < fine.rows; row++) {
+            for (uint32_t col = 0; col < fine.cols; col++) {
+                size_t i = size_t(row) * fine.cols + col;
+                if (fine.valid[i]) {
+                    continue;
+                }
+                float y = std::clamp((row + 0.5f) * 0.5f - 0.5f, 0.0f, float(coarse.rows - 1));
+                float x = std::clamp((col + 0.5f) * 0.5f - 0.5f, 0.0f, float(coarse.cols - 1));
+                uint32_t r0 = uint32_t(y), c0 = uint32_t(x);
+                uint32_t r1 = std::min(r0 + 1, coarse.rows - 1), c1 = std::min(c0 + 1, coarse.cols - 1);
+                float fy = y - r0, fx = x - c0;
+                auto at = [&](uint32_t r, uint32_t c) { return coarse.heights[size_t(r) * coarse.cols + c]; };
+                fine.heights[i] = (1 - fy) * ((1 - fx) * at(r0, c0) + fx * at(r0, c1)) +
+                                  fy * ((1 - fx) * at(r1, c0) + fx * at(r1, c1));
+            }
+        }
+    }
+    heights = std::move(levels[0].heights);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "terrain_file.h"
+
+// A lidar return, x and y relative to the cloud's origin so floats keep centimetres in projected coordinates
+struct LidarPoint {
+    float x, y, z;
+};
+
+struct PointCloud {
+    double originX = 0;
+    double originY = 0;
+    float minX = INFINITY, maxX = -INFINITY; // bounds relative to the origin
+    float minY = INFINITY, maxY = -INFINITY;
+    std::vector<LidarPoint> points;
+
+    void update_bounds();
+};
+
+struct PointCloudOptions {
+    bool groundOnly = false;    // LAS only, keep the points classified as ground (class 2)
+    unsigned int threads = 0;   // 0 uses every hardware thread
+};
+
+enum class PointReduction {
+    Min,    // lowest return, closest to bare earth under vegetation
+    Max,    // highest return, the surface the wind sees
+    Mean
+};
+
+const char* point_reduction_name(PointReduction reduction);
+
+struct RasteriseOptions {
+    // Cells of the heightmap, 0 for both picks square cells holding a few points each, 0 for one keeps
+    // the cells square
+    uint32_t cols = 0;
+    uint32_t rows = 0;
+    PointReduction reduction = PointReduction::Mean;
+    bool fillHoles = true;      // otherwise empty cells get the lowest height
+    // Heights relative to the lowest cell, in units of the wider horizontal extent, as the unit domain
+    // the solver and terrain mesh expect
+    bool normalise = false;
+    unsigned int threads = 0;
+};
+
+// LAS 1.0 - 1.4 point clouds, uncompressed
+bool is_point_cloud_file(const std::string& filename);
+// LAS files, anything else is read as "x y z" text lines
+PointCloud read_point_cloud(const std::string& filename, const PointCloudOptions& options = {});
+
+// Bins the points into a grid over their bounds, row 0 at the largest y. Every thread reduces its share of
+// the points into private tiles of the grid, which are merged tile by tile afterwards.
+TerrainMap rasterise_points(const PointCloud& cloud, const RasteriseOptions& options = {});
+
+// Point clouds are read and rasterised with options, anything else goes through TerrainMap::open: text
+// grids larger than cols x rows are averaged down to it while parsing (0 keeps that axis), binary maps
+// are mapped as they are
+TerrainMap open_terrain(const std::string& filename, const RasteriseOptions& options = {});
+
+// Gives every cell with valid[i] == 0 a height interpolated from the valid cells around it (pull-push over a
+// pyramid of the grid), so holes of any size close smoothly
+void fill_terrain_holes(std::vector<float>& heights, const std::vector<uint8_t>& valid, uint32_t rows, uint32_t cols);
@@ -0,0 +1,118 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(unsigned int threadCount)
+{
+    if (threadCount == 0) {
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    for (unsigned int i = 0; i < threadCount; i++) {
+        _queues.push_back(std::make_unique<Queue>());
+    }
+    for (unsigned int i = 1; i < threadCount; i++) {
+        _workers.emplace_back(&ThreadPool::worker_loop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _wake.notify_all();
+    for (auto& worker : _workers) {
+        worker.join();
+    }
+}
+
+bool ThreadPool::pop_or_steal(unsigned int self, Range& range)
+{
+    {
+        Queue& own = *_queues[self];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.ranges.empty()) {
+            range = own.ranges.back();
+            own.ranges.pop_back();
+            return true;
+        }
+    }
+
+    // Steal the oldest chunk of another thread, it is the one furthest from what that thread is working on
+    for (size_t i = 1; i < _queues.size(); i++) {
+        Queue& victim = *_queues[(self + i) % _queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.ranges.empty()) {
+            range = victim.ranges.front();
+            victim.ranges.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::run_ranges(unsigned int self)
+{
+    Range range;
+    while (pop_or_steal(self, range)) {
+        (*_job)(range.begin, range.end);
+        if (_remaining.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _done.notify_all();
+        }
+    }
+}
+
+void ThreadPool::worker_loop(unsigned int self)
+{
+    uint64_t seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _wake.wait(lock, [&] { return _stop || _generation != seen; });
+            if (_stop) {
+                return;
+            }
+            seen = _generation;
+        }
+        run_ranges(self);
+    }
+}
+
+void ThreadPool::parallel_for(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& fn)
+{
+    if (begin >= end) {
+        return;
+    }
+    grain = std::max<size_t>(grain, 1);
+
+    size_t chunks = (end - begin + grain - 1) / grain;
+    if (chunks == 1 || _queues.size() == 1) {
+        fn(begin, end);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _job = &fn;
+        _remaining = chunks;
+
+        // Contiguous blocks per thread keep neighbouring slabs on one core until stealing kicks in
+        size_t perQueue = (chunks + _queues.size() - 1) / _queues.size();
+        for (size_t c = 0; c < chunks; c++) {
+            Queue& queue = *_queues[c / perQueue];
+            std::lock_guard<std::mutex> queueLock(queue.mutex);
+            queue.ranges.push_back({begin + c * grain, std::min(end, begin + (c + 1) * grain)});
+        }
+        _generation++;
+    }
+    _wake.notify_all();
+
+    run_ranges(0);
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _done.wait(lock, [&] { return _remaining.load() == 0; });
+    _job = nullptr;
+}
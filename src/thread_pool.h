@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed pool of worker threads running data parallel loops.
+// parallel_for deals the chunks of a range out in contiguous blocks onto per-thread deques; a thread pops from the
+// back of its own deque and steals from the front of the others once it runs dry, so uneven chunks
+// (e.g. slabs full of solid cells) balance out without a shared queue. The calling thread takes part.
+class ThreadPool {
+private:
+    struct Range {
+        size_t begin;
+        size_t end;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Range> ranges;
+    };
+
+    std::vector<std::thread> _workers;
+    std::vector<std::unique_ptr<Queue>> _queues; // index 0 belongs to the calling thread
+
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::condition_variable _done;
+    const std::function<void(size_t, size_t)>* _job = nullptr;
+    uint64_t _generation = 0;
+    std::atomic<size_t> _remaining{0};
+    bool _stop = false;
+
+    bool pop_or_steal(unsigned int self, Range& range);
+    void run_ranges(unsigned int self);
+    void worker_loop(unsigned int self);
+
+public:
+    // 0 uses every hardware thread
+    explicit ThreadPool(unsigned int threadCount = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Run fn(chunkBegin, chunkEnd) over [begin, end) in chunks of at most grain, returns once all chunks are done
+    void parallel_for(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& fn);
+
+    unsigned int thread_count() const { return static_cast<unsigned int>(_queues.size()); }
+};
@@ -1,5 +1,7 @@
 #include "vk_engine.h"
 
+#include <filesystem>
+
 #include <SDL.h>
 #include <SDL_vulkan.h>
 
@@ -38,6 +40,10 @@ void VulkanEngine::init()
 
 	printf("init allocator complete\n");
 
+	init_uploads();
+
+	printf("init uploads complete\n");
+
     init_default_renderpass();
 
 	printf("init default renderpass complete\n");
@@ -62,6 +68,22 @@ void VulkanEngine::init()
 
 	printf("init CFD complete \n");
 
+	init_readback();
+
+	printf("init readback complete\n");
+
+	init_diagnostics();
+
+	printf("init diagnostics complete\n");
+
+	init_checkpoints();
+
+	printf("init checkpoints complete\n");
+
+	init_field_output();
+
+	printf("init field output complete\n");
+
 	initSSBOs();
 
 	printf("init SSBOs complete\n");
@@ -76,6 +98,14 @@ void VulkanEngine::init()
 
 	// load_model();
 
+	// Staged after the terrain so the checkpoint's mask and fields replace what it staged
+	if (!_restoreCheckpoint.empty()) {
+		restore_checkpoint(_restoreCheckpoint);
+	}
+
+	// Submit every staged upload in one batch, the compute and draw submissions are ordered after it
+	_uploader.flush();
+
 	//everything went fine
 	_isInitialized = true;
 
@@ -85,29 +115,45 @@ void VulkanEngine::init()
 void VulkanEngine::initSSBOs() {
 	VkCommandBuffer cmd = vkinit::beginSingleTimeCommands(_device, _commandPool);
 
-	vkinit::transitionImageLayout(
-		cmd,
-		_cfd.get_texture_bindings().at(0).image,
-		VK_IMAGE_LAYOUT_UNDEFINED,
-		VK_IMAGE_LAYOUT_GENERAL,
-		0,    // srcStage (instead of 0)
-		VK_ACCESS_SHADER_WRITE_BIT, // dstStage
-		VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,                                    // srcAccessMask
-		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT            // dstAccessMask
-	);
+	for (auto& texture : _cfd.get_texture_bindings()) {
+		vkinit::transitionImageLayout(
+			cmd,
+			texture.image,
+			VK_IMAGE_LAYOUT_UNDEFINED,
+			VK_IMAGE_LAYOUT_GENERAL,
+			0,    // srcStage (instead of 0)
+			VK_ACCESS_SHADER_WRITE_BIT, // dstStage
+			VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,                                    // srcAccessMask
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT            // dstAccessMask
+		);
+	}
 
 
 	vkinit::endSingleTimeCommands(_device, _commandPool, _graphicsQueue, cmd);
 
-	vkinit::initMesh(_quadMesh, _device, _commandPool, _graphicsQueue, _allocator, _quadVertices, _quadIndices);
+	// From here on the texture only moves between compute writes and fragment reads, tracked per frame
+	_densityTex = _cfd.get_texture_bindings().at(0);
+	_occupancyTex = _cfd.get_texture_bindings().at(1);
+	_imageStates.set(_densityTex, VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT);
+	_imageStates.set(_occupancyTex, VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT);
+
+	vkinit::initMesh(_quadMesh, _uploader, _allocator, _quadVertices, _quadIndices);
 
 	printf("Buffers and textures created\n");
 }
 
 void VulkanEngine::init_cfd()
 {
+	_cfd.set_field_storage(_fieldStorage);
+	_cfd.set_volume_format(_volumeFormat);
+	_cfd.set_verbose(_solverVerbose);
 	_cfd.init_cfd(_device, _allocator, _res);
-	_cfd.load_default_state(_commandPool, _graphicsQueue);
+	_res = _cfd.get_resolution();
+	_cfd.load_default_state(_uploader);
+
+	_mainDeletionQueue.push_function([=]() {
+		_cfd.cleanup();
+	});
 }
 
 void VulkanEngine::init_camera()
@@ -127,7 +173,7 @@ void VulkanEngine::initKernels() {
     pushConstantRange.size = sizeof(CamData);
 	std::vector<VkPushConstantRange> pushConstants = { pushConstantRange };
 
-	std::vector<ResourceBinding> subsetResources = {_cfd.get_texture_bindings()[0], _depthImage, _rasterColourImage};
+	std::vector<ResourceBinding> subsetResources = {_cfd.get_texture_bindings()[0], _depthImage, _rasterColourImage, _cfd.get_texture_bindings()[1]};
 	for (int i=0; i<subsetResources.size(); i++) {
 		subsetResources[i].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
 	}
@@ -135,7 +181,8 @@ void VulkanEngine::initKernels() {
 	std::vector<VkDescriptorSetLayoutBinding> subsetLayoutBindings = {
 		{0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_FRAGMENT_BIT, nullptr},
 		{1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_FRAGMENT_BIT, nullptr},
-		{2, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_FRAGMENT_BIT, nullptr}};
+		{2, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_FRAGMENT_BIT, nullptr},
+		{3, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_FRAGMENT_BIT, nullptr}};
 
 	vkhelp::transitionImageLayout(
 		_device, _commandPool, _graphicsQueue,
@@ -159,6 +206,43 @@ void VulkanEngine::initKernels() {
 
 	vkinit::updateKernelDescriptors(_device, _rp, subsetResources);
 
+	if (march_in_compute()) {
+		VkPushConstantRange marchPushConstants{};
+		marchPushConstants.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+		marchPushConstants.offset = 0;
+		marchPushConstants.size = sizeof(VolumeMarchConstants);
+
+		// The terrain depth is read straight after the raster pass, in its final layout
+		ResourceBinding depth = subsetResources[1];
+		depth.layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		ResourceBinding colour = subsetResources[2];
+		colour.layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		ResourceBinding volumeColour = _volumeColourImage;
+		volumeColour.type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+		ResourceBinding volumeDepth = _volumeDepthImage;
+		volumeDepth.type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+
+		std::vector<ResourceBinding> marchResources = {subsetResources[0], subsetResources[3], depth, volumeColour, volumeDepth,
+			_volumeColourHistory, _volumeDepthHistory, _blueNoise};
+		_rayMarch = vkinit::initKernel(_device, KernelType::Compute, {"build/shaders/rayMarch.comp.spv"}, marchResources, {marchPushConstants});
+		vkinit::updateKernelDescriptors(_device, _rayMarch, marchResources);
+
+		std::vector<ResourceBinding> compositeResources = {_volumeColourImage, _volumeDepthImage, depth, colour};
+		_composite = vkinit::initKernel(_device, KernelType::Graphics,
+			{"build/shaders/triangle.vert.spv", "build/shaders/composite.frag.spv"},
+			subsetLayoutBindings, {}, _renderPass, _windowExtent);
+		vkinit::updateKernelDescriptors(_device, _composite, compositeResources);
+
+		_mainDeletionQueue.push_function([=]() {
+			vkhelp::destroy_kernel(_device, _rayMarch);
+			vkhelp::destroy_kernel(_device, _composite);
+		});
+	}
+
+	// The raster pass leaves both attachments in SHADER_READ_ONLY_OPTIMAL through its final layouts
+	_imageStates.set(_depthImage, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_ASPECT_DEPTH_BIT);
+	_imageStates.set(_rasterColourImage, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+
 	printf("Ray trace kernel initialized\n");
 
 }
@@ -385,7 +469,7 @@ void VulkanEngine::init_offscreen_render_pass() {
     depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
     depthAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    depthAttachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    depthAttachment.finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL; // sampled by the ray trace pass
 
     // --- References ---
     VkAttachmentReference colorRef{};
@@ -403,6 +487,24 @@ void VulkanEngine::init_offscreen_render_pass() {
     subpass.pColorAttachments = &colorRef;
     subpass.pDepthStencilAttachment = &depthRef;
 
+    // --- Dependencies ---
+    // The attachment layout transitions happen inside the pass, these order them against the ray trace
+    // pass sampling the images in the previous and the current frame
+    std::array<VkSubpassDependency, 2> dependencies{};
+    dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+    dependencies[0].dstSubpass = 0;
+    dependencies[0].srcStageMask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    dependencies[0].srcAccessMask = 0;
+    dependencies[0].dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    dependencies[0].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+
+    dependencies[1].srcSubpass = 0;
+    dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+    dependencies[1].srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    dependencies[1].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    dependencies[1].dstStageMask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT; // read by rayMarch.comp or the ray pass
+    dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
     // --- Render pass ---
     std::array<VkAttachmentDescription, 2> attachments = { colorAttachment, depthAttachment };
     VkRenderPassCreateInfo renderPassInfo{};
@@ -411,6 +513,8 @@ void VulkanEngine::init_offscreen_render_pass() {
     renderPassInfo.pAttachments = attachments.data();
     renderPassInfo.subpassCount = 1;
     renderPassInfo.pSubpasses = &subpass;
+    renderPassInfo.dependencyCount = static_cast<uint32_t>(dependencies.size());
+    renderPassInfo.pDependencies = dependencies.data();
 
     VK_CHECK(vkCreateRenderPass(_device, &renderPassInfo, nullptr, &_rasterRenderPass));
 }
@@ -454,7 +558,7 @@ void VulkanEngine::init_vulkan()
 	//make the Vulkan instance, with basic debug features
 	auto inst_ret = builder.set_app_name("Example Vulkan Application")
 		.request_validation_layers(true)
-		.require_api_version(1, 1, 0)
+		.require_api_version(1, 2, 0)
 		.use_default_debug_messenger()
 		.build();
 
@@ -469,16 +573,48 @@ void VulkanEngine::init_vulkan()
 	SDL_Vulkan_CreateSurface(_window, _instance, &_surface);
 
 	//use vkbootstrap to select a GPU.
-	//We want a GPU that can write to the SDL surface and supports Vulkan 1.1
+	//We want a GPU that can write to the SDL surface and supports Vulkan 1.2
+	//timeline semaphores let the readback worker wait on individual solver steps
+	VkPhysicalDeviceVulkan12Features features12{};
+	features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+	features12.timelineSemaphore = VK_TRUE;
+
+	//the solver writes its two channel visualisation volume through a storage image declared without a format
+	VkPhysicalDeviceFeatures features{};
+	features.shaderStorageImageWriteWithoutFormat = VK_TRUE;
+	features.shaderStorageImageExtendedFormats = VK_TRUE;
+
 	vkb::PhysicalDeviceSelector selector{ vkb_inst };
 	vkb::PhysicalDevice physicalDevice = selector
-		.set_minimum_version(1, 1)
+		.set_minimum_version(1, 2)
+		.set_required_features(features)
+		.set_required_features_12(features12)
 		.set_surface(_surface)
 		.select()
 		.value();
 
+	//half precision solver fields need 16-bit storage buffers, without them the packed kernels are used
+	VkPhysicalDeviceVulkan11Features features11{};
+	features11.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES;
+	VkPhysicalDeviceFeatures2 supported{};
+	supported.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+	supported.pNext = &features11;
+	vkGetPhysicalDeviceFeatures2(physicalDevice.physical_device, &supported);
+
+	const bool storage16Bit = features11.storageBuffer16BitAccess == VK_TRUE;
+	features11 = {};
+	features11.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES;
+	features11.storageBuffer16BitAccess = storage16Bit ? VK_TRUE : VK_FALSE;
+	if (_fieldStorage == FieldStorage::Float16 && !storage16Bit) {
+		printf("No 16-bit storage buffers, using packed half precision fields\n");
+		_fieldStorage = FieldStorage::Float16Packed;
+	}
+
 	//create the final Vulkan device
 	vkb::DeviceBuilder deviceBuilder{ physicalDevice };
+	if (storage16Bit) {
+		deviceBuilder.add_pNext(&features11);
+	}
 
 	vkb::Device vkbDevice = deviceBuilder.build().value();
 
@@ -514,6 +650,59 @@ void VulkanEngine::init_render_images()
 		VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
 		VK_IMAGE_ASPECT_COLOR_BIT
 	);
+
+	if (!march_in_compute()) {
+		return;
+	}
+
+	// Written by rayMarch.comp and sampled by composite.frag, both in GENERAL, the tracker takes them from UNDEFINED
+	VkExtent2D volumeExtent = volume_extent();
+	_volumeColourImage = {3, bufferSize, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, COLOR_IMAGE};
+	_volumeDepthImage = {4, bufferSize, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, COLOR_IMAGE};
+	vkinit::createResource(_device, _allocator, _volumeColourImage, {volumeExtent.width, volumeExtent.height, 1}, VK_FORMAT_R16G16B16A16_SFLOAT, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, 2);
+	vkinit::createResource(_device, _allocator, _volumeDepthImage, {volumeExtent.width, volumeExtent.height, 1}, VK_FORMAT_R32_SFLOAT, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, 2);
+	printf("Volume ray marched at %ux%u (1/%u)\n", volumeExtent.width, volumeExtent.height, _volumeDownsample);
+
+	// Copies of the last temporal frame, sampled by the next one where its pixels reproject to
+	_volumeColourHistory = {5, bufferSize, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, COLOR_IMAGE};
+	_volumeDepthHistory = {6, bufferSize, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, COLOR_IMAGE};
+	vkinit::createResource(_device, _allocator, _volumeColourHistory, {volumeExtent.width, volumeExtent.height, 1}, VK_FORMAT_R16G16B16A16_SFLOAT, VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, 2);
+	vkinit::createResource(_device, _allocator, _volumeDepthHistory, {volumeExtent.width, volumeExtent.height, 1}, VK_FORMAT_R32_SFLOAT, VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, 2);
+
+	std::vector<float> noise = blue_noise_tile(BLUE_NOISE_TILE_SIZE);
+	_blueNoise = {7, noise.size() * sizeof(float), VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, BUFFER};
+	vkinit::createResource(_device, _allocator, _blueNoise);
+	_uploader.upload(_blueNoise, noise.data(), noise.size() * sizeof(float));
+
+	_mainDeletionQueue.push_function([=]() {
+		vkhelp::destroy_resource(_device, _allocator, _volumeColourImage);
+		vkhelp::destroy_resource(_device, _allocator, _volumeDepthImage);
+		vkhelp::destroy_resource(_device, _allocator, _volumeColourHistory);
+		vkhelp::destroy_resource(_device, _allocator, _volumeDepthHistory);
+		vkhelp::destroy_resource(_device, _allocator, _blueNoise);
+	});
+}
+
+// The history is only blended in while the camera moves less than this between frames
+const float VOLUME_HISTORY_WEIGHT = 0.9f;
+const float VOLUME_HISTORY_CUT_DISTANCE = 0.1f;
+const float VOLUME_HISTORY_CUT_DEGREES = 15.0f;
+
+static bool camera_cut(const CamData& from, const CamData& to)
+{
+	glm::vec3 fromPos = glm::make_vec3(from.pos);
+	glm::vec3 toPos = glm::make_vec3(to.pos);
+	glm::vec3 fromDir = glm::normalize(glm::make_vec3(from.lookAt) - fromPos);
+	glm::vec3 toDir = glm::normalize(glm::make_vec3(to.lookAt) - toPos);
+
+	return glm::distance(fromPos, toPos) > VOLUME_HISTORY_CUT_DISTANCE ||
+		glm::dot(fromDir, toDir) < std::cos(glm::radians(VOLUME_HISTORY_CUT_DEGREES));
+}
+
+VkExtent2D VulkanEngine::volume_extent() const
+{
+	unsigned int ds = _volumeDownsample > 1 ? _volumeDownsample : 1;
+	return {(_windowExtent.width + ds - 1) / ds, (_windowExtent.height + ds - 1) / ds};
 }
 
 void VulkanEngine::init_commands()
@@ -547,6 +736,211 @@ void VulkanEngine::init_allocator()
 	}
 }
 
+void VulkanEngine::init_uploads()
+{
+	_uploader.init(_device, _allocator, _graphicsQueueFamily, _graphicsQueue);
+
+	_mainDeletionQueue.push_function([=]() {
+		_uploader.cleanup();
+	});
+}
+
+void VulkanEngine::init_readback()
+{
+	if (_snapshotInterval == 0) {
+		return;
+	}
+
+	// Default consumer only reports what arrived, exporters hook in through the same callback
+	_readback.init(_device, _allocator, _cfd.get_field_bindings(), 3, _snapshotInterval,
+		[](uint64_t step, const std::vector<ReadbackView>& fields) {
+			VkDeviceSize bytes = 0;
+			for (auto& field : fields) {
+				bytes += field.size;
+			}
+			printf("Snapshot of step %llu: %zu fields, %llu KB\n",
+				(unsigned long long)step, fields.size(), (unsigned long long)(bytes >> 10));
+		});
+
+	_mainDeletionQueue.push_function([=]() {
+		_readback.cleanup();
+	});
+}
+
+void VulkanEngine::init_diagnostics()
+{
+	// Runs on the readback worker, a copy holds the whole ring so a skipped capture loses nothing
+	_diagnosticsReadback.init(_device, _allocator, {_cfd.get_diagnostics_binding()}, 2, DIAGNOSTICS_RING_SIZE / 4,
+		[this](uint64_t, const std::vector<ReadbackView>& fields) {
+			const DiagnosticsRecord* ring = static_cast<const DiagnosticsRecord*>(fields[0].data);
+			DiagnosticsRecord last;
+			bool hadRecord = _diagnostics.latest(last);
+
+			if (_diagnostics.append_ring(ring, fields[0].size / sizeof(DiagnosticsRecord)) == 0 || _diagnosticsLogInterval == 0) {
+				return;
+			}
+
+			DiagnosticsRecord r;
+			_diagnostics.latest(r);
+			if (!hadRecord || r.step / _diagnosticsLogInterval != last.step / _diagnosticsLogInterval) {
+				printf("Step %u: max div %.3e, rms div %.3e, KE %.4g, mass %.4g, max |u| %.3g, CFL %.3f\n",
+					r.step, r.maxDivergence, r.rmsDivergence, r.kineticEnergy, r.mass, r.maxVelocity, r.cfl);
+			}
+		});
+
+	_mainDeletionQueue.push_function([=]() {
+		_diagnosticsReadback.cleanup();
+	});
+}
+
+void VulkanEngine::init_checkpoints()
+{
+	if (_checkpointInterval == 0) {
+		return;
+	}
+
+	// Two slots, a capture arriving while the writer is still busy with the previous one is dropped
+	_checkpointReadback.init(_device, _allocator, _cfd.get_checkpoint_bindings(), 2, _checkpointInterval,
+		[this](uint64_t step, const std::vector<ReadbackView>& fields) {
+			if (_checkpointWriter.busy()) {
+				printf("Checkpoint of step %llu skipped, the previous one is still being written\n", (unsigned long long)step);
+				return;
+			}
+
+			// Sources are only staged during init, before the first step, so the counts are settled here
+			CfdState state;
+			state.res = _cfd.get_resolution();
+			for (auto& field : fields) {
+				const float* values = static_cast<const float*>(field.data);
+				const size_t count = field.size / sizeof(float);
+				if (field.name == "vx") state.vx.assign(values, values + count);
+				else if (field.name == "vy") state.vy.assign(values, values + count);
+				else if (field.name == "vz") state.vz.assign(values, values + count);
+				else if (field.name == "density") state.density.assign(values, values + count);
+				else if (field.name == "pressure") state.pressure.assign(values, values + count);
+				else if (field.name == "boundaries") state.boundaries.assign(values, values + count);
+				else if (field.name == "velocitySources") {
+					const VelocitySource* sources = static_cast<const VelocitySource*>(field.data);
+					state.velocitySources.assign(sources, sources + _cfd.velocity_source_count());
+				} else if (field.name == "densitySources") {
+					const DensitySource* sources = static_cast<const DensitySource*>(field.data);
+					state.densitySources.assign(sources, sources + _cfd.density_source_count());
+				}
+			}
+
+			// Captured after the evolve recorded for step, so the state is that of step + 1 completed steps
+			const uint64_t completed = step + 1;
+			char name[32];
+			snprintf(name, sizeof(name), "step_%08llu.rchk", (unsigned long long)completed);
+			const std::string filename = _checkpointDir + "/" + name;
+
+			// Runs branched from one checkpoint share it, none of them may replace it
+			std::error_code error;
+			if (!_restoreCheckpoint.empty() && std::filesystem::equivalent(filename, _restoreCheckpoint, error)) {
+				printf("Checkpoint of step %llu skipped, it would replace %s this run restored from\n",
+					(unsigned long long)completed, _restoreCheckpoint.c_str());
+				return;
+			}
+			_checkpointWriter.submit(filename, std::move(state), completed);
+		});
+
+	_mainDeletionQueue.push_function([=]() {
+		_checkpointReadback.cleanup();
+	});
+}
+
+void VulkanEngine::init_field_output()
+{
+	if (_fieldOutputInterval == 0) {
+		return;
+	}
+
+	_fieldOutputWriter = std::make_unique<FieldOutputWriter>(_fieldOutput, _cfd.get_resolution());
+
+	// Only what the derived fields need, pressure stays on the device
+	std::vector<FieldBinding> bindings;
+	for (auto& field : _cfd.get_field_bindings()) {
+		if (field.name != "pressure") {
+			bindings.push_back(field);
+		}
+	}
+
+	// Runs on the readback worker and only crops, a full queue drops the frame instead of waiting
+	_fieldOutputReadback.init(_device, _allocator, bindings, 2, _fieldOutputInterval,
+		[this](uint64_t step, const std::vector<ReadbackView>& fields) {
+			if (_fieldOutputWriter->full()) {
+				printf("Field output of step %llu dropped, the writer is behind\n", (unsigned long long)(step + 1));
+				return;
+			}
+
+			const float* views[4] = {};
+			const char* names[4] = {"vx", "vy", "vz", "density"};
+			for (auto& field : fields) {
+				for (int i = 0; i < 4; i++) {
+					if (field.name == names[i]) {
+						views[i] = static_cast<const float*>(field.data);
+					}
+				}
+			}
+			// Labelled with steps completed like the checkpoints, a restored run carries on the same series
+			_fieldOutputWriter->submit(make_output_frame(step + 1, _cfd.get_resolution(),
+				_fieldOutputWriter->region_lo(), _fieldOutputWriter->region_size(), views[0], views[1], views[2], views[3]));
+		});
+
+	// Reverse order: the readback worker stops first, then the writer finishes the queued frames
+	_mainDeletionQueue.push_function([=]() {
+		_fieldOutputWriter.reset();
+	});
+	_mainDeletionQueue.push_function([=]() {
+		_fieldOutputReadback.cleanup();
+	});
+}
+
+void VulkanEngine::init_terrain_cache_fill()
+{
+	// One slot and one capture, the first step's mask is the voxelised terrain as nothing is stamped before it
+	_terrainCacheReadback.init(_device, _allocator, {_cfd.get_boundaries_binding()}, 1, 1,
+		[this](uint64_t, const std::vector<ReadbackView>& fields) {
+			// The buffer pads halves to whole words, the section holds the mask alone
+			const size_t cells = size_t(_cfd.get_resolution() + 2) * (_cfd.get_resolution() + 2) * (_cfd.get_resolution() + 2);
+			const size_t bytes = cells * (_cfd.get_field_storage() == FieldStorage::Float32 ? sizeof(float) : sizeof(uint16_t));
+			_terrainCacheFill->add(TerrainCacheSection::Boundaries, fields[0].data, bytes);
+			try {
+				_terrainCache.store(_terrainCacheKey, *_terrainCacheFill);
+				printf("Terrain cache written to %s\n", _terrainCache.path(_terrainCacheKey).c_str());
+			} catch (const std::exception& e) {
+				// Only costs the next start its head start
+				printf("Terrain cache not written: %s\n", e.what());
+			}
+			_terrainCacheFill.reset();
+		});
+	_terrainCachePending = true;
+
+	// Reverse order: the readback worker stops before the entry it may still be writing is dropped
+	_mainDeletionQueue.push_function([=]() {
+		_terrainCacheFill.reset();
+	});
+	_mainDeletionQueue.push_function([=]() {
+		_terrainCacheReadback.cleanup();
+	});
+}
+
+void VulkanEngine::restore_checkpoint(const std::string& filename)
+{
+	uint64_t step = 0;
+	CfdState state = read_checkpoint(filename, &step);
+	if (state.res != _cfd.get_resolution()) {
+		throw std::runtime_error("Checkpoint " + filename + " is for a " + std::to_string(state.res) +
+			"^3 grid, the solver runs " + std::to_string(_cfd.get_resolution()) + "^3");
+	}
+
+	// The header holds steps completed, which is the number of the next step to run; the solver counts its
+	// diagnostics from it too, so every series carries the same step labels
+	_cfd.restore_state(_uploader, state, step);
+	_stepNumber = step;
+	printf("Restored step %llu from %s\n", (unsigned long long)step, filename.c_str());
+}
+
 void VulkanEngine::cleanup()
 {
 	if (_isInitialized) {
@@ -569,6 +963,9 @@ void VulkanEngine::compute()
 	VK_CHECK(vkWaitForFences(_device, 1, &_renderFence, true, 1000000000));
     VK_CHECK(vkResetFences(_device, 1, &_renderFence));
 
+	// Any uploads staged since the last step (e.g. a scenario switch) go out ahead of the solver
+	_uploader.flush();
+
 	VkCommandBuffer cmd = _mainCommandBuffer;
 	//begin the command buffer recording. We will use this command buffer exactly once, so we want to let Vulkan know that
     VkCommandBufferBeginInfo cmdBeginInfo = {};
@@ -580,15 +977,47 @@ void VulkanEngine::compute()
 
 	vkBeginCommandBuffer(cmd, &cmdBeginInfo);
 
-	_cfd.evolve_cfd_cmd(cmd);
+	// The graph orders the texture writes after the previous frame's ray trace sampling through _imageStates
+	_cfd.evolve_cfd_cmd(cmd, _imageStates);
+
+	// Snapshot copies ride along in the same submission, the host side is picked up by the readback worker
+	std::vector<VkSemaphore> signalSemaphores;
+	std::vector<uint64_t> signalValues;
+	if (_snapshotInterval > 0) {
+		_readback.record(cmd, _stepNumber);
+		_readback.append_signal(signalSemaphores, signalValues);
+	}
+	_diagnosticsReadback.record(cmd, _stepNumber);
+	_diagnosticsReadback.append_signal(signalSemaphores, signalValues);
+	if (_checkpointInterval > 0) {
+		_checkpointReadback.record(cmd, _stepNumber);
+		_checkpointReadback.append_signal(signalSemaphores, signalValues);
+	}
+	if (_fieldOutputInterval > 0) {
+		_fieldOutputReadback.record(cmd, _stepNumber);
+		_fieldOutputReadback.append_signal(signalSemaphores, signalValues);
+	}
+	if (_terrainCachePending) {
+		_terrainCachePending = !_terrainCacheReadback.record(cmd, _stepNumber);
+		_terrainCacheReadback.append_signal(signalSemaphores, signalValues);
+	}
+	_stepNumber++;
 
 	vkEndCommandBuffer(cmd);
 
+	VkTimelineSemaphoreSubmitInfo timelineInfo{};
+	timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+	timelineInfo.signalSemaphoreValueCount = static_cast<uint32_t>(signalValues.size());
+	timelineInfo.pSignalSemaphoreValues = signalValues.data();
+
 	// Submit once
 	VkSubmitInfo submit{};
 	submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submit.pNext = signalSemaphores.empty() ? nullptr : &timelineInfo;
 	submit.commandBufferCount = 1;
 	submit.pCommandBuffers = &cmd;
+	submit.signalSemaphoreCount = static_cast<uint32_t>(signalSemaphores.size());
+	submit.pSignalSemaphores = signalSemaphores.data();
 	vkQueueSubmit(_graphicsQueue, 1, &submit, _renderFence);
 
 	// printf("Compute dispatched\n");
@@ -656,15 +1085,7 @@ void VulkanEngine::draw()
 	rayPassInfo.clearValueCount = 1;
 	rayPassInfo.pClearValues = clearValue;
 
-	vkhelp::transitionImageLayout(_device, 
-		_commandPool,
-		_graphicsQueue,
-		_depthImage,
-		VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-		VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
-		VK_IMAGE_ASPECT_DEPTH_BIT);
-
-
+	// Depth and colour start UNDEFINED and are cleared, the render pass handles their transitions
 	vkCmdBeginRenderPass(cmd, &rasterPassInfo, VK_SUBPASS_CONTENTS_INLINE);
 
     vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _terrainRender.pipeline);
@@ -678,55 +1099,111 @@ void VulkanEngine::draw()
 		0, nullptr
 	);
 
-	vkCmdPushConstants(
-		cmd,
-		_terrainRender.pipelineLayout,
-		VK_SHADER_STAGE_VERTEX_BIT,
-		0,
-		sizeof(CamMatrices),
-		&_camMatrices
-	);
+	// The heightfield path pushes its constants per chunk
+	if (!_terrainHeightfield) {
+		vkCmdPushConstants(
+			cmd,
+			_terrainRender.pipelineLayout,
+			VK_SHADER_STAGE_VERTEX_BIT,
+			0,
+			sizeof(CamMatrices),
+			&_camMatrices
+		);
+	}
 
-	_terrainMesh.draw(cmd);
+	// Chunks picked by screen space error and culled against this frame's frustum
+	_terrain.draw(cmd, _terrainRender.pipelineLayout, _camMatrices, _camData, float(_windowExtent.height));
 
     // vkCmdDraw(cmd, 3, 1, 0, 0);
 
     //finalize the render pass
 	vkCmdEndRenderPass(cmd);
 
-	// Transition image layout,
-	vkhelp::transitionImageBarrier(cmd,
-		_depthImage,
-		VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
-		VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-		VK_IMAGE_ASPECT_DEPTH_BIT);
-
-	// Update kernels to take output from previous subpass
-
-
-	vkCmdBeginRenderPass(cmd, &rayPassInfo, VK_SUBPASS_CONTENTS_INLINE);
-
-    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _rp.pipeline);
-
-	vkCmdBindDescriptorSets(
-		cmd,
-		VK_PIPELINE_BIND_POINT_GRAPHICS,
-		_rp.pipelineLayout,
-		0, // first set
-		1, &_rp.descriptorSet,
-		0, nullptr
-	);
-
-	vkCmdPushConstants(
-		cmd,
-		_rp.pipelineLayout,
-		VK_SHADER_STAGE_FRAGMENT_BIT,
-		0,
-		sizeof(CamData),
-		&_camData
-	);
-
-	_quadMesh.draw(cmd);
+	// Final layouts leave the attachments ready for sampling, the outgoing subpass dependency made the writes visible
+	_imageStates.set(_depthImage, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_ASPECT_DEPTH_BIT);
+	_imageStates.set(_rasterColourImage, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+
+	if (march_in_compute()) {
+		// Solver output and terrain depth are marched at reduced resolution, then upsampled in the ray pass
+		_imageStates.require(_densityTex, VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+		_imageStates.require(_occupancyTex, VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+		_imageStates.require(_depthImage, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+		_imageStates.require(_volumeColourImage, VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT);
+		_imageStates.require(_volumeDepthImage, VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT);
+		_imageStates.require(_volumeColourHistory, VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+		_imageStates.require(_volumeDepthHistory, VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+		_imageStates.flush(cmd);
+
+		VolumeMarchConstants march{};
+		march.cam = _camData;
+		march.history = _historyCamData;
+		march.frame = uint32_t(_frameNumber);
+		march.temporal = _volumeTemporal ? 1 : 0;
+		march.historyWeight = (_volumeTemporal && _historyValid && !camera_cut(_historyCamData, _camData)) ? VOLUME_HISTORY_WEIGHT : 0.0f;
+
+		VkExtent2D volumeExtent = volume_extent();
+		vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _rayMarch.pipeline);
+		vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _rayMarch.pipelineLayout, 0, 1, &_rayMarch.descriptorSet, 0, nullptr);
+		vkCmdPushConstants(cmd, _rayMarch.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(VolumeMarchConstants), &march);
+		vkCmdDispatch(cmd, (volumeExtent.width + 7) / 8, (volumeExtent.height + 7) / 8, 1);
+
+		if (_volumeTemporal) {
+			// This frame becomes the history of the next
+			_imageStates.require(_volumeColourImage, VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+			_imageStates.require(_volumeDepthImage, VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+			_imageStates.require(_volumeColourHistory, VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+			_imageStates.require(_volumeDepthHistory, VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+			_imageStates.flush(cmd);
+
+			VkImageCopy region{};
+			region.srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+			region.dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+			region.extent = {volumeExtent.width, volumeExtent.height, 1};
+			vkCmdCopyImage(cmd, _volumeColourImage.image, VK_IMAGE_LAYOUT_GENERAL, _volumeColourHistory.image, VK_IMAGE_LAYOUT_GENERAL, 1, &region);
+			vkCmdCopyImage(cmd, _volumeDepthImage.image, VK_IMAGE_LAYOUT_GENERAL, _volumeDepthHistory.image, VK_IMAGE_LAYOUT_GENERAL, 1, &region);
+
+			_historyCamData = _camData;
+			_historyValid = true;
+		}
+
+		_imageStates.require(_volumeColourImage, VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+		_imageStates.require(_volumeDepthImage, VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+		_imageStates.flush(cmd);
+
+		vkCmdBeginRenderPass(cmd, &rayPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+		vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _composite.pipeline);
+		vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _composite.pipelineLayout, 0, 1, &_composite.descriptorSet, 0, nullptr);
+		_quadMesh.draw(cmd);
+	} else {
+		// Solver output written by the compute submission is sampled by the ray trace pass
+		_imageStates.require(_densityTex, VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+		_imageStates.require(_occupancyTex, VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+		_imageStates.flush(cmd);
+
+		vkCmdBeginRenderPass(cmd, &rayPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+	    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _rp.pipeline);
+
+		vkCmdBindDescriptorSets(
+			cmd,
+			VK_PIPELINE_BIND_POINT_GRAPHICS,
+			_rp.pipelineLayout,
+			0, // first set
+			1, &_rp.descriptorSet,
+			0, nullptr
+		);
+
+		vkCmdPushConstants(
+			cmd,
+			_rp.pipelineLayout,
+			VK_SHADER_STAGE_FRAGMENT_BIT,
+			0,
+			sizeof(CamData),
+			&_camData
+		);
+
+		_quadMesh.draw(cmd);
+	}
 
 
     //finalize the render pass
@@ -873,14 +1350,18 @@ void VulkanEngine::init_terrain_rendering()
 	VkPushConstantRange pushConstantRange{};
     pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
     pushConstantRange.offset = 0;
-    pushConstantRange.size = sizeof(CamMatrices);
+    pushConstantRange.size = _terrainHeightfield ? sizeof(TerrainChunkConstants) : sizeof(CamMatrices);
 	std::vector<VkPushConstantRange> pushConstants = { pushConstantRange };
 
 	// If you want to use a subset of the resources and bindings, you can do so like this:
 	std::vector<VkDescriptorSetLayoutBinding> layoutBindings = {};
+	if (_terrainHeightfield) {
+		// The heightmap texture, bound once the terrain is loaded
+		layoutBindings.push_back({0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_VERTEX_BIT, nullptr});
+	}
 
 	_terrainRender = vkinit::initKernel(_device, KernelType::Graphics, 
-		{"build/shaders/model.vert.spv", "build/shaders/model.frag.spv"}, 
+		{_terrainHeightfield ? "build/shaders/heightfield.vert.spv" : "build/shaders/model.vert.spv", "build/shaders/model.frag.spv"}, 
 		layoutBindings, pushConstants, _rasterRenderPass, _windowExtent);
 	
 	printf("Render kernel initialized\n");
@@ -888,14 +1369,58 @@ void VulkanEngine::init_terrain_rendering()
 
 void VulkanEngine::load_terrain_model(const std::string &filename)
 {
-	float terrainScale = 0.6;
-	_cfd.load_terrain(_commandPool, _graphicsQueue, filename.c_str(), terrainScale);
+	const TerrainLod::Storage storage = _terrainHeightfield ? TerrainLod::Storage::Heightfield : TerrainLod::Storage::Vertices;
+
+	TerrainCacheKey key;
+	key.res = _cfd.get_resolution();
+	key.heightScale = _terrainScale;
+	key.fieldStorage = uint32_t(_cfd.get_field_storage());
+	key.meshStorage = uint32_t(storage);
+	key.reduction = uint32_t(_terrainPointReduction);
+	key.bilinear = _cfd.get_terrain_bilinear() ? 1 : 0;
+	TerrainCacheEntry cached;
+	if (_terrainCacheEnabled) {
+		key.source = hash_file(filename);
+		cached = _terrainCache.find(key.digest());
+	}
+
+	if (!cached.empty()) {
+		printf("Terrain %s: cached in %s\n", filename.c_str(), _terrainCache.path(key.digest()).c_str());
+		TerrainMap terrain = cached.terrain();
+		_cfd.load_terrain(_uploader, terrain, _terrainScale,
+			cached.data(TerrainCacheSection::Boundaries), cached.size(TerrainCacheSection::Boundaries));
+		_terrain.load(cached);
+	} else {
+		// Read once, the solver's boundary mask and the terrain chunks both sample the same map. Point clouds
+		// are gridded and larger text grids averaged down to the solver resolution as they are read.
+		RasteriseOptions raster;
+		raster.cols = raster.rows = _cfd.get_resolution();
+		raster.reduction = _terrainPointReduction;
+		raster.normalise = true;
+		TerrainMap terrain = open_terrain(filename, raster);
+		printf("Terrain %s: %ux%u, %s\n", filename.c_str(), terrain.cols(), terrain.rows(),
+			terrain.mapped() ? "mapped" : "read into memory");
+
+		_terrain.build(terrain, _terrainScale, storage);
+		_cfd.load_terrain(_uploader, terrain, _terrainScale);
+		// A restored checkpoint replaces the mask before the first step, there is nothing to capture then
+		if (_terrainCacheEnabled && _restoreCheckpoint.empty()) {
+			_terrainCacheFill = std::make_unique<TerrainCacheWriter>();
+			_terrainCacheFill->add_terrain(terrain);
+			_terrain.save(*_terrainCacheFill);
+			_terrainCacheKey = key.digest();
+			init_terrain_cache_fill();
+		}
+	}
 
-	std::vector<Vertex> vertices;
-	std::vector<uint32_t> indices;
-	MeshGen::generateMesh(vertices, indices, filename, _res, terrainScale);
+	_terrain.upload(_uploader, _device, _allocator);
+	if (_terrainHeightfield) {
+		vkinit::updateKernelDescriptors(_device, _terrainRender, {_terrain.heightfield()});
+	}
 
-	_terrainMesh.init(_device, _commandPool, _graphicsQueue, _allocator, vertices, indices);
+	_mainDeletionQueue.push_function([=]() {
+		_terrain.cleanup(_device, _allocator);
+	});
 
 	printf("Terrain Loaded \n");
 }
@@ -2,6 +2,7 @@
 
 #include <iostream>
 #include <fstream>
+#include <memory>
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -13,9 +14,27 @@
 #include "vk_types.h"
 #include "vk_helper.h"
 #include "vk_initializers.h"
+#include "vk_upload.h"
+#include "vk_readback.h"
 #include "gen_mesh.hpp"
+#include "terrain_lod.h"
+#include "terrain_points.h"
+#include "terrain_cache.h"
+#include "checkpoint.h"
+#include "field_output.h"
 
 #include "cfd.h"
+#include "blue_noise.h"
+
+// Push constants of rayMarch.comp
+struct VolumeMarchConstants {
+	CamData cam;
+	CamData history;       // camera of the frame in the history images
+	uint32_t frame;        // rotates the blue noise offsets
+	float historyWeight;   // share of the reprojected history in the result, 0 drops it
+	uint32_t temporal;     // 0 marches with the fixed small step and no history
+	float padding;
+};
 
 //we want to immediately abort when there is an error. In normal engines this would give an error message to the user, or perform a dump of state.
 using namespace std;
@@ -41,9 +60,48 @@ struct DeletionQueue
 class VulkanEngine {
 public:
 
+    // Grid resolution, 0 picks the largest the device memory budget allows
     unsigned int _res = 129;
 	bool _isInitialized{ false };
 	int _frameNumber {0};
+	uint64_t _stepNumber {0};
+	// Copy solver fields to the host every N steps, 0 disables snapshots
+	unsigned int _snapshotInterval = 0;
+	// Print the latest diagnostics every N steps, 0 keeps them silent
+	unsigned int _diagnosticsLogInterval = 256;
+	// Element type of the solver fields, the half modes fall back to packed halves without 16-bit storage
+	FieldStorage _fieldStorage = FieldStorage::Float32;
+	// Format of the volume the solver writes for the ray marcher
+	VolumeFormat _volumeFormat = VolumeFormat::Float16;
+	// Log the solver's memory plan and every frame graph compile
+	bool _solverVerbose = false;
+	// Window pixels per ray marched pixel along each axis, 1 marches every pixel in rayTrace.frag,
+	// 2 or 4 march in rayMarch.comp and upsample against the terrain depth in composite.frag
+	unsigned int _volumeDownsample = 2;
+	// Ray march with a longer step and blue noise offsets rotated every frame, accumulated over frames by
+	// reprojecting the previous result, dropped on camera cuts. Always runs in rayMarch.comp.
+	bool _volumeTemporal = false;
+	// Draw the terrain from an R16 heightmap texture instead of per chunk vertex buffers
+	bool _terrainHeightfield = true;
+	// Height of the terrain in domain units per heightmap unit
+	float _terrainScale = 0.6f;
+	// How lidar point clouds (.las) are reduced per heightmap cell, they are gridded at the solver resolution
+	PointReduction _terrainPointReduction = PointReduction::Max;
+	// Heightmap as read, boundary mask and terrain buffers of earlier runs, keyed by the terrain file's
+	// contents and the settings above; a hit skips parsing, voxelising and meshing
+	bool _terrainCacheEnabled = true;
+	TerrainCache _terrainCache;
+	// Write the full solver state to _checkpointDir every N steps, 0 disables checkpoints. The copy rides
+	// along with the step like a snapshot, compressing and writing happen on the checkpoint writer's thread.
+	unsigned int _checkpointInterval = 0;
+	std::string _checkpointDir = "Data/checkpoints";
+	// Checkpoint to restart from in place of the terrain's mask and the default state, empty starts fresh
+	std::string _restoreCheckpoint;
+	// Append derived fields to a time series container every N steps, 0 disables field output. Selection,
+	// region of interest and encoding are in _fieldOutput; deriving, encoding and writing run on the
+	// output writer's thread.
+	unsigned int _fieldOutputInterval = 0;
+	FieldOutputOptions _fieldOutput;
 
 	VkExtent2D _windowExtent{ 900 , 900 };
 
@@ -105,6 +163,22 @@ public:
 
     VmaAllocator _allocator;
 
+	UploadManager _uploader;
+	ReadbackRing _readback;
+	// Per step diagnostics as a time series, the device ring is copied over every quarter ring
+	ReadbackRing _diagnosticsReadback;
+	DiagnosticsSeries _diagnostics;
+	ReadbackRing _checkpointReadback;
+	CheckpointWriter _checkpointWriter;
+	ReadbackRing _fieldOutputReadback;
+	std::unique_ptr<FieldOutputWriter> _fieldOutputWriter;
+	// A terrain cache miss is stored once the voxeliser has written the mask in the first step, the
+	// readback worker copies it into the entry and writes it, _terrainCacheFill is its until then
+	ReadbackRing _terrainCacheReadback;
+	std::unique_ptr<TerrainCacheWriter> _terrainCacheFill;
+	uint64_t _terrainCacheKey = 0;
+	bool _terrainCachePending = false;
+
     VkImage _3DTexture;
     VkImageView _3DTextureView;
     VkDeviceMemory _3DTextureMemory;
@@ -116,9 +190,25 @@ public:
 	Kernel _writeTextureSwapped{};
 	Kernel _rp{};
 	Kernel _terrainRender{};
+	Kernel _rayMarch{};
+	Kernel _composite{};
 
 	ResourceBinding _depthImage;
 	ResourceBinding _rasterColourImage;
+	ResourceBinding _densityTex;
+	ResourceBinding _occupancyTex;
+	// Reduced resolution ray march output, premultiplied colour and the linear depth each ray stopped at
+	ResourceBinding _volumeColourImage;
+	ResourceBinding _volumeDepthImage;
+	// Previous frame's ray march output for temporal accumulation, and the blue noise tile it jitters with
+	ResourceBinding _volumeColourHistory;
+	ResourceBinding _volumeDepthHistory;
+	ResourceBinding _blueNoise;
+	// Camera the history was rendered with, invalid until the first temporal frame
+	CamData _historyCamData{};
+	bool _historyValid = false;
+
+	vkhelp::ImageStateTracker _imageStates;
 
     VkDeviceSize bufferSize = _res * _res * _res * sizeof(float);
 
@@ -141,15 +231,18 @@ public:
 
 	bool mouseCaptured = false;
 
-	Mesh _terrainMesh;
+	TerrainLod _terrain;
 
 private:
 
 	void init_vulkan();
 	void init_render_images();
+	VkExtent2D volume_extent() const;
+	bool march_in_compute() const { return _volumeDownsample > 1 || _volumeTemporal; }
     void init_swapchain();
     void init_commands();
 	void init_allocator();
+	void init_uploads();
     void init_default_renderpass();
     void init_offscreen_render_pass();
     void init_framebuffers();
@@ -160,8 +253,15 @@ private:
     void initKernels();
     void initSSBOs();
 	void init_cfd();
+	void init_readback();
+	void init_diagnostics();
+	void init_checkpoints();
+	void restore_checkpoint(const std::string& filename);
+	void init_field_output();
 	void init_camera();
 	void init_terrain_rendering();
 	void load_terrain_model(const std::string& filename);
+	// Stores the terrain cache entry load_terrain_model left in _terrainCacheFill after the first step
+	void init_terrain_cache_fill();
 	void update_camera(float dt);
 };
\ No newline at end of file
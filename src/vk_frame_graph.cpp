@@ -0,0 +1,237 @@
+#include "vk_frame_graph.h"
+
+#include <algorithm>
+
+static const VkAccessFlags kWriteAccess = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT |
+                                          VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+bool FrameGraph::is_image(const ResourceBinding& resource)
+{
+    return resource.kind != BUFFER;
+}
+
+VkBuffer FrameGraph::memory_key(VkBuffer buffer) const
+{
+    auto it = _aliases.find(buffer);
+    return it == _aliases.end() ? buffer : it->second;
+}
+
+bool FrameGraph::conflicts(const Pass& a, const Pass& b) const
+{
+    for (auto& ua : a.uses) {
+        for (auto& ub : b.uses) {
+            bool same = is_image(ua.resource)
+                ? (is_image(ub.resource) && ua.resource.image == ub.resource.image)
+                : (!is_image(ub.resource) && memory_key(ua.resource.buffer) == memory_key(ub.resource.buffer));
+            if (same && ((ua.access | ub.access) & kWriteAccess)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+uint32_t FrameGraph::add_pass(const std::string& name,
+                              const std::vector<ResourceBinding>& reads,
+                              const std::vector<ResourceBinding>& writes,
+                              RecordFn record,
+                              VkPipelineStageFlags stages)
+{
+    Pass pass;
+    pass.name = name;
+    pass.stages = stages;
+    pass.record = record;
+
+    auto add_use = [&](const ResourceBinding& resource, VkAccessFlags access) {
+        for (auto& use : pass.uses) {
+            bool same = is_image(resource) ? use.resource.image == resource.image : use.resource.buffer == resource.buffer;
+            if (same) {
+                use.access |= access;
+                return;
+            }
+        }
+
+        // Storage images stay in GENERAL, anything sampled is read in SHADER_READ_ONLY_OPTIMAL
+        VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+        if (is_image(resource)) {
+            layout = resource.type == VK_DESCRIPTOR_TYPE_STORAGE_IMAGE ? VK_IMAGE_LAYOUT_GENERAL : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        }
+        pass.uses.push_back({resource, access, layout});
+    };
+
+    for (auto& resource : reads) {
+        add_use(resource, VK_ACCESS_SHADER_READ_BIT);
+    }
+    for (auto& resource : writes) {
+        add_use(resource, VK_ACCESS_SHADER_WRITE_BIT);
+    }
+
+    _passes.push_back(pass);
+    _compiled = false;
+    return static_cast<uint32_t>(_passes.size() - 1);
+}
+
+void FrameGraph::set_alias(VkBuffer buffer, VkBuffer memory)
+{
+    if (buffer != memory) {
+        _aliases[buffer] = memory;
+    }
+    _compiled = false;
+}
+
+void FrameGraph::compile()
+{
+    // Each pass goes one level after the latest pass it has a hazard with. Without reordering a pass
+    // may never be scheduled before an earlier one, so independent neighbours are merged but the order holds.
+    uint32_t previousLevel = 0;
+    uint32_t levelCount = 0;
+    for (size_t i = 0; i < _passes.size(); i++) {
+        uint32_t level = _reorder ? 0 : previousLevel;
+        for (size_t j = 0; j < i; j++) {
+            if (_passes[j].level + 1 > level && conflicts(_passes[j], _passes[i])) {
+                level = _passes[j].level + 1;
+            }
+        }
+        _passes[i].level = level;
+        previousLevel = level;
+        levelCount = std::max(levelCount, level + 1);
+    }
+
+    _levels.assign(levelCount, {});
+    for (uint32_t i = 0; i < _passes.size(); i++) {
+        _levels[_passes[i].level].push_back(i);
+    }
+
+    _compiled = true;
+    if (_verbose) {
+        printf("Frame graph compiled: %zu passes in %u levels\n", _passes.size(), levelCount);
+    }
+}
+
+void FrameGraph::execute(VkCommandBuffer cmd, vkhelp::ImageStateTracker& images)
+{
+    if (!_compiled) {
+        compile();
+    }
+
+    std::vector<VkBufferMemoryBarrier> bufferBarriers;
+    std::unordered_map<VkBuffer, BufferState> levelStates;
+
+    for (auto& level : _levels) {
+        bufferBarriers.clear();
+        levelStates.clear();
+        VkPipelineStageFlags srcStages = 0;
+        VkPipelineStageFlags dstStages = 0;
+
+        for (uint32_t passIndex : level) {
+            Pass& pass = _passes[passIndex];
+            for (auto& use : pass.uses) {
+                if (is_image(use.resource)) {
+                    images.require(use.resource, use.layout, pass.stages, use.access);
+                    continue;
+                }
+
+                // Hazards are checked against the state before this level, passes within it are independent.
+                // Aliased buffers share one state, a new occupant waits for the previous one's users.
+                VkBuffer key = memory_key(use.resource.buffer);
+                BufferState& state = _bufferStates[key];
+                bool writes = (use.access & kWriteAccess) != 0;
+
+                VkPipelineStageFlags waitStages = 0;
+                VkAccessFlags srcAccess = 0;
+                if (writes) {
+                    waitStages = state.writeStages | state.readStages; // write after read only needs execution order
+                    srcAccess = state.writeAccess;
+                } else if (state.writeStages && (state.readStages & pass.stages) != pass.stages) {
+                    waitStages = state.writeStages;
+                    srcAccess = state.writeAccess;
+                }
+
+                if (waitStages) {
+                    auto it = std::find_if(bufferBarriers.begin(), bufferBarriers.end(),
+                        [&](const VkBufferMemoryBarrier& b) { return b.buffer == use.resource.buffer; });
+                    if (it == bufferBarriers.end()) {
+                        VkBufferMemoryBarrier barrier{};
+                        barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+                        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                        barrier.buffer = use.resource.buffer;
+                        barrier.offset = 0;
+                        barrier.size = VK_WHOLE_SIZE;
+                        bufferBarriers.push_back(barrier);
+                        it = bufferBarriers.end() - 1;
+                    }
+                    it->srcAccessMask |= srcAccess;
+                    it->dstAccessMask |= use.access;
+                    srcStages |= waitStages;
+                    dstStages |= pass.stages;
+                }
+
+                BufferState& next = levelStates.emplace(key, state).first->second;
+                if (writes) {
+                    next.writeStages = pass.stages;
+                    next.writeAccess = use.access & kWriteAccess;
+                    next.readStages = 0;
+                } else {
+                    next.readStages |= pass.stages;
+                }
+            }
+        }
+
+        for (auto& entry : levelStates) {
+            _bufferStates[entry.first] = entry.second;
+        }
+
+        images.flush(cmd, bufferBarriers, srcStages, dstStages);
+
+        for (uint32_t passIndex : level) {
+            Pass& pass = _passes[passIndex];
+            if (_beforePass) {
+                _beforePass(cmd, passIndex, pass.name);
+            }
+            pass.record(cmd);
+            if (_afterPass) {
+                _afterPass(cmd, passIndex, pass.name);
+            }
+        }
+    }
+}
+
+bool FrameGraph::buffer_lifetime(VkBuffer buffer, uint32_t& firstLevel, uint32_t& lastLevel) const
+{
+    bool used = false;
+    for (auto& pass : _passes) {
+        for (auto& use : pass.uses) {
+            if (is_image(use.resource) || use.resource.buffer != buffer) {
+                continue;
+            }
+            firstLevel = used ? std::min(firstLevel, pass.level) : pass.level;
+            lastLevel = used ? std::max(lastLevel, pass.level) : pass.level;
+            used = true;
+        }
+    }
+    return used;
+}
+
+VkDeviceSize FrameGraph::pass_traffic(uint32_t index) const
+{
+    VkDeviceSize bytes = 0;
+    for (auto& use : _passes[index].uses) {
+        if (use.access & VK_ACCESS_SHADER_READ_BIT) {
+            bytes += use.resource.range;
+        }
+        if (use.access & kWriteAccess) {
+            bytes += use.resource.range;
+        }
+    }
+    return bytes;
+}
+
+void FrameGraph::clear()
+{
+    _passes.clear();
+    _levels.clear();
+    _bufferStates.clear();
+    _aliases.clear();
+    _compiled = false;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "vk_types.h"
+#include "vk_helper.h"
+
+// Records a fixed sequence of passes with the barriers between them derived from declared resource use.
+// Passes list the ResourceBindings they read and write; compile() turns the read-after-write,
+// write-after-read and write-after-write hazards into a dependency DAG and schedules passes into levels.
+// Passes in one level are independent and share a single batched barrier, so nothing is synchronised
+// that the data flow does not require. Resource state is kept between executions, so the first level
+// of a frame is ordered against what the previous frame left behind. Buffers placed in the same memory
+// are registered as aliases and then count as one resource for hazards and barriers.
+class FrameGraph {
+public:
+    using RecordFn = std::function<void(VkCommandBuffer)>;
+
+    // Hooks called around every pass, e.g. for timestamp queries
+    using PassHook = std::function<void(VkCommandBuffer, uint32_t passIndex, const std::string& name)>;
+
+private:
+    struct Use {
+        ResourceBinding resource;
+        VkAccessFlags access;
+        VkImageLayout layout;
+    };
+
+    struct Pass {
+        std::string name;
+        std::vector<Use> uses;
+        VkPipelineStageFlags stages;
+        RecordFn record;
+        uint32_t level = 0;
+    };
+
+    struct BufferState {
+        VkPipelineStageFlags writeStages = 0;
+        VkAccessFlags writeAccess = 0;
+        VkPipelineStageFlags readStages = 0; // readers since the last write, already ordered after it
+    };
+
+    std::vector<Pass> _passes;
+    std::vector<std::vector<uint32_t>> _levels;
+    std::unordered_map<VkBuffer, BufferState> _bufferStates;
+    std::unordered_map<VkBuffer, VkBuffer> _aliases; // buffer -> buffer standing for its memory
+    bool _reorder = true;
+    bool _compiled = false;
+    bool _verbose = false;
+
+    PassHook _beforePass;
+    PassHook _afterPass;
+
+    static bool is_image(const ResourceBinding& resource);
+    VkBuffer memory_key(VkBuffer buffer) const;
+    bool conflicts(const Pass& a, const Pass& b) const;
+
+public:
+    // reads and writes may overlap, a resource in both is read-modify-write
+    uint32_t add_pass(const std::string& name,
+                      const std::vector<ResourceBinding>& reads,
+                      const std::vector<ResourceBinding>& writes,
+                      RecordFn record,
+                      VkPipelineStageFlags stages = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+    // With reordering off passes keep their declaration order and only redundant barriers are dropped
+    void set_reorder(bool reorder) { _reorder = reorder; _compiled = false; }
+    void set_pass_hooks(PassHook before, PassHook after) { _beforePass = before; _afterPass = after; }
+    // Logs the pass and level counts of every compile, which runs again on each rebuild
+    void set_verbose(bool verbose) { _verbose = verbose; }
+    // buffer shares memory with memory, set before compile so their passes are ordered
+    void set_alias(VkBuffer buffer, VkBuffer memory);
+
+    void compile();
+
+    // Images are transitioned through the caller's tracker so their state stays consistent with other submissions
+    void execute(VkCommandBuffer cmd, vkhelp::ImageStateTracker& images);
+
+    uint32_t pass_count() const { return static_cast<uint32_t>(_passes.size()); }
+    const std::string& pass_name(uint32_t index) const { return _passes[index].name; }
+    // Bytes the pass must move if every declared read and write touches its whole resource once
+    VkDeviceSize pass_traffic(uint32_t index) const;
+    uint32_t level_count() const { return static_cast<uint32_t>(_levels.size()); }
+    // First and last compiled level touching the buffer, false when no pass uses it
+    bool buffer_lifetime(VkBuffer buffer, uint32_t& firstLevel, uint32_t& lastLevel) const;
+
+    void clear();
+};
@@ -92,7 +92,8 @@ void vkhelp::copy_from_buffer(VkDevice device, VmaAllocator allocator, VkCommand
 
     if (allocInfo.pMappedData) {
         // Already persistently mapped (common if you allocated with HOST_ACCESS flag)
-        memcpy(allocInfo.pMappedData, data, size);
+        vmaInvalidateAllocation(allocator, buf.bufferAllocation, 0, size);
+        memcpy(data, allocInfo.pMappedData, size);
     } 
     else {
         // Query memory properties
@@ -103,7 +104,8 @@ void vkhelp::copy_from_buffer(VkDevice device, VmaAllocator allocator, VkCommand
             // Can map directly
             void* mapped = nullptr;
             vmaMapMemory(allocator, buf.bufferAllocation, &mapped);
-            memcpy(mapped, data, size);
+            vmaInvalidateAllocation(allocator, buf.bufferAllocation, 0, size);
+            memcpy(data, mapped, size);
             vmaUnmapMemory(allocator, buf.bufferAllocation);
         } 
         else {
@@ -117,13 +119,22 @@ void vkhelp::copy_from_buffer(VkDevice device, VmaAllocator allocator, VkCommand
 
             VmaAllocationCreateInfo stagingAllocInfo{};
             stagingAllocInfo.usage = VMA_MEMORY_USAGE_AUTO;
-            stagingAllocInfo.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT;
+            stagingAllocInfo.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT; // read back on the host
 
             vmaCreateBuffer(allocator, &bufInfo, &stagingAllocInfo, 
                             &stagingBuffer, &stagingAlloc, nullptr);
 
             // Record a one-shot copy command
             VkCommandBuffer cmd = vkinit::beginSingleTimeCommands(device, commandPool);
+
+            // Shader writes from earlier submissions must be visible to the copy
+            VkMemoryBarrier barrier{};
+            barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+            barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+            vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
             VkBufferCopy copyRegion{0,0,size};
             vkCmdCopyBuffer(cmd, buf.buffer, stagingBuffer, 1, &copyRegion);
 
@@ -132,6 +143,7 @@ void vkhelp::copy_from_buffer(VkDevice device, VmaAllocator allocator, VkCommand
             // Map and copy
             void* mapped = nullptr;
             vmaMapMemory(allocator, stagingAlloc, &mapped);
+            vmaInvalidateAllocation(allocator, stagingAlloc, 0, size);
             memcpy(data, mapped, size);
             vmaUnmapMemory(allocator, stagingAlloc);
 
@@ -140,6 +152,38 @@ void vkhelp::copy_from_buffer(VkDevice device, VmaAllocator allocator, VkCommand
     }
 }
 
+void vkhelp::destroy_resource(VkDevice device, VmaAllocator allocator, ResourceBinding& resource)
+{
+    if (resource.buffer != VK_NULL_HANDLE) {
+        vmaDestroyBuffer(allocator, resource.buffer, resource.bufferAllocation);
+        resource.buffer = VK_NULL_HANDLE;
+        resource.bufferAllocation = VK_NULL_HANDLE;
+    }
+    if (resource.sampler != VK_NULL_HANDLE) {
+        vkDestroySampler(device, resource.sampler, nullptr);
+        resource.sampler = VK_NULL_HANDLE;
+    }
+    if (resource.imageView != VK_NULL_HANDLE) {
+        vkDestroyImageView(device, resource.imageView, nullptr);
+        resource.imageView = VK_NULL_HANDLE;
+    }
+    if (resource.image != VK_NULL_HANDLE) {
+        vmaDestroyImage(allocator, resource.image, resource.imageAllocation);
+        resource.image = VK_NULL_HANDLE;
+        resource.imageAllocation = VK_NULL_HANDLE;
+    }
+}
+
+void vkhelp::destroy_kernel(VkDevice device, Kernel& kernel)
+{
+    // Destroying the pool frees the descriptor set with it
+    vkDestroyDescriptorPool(device, kernel.descriptorPool, nullptr);
+    vkDestroyPipeline(device, kernel.pipeline, nullptr);
+    vkDestroyPipelineLayout(device, kernel.pipelineLayout, nullptr);
+    vkDestroyDescriptorSetLayout(device, kernel.descriptorSetLayout, nullptr);
+    kernel = Kernel{};
+}
+
 void vkhelp::transitionImageBarrier(
     VkCommandBuffer cmd,
     ResourceBinding& imageBinding,
@@ -299,4 +343,73 @@ void vkhelp::transitionImageLayout(
     transitionImageBarrier(cmd, imageBinding, oldLayout, newLayout, aspectMask, mipLevels, layerCount);
 
     vkinit::endSingleTimeCommands(device, commandPool, queue, cmd);
-}
\ No newline at end of file
+}
+
+void vkhelp::ImageStateTracker::set(ResourceBinding& image, VkImageLayout layout, VkPipelineStageFlags stages,
+                                    VkAccessFlags access, VkImageAspectFlags aspectMask)
+{
+    _states[image.image] = {layout, stages, access, aspectMask};
+    image.layout = layout;
+}
+
+void vkhelp::ImageStateTracker::require(ResourceBinding& image, VkImageLayout layout, VkPipelineStageFlags stages, VkAccessFlags access)
+{
+    ImageState& state = _states[image.image];
+
+    const VkAccessFlags writeMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                                    VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    bool layoutChange = state.layout != layout;
+    bool prevWrites = (state.access & writeMask) != 0;
+    bool nextWrites = (access & writeMask) != 0;
+
+    // Read after read in the same layout needs no barrier, just widen the set of readers
+    if (!layoutChange && !prevWrites && !nextWrites) {
+        state.stages |= stages;
+        state.access |= access;
+        return;
+    }
+
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcAccessMask = prevWrites ? (state.access & writeMask) : 0; // write after read only needs an execution dependency
+    barrier.dstAccessMask = access;
+    barrier.oldLayout = state.layout;
+    barrier.newLayout = layout;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image.image;
+    barrier.subresourceRange = {state.aspectMask, 0, VK_REMAINING_MIP_LEVELS, 0, VK_REMAINING_ARRAY_LAYERS};
+    _barriers.push_back(barrier);
+
+    _srcStages |= state.stages;
+    _dstStages |= stages;
+
+    state.layout = layout;
+    state.stages = stages;
+    state.access = access;
+    image.layout = layout;
+}
+
+void vkhelp::ImageStateTracker::flush(VkCommandBuffer cmd,
+                                      const std::vector<VkBufferMemoryBarrier>& bufferBarriers,
+                                      VkPipelineStageFlags bufferSrcStages,
+                                      VkPipelineStageFlags bufferDstStages)
+{
+    if (_barriers.empty() && bufferBarriers.empty()) {
+        return;
+    }
+
+    vkCmdPipelineBarrier(
+        cmd,
+        _srcStages | bufferSrcStages,
+        _dstStages | bufferDstStages,
+        0,
+        0, nullptr,
+        static_cast<uint32_t>(bufferBarriers.size()), bufferBarriers.data(),
+        static_cast<uint32_t>(_barriers.size()), _barriers.data()
+    );
+
+    _barriers.clear();
+    _srcStages = 0;
+    _dstStages = 0;
+}
@@ -3,6 +3,8 @@
 #include <vulkan/vulkan.h>
 #include <vk_mem_alloc.h>
 #include <iostream>
+#include <unordered_map>
+#include <vector>
 
 #include "vk_types.h"
 #include "vk_initializers.h"
@@ -12,6 +14,10 @@ namespace vkhelp
     void copy_to_buffer(VkDevice device, VmaAllocator allocator, VkCommandPool commandPool, VkQueue queue, ResourceBinding &buf, void *data, size_t size);
     void copy_from_buffer(VkDevice device, VmaAllocator allocator, VkCommandPool commandPool, VkQueue queue, ResourceBinding &buf, void *data, size_t size);
 
+    // Release whatever createResource / initKernel made for the binding, handles are reset to null
+    void destroy_resource(VkDevice device, VmaAllocator allocator, ResourceBinding& resource);
+    void destroy_kernel(VkDevice device, Kernel& kernel);
+
     void transitionImageLayout(
     VkDevice device,
     VkCommandPool commandPool,
@@ -32,4 +38,35 @@ namespace vkhelp
         uint32_t mipLevels = 1,
         uint32_t layerCount = 1
     );
+
+    // Tracks the last known layout and access of each image across the frame's command buffers,
+    // so transitions are recorded inline as barriers instead of through blocking single-time submits.
+    class ImageStateTracker {
+    private:
+        struct ImageState {
+            VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+            VkPipelineStageFlags stages = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+            VkAccessFlags access = 0;
+            VkImageAspectFlags aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        };
+
+        std::unordered_map<VkImage, ImageState> _states;
+        std::vector<VkImageMemoryBarrier> _barriers;
+        VkPipelineStageFlags _srcStages = 0;
+        VkPipelineStageFlags _dstStages = 0;
+
+    public:
+        // Record the state an image is in without emitting anything, e.g. after a render pass final layout
+        void set(ResourceBinding& image, VkImageLayout layout, VkPipelineStageFlags stages, VkAccessFlags access,
+                 VkImageAspectFlags aspectMask = VK_IMAGE_ASPECT_COLOR_BIT);
+
+        // Queue a barrier moving the image to the requested use, skipped when nothing needs to be ordered
+        void require(ResourceBinding& image, VkImageLayout layout, VkPipelineStageFlags stages, VkAccessFlags access);
+
+        // Emit every queued barrier as one vkCmdPipelineBarrier, optionally together with buffer barriers
+        void flush(VkCommandBuffer cmd,
+                   const std::vector<VkBufferMemoryBarrier>& bufferBarriers = {},
+                   VkPipelineStageFlags bufferSrcStages = 0,
+                   VkPipelineStageFlags bufferDstStages = 0);
+    };
 } // namespace name
@@ -1,4 +1,5 @@
 #include "vk_initializers.h"
+#include "vk_upload.h"
 #define VMA_IMPLEMENTATION
 #include <vk_mem_alloc.h>
 
@@ -1053,55 +1054,16 @@ void vkinit::transitionImageLayout(
     );
 }
 
-void vkinit::initMesh(Mesh &mesh, VkDevice device, VkCommandPool commandPool, VkQueue queue, VmaAllocator allocator, const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices)
+void vkinit::initMesh(Mesh &mesh, UploadManager& uploader, VmaAllocator allocator, const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices)
 {
-    mesh.init(device, commandPool, queue, allocator, vertices, indices);
+    mesh.init(uploader, allocator, vertices, indices);
 }
 
-void Mesh::init(VkDevice device, VkCommandPool commandPool, VkQueue queue, VmaAllocator allocator,
+void Mesh::init(UploadManager& uploader, VmaAllocator allocator,
               const std::vector<Vertex>& vertices,
               const std::vector<uint32_t>& indices){
 
-    this->device = device;
-    this->commandPool = commandPool;
-    this->queue = queue;
-    upload(allocator, vertices, indices);
-}
-
-void Mesh::uploadBufferData(VmaAllocator allocator,
-                          VkBuffer dstBuffer,
-                          const void* data,
-                          VkDeviceSize size) {
-    // Create staging buffer
-    VkBufferCreateInfo stagingInfo{};
-    stagingInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    stagingInfo.size = size;
-    stagingInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-
-    VmaAllocationCreateInfo stagingAllocInfo{};
-    stagingAllocInfo.usage = VMA_MEMORY_USAGE_AUTO; 
-    stagingAllocInfo.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
-                                VMA_ALLOCATION_CREATE_MAPPED_BIT;
-
-    VkBuffer stagingBuffer;
-    VmaAllocation stagingAlloc;
-    VmaAllocationInfo allocInfo;
-
-    VK_CHECK(vmaCreateBuffer(allocator, &stagingInfo, &stagingAllocInfo,
-                                &stagingBuffer, &stagingAlloc, &allocInfo));
-
-    // Copy data into staging
-    memcpy(allocInfo.pMappedData, data, (size_t)size);
-
-    // Submit copy command
-    VkCommandBuffer cmd = vkinit::beginSingleTimeCommands(device, commandPool); // <-- you already have this helper
-    VkBufferCopy copy{};
-    copy.size = size;
-    vkCmdCopyBuffer(cmd, stagingBuffer, dstBuffer, 1, &copy);
-    vkinit::endSingleTimeCommands(device, commandPool, queue, cmd); // <-- and this one
-
-    // Cleanup staging
-    vmaDestroyBuffer(allocator, stagingBuffer, stagingAlloc);
+    upload(uploader, allocator, vertices, indices);
 }
 
 void Mesh::draw(VkCommandBuffer cmd) const {
@@ -1112,7 +1074,7 @@ void Mesh::draw(VkCommandBuffer cmd) const {
     vkCmdDrawIndexed(cmd, indexCount, 1, 0, 0, 0);
 }
 
-void Mesh::upload(VmaAllocator allocator,
+void Mesh::upload(UploadManager& uploader, VmaAllocator allocator,
             const std::vector<Vertex>& vertices,
             const std::vector<uint32_t>& indices) {
     indexCount = static_cast<uint32_t>(indices.size());
@@ -1138,7 +1100,7 @@ void Mesh::upload(VmaAllocator allocator,
     VK_CHECK(vmaCreateBuffer(allocator, &ibInfo, &vmaAllocInfo,
                             &indexBuffer, &indexAllocation, nullptr));
 
-    // --- Upload data using staging buffer ---
-    uploadBufferData(allocator, vertexBuffer, vertices.data(), vbInfo.size);
-    uploadBufferData(allocator, indexBuffer, indices.data(), ibInfo.size);
+    // --- Upload data through the staging ring ---
+    uploader.upload(vertexBuffer, vertices.data(), vbInfo.size);
+    uploader.upload(indexBuffer, indices.data(), ibInfo.size);
 }
\ No newline at end of file
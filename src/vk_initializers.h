@@ -114,7 +114,7 @@ namespace vkinit {
         return out;
     }
 
-    void initMesh(Mesh& mesh, VkDevice device, VkCommandPool commandPool, VkQueue queue, VmaAllocator allocator,
+    void initMesh(Mesh& mesh, UploadManager& uploader, VmaAllocator allocator,
                   const std::vector<Vertex>& vertices,
                   const std::vector<uint32_t>& indices);
 
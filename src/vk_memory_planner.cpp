@@ -0,0 +1,178 @@
+#include "vk_memory_planner.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <numeric>
+#include <stdexcept>
+
+#include "vk_initializers.h"
+
+void MemoryPlanner::init(VkDevice device, VmaAllocator allocator)
+{
+    _device = device;
+    _allocator = allocator;
+}
+
+void MemoryPlanner::add_buffer(const std::string& name, ResourceBinding& resource, bool transient)
+{
+    // Same usage as vkinit::createResources, only the memory is left for allocate()
+    VkBufferCreateInfo bufferInfo{};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = resource.range;
+    bufferInfo.usage = (resource.type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER)
+        ? (VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT)
+        : VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    VK_CHECK(vkCreateBuffer(_device, &bufferInfo, nullptr, &resource.buffer));
+
+    Entry entry;
+    entry.name = name;
+    entry.resource = &resource;
+    entry.transient = transient;
+    vkGetBufferMemoryRequirements(_device, resource.buffer, &entry.requirements);
+    _entries.push_back(entry);
+    _planned = false;
+}
+
+bool MemoryPlanner::fits(const Slot& slot, const Entry& entry) const
+{
+    if ((slot.requirements.memoryTypeBits & entry.requirements.memoryTypeBits) == 0) {
+        return false;
+    }
+
+    // Levels are inclusive, buffers used in the same level may run concurrently
+    for (uint32_t index : slot.entries) {
+        const Entry& other = _entries[index];
+        if (!other.transient) {
+            return false;
+        }
+        if (entry.used && other.used && entry.firstLevel <= other.lastLevel && other.firstLevel <= entry.lastLevel) {
+            return false;
+        }
+    }
+    return true;
+}
+
+VkDeviceSize MemoryPlanner::plan(const FrameGraph& graph)
+{
+    _slots.clear();
+
+    std::vector<uint32_t> transients;
+    for (uint32_t i = 0; i < _entries.size(); i++) {
+        Entry& entry = _entries[i];
+        entry.used = graph.buffer_lifetime(entry.resource->buffer, entry.firstLevel, entry.lastLevel);
+
+        if (entry.transient) {
+            transients.push_back(i);
+        } else {
+            entry.slot = static_cast<uint32_t>(_slots.size());
+            _slots.push_back({{i}, entry.requirements});
+        }
+    }
+
+    // Largest first, so every slot is sized by its first occupant and later ones only fill it
+    std::stable_sort(transients.begin(), transients.end(), [&](uint32_t a, uint32_t b) {
+        return _entries[a].requirements.size > _entries[b].requirements.size;
+    });
+
+    for (uint32_t i : transients) {
+        Entry& entry = _entries[i];
+        auto slot = std::find_if(_slots.begin(), _slots.end(), [&](const Slot& s) { return fits(s, entry); });
+        if (slot == _slots.end()) {
+            entry.slot = static_cast<uint32_t>(_slots.size());
+            _slots.push_back({{i}, entry.requirements});
+            continue;
+        }
+
+        entry.slot = static_cast<uint32_t>(slot - _slots.begin());
+        slot->entries.push_back(i);
+        slot->requirements.size = std::max(slot->requirements.size, entry.requirements.size);
+        slot->requirements.alignment = std::max(slot->requirements.alignment, entry.requirements.alignment);
+        slot->requirements.memoryTypeBits &= entry.requirements.memoryTypeBits;
+    }
+
+    _planned = true;
+    return footprint();
+}
+
+VkDeviceSize MemoryPlanner::footprint() const
+{
+    return std::accumulate(_slots.begin(), _slots.end(), _externalBytes,
+        [](VkDeviceSize sum, const Slot& slot) { return sum + slot.requirements.size; });
+}
+
+VkDeviceSize MemoryPlanner::dedicated_footprint() const
+{
+    return std::accumulate(_entries.begin(), _entries.end(), _externalBytes,
+        [](VkDeviceSize sum, const Entry& entry) { return sum + entry.requirements.size; });
+}
+
+void MemoryPlanner::allocate()
+{
+    if (!_planned) {
+        throw std::runtime_error("MemoryPlanner: allocate called before plan");
+    }
+
+    VmaAllocationCreateInfo allocInfo{};
+    allocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+
+    for (Slot& slot : _slots) {
+        VK_CHECK(vmaAllocateMemory(_allocator, &slot.requirements, &allocInfo, &slot.allocation, nullptr));
+        for (uint32_t index : slot.entries) {
+            ResourceBinding& resource = *_entries[index].resource;
+            VK_CHECK(vmaBindBufferMemory(_allocator, slot.allocation, resource.buffer));
+            resource.bufferAllocation = slot.allocation;
+        }
+    }
+}
+
+void MemoryPlanner::register_aliases(FrameGraph& graph) const
+{
+    for (const Slot& slot : _slots) {
+        VkBuffer memory = _entries[slot.entries[0]].resource->buffer;
+        for (size_t i = 1; i < slot.entries.size(); i++) {
+            graph.set_alias(_entries[slot.entries[i]].resource->buffer, memory);
+        }
+    }
+}
+
+void MemoryPlanner::report() const
+{
+    const double mb = 1024.0 * 1024.0;
+
+    printf("Memory plan: %zu buffers in %zu allocations\n", _entries.size(), _slots.size());
+    for (size_t s = 0; s < _slots.size(); s++) {
+        for (uint32_t index : _slots[s].entries) {
+            const Entry& entry = _entries[index];
+            if (!entry.transient) {
+                printf("  [%2zu] %-18s %9.2f MB  persistent\n", s, entry.name.c_str(), entry.requirements.size / mb);
+            } else if (!entry.used) {
+                printf("  [%2zu] %-18s %9.2f MB  unused\n", s, entry.name.c_str(), entry.requirements.size / mb);
+            } else {
+                printf("  [%2zu] %-18s %9.2f MB  levels %u-%u\n", s, entry.name.c_str(), entry.requirements.size / mb,
+                       entry.firstLevel, entry.lastLevel);
+            }
+        }
+    }
+    printf("  footprint %.2f MB (%.2f MB without aliasing, %.2f MB of it allocated elsewhere)\n",
+           footprint() / mb, dedicated_footprint() / mb, _externalBytes / mb);
+}
+
+void MemoryPlanner::destroy()
+{
+    for (Entry& entry : _entries) {
+        vkDestroyBuffer(_device, entry.resource->buffer, nullptr);
+        entry.resource->buffer = VK_NULL_HANDLE;
+        entry.resource->bufferAllocation = VK_NULL_HANDLE;
+    }
+    for (Slot& slot : _slots) {
+        if (slot.allocation != VK_NULL_HANDLE) {
+            vmaFreeMemory(_allocator, slot.allocation);
+        }
+    }
+
+    _entries.clear();
+    _slots.clear();
+    _externalBytes = 0;
+    _planned = false;
+}
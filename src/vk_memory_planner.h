@@ -0,0 +1,70 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+#include <vk_mem_alloc.h>
+
+#include "vk_types.h"
+#include "vk_frame_graph.h"
+
+// Places the buffers a FrameGraph uses in device memory.
+// Buffers are created without memory so the graph can be built on their handles first; plan() then
+// takes each buffer's lifetime from the compiled levels. Persistent buffers get a dedicated allocation,
+// transient ones (fully rewritten every execution before anything reads them) share an allocation with
+// other transients whose lifetimes do not overlap. Footprints are known before anything is allocated.
+class MemoryPlanner {
+private:
+    struct Entry {
+        std::string name;
+        ResourceBinding* resource;
+        bool transient;
+        VkMemoryRequirements requirements;
+        bool used = false;
+        uint32_t firstLevel = 0;
+        uint32_t lastLevel = 0;
+        uint32_t slot = 0;
+    };
+
+    // One allocation, shared by every entry placed in it
+    struct Slot {
+        std::vector<uint32_t> entries;
+        VkMemoryRequirements requirements{};
+        VmaAllocation allocation = VK_NULL_HANDLE;
+    };
+
+    VkDevice _device = VK_NULL_HANDLE;
+    VmaAllocator _allocator = VK_NULL_HANDLE;
+
+    std::vector<Entry> _entries;
+    std::vector<Slot> _slots;
+    VkDeviceSize _externalBytes = 0;
+    bool _planned = false;
+
+    bool fits(const Slot& slot, const Entry& entry) const;
+
+public:
+    void init(VkDevice device, VmaAllocator allocator);
+
+    // Creates resource.buffer without memory, the binding must outlive the planner's use of it
+    void add_buffer(const std::string& name, ResourceBinding& resource, bool transient);
+    // Memory allocated elsewhere, e.g. images, only counted in the footprint
+    void add_external(VkDeviceSize bytes) { _externalBytes += bytes; }
+
+    // Lifetimes from the compiled graph, then transients go largest first into the first slot they fit.
+    // Returns the planned footprint.
+    VkDeviceSize plan(const FrameGraph& graph);
+    VkDeviceSize footprint() const;
+    // What the same buffers take with one allocation each
+    VkDeviceSize dedicated_footprint() const;
+
+    // Allocates every slot and binds its buffers at offset 0
+    void allocate();
+    // Tells the graph which buffers share memory, call before it compiles
+    void register_aliases(FrameGraph& graph) const;
+    void report() const;
+
+    // Destroys the buffers and their memory, the device must be idle
+    void destroy();
+};
@@ -0,0 +1,186 @@
+#include "vk_readback.h"
+
+#include "half_float.h"
+
+void ReadbackRing::init(VkDevice device, VmaAllocator allocator, const std::vector<FieldBinding>& fields,
+                        uint32_t slotCount, uint32_t interval, ReadbackCallback callback)
+{
+    _device = device;
+    _allocator = allocator;
+    _fields = fields;
+    _interval = interval > 0 ? interval : 1;
+    _callback = callback;
+
+    // All fields of one capture share a slot, packed back to back
+    _slotSize = 0;
+    for (auto& field : _fields) {
+        _fieldOffsets.push_back(_slotSize);
+        _slotSize += (field.resource.range + 15) & ~VkDeviceSize(15);
+    }
+
+    _converted.resize(_fields.size());
+
+    _slots.resize(slotCount);
+    for (auto& slot : _slots) {
+        VkBufferCreateInfo bufInfo{VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+        bufInfo.size = _slotSize;
+        bufInfo.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+
+        VmaAllocationCreateInfo slotAllocInfo{};
+        slotAllocInfo.usage = VMA_MEMORY_USAGE_AUTO;
+        slotAllocInfo.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT;
+        slotAllocInfo.preferredFlags = VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+
+        VmaAllocationInfo allocInfo{};
+        VK_CHECK(vmaCreateBuffer(_allocator, &bufInfo, &slotAllocInfo, &slot.buffer, &slot.allocation, &allocInfo));
+        slot.data = static_cast<uint8_t*>(allocInfo.pMappedData);
+    }
+
+    VkSemaphoreTypeCreateInfo typeInfo{};
+    typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    typeInfo.initialValue = 0;
+
+    VkSemaphoreCreateInfo semaphoreInfo = vkinit::semaphore_create_info();
+    semaphoreInfo.pNext = &typeInfo;
+    VK_CHECK(vkCreateSemaphore(_device, &semaphoreInfo, nullptr, &_timeline));
+
+    _worker = std::thread(&ReadbackRing::worker_loop, this);
+
+    printf("Readback ring initialized: %u slots of %llu KB every %u steps\n",
+           slotCount, (unsigned long long)(_slotSize >> 10), _interval);
+}
+
+bool ReadbackRing::record(VkCommandBuffer cmd, uint64_t step)
+{
+    if (step % _interval != 0) {
+        return false;
+    }
+
+    uint32_t slotIndex;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_slots[_nextSlot].busy) {
+            _skipped++; // consumer is behind, drop this capture rather than stall the solver
+            return false;
+        }
+        slotIndex = _nextSlot;
+        _slots[slotIndex].busy = true;
+        _slots[slotIndex].step = step;
+        _nextSlot = (_nextSlot + 1) % _slots.size();
+    }
+    Slot& slot = _slots[slotIndex];
+
+    VkMemoryBarrier toTransfer{};
+    toTransfer.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    toTransfer.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    toTransfer.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         0, 1, &toTransfer, 0, nullptr, 0, nullptr);
+
+    for (size_t i = 0; i < _fields.size(); i++) {
+        VkBufferCopy copyRegion{_fields[i].resource.offset, _fieldOffsets[i], _fields[i].resource.range};
+        vkCmdCopyBuffer(cmd, _fields[i].resource.buffer, slot.buffer, 1, &copyRegion);
+    }
+
+    // Make the copy visible to the host, and keep later compute writes behind the copy reads
+    VkMemoryBarrier toHost{};
+    toHost.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    toHost.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    toHost.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 1, &toHost, 0, nullptr, 0, nullptr);
+
+    _unsubmitted.push_back(slotIndex);
+    return true;
+}
+
+void ReadbackRing::append_signal(std::vector<VkSemaphore>& semaphores, std::vector<uint64_t>& values)
+{
+    if (_unsubmitted.empty()) {
+        return;
+    }
+
+    _timelineValue++;
+    semaphores.push_back(_timeline);
+    values.push_back(_timelineValue);
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (uint32_t slotIndex : _unsubmitted) {
+            _slots[slotIndex].signalValue = _timelineValue;
+            _pending.push_back(slotIndex);
+        }
+    }
+    _unsubmitted.clear();
+    _cv.notify_one();
+}
+
+void ReadbackRing::worker_loop()
+{
+    for (;;) {
+        uint32_t slotIndex;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cv.wait(lock, [this] { return _stop || !_pending.empty(); });
+            if (_stop) {
+                return;
+            }
+            slotIndex = _pending.front();
+        }
+        Slot& slot = _slots[slotIndex];
+
+        VkSemaphoreWaitInfo waitInfo{};
+        waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+        waitInfo.semaphoreCount = 1;
+        waitInfo.pSemaphores = &_timeline;
+        waitInfo.pValues = &slot.signalValue;
+
+        // Short timeout so cleanup() is never held up by a submission that will not arrive
+        VkResult result = vkWaitSemaphores(_device, &waitInfo, 100000000);
+        if (result == VK_TIMEOUT) {
+            continue;
+        }
+        VK_CHECK(result);
+
+        vmaInvalidateAllocation(_allocator, slot.allocation, 0, VK_WHOLE_SIZE);
+
+        std::vector<ReadbackView> views;
+        views.reserve(_fields.size());
+        for (size_t i = 0; i < _fields.size(); i++) {
+            const uint8_t* data = slot.data + _fieldOffsets[i];
+            if (!_fields[i].float16) {
+                views.push_back({_fields[i].name, data, _fields[i].resource.range});
+                continue;
+            }
+            std::vector<float>& values = _converted[i];
+            // The padding half of an odd count is not part of the field
+            values.resize(_fields[i].count ? _fields[i].count : _fields[i].resource.range / sizeof(uint16_t));
+            halves_to_floats(reinterpret_cast<const uint16_t*>(data), values.data(), values.size());
+            views.push_back({_fields[i].name, values.data(), values.size() * sizeof(float)});
+        }
+        _callback(slot.step, views);
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        slot.busy = false;
+        _pending.pop_front();
+    }
+}
+
+void ReadbackRing::cleanup()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _cv.notify_one();
+    if (_worker.joinable()) {
+        _worker.join();
+    }
+
+    vkDestroySemaphore(_device, _timeline, nullptr);
+    for (auto& slot : _slots) {
+        vmaDestroyBuffer(_allocator, slot.buffer, slot.allocation);
+    }
+    _slots.clear();
+}
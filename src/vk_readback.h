@@ -0,0 +1,79 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+#include <vk_mem_alloc.h>
+
+#include "vk_types.h"
+#include "vk_initializers.h"
+
+struct ReadbackView {
+    std::string name;
+    const void* data;
+    VkDeviceSize size;
+};
+
+// Called on the readback worker thread, the views are only valid for the duration of the call.
+// Fields stored as halves are handed over converted to float.
+using ReadbackCallback = std::function<void(uint64_t step, const std::vector<ReadbackView>& fields)>;
+
+// Streams device fields to the host without stalling the queue.
+// Copies into a ring of host-cached staging slots are recorded into the solver's own command buffer,
+// the submission signals a timeline semaphore and a worker thread hands the mapped slot to a callback
+// once the GPU has reached that value. When every slot is still busy the capture is skipped, never waited on.
+class ReadbackRing {
+private:
+    struct Slot {
+        VkBuffer buffer = VK_NULL_HANDLE;
+        VmaAllocation allocation = VK_NULL_HANDLE;
+        uint8_t* data = nullptr;
+        uint64_t signalValue = 0;
+        uint64_t step = 0;
+        bool busy = false;
+    };
+
+    VkDevice _device = VK_NULL_HANDLE;
+    VmaAllocator _allocator = VK_NULL_HANDLE;
+
+    std::vector<FieldBinding> _fields;
+    std::vector<VkDeviceSize> _fieldOffsets;
+    VkDeviceSize _slotSize = 0;
+    std::vector<Slot> _slots;
+    uint32_t _nextSlot = 0;
+    uint32_t _interval = 1;
+    ReadbackCallback _callback;
+
+    VkSemaphore _timeline = VK_NULL_HANDLE;
+    uint64_t _timelineValue = 0;
+    std::vector<uint32_t> _unsubmitted; // recorded into the current command buffer, not yet submitted
+    uint64_t _skipped = 0;
+
+    std::thread _worker;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<uint32_t> _pending; // submitted slots in signal order
+    bool _stop = false;
+
+    std::vector<std::vector<float>> _converted; // worker only, float copies of the float16 fields
+
+    void worker_loop();
+
+public:
+    void init(VkDevice device, VmaAllocator allocator, const std::vector<FieldBinding>& fields,
+              uint32_t slotCount, uint32_t interval, ReadbackCallback callback);
+
+    // Records the field copies into cmd when step is due and a slot is free, returns whether it did
+    bool record(VkCommandBuffer cmd, uint64_t step);
+
+    // Adds the timeline signal for the submission that carries the recorded copies
+    void append_signal(std::vector<VkSemaphore>& semaphores, std::vector<uint64_t>& values);
+
+    uint64_t skipped() const { return _skipped; }
+    void cleanup();
+};
@@ -3,6 +3,7 @@
 #include <vk_mem_alloc.h>
 #include <iostream>
 #include <vector>
+#include <string>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
@@ -80,6 +81,14 @@ struct ResourceBinding {
     VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
 };
 
+// A named solver field, used by consumers that copy fields off the device
+struct FieldBinding {
+    std::string name;
+    ResourceBinding resource;
+    bool float16 = false; // stored as IEEE halves, readers get floats
+    size_t count = 0;     // halves of a float16 field, the buffer pads to whole words; 0 takes the whole range
+};
+
 
 class PipelineBuilder {
 public:
@@ -128,6 +137,8 @@ struct Vertex {
     }
 };
 
+class UploadManager;
+
 struct Mesh {
     VkBuffer vertexBuffer = VK_NULL_HANDLE;
     VmaAllocation vertexAllocation = VK_NULL_HANDLE;
@@ -136,26 +147,15 @@ struct Mesh {
     VmaAllocation indexAllocation = VK_NULL_HANDLE;
 
     uint32_t indexCount = 0;
-    
-    VkDevice device;
-    VkCommandPool commandPool;
-    VkQueue queue;
 
-    void init(VkDevice device, VkCommandPool commandPool, VkQueue queue, VmaAllocator allocator,
+    void init(UploadManager& uploader, VmaAllocator allocator,
               const std::vector<Vertex>& vertices,
               const std::vector<uint32_t>& indices);
 
-    // Upload CPU data to GPU buffers
-    void upload(VmaAllocator allocator,
+    // Upload CPU data to GPU buffers, copies are batched in the upload manager
+    void upload(UploadManager& uploader, VmaAllocator allocator,
                 const std::vector<Vertex>& vertices,
                 const std::vector<uint32_t>& indices);
 
     void draw(VkCommandBuffer cmd) const;
-
-private:
-    // Helper: copy CPU memory into GPU buffer via VMA staging
-    void uploadBufferData(VmaAllocator allocator,
-                          VkBuffer dstBuffer,
-                          const void* data,
-                          VkDeviceSize size);
 };
@@ -0,0 +1,248 @@
+#include "vk_upload.h"
+
+#include <algorithm>
+#include <cstring>
+
+void UploadManager::init(VkDevice device, VmaAllocator allocator, uint32_t queueFamily, VkQueue queue, VkDeviceSize ringSize)
+{
+    _device = device;
+    _allocator = allocator;
+    _queue = queue;
+    _ringSize = ringSize;
+
+    VkCommandPoolCreateInfo poolInfo = vkinit::command_pool_create_info(queueFamily, VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
+    VK_CHECK(vkCreateCommandPool(_device, &poolInfo, nullptr, &_commandPool));
+
+    VkBufferCreateInfo bufInfo{VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+    bufInfo.size = _ringSize;
+    bufInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+
+    VmaAllocationCreateInfo ringAllocInfo{};
+    ringAllocInfo.usage = VMA_MEMORY_USAGE_AUTO;
+    ringAllocInfo.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT;
+
+    VmaAllocationInfo allocInfo{};
+    VK_CHECK(vmaCreateBuffer(_allocator, &bufInfo, &ringAllocInfo, &_ring, &_ringAllocation, &allocInfo));
+    _ringData = static_cast<uint8_t*>(allocInfo.pMappedData);
+
+    printf("Upload ring initialized with %llu MB\n", (unsigned long long)(_ringSize >> 20));
+}
+
+VkCommandBuffer UploadManager::begin_batch()
+{
+    if (_isRecording) {
+        return _recording.cmd;
+    }
+
+    if (!_free.empty()) {
+        _recording = _free.back();
+        _free.pop_back();
+    } else {
+        _recording = {};
+        VkCommandBufferAllocateInfo cmdAllocInfo = vkinit::command_buffer_allocate_info(_commandPool, 1);
+        VK_CHECK(vkAllocateCommandBuffers(_device, &cmdAllocInfo, &_recording.cmd));
+
+        VkFenceCreateInfo fenceInfo = vkinit::fence_create_info();
+        VK_CHECK(vkCreateFence(_device, &fenceInfo, nullptr, &_recording.fence));
+    }
+
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    VK_CHECK(vkBeginCommandBuffer(_recording.cmd, &beginInfo));
+
+    // Earlier submissions on this queue may still be reading or writing the destinations, vertex and index
+    // buffers included
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    vkCmdPipelineBarrier(_recording.cmd,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+        VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+        VK_PIPELINE_STAGE_TRANSFER_BIT,
+        0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    _isRecording = true;
+    return _recording.cmd;
+}
+
+void UploadManager::retire(bool wait)
+{
+    while (!_inFlight.empty()) {
+        Batch& batch = _inFlight.front();
+        if (wait) {
+            VK_CHECK(vkWaitForFences(_device, 1, &batch.fence, VK_TRUE, UINT64_MAX));
+            wait = false; // only block on the oldest batch
+        } else if (vkGetFenceStatus(_device, batch.fence) != VK_SUCCESS) {
+            break;
+        }
+
+        VK_CHECK(vkResetFences(_device, 1, &batch.fence));
+        VK_CHECK(vkResetCommandBuffer(batch.cmd, 0));
+        _tail = batch.ringEnd;
+        _free.push_back(batch);
+        _inFlight.pop_front();
+    }
+}
+
+VkDeviceSize UploadManager::reserve(VkDeviceSize size)
+{
+    if (size > _ringSize) {
+        throw std::runtime_error("UploadManager: staging request larger than the ring");
+    }
+
+    retire(false);
+    for (;;) {
+        if (_inFlight.empty() && !_isRecording) {
+            _head = _tail = 0; // ring idle, restart from the beginning
+        }
+
+        uint64_t start = (_head + 15) & ~uint64_t(15);
+        VkDeviceSize offset = start % _ringSize;
+        if (offset + size > _ringSize) {
+            start += _ringSize - offset; // no space before the end, wrap around
+        }
+
+        if (start + size - _tail <= _ringSize) {
+            _head = start + size;
+            return start % _ringSize;
+        }
+
+        // Ring full: submit what we have, then wait for the oldest batch to free its space
+        if (_isRecording) {
+            flush();
+        } else {
+            retire(true);
+        }
+    }
+}
+
+void UploadManager::upload(ResourceBinding& buf, const void* data, VkDeviceSize size, VkDeviceSize dstOffset)
+{
+    upload(buf.buffer, data, size, dstOffset);
+}
+
+void UploadManager::upload(VkBuffer dstBuffer, const void* data, VkDeviceSize size, VkDeviceSize dstOffset)
+{
+    // Large uploads are chunked so earlier pieces can be in flight while later ones are staged
+    const VkDeviceSize maxChunk = std::max<VkDeviceSize>(_ringSize / 4, 1);
+    const uint8_t* src = static_cast<const uint8_t*>(data);
+
+    while (size > 0) {
+        VkDeviceSize chunk = std::min(size, maxChunk);
+        VkDeviceSize ringOffset = reserve(chunk);
+
+        memcpy(_ringData + ringOffset, src, (size_t)chunk);
+        vmaFlushAllocation(_allocator, _ringAllocation, ringOffset, chunk);
+
+        VkCommandBuffer cmd = begin_batch();
+        VkBufferCopy copyRegion{ringOffset, dstOffset, chunk};
+        vkCmdCopyBuffer(cmd, _ring, dstBuffer, 1, &copyRegion);
+
+        src += chunk;
+        dstOffset += chunk;
+        size -= chunk;
+    }
+}
+
+void UploadManager::upload_image(ResourceBinding& image, const void* data, VkExtent2D extent, VkDeviceSize texelBytes,
+                                 VkImageLayout finalLayout)
+{
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image.image;
+    barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    vkCmdPipelineBarrier(begin_batch(), VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+    // Chunked by whole rows like buffer uploads, a chunk may land in a later batch than the transition
+    const VkDeviceSize rowBytes = extent.width * texelBytes;
+    const uint32_t rowsPerChunk = uint32_t(std::max<VkDeviceSize>(_ringSize / 4 / rowBytes, 1));
+    const uint8_t* src = static_cast<const uint8_t*>(data);
+
+    for (uint32_t row = 0; row < extent.height; row += rowsPerChunk) {
+        uint32_t rows = std::min(rowsPerChunk, extent.height - row);
+        VkDeviceSize chunk = rows * rowBytes;
+        VkDeviceSize ringOffset = reserve(chunk);
+
+        memcpy(_ringData + ringOffset, src + row * rowBytes, (size_t)chunk);
+        vmaFlushAllocation(_allocator, _ringAllocation, ringOffset, chunk);
+
+        VkBufferImageCopy region{};
+        region.bufferOffset = ringOffset;
+        region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+        region.imageOffset = {0, int32_t(row), 0};
+        region.imageExtent = {extent.width, rows, 1};
+        vkCmdCopyBufferToImage(begin_batch(), _ring, image.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+    }
+
+    // The layout change also makes the copies visible to shader reads
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = finalLayout;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(begin_batch(), VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        0, 0, nullptr, 0, nullptr, 1, &barrier);
+    image.layout = finalLayout;
+}
+
+void UploadManager::flush()
+{
+    if (!_isRecording) {
+        return;
+    }
+
+    // One barrier for the whole batch makes every copy visible to later shader and vertex reads
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT |
+                            VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT;
+    vkCmdPipelineBarrier(_recording.cmd,
+        VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+        VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+        0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    VK_CHECK(vkEndCommandBuffer(_recording.cmd));
+
+    VkSubmitInfo submit{};
+    submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit.commandBufferCount = 1;
+    submit.pCommandBuffers = &_recording.cmd;
+    VK_CHECK(vkQueueSubmit(_queue, 1, &submit, _recording.fence));
+
+    _recording.ringEnd = _head;
+    _inFlight.push_back(_recording);
+    _recording = {};
+    _isRecording = false;
+}
+
+void UploadManager::wait_idle()
+{
+    flush();
+    while (!_inFlight.empty()) {
+        retire(true);
+    }
+}
+
+void UploadManager::cleanup()
+{
+    wait_idle();
+
+    for (auto& batch : _free) {
+        vkDestroyFence(_device, batch.fence, nullptr);
+    }
+    _free.clear();
+
+    vkDestroyCommandPool(_device, _commandPool, nullptr);
+    vmaDestroyBuffer(_allocator, _ring, _ringAllocation);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+#include <vk_mem_alloc.h>
+
+#include "vk_types.h"
+#include "vk_initializers.h"
+
+// Batches host -> device copies through a persistently mapped staging ring.
+// Copies are recorded into a dedicated transfer command buffer and submitted together by flush();
+// every submission carries a fence so ring space is recycled without ever idling the queue.
+class UploadManager {
+private:
+    struct Batch {
+        VkCommandBuffer cmd = VK_NULL_HANDLE;
+        VkFence fence = VK_NULL_HANDLE;
+        uint64_t ringEnd = 0; // ring head once this batch's data was staged
+    };
+
+    VkDevice _device = VK_NULL_HANDLE;
+    VmaAllocator _allocator = VK_NULL_HANDLE;
+    VkQueue _queue = VK_NULL_HANDLE;
+    VkCommandPool _commandPool = VK_NULL_HANDLE;
+
+    VkBuffer _ring = VK_NULL_HANDLE;
+    VmaAllocation _ringAllocation = VK_NULL_HANDLE;
+    uint8_t* _ringData = nullptr;
+    VkDeviceSize _ringSize = 0;
+
+    // Monotonic byte counters, the ring offset is counter % _ringSize
+    uint64_t _head = 0;
+    uint64_t _tail = 0;
+
+    Batch _recording{};
+    bool _isRecording = false;
+    std::deque<Batch> _inFlight;
+    std::vector<Batch> _free;
+
+    VkDeviceSize reserve(VkDeviceSize size);
+    VkCommandBuffer begin_batch();
+    void retire(bool wait);
+
+public:
+    void init(VkDevice device, VmaAllocator allocator, uint32_t queueFamily, VkQueue queue, VkDeviceSize ringSize = 64ull << 20);
+
+    // Stage data and record the copy, nothing is submitted until flush()
+    void upload(ResourceBinding& buf, const void* data, VkDeviceSize size, VkDeviceSize dstOffset = 0);
+    void upload(VkBuffer dstBuffer, const void* data, VkDeviceSize size, VkDeviceSize dstOffset = 0);
+    // Whole 2D colour image from tightly packed rows, taken from UNDEFINED to finalLayout for shader reads
+    void upload_image(ResourceBinding& image, const void* data, VkExtent2D extent, VkDeviceSize texelBytes,
+                      VkImageLayout finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+    // Submit all recorded copies as one batch, does not wait for completion
+    void flush();
+    // Block until every submitted batch has retired
+    void wait_idle();
+    void cleanup();
+};
@@ -0,0 +1,201 @@
+// Converts a text heightmap (ESRI ASCII grid, plain grid or XYZ, see terrain_ingest.h) or a lidar point
+// cloud (LAS, or XYZ text with --points) into the binary terrain format of terrain_file.h, which the viewer
+// maps instead of parsing. Binary input is re-encoded, e.g. to change the sample type or the georeference.
+//
+//   rotor_terrain_convert <input> <output> [--samples f32|u16] [--size 0,0] [--threads 0]
+//                         [--spacing 1,1] [--origin 0,0] [--crs EPSG:27700]
+//                         [--points] [--reduce min|max|mean] [--ground] [--no-fill] [--normalise]
+//
+// --samples u16 halves the file, heights are quantised over their own range and the largest error is
+// reported. --size averages text input down to columns,rows while it is parsed, for point clouds it is the
+// grid they are binned into (0,0 picks a few points per cell). --reduce picks the height of a cell
+// from its points, --ground keeps only LAS ground returns, --no-fill leaves empty cells at the lowest
+// height instead of interpolating them and --normalise rescales heights into the viewer's unit domain.
+// --spacing is the ground distance between columns and rows and --origin the centre of the first sample,
+// both in units of --crs; they replace what the input's own header gives.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "terrain_file.h"
+#include "terrain_ingest.h"
+#include "terrain_points.h"
+
+namespace {
+
+struct ConvertOptions {
+    std::string input;
+    std::string output;
+    TerrainSampleType samples = TerrainSampleType::Float32;
+    double spacing[2] = {1.0, 1.0};
+    double origin[2] = {0.0, 0.0};
+    std::string crs;
+    bool keepGeoreference = true; // unless one of the georeference options is given
+    TerrainIngestOptions ingest;
+    bool points = false;
+    bool ground = false;
+    RasteriseOptions raster;
+};
+
+void parse_pair(const std::string& arg, const std::string& value, double pair[2])
+{
+    std::stringstream ss(value);
+    char comma = 0;
+    if (!(ss >> pair[0] >> comma >> pair[1]) || comma != ',') {
+        throw std::runtime_error(arg + " takes two comma separated values, got " + value);
+    }
+}
+
+ConvertOptions parse_options(int argc, char* argv[])
+{
+    ConvertOptions options;
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            printf("usage: rotor_terrain_convert <input> <output> [--samples f32|u16] [--size 0,0] [--threads 0]\n"
+                   "                             [--spacing 1,1] [--origin 0,0] [--crs EPSG:27700]\n"
+                   "                             [--points] [--reduce min|max|mean] [--ground] [--no-fill] [--normalise]\n");
+            exit(0);
+        }
+        if (arg == "--points") {
+            options.points = true;
+            continue;
+        } else if (arg == "--ground") {
+            options.ground = true;
+            continue;
+        } else if (arg == "--no-fill") {
+            options.raster.fillHoles = false;
+            continue;
+        } else if (arg == "--normalise") {
+            options.raster.normalise = true;
+            continue;
+        }
+        if (arg.rfind("--", 0) != 0) {
+            positional.push_back(arg);
+            continue;
+        }
+        if (i + 1 >= argc) {
+            throw std::runtime_error("Missing value for " + arg);
+        }
+        std::string value = argv[++i];
+
+        if (arg == "--samples") {
+            if (value == "f32") {
+                options.samples = TerrainSampleType::Float32;
+            } else if (value == "u16") {
+                options.samples = TerrainSampleType::UInt16;
+            } else {
+                throw std::runtime_error("Unknown sample type: " + value);
+            }
+        } else if (arg == "--size") {
+            double size[2];
+            parse_pair(arg, value, size);
+            if (size[0] < 0 || size[1] < 0) {
+                throw std::runtime_error("--size takes non-negative column and row counts");
+            }
+            options.ingest.targetCols = options.raster.cols = uint32_t(size[0]);
+            options.ingest.targetRows = options.raster.rows = uint32_t(size[1]);
+        } else if (arg == "--threads") {
+            options.ingest.threads = options.raster.threads = std::stoul(value);
+        } else if (arg == "--reduce") {
+            if (value == "min") {
+                options.raster.reduction = PointReduction::Min;
+            } else if (value == "max") {
+                options.raster.reduction = PointReduction::Max;
+            } else if (value == "mean") {
+                options.raster.reduction = PointReduction::Mean;
+            } else {
+                throw std::runtime_error("Unknown reduction: " + value);
+            }
+        } else if (arg == "--spacing") {
+            parse_pair(arg, value, options.spacing);
+            options.keepGeoreference = false;
+        } else if (arg == "--origin") {
+            parse_pair(arg, value, options.origin);
+            options.keepGeoreference = false;
+        } else if (arg == "--crs") {
+            if (value.size() >= sizeof(TerrainHeader::crs)) {
+                throw std::runtime_error("--crs is limited to " + std::to_string(sizeof(TerrainHeader::crs) - 1) + " characters");
+            }
+            options.crs = value;
+            options.keepGeoreference = false;
+        } else {
+            throw std::runtime_error("Unknown option: " + arg);
+        }
+    }
+    if (positional.size() != 2) {
+        throw std::runtime_error("Expected an input and an output file, see --help");
+    }
+    options.input = positional[0];
+    options.output = positional[1];
+    return options;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    try {
+        ConvertOptions options = parse_options(argc, argv);
+
+        TerrainMap terrain;
+        if (options.points || is_point_cloud_file(options.input)) {
+            PointCloudOptions cloudOptions;
+            cloudOptions.groundOnly = options.ground;
+            cloudOptions.threads = options.raster.threads;
+            terrain = rasterise_points(read_point_cloud(options.input, cloudOptions), options.raster);
+        } else {
+            terrain = TerrainMap::open(options.input, options.ingest);
+        }
+        if (terrain.rows() == 0 || terrain.cols() == 0) {
+            throw std::runtime_error(options.input + " holds no samples");
+        }
+
+        TerrainHeader header = make_terrain_header(terrain.rows(), terrain.cols(), options.samples);
+        if (options.keepGeoreference) {
+            header.spacingX = terrain.header().spacingX;
+            header.spacingY = terrain.header().spacingY;
+            header.originX = terrain.header().originX;
+            header.originY = terrain.header().originY;
+            std::memcpy(header.crs, terrain.header().crs, sizeof(header.crs));
+        } else {
+            header.spacingX = options.spacing[0];
+            header.spacingY = options.spacing[1];
+            header.originX = options.origin[0];
+            header.originY = options.origin[1];
+            std::strncpy(header.crs, options.crs.c_str(), sizeof(header.crs) - 1);
+        }
+
+        std::vector<float> heights = terrain.to_floats();
+        write_terrain_file(options.output, header, heights);
+
+        float min, max;
+        terrain.height_range(min, max);
+        printf("%s: %ux%u samples, heights %g to %g\n", options.input.c_str(), terrain.cols(), terrain.rows(), min, max);
+
+        // Read the result back through the same path as the viewer, which also checks the quantisation
+        TerrainMap written = TerrainMap::open(options.output);
+        double maxError = 0;
+        for (uint32_t row = 0; row < written.rows(); row++) {
+            for (uint32_t col = 0; col < written.cols(); col++) {
+                double error = std::fabs(double(written.height(row, col)) - heights[size_t(row) * written.cols() + col]);
+                maxError = std::max(maxError, error);
+            }
+        }
+        printf("Wrote %s: %s samples, spacing %g,%g, origin %g,%g, crs \"%s\", largest height error %g\n",
+               options.output.c_str(), options.samples == TerrainSampleType::UInt16 ? "u16" : "f32",
+               header.spacingX, header.spacingY, header.originX, header.originY, header.crs, maxError);
+    } catch (const std::exception& e) {
+        fprintf(stderr, "rotor_terrain_convert: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}